@@ -33,6 +33,8 @@
 
 #define COMMON_NO_HYPERVISOR bfscast(status_t, 0x8000000000000001)
 #define COMMON_CREATE_VM_FROM_BZIMAGE_FAILED bfscast(status_t, 0x8000000000000002)
+#define COMMON_FORK_FAILED bfscast(status_t, 0x8000000000000003)
+#define COMMON_RESTORE_FAILED bfscast(status_t, 0x8000000000000004)
 
 /* -------------------------------------------------------------------------- */
 /* Functions                                                                  */
@@ -61,7 +63,184 @@ common_create_vm_from_bzimage(struct create_vm_from_bzimage_args *args);
  * @param domainid the domain to destroy
  * @return SUCCESS on success, negative error code on failure
  */
+int64_t
+common_fork(struct fork_vm_args *args);
+
+int64_t
+common_restore(struct restore_vm_args *args);
+
+int64_t
+common_write_memory(struct write_memory_args *args);
+
 int64_t
 common_destroy(uint64_t domainid);
 
+/**
+ * vCPU Exit Info
+ *
+ * Returns the page the hypervisor uses to report why the provided vCPU
+ * last handed control back to its parent. The page is allocated and
+ * registered with the hypervisor the first time it is requested, and is
+ * freed when the VM is destroyed.
+ *
+ * @param domainid the domain the vCPU belongs to
+ * @param vcpuid the vCPU to get the exit info for
+ * @return the vCPU's exit info page on success, 0 on failure
+ */
+struct mv_vp_exit_info_t *
+common_vcpu_exit_info(uint64_t domainid, uint64_t vcpuid);
+
+/**
+ * Balloon
+ *
+ * Services a VM's balloon. The guest is given a new balloon target, the
+ * memory the guest has given back is released to the host, and the
+ * ranges the guest has asked to get back are populated with new memory.
+ *
+ * @param args the balloon_args arguments needed to service the balloon
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_balloon(struct balloon_args *args);
+
+/**
+ * Populate
+ *
+ * Adds memory to the pool the hypervisor uses to back a VM's RAM the first
+ * time the guest touches it. This is called each time a vCPU reports
+ * hypercall_enum_run_op__populate (i.e. the pool is empty).
+ *
+ * @param domainid the domain to add memory to
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_populate(uint64_t domainid);
+
+/**
+ * Wait vCPU
+ *
+ * Puts the calling thread to sleep until the provided vCPU is woken up
+ * (see common_wake_vcpu()), or until the timeout expires. This is called
+ * by the thread that runs the vCPU after the vCPU yields.
+ *
+ * @param args the wait_vcpu_args arguments needed to wait
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_wait_vcpu(struct wait_vcpu_args *args);
+
+/**
+ * Wake vCPU
+ *
+ * Wakes up the thread that is waiting on the provided vCPU (see
+ * common_wait_vcpu()). If the thread is not waiting yet, its next wait
+ * returns right away. This is called each time a vCPU reports
+ * hypercall_enum_run_op__wakeup.
+ *
+ * @param domainid the domain the vCPU belongs to
+ * @param vcpuid the vCPU to wake up
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_wake_vcpu(uint64_t domainid, uint64_t vcpuid);
+
+/* -------------------------------------------------------------------------- */
+/* Platform Functions                                                         */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Compare Memory
+ *
+ * @param a the first buffer to compare
+ * @param b the second buffer to compare
+ * @param num the number of bytes to compare
+ * @return 0 if the first num bytes of both buffers are equal, non-zero
+ *     otherwise
+ */
+int64_t
+platform_memcmp(const void *a, const void *b, uint64_t num);
+
+/**
+ * Allocate Guest RAM
+ *
+ * Allocates zeroed memory that will be used as a guest's RAM. Unlike
+ * platform_alloc_rw(), the platform attempts to back the memory with
+ * physically contiguous large pages that are aligned with respect to the
+ * guest physical address the memory will be mapped to, so that the
+ * hypervisor can map the memory using large EPT entries.
+ *
+ * @param len the number of bytes to allocate
+ * @param gpa the guest physical address the memory will be mapped to
+ * @return the virtual address of the memory on success, 0 on failure
+ */
+void *
+platform_alloc_guest_ram(uint64_t len, uint64_t gpa);
+
+/**
+ * Free Guest RAM
+ *
+ * @param addr the address returned by platform_alloc_guest_ram()
+ * @param len the number of bytes that were allocated
+ */
+void
+platform_free_guest_ram(void *addr, uint64_t len);
+
+/**
+ * Release Guest RAM
+ *
+ * Gives part of the memory allocated by platform_alloc_guest_ram() back to
+ * the host. Memory that cannot be given back on its own (e.g. part of a
+ * large page) is kept until platform_free_guest_ram() is called.
+ *
+ * @param addr the address returned by platform_alloc_guest_ram()
+ * @param offset the offset into addr of the memory to release
+ * @param len the number of bytes to release
+ * @return the number of bytes given back to the host
+ */
+uint64_t
+platform_release_guest_ram(void *addr, uint64_t offset, uint64_t len);
+
+/**
+ * Allocate Event
+ *
+ * Allocates an auto-reset event that a thread can sleep on until another
+ * thread sets it (see platform_wait_event()).
+ *
+ * @return the event on success, 0 on failure
+ */
+void *
+platform_alloc_event(void);
+
+/**
+ * Free Event
+ *
+ * @param event the event returned by platform_alloc_event()
+ */
+void
+platform_free_event(void *event);
+
+/**
+ * Set Event
+ *
+ * Wakes up the thread that is waiting on the event. If no thread is
+ * waiting, the next wait returns right away.
+ *
+ * @param event the event to set
+ */
+void
+platform_set_event(void *event);
+
+/**
+ * Wait Event
+ *
+ * Sleeps until the event is set, the timeout expires, or the calling
+ * thread is interrupted (e.g. by a signal), and resets the event.
+ *
+ * @param event the event to wait on
+ * @param nsec the maximum number of nanoseconds to sleep for
+ * @return 1 if the event was set, 0 otherwise
+ */
+int64_t
+platform_wait_event(void *event, uint64_t nsec);
+
 #endif
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2019 Assured Information Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MPTABLE_H
+#define MPTABLE_H
+
+#include <bftypes.h>
+
+#pragma pack(push, 1)
+
+// -----------------------------------------------------------------------------
+// Intel MultiProcessor Specification (v1.4)
+// -----------------------------------------------------------------------------
+
+#define MPF_SIGNATURE "_MP_"
+#define MPC_SIGNATURE "PCMP"
+
+#define MP_SPEC_REV 4
+#define MP_LAPIC_ADDR 0xFEE00000
+#define MP_LAPIC_VERSION 0x14
+
+#define MP_PROCESSOR 0
+
+#define CPU_ENABLED 1
+#define CPU_BOOTPROCESSOR 2
+
+struct mpf_intel {
+	char        signature[4];
+	uint32_t    physptr;
+	uint8_t     length;
+	uint8_t     specification;
+	uint8_t     checksum;
+	uint8_t     feature1;
+	uint8_t     feature2;
+	uint8_t     feature3;
+	uint8_t     feature4;
+	uint8_t     feature5;
+};
+
+struct mpc_table {
+	char        signature[4];
+	uint16_t    length;
+	uint8_t     spec;
+	uint8_t     checksum;
+	char        oem[8];
+	char        productid[12];
+	uint32_t    oemptr;
+	uint16_t    oemsize;
+	uint16_t    oemcount;
+	uint32_t    lapic;
+	uint32_t    reserved;
+};
+
+struct mpc_cpu {
+	uint8_t     type;
+	uint8_t     apicid;
+	uint8_t     apicver;
+	uint8_t     cpuflag;
+	uint32_t    cpufeature;
+	uint32_t    featureflag;
+	uint32_t    reserved[2];
+};
+
+#pragma pack(pop)
+
+#endif
@@ -22,6 +22,7 @@
 
 #include <bootparams.h>
 #include <common.h>
+#include <mptable.h>
 
 #include <bfack.h>
 #include <bfdebug.h>
@@ -40,6 +41,56 @@
 /* -------------------------------------------------------------------------- */
 
 #define MAX_VMS 0x1000
+#define MAX_VCPUS_PER_VM 0x40
+#define MAX_EXTRA_RAM_PER_PAGE 0xFF
+#define MAX_TEMPLATES 0x10
+
+struct vcpu_exit_info_t {
+    uint64_t vcpuid;
+    struct mv_vp_exit_info_t *info;
+    void *event;
+};
+
+struct guest_ram_t {
+    char *addr;
+    uint64_t size;
+};
+
+/**
+ * Note:
+ *
+ * Guest RAM that is allocated after the VM is created (i.e. to service the
+ * balloon, or to back memory that is populated on demand) is tracked using
+ * a list of pages, each holding MAX_EXTRA_RAM_PER_PAGE allocations.
+ */
+
+struct extra_ram_t {
+    uint64_t num_entries;
+    struct extra_ram_t *next;
+    struct guest_ram_t entries[MAX_EXTRA_RAM_PER_PAGE];
+};
+
+/**
+ * Note:
+ *
+ * A template holds a kernel and initrd that have already been loaded into
+ * guest RAM. VMs that are created from the same kernel and initrd (and ask
+ * to share them) map the template copy-on-write instead of loading their
+ * own copy, and the template is freed once the last of these VMs is
+ * destroyed.
+ */
+
+struct template_t {
+    uint64_t refs;
+
+    char *addr;
+    uint64_t size;
+
+    uint64_t kernel_size;
+    uint64_t initrd_size;
+};
+
+static struct template_t g_templates[MAX_TEMPLATES] = {0};
 
 struct vm_t {
     uint64_t domainid;
@@ -48,16 +99,30 @@ struct vm_t {
 
     struct boot_params *params;
     char *cmdline;
+    uint8_t *mp_table;
 
     uint64_t *gdt;
 
     char *addr;
     uint64_t size;
+    uint64_t addr_gpa;
+    uint64_t addr_size;
+
+    struct template_t *tpl;
 
     int used;
 
     struct mv_handle_t handle;
     struct mv_mdl_t *e820_map;
+
+    uint64_t num_exit_infos;
+    struct vcpu_exit_info_t exit_infos[MAX_VCPUS_PER_VM];
+
+    struct extra_ram_t *extra_ram;
+
+    struct vm_t *parent;
+    uint64_t children;
+    int destroyed;
 };
 
 static struct vm_t g_vms[MAX_VMS] = {0};
@@ -217,17 +282,107 @@ donate_page_rw(
     return SUCCESS;
 }
 
+/**
+ * Note:
+ *
+ * Buffers are donated using a single hypercall. The buffer is described
+ * using a chain of MDLs with one entry per physically contiguous run of
+ * pages, and the VMM maps each run using the largest EPT page size that the
+ * run allows.
+ */
+
+static uint64_t
+count_buffer_runs(void *gva, uint64_t size)
+{
+    uint64_t i;
+    uint64_t gpa;
+    uint64_t next_gpa = 0;
+    uint64_t num_runs = 0;
+
+    for (i = 0; i < size; i += BAREFLANK_PAGE_SIZE) {
+        gpa = (uint64_t)platform_virt_to_phys((char *)gva + i);
+
+        if (i == 0 || gpa != next_gpa) {
+            num_runs++;
+        }
+
+        next_gpa = gpa + BAREFLANK_PAGE_SIZE;
+    }
+
+    return num_runs;
+}
+
+static struct mv_mdl_t *
+alloc_buffer_mdls(void *gva, uint64_t size, uint64_t *num_mdls)
+{
+    uint64_t i;
+    uint64_t gpa;
+    uint64_t next_gpa = 0;
+
+    struct mv_mdl_t *mdls;
+    struct mv_mdl_t *mdl;
+    struct mv_mdl_entry_t *entry = 0;
+
+    *num_mdls = count_buffer_runs(gva, size);
+    *num_mdls = (*num_mdls + MV_MDL_MAP_MAX_NUM_ENTRIES - 1) / MV_MDL_MAP_MAX_NUM_ENTRIES;
+
+    mdls = bfalloc_buffer(struct mv_mdl_t, *num_mdls * BAREFLANK_PAGE_SIZE);
+    if (mdls == 0) {
+        BFERROR("alloc_buffer_mdls: failed to alloc mdls\n");
+        return 0;
+    }
+
+    mdl = mdls;
+
+    for (i = 0; i < size; i += BAREFLANK_PAGE_SIZE) {
+        gpa = (uint64_t)platform_virt_to_phys((char *)gva + i);
+
+        if (entry != 0 && gpa == next_gpa) {
+            entry->size += BAREFLANK_PAGE_SIZE;
+        }
+        else {
+            if (mdl->num_entries == MV_MDL_MAP_MAX_NUM_ENTRIES) {
+                mdl->next = (uint64_t)platform_virt_to_phys(mdl + 1);
+                mdl++;
+            }
+
+            entry = &mdl->entries[mdl->num_entries++];
+            entry->gpa = gpa;
+            entry->size = BAREFLANK_PAGE_SIZE;
+        }
+
+        next_gpa = gpa + BAREFLANK_PAGE_SIZE;
+    }
+
+    return mdls;
+}
+
 static status_t
-donate_page_rwe(
-    struct vm_t *vm, void *gva, uint64_t domain_gpa)
+map_buffer(
+    struct vm_t *vm, void *gva, uint64_t domain_gpa, uint64_t size, uint64_t flags)
 {
+    uint64_t num_mdls;
     status_t ret = SUCCESS;
-    uint64_t gpa = (uint64_t)platform_virt_to_phys(gva);
+    struct mv_mdl_t *mdls;
+
+    mdls = alloc_buffer_mdls(gva, size, &num_mdls);
+    if (mdls == 0) {
+        return FAILURE;
+    }
+
+    ret = mv_vm_state_op_map_mdl(
+        &vm->handle,
+        MV_VMID_SELF,
+        (mv_uint64_t)platform_virt_to_phys(mdls),
+        vm->domainid,
+        domain_gpa,
+        flags);
+
+    platform_free_rw(mdls, num_mdls * BAREFLANK_PAGE_SIZE);
 
-    ret = hypercall_domain_op__donate_page_rwe(vm->domainid, gpa, domain_gpa);
     if (ret != SUCCESS) {
-        BFERROR("donate_page: hypercall_domain_op__donate_page_rwe failed\n");
-        return ret;
+        BFERROR("map_buffer: mv_vm_state_op_map_mdl failed\n");
+        return FAILURE;
     }
 
     return SUCCESS;
@@ -237,14 +392,41 @@ static status_t
 donate_buffer(
     struct vm_t *vm, void *gva, uint64_t domain_gpa, uint64_t size)
 {
-    uint64_t i;
+    return map_buffer(
+        vm, gva, domain_gpa, size,
+        MV_GPA_FLAG_READ_ACCESS | MV_GPA_FLAG_WRITE_ACCESS | MV_GPA_FLAG_EXECUTE_ACCESS);
+}
+
+static status_t
+share_buffer(
+    struct vm_t *vm, void *gva, uint64_t domain_gpa, uint64_t size)
+{
+    return map_buffer(
+        vm, gva, domain_gpa, size,
+        MV_GPA_FLAG_READ_ACCESS | MV_GPA_FLAG_WRITE_ACCESS | MV_GPA_FLAG_EXECUTE_ACCESS |
+        MV_GPA_FLAG_WRITE_PROTECTED);
+}
+
+static status_t
+add_demand_pool(struct vm_t *vm, void *gva, uint64_t size)
+{
+    uint64_t num_mdls;
     status_t ret = SUCCESS;
+    struct mv_mdl_t *mdls;
 
-    for (i = 0; i < size; i += BAREFLANK_PAGE_SIZE) {
-        ret = donate_page_rwe(vm, (char *)gva + i, domain_gpa + i);
-        if (ret != SUCCESS) {
-            return ret;
-        }
+    mdls = alloc_buffer_mdls(gva, size, &num_mdls);
+    if (mdls == 0) {
+        return FAILURE;
+    }
+
+    ret = hypercall_domain_op__demand_pool_add(
+        vm->domainid, (uint64_t)platform_virt_to_phys(mdls));
+
+    platform_free_rw(mdls, num_mdls * BAREFLANK_PAGE_SIZE);
+
+    if (ret != SUCCESS) {
+        BFERROR("add_demand_pool: __domain_op__demand_pool_add failed\n");
+        return FAILURE;
     }
 
     return SUCCESS;
@@ -288,6 +470,202 @@ setup_pt_uart(
     return SUCCESS;
 }
 
+/* -------------------------------------------------------------------------- */
+/* Template Functions                                                         */
+/* -------------------------------------------------------------------------- */
+
+static status_t
+load_kernel(
+    char *addr, uint64_t size,
+    const void *kernel, uint64_t kernel_size,
+    const void *initrd, uint64_t initrd_size)
+{
+    status_t ret;
+    uint64_t initrd_offset = (kernel_size + 0xFFF) & ~(0xFFFULL);
+
+    ret = platform_memcpy(
+        addr, size, kernel, kernel_size, kernel_size);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    ret = platform_memcpy(
+        addr + initrd_offset, size - initrd_offset, initrd, initrd_size, initrd_size);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    return SUCCESS;
+}
+
+static int
+is_template_of(
+    struct template_t *tpl,
+    const void *kernel, uint64_t kernel_size,
+    const void *initrd, uint64_t initrd_size)
+{
+    uint64_t initrd_offset = (kernel_size + 0xFFF) & ~(0xFFFULL);
+
+    if (tpl->kernel_size != kernel_size || tpl->initrd_size != initrd_size) {
+        return 0;
+    }
+
+    if (platform_memcmp(tpl->addr, kernel, kernel_size) != 0) {
+        return 0;
+    }
+
+    if (platform_memcmp(tpl->addr + initrd_offset, initrd, initrd_size) != 0) {
+        return 0;
+    }
+
+    return 1;
+}
+
+static struct template_t *
+acquire_template(
+    const void *kernel, uint64_t kernel_size,
+    const void *initrd, uint64_t initrd_size)
+{
+    int64_t i;
+    struct template_t *tpl = 0;
+    struct template_t *unused = 0;
+
+    platform_acquire_mutex();
+
+    for (i = 0; i < MAX_TEMPLATES; i++) {
+        if (g_templates[i].refs == 0) {
+            if (unused == 0) {
+                unused = &g_templates[i];
+            }
+
+            continue;
+        }
+
+        if (is_template_of(&g_templates[i], kernel, kernel_size, initrd, initrd_size)) {
+            tpl = &g_templates[i];
+            ++tpl->refs;
+
+            goto done;
+        }
+    }
+
+    if (unused == 0) {
+        BFALERT("MAX_TEMPLATES reached. Could not acquire template\n");
+        goto done;
+    }
+
+    unused->size =
+        ((kernel_size + 0xFFF) & ~(0xFFFULL)) + ((initrd_size + 0xFFF) & ~(0xFFFULL));
+
+    unused->addr = platform_alloc_guest_ram(unused->size, 0x100000);
+    if (unused->addr == 0) {
+        BFERROR("acquire_template: failed to alloc ram\n");
+        goto done;
+    }
+
+    if (load_kernel(unused->addr, unused->size, kernel, kernel_size, initrd, initrd_size) != SUCCESS) {
+        platform_free_guest_ram(unused->addr, unused->size);
+        unused->addr = 0;
+        goto done;
+    }
+
+    tpl = unused;
+    tpl->kernel_size = kernel_size;
+    tpl->initrd_size = initrd_size;
+    tpl->refs = 1;
+
+done:
+
+    platform_release_mutex();
+    return tpl;
+}
+
+static void
+release_template(struct template_t *tpl)
+{
+    platform_acquire_mutex();
+
+    if (--tpl->refs == 0) {
+        platform_free_guest_ram(tpl->addr, tpl->size);
+        platform_memset(tpl, 0, sizeof(struct template_t));
+    }
+
+    platform_release_mutex();
+}
+
+/* -------------------------------------------------------------------------- */
+/* Extra RAM Functions                                                        */
+/* -------------------------------------------------------------------------- */
+
+static status_t
+track_extra_ram(struct vm_t *vm, char *addr, uint64_t size)
+{
+    status_t ret = SUCCESS;
+    struct extra_ram_t *extra_ram;
+
+    platform_acquire_mutex();
+
+    extra_ram = vm->extra_ram;
+
+    if (extra_ram == 0 || extra_ram->num_entries == MAX_EXTRA_RAM_PER_PAGE) {
+        extra_ram = bfalloc_page(struct extra_ram_t);
+        if (extra_ram == 0) {
+            BFERROR("track_extra_ram: failed to alloc extra_ram page\n");
+            ret = FAILURE;
+            goto done;
+        }
+
+        extra_ram->next = vm->extra_ram;
+        vm->extra_ram = extra_ram;
+    }
+
+    extra_ram->entries[extra_ram->num_entries].addr = addr;
+    extra_ram->entries[extra_ram->num_entries].size = size;
+    ++extra_ram->num_entries;
+
+done:
+
+    platform_release_mutex();
+    return ret;
+}
+
+static char *
+alloc_extra_ram(struct vm_t *vm, uint64_t size, uint64_t gpa)
+{
+    char *addr;
+
+    addr = platform_alloc_guest_ram(size, gpa);
+    if (addr == 0) {
+        BFERROR("alloc_extra_ram: failed to alloc guest ram\n");
+        return 0;
+    }
+
+    if (track_extra_ram(vm, addr, size) != SUCCESS) {
+        platform_free_guest_ram(addr, size);
+        return 0;
+    }
+
+    return addr;
+}
+
+static void
+free_extra_ram(struct vm_t *vm)
+{
+    uint64_t i;
+    struct extra_ram_t *next;
+
+    while (vm->extra_ram != 0) {
+        for (i = 0; i < vm->extra_ram->num_entries; i++) {
+            platform_free_guest_ram(
+                vm->extra_ram->entries[i].addr, vm->extra_ram->entries[i].size);
+        }
+
+        next = vm->extra_ram->next;
+        platform_free_rw(vm->extra_ram, BAREFLANK_PAGE_SIZE);
+        vm->extra_ram = next;
+    }
+}
+
 /* -------------------------------------------------------------------------- */
 /* GPA Functions                                                              */
 /* -------------------------------------------------------------------------- */
@@ -320,6 +698,83 @@ setup_cmdline(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
     return SUCCESS;
 }
 
+/**
+ * Note:
+ *
+ * The guest does not get any ACPI tables, so its vCPUs are described using
+ * an MP table (see the Intel MultiProcessor Specification), which Linux
+ * looks for in the BIOS region (0xF0000 - 0xFFFFF). The floating pointer
+ * and the configuration table share a single read-only page. Each vCPU
+ * gets a processor entry whose APIC ID matches the x2APIC ID the VMM gives
+ * it (i.e. the order in which the vCPUs are created, starting with the BSP
+ * as 0). The guest kernel needs CONFIG_X86_MPPARSE to see the APs.
+ */
+
+static uint8_t
+mp_checksum(const uint8_t *buf, uint64_t len)
+{
+    uint64_t i;
+    uint8_t sum = 0;
+
+    for (i = 0; i < len; i++) {
+        sum += buf[i];
+    }
+
+    return (uint8_t)(0 - sum);
+}
+
+static status_t
+setup_mp_table(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
+{
+    uint64_t i;
+    uint64_t num_vcpus = args->num_vcpus != 0 ? args->num_vcpus : 1;
+
+    struct mpf_intel *mpf;
+    struct mpc_table *mpc;
+    struct mpc_cpu *cpu;
+
+    if (num_vcpus > MAX_VCPUS_PER_VM) {
+        BFERROR("setup_mp_table: too many vcpus\n");
+        return FAILURE;
+    }
+
+    vm->mp_table = bfalloc_page(uint8_t);
+    if (vm->mp_table == 0) {
+        BFERROR("setup_mp_table: failed to alloc mp table page\n");
+        return FAILURE;
+    }
+
+    mpf = (struct mpf_intel *)vm->mp_table;
+    mpc = (struct mpc_table *)(mpf + 1);
+    cpu = (struct mpc_cpu *)(mpc + 1);
+
+    for (i = 0; i < num_vcpus; i++) {
+        cpu[i].type = MP_PROCESSOR;
+        cpu[i].apicid = (uint8_t)i;
+        cpu[i].apicver = MP_LAPIC_VERSION;
+        cpu[i].cpuflag = i == 0 ? CPU_ENABLED | CPU_BOOTPROCESSOR : CPU_ENABLED;
+    }
+
+    platform_memcpy(mpc->signature, 4, MPC_SIGNATURE, 4, 4);
+    platform_memcpy(mpc->oem, 8, "BAREFLNK", 8, 8);
+    platform_memcpy(mpc->productid, 12, "MICROV      ", 12, 12);
+
+    mpc->length = (uint16_t)(sizeof(struct mpc_table) + num_vcpus * sizeof(struct mpc_cpu));
+    mpc->spec = MP_SPEC_REV;
+    mpc->oemcount = (uint16_t)num_vcpus;
+    mpc->lapic = MP_LAPIC_ADDR;
+    mpc->checksum = mp_checksum((uint8_t *)mpc, mpc->length);
+
+    platform_memcpy(mpf->signature, 4, MPF_SIGNATURE, 4, 4);
+
+    mpf->physptr = MP_TABLE_GPA + sizeof(struct mpf_intel);
+    mpf->length = 1;
+    mpf->specification = MP_SPEC_REV;
+    mpf->checksum = mp_checksum((uint8_t *)mpf, sizeof(struct mpf_intel));
+
+    return donate_page_r(vm, vm->mp_table, MP_TABLE_GPA);
+}
+
 static status_t
 setup_boot_params(
     struct vm_t *vm, struct create_vm_from_bzimage_args *args, const struct setup_header *hdr)
@@ -347,6 +802,11 @@ setup_boot_params(
         return ret;
     }
 
+    ret = setup_mp_table(vm, args);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
     ret = setup_microv_e820_map(vm);
     if (ret != SUCCESS) {
         return ret;
@@ -413,6 +873,10 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
     const void *kernel = 0;
     uint64_t kernel_size = 0;
     uint64_t kernel_offset = 0;
+    uint64_t ram_end = 0;
+    uint64_t high_size = 0;
+    uint64_t demand_end = 0;
+    char *high_addr = 0;
 
     if (args->bzimage == 0) {
         BFERROR("setup_kernel: bzImage is null\n");
@@ -424,11 +888,16 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
         return FAILURE;
     }
 
-    if (args->bzimage_size + args->initrd_size > args->size) {
+    if (args->bzimage_size + args->initrd_size > low_ram_size(args->size)) {
         BFERROR("setup_kernel: requested RAM is too small\n");
         return FAILURE;
     }
 
+    if (args->size > RAM_MAX_SIZE) {
+        BFERROR("setup_kernel: requested RAM is too large\n");
+        return FAILURE;
+    }
+
     if (hdr->header != 0x53726448) {
         BFERROR("setup_kernel: bzImage does not contain magic number\n");
         return FAILURE;
@@ -444,14 +913,6 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
         return FAILURE;
     }
 
-    vm->size = args->size;
-    vm->addr = bfalloc_buffer(char, vm->size);
-
-    if (vm->addr == 0) {
-        BFERROR("setup_kernel: failed to alloc ram\n");
-        return FAILURE;
-    }
-
     kernel_offset = ((hdr->setup_sects + 1) * 512);
 
     if (kernel_offset > args->bzimage_size) {
@@ -468,38 +929,138 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
     kernel = args->bzimage + kernel_offset;
     kernel_size = args->bzimage_size - kernel_offset;
 
-    ret = platform_memcpy(
-        vm->addr, vm->size, kernel, kernel_size, kernel_size);
-    if (ret != SUCCESS) {
-        return ret;
-    }
+    /**
+     * Note:
+     *
+     * When share is set, the kernel and initrd are not loaded into this
+     * VM's RAM. Instead, a template holding them is mapped copy-on-write
+     * (see acquire_template), and the VM's own RAM starts right after it.
+     *
+     * When lazy is set, only the RAM that holds the kernel and initrd
+     * (rounded up to a 2M boundary) is allocated here. The rest of the
+     * guest's RAM is reserved in the hypervisor and populated the first
+     * time the guest touches it (see common_populate), so creating a VM no
+     * longer scales with the amount of RAM it is given.
+     *
+     * RAM that does not fit in low RAM is placed in high RAM (see
+     * bfgpalayout.h). The kernel and initrd are always in low RAM, while
+     * high RAM is either allocated as a whole (and mapped using large
+     * pages where the allocation allows it) or, when lazy is set, added to
+     * the demand range like the rest of the guest's RAM.
+     */
 
-    if ((kernel_size & 0xFFF) != 0) {
-        kernel_size += 0x1000;
-        kernel_size &= ~(0xFFF);
-    }
+    vm->size = args->size;
+    vm->addr_gpa = 0x100000;
+    vm->addr_size = low_ram_size(args->size);
 
-    ret = platform_memcpy(
-        vm->addr + kernel_size, vm->size - kernel_size, args->initrd, args->initrd_size, args->initrd_size);
-    if (ret != SUCCESS) {
-        return ret;
-    }
+    high_size = high_ram_size(args->size);
+    demand_end = LOW_RAM_ADDR + low_ram_size(args->size);
 
-    ret = donate_buffer(vm, vm->addr, 0x100000, vm->size);
-    if (ret != SUCCESS) {
-        return ret;
-    }
+    if (args->share != 0) {
+        vm->tpl = acquire_template(kernel, kernel_size, args->initrd, args->initrd_size);
+        if (vm->tpl == 0) {
+            BFERROR("setup_kernel: failed to acquire template\n");
+            return FAILURE;
+        }
 
-    ret = setup_boot_params(vm, args, hdr);
+        if (vm->tpl->size > vm->addr_size) {
+            BFERROR("setup_kernel: requested RAM is too small\n");
+            return FAILURE;
+        }
+
+        ret = share_buffer(vm, vm->tpl->addr, 0x100000, vm->tpl->size);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+
+        vm->addr_gpa += vm->tpl->size;
+        vm->addr_size -= vm->tpl->size;
+    }
+
+    if (args->lazy != 0) {
+        ram_end = 0x100000 +
+            ((kernel_size + 0xFFF) & ~(0xFFFULL)) + ((args->initrd_size + 0xFFF) & ~(0xFFFULL));
+        ram_end = (ram_end + 0x1FFFFF) & ~(0x1FFFFFULL);
+
+        if (ram_end - vm->addr_gpa < vm->addr_size) {
+            vm->addr_size = ram_end - vm->addr_gpa;
+        }
+    }
+
+    if (vm->addr_size != 0) {
+        vm->addr = platform_alloc_guest_ram(vm->addr_size, vm->addr_gpa);
+
+        if (vm->addr == 0) {
+            BFERROR("setup_kernel: failed to alloc ram\n");
+            return FAILURE;
+        }
+
+        if (vm->tpl == 0) {
+            ret = load_kernel(
+                vm->addr, vm->addr_size, kernel, kernel_size, args->initrd, args->initrd_size);
+            if (ret != SUCCESS) {
+                return ret;
+            }
+        }
+
+        ret = donate_buffer(vm, vm->addr, vm->addr_gpa, vm->addr_size);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+    }
+
+    if (high_size != 0) {
+        if (args->lazy != 0) {
+            demand_end = HIGH_RAM_ADDR + high_size;
+        }
+        else {
+            high_addr = alloc_extra_ram(vm, high_size, HIGH_RAM_ADDR);
+            if (high_addr == 0) {
+                BFERROR("setup_kernel: failed to alloc high ram\n");
+                return FAILURE;
+            }
+
+            ret = donate_buffer(vm, high_addr, HIGH_RAM_ADDR, high_size);
+            if (ret != SUCCESS) {
+                return ret;
+            }
+        }
+    }
+
+    if (vm->addr_gpa + vm->addr_size < demand_end) {
+        ret = hypercall_domain_op__set_demand_range(
+            vm->domainid,
+            vm->addr_gpa + vm->addr_size,
+            (demand_end - vm->addr_gpa - vm->addr_size) & ~(0xFFFULL));
+        if (ret != SUCCESS) {
+            BFERROR("__domain_op__set_demand_range failed\n");
+            return ret;
+        }
+    }
+
+    if ((kernel_size & 0xFFF) != 0) {
+        kernel_size += 0x1000;
+        kernel_size &= ~(0xFFF);
+    }
+
+    ret = setup_boot_params(vm, args, hdr);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    // TODO
-    //
-    // Check initrd size and location to ensure they are in the 32bit
-    // boundary
-    //
+    /**
+     * Note:
+     *
+     * The initrd follows the kernel in low RAM. The boot protocol only has
+     * 32bit fields for its location, and the kernel tells us the highest
+     * address the initrd can be loaded at (initrd_addr_max).
+     */
+
+    if (args->initrd_size != 0 &&
+        0x100000 + kernel_size + args->initrd_size - 1 > hdr->initrd_addr_max) {
+        BFERROR("setup_kernel: initrd does not fit below initrd_addr_max\n");
+        return FAILURE;
+    }
 
     vm->params->hdr.ramdisk_image = (uint32_t)(0x100000 + kernel_size);
     vm->params->hdr.ramdisk_size = (uint32_t)(args->initrd_size);
@@ -580,69 +1141,87 @@ setup_32bit_register_state(struct vm_t *vm)
      */
 
     status_t ret = SUCCESS;
+    struct mv_reg_vals_t *regs = bfalloc_page(struct mv_reg_vals_t);
 
-    ret |= hypercall_domain_op__set_rip(vm->domainid, 0x100000);
-    ret |= hypercall_domain_op__set_rsi(vm->domainid, BOOT_PARAMS_PAGE_GPA);
-
-    ret |= hypercall_domain_op__set_gdt_base(vm->domainid, INITIAL_GDT_GPA);
-    ret |= hypercall_domain_op__set_gdt_limit(vm->domainid, 32);
+    if (regs == 0) {
+        BFERROR("setup_32bit_register_state: failed to alloc reg vals\n");
+        return FAILURE;
+    }
 
-    ret |= hypercall_domain_op__set_cr0(vm->domainid, 0x10037);
-    ret |= hypercall_domain_op__set_cr2(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_cr3(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_cr4(vm->domainid, 0x02000);
-    ret |= hypercall_domain_op__set_cr8(vm->domainid, 0x0);
+    /**
+     * Note:
+     *
+     * All of the registers are set using a single hypercall. The remaining
+     * state is not part of the MicroV register list and is set using the
+     * legacy domain_op hypercalls.
+     */
 
-    ret |= hypercall_domain_op__set_dr0(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_dr1(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_dr2(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_dr3(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_dr6(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_dr7(vm->domainid, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_rip, 0x100000);
+    mv_reg_vals_set(regs, mv_reg_t_rsi, BOOT_PARAMS_PAGE_GPA);
+
+    mv_reg_vals_set(regs, mv_reg_t_gdtr_base_addr, INITIAL_GDT_GPA);
+    mv_reg_vals_set(regs, mv_reg_t_gdtr_limit, 32);
+
+    mv_reg_vals_set(regs, mv_reg_t_cr0, 0x10037);
+    mv_reg_vals_set(regs, mv_reg_t_cr2, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_cr3, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_cr4, 0x02000);
+    mv_reg_vals_set(regs, mv_reg_t_cr8, 0x0);
+
+    mv_reg_vals_set(regs, mv_reg_t_dr0, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_dr1, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_dr2, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_dr3, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_dr6, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_dr7, 0x0);
+
+    mv_reg_vals_set(regs, mv_reg_t_es, 0x18);
+    mv_reg_vals_set(regs, mv_reg_t_es_base_addr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_es_limit, 0xFFFFFFFF);
+    mv_reg_vals_set(regs, mv_reg_t_es_attributes, 0xc093);
+
+    mv_reg_vals_set(regs, mv_reg_t_cs, 0x10);
+    mv_reg_vals_set(regs, mv_reg_t_cs_base_addr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_cs_limit, 0xFFFFFFFF);
+    mv_reg_vals_set(regs, mv_reg_t_cs_attributes, 0xc09b);
+
+    mv_reg_vals_set(regs, mv_reg_t_ss, 0x18);
+    mv_reg_vals_set(regs, mv_reg_t_ss_base_addr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_ss_limit, 0xFFFFFFFF);
+    mv_reg_vals_set(regs, mv_reg_t_ss_attributes, 0xc093);
+
+    mv_reg_vals_set(regs, mv_reg_t_ds, 0x18);
+    mv_reg_vals_set(regs, mv_reg_t_ds_base_addr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_ds_limit, 0xFFFFFFFF);
+    mv_reg_vals_set(regs, mv_reg_t_ds_attributes, 0xc093);
+
+    mv_reg_vals_set(regs, mv_reg_t_fs, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_fs_base_addr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_fs_limit, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_fs_attributes, 0x10000);
+
+    mv_reg_vals_set(regs, mv_reg_t_gs, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_gs_base_addr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_gs_limit, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_gs_attributes, 0x10000);
+
+    mv_reg_vals_set(regs, mv_reg_t_tr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_tr_base_addr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_tr_limit, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_tr_attributes, 0x008b);
+
+    mv_reg_vals_set(regs, mv_reg_t_ldtr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_ldtr_base_addr, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_ldtr_limit, 0x0);
+    mv_reg_vals_set(regs, mv_reg_t_ldtr_attributes, 0x10000);
+
+    ret |= mv_vm_state_op_set_list_of_initial_reg_vals(
+        &vm->handle, vm->domainid, (mv_uint64_t)platform_virt_to_phys(regs));
+
+    platform_free_rw(regs, BAREFLANK_PAGE_SIZE);
 
     ret |= hypercall_domain_op__set_xcr0(vm->domainid, 0x3);
     ret |= hypercall_domain_op__set_ia32_xss(vm->domainid, 0x0);
-
-    ret |= hypercall_domain_op__set_es_selector(vm->domainid, 0x18);
-    ret |= hypercall_domain_op__set_es_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_es_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_es_access_rights(vm->domainid, 0xc093);
-
-    ret |= hypercall_domain_op__set_cs_selector(vm->domainid, 0x10);
-    ret |= hypercall_domain_op__set_cs_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_cs_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_cs_access_rights(vm->domainid, 0xc09b);
-
-    ret |= hypercall_domain_op__set_ss_selector(vm->domainid, 0x18);
-    ret |= hypercall_domain_op__set_ss_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ss_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_ss_access_rights(vm->domainid, 0xc093);
-
-    ret |= hypercall_domain_op__set_ds_selector(vm->domainid, 0x18);
-    ret |= hypercall_domain_op__set_ds_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ds_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_ds_access_rights(vm->domainid, 0xc093);
-
-    ret |= hypercall_domain_op__set_fs_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_fs_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_fs_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_fs_access_rights(vm->domainid, 0x10000);
-
-    ret |= hypercall_domain_op__set_gs_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_gs_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_gs_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_gs_access_rights(vm->domainid, 0x10000);
-
-    ret |= hypercall_domain_op__set_tr_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_tr_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_tr_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_tr_access_rights(vm->domainid, 0x008b);
-
-    ret |= hypercall_domain_op__set_ldtr_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ldtr_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ldtr_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ldtr_access_rights(vm->domainid, 0x10000);
-
     ret |= hypercall_domain_op__set_ia32_pat(vm->domainid, 0x0606060606060606);
 
     if (ret != SUCCESS) {
@@ -658,6 +1237,260 @@ setup_32bit_register_state(struct vm_t *vm)
     return SUCCESS;
 }
 
+/* -------------------------------------------------------------------------- */
+/* Exit Info                                                                  */
+/* -------------------------------------------------------------------------- */
+
+static struct mv_vp_exit_info_t *
+register_exit_info(struct vm_t *vm, uint64_t vcpuid)
+{
+    status_t ret;
+    struct vcpu_exit_info_t *exit_info;
+
+    if (vm->num_exit_infos >= MAX_VCPUS_PER_VM) {
+        BFERROR("register_exit_info: MAX_VCPUS_PER_VM reached\n");
+        return 0;
+    }
+
+    exit_info = &vm->exit_infos[vm->num_exit_infos];
+
+    exit_info->info = bfalloc_page(struct mv_vp_exit_info_t);
+    if (exit_info->info == 0) {
+        BFERROR("register_exit_info: failed to alloc exit info page\n");
+        return 0;
+    }
+
+    exit_info->event = platform_alloc_event();
+    if (exit_info->event == 0) {
+        BFERROR("register_exit_info: failed to alloc event\n");
+        platform_free_rw(exit_info->info, BAREFLANK_PAGE_SIZE);
+
+        exit_info->info = 0;
+        return 0;
+    }
+
+    ret = mv_vp_exit_op_set_exit_info(
+        &vm->handle, vcpuid, (mv_uint64_t)platform_virt_to_phys(exit_info->info));
+    if (ret != SUCCESS) {
+        BFERROR("register_exit_info: mv_vp_exit_op_set_exit_info failed\n");
+        platform_free_rw(exit_info->info, BAREFLANK_PAGE_SIZE);
+        platform_free_event(exit_info->event);
+
+        exit_info->info = 0;
+        exit_info->event = 0;
+        return 0;
+    }
+
+    exit_info->vcpuid = vcpuid;
+    ++vm->num_exit_infos;
+
+    return exit_info->info;
+}
+
+static void
+release_exit_infos(struct vm_t *vm)
+{
+    uint64_t i;
+
+    for (i = 0; i < vm->num_exit_infos; i++) {
+        platform_free_rw(vm->exit_infos[i].info, BAREFLANK_PAGE_SIZE);
+        platform_free_event(vm->exit_infos[i].event);
+    }
+
+    vm->num_exit_infos = 0;
+}
+
+static struct vcpu_exit_info_t *
+find_exit_info(struct vm_t *vm, uint64_t vcpuid)
+{
+    uint64_t i;
+
+    for (i = 0; i < vm->num_exit_infos; i++) {
+        if (vm->exit_infos[i].vcpuid == vcpuid) {
+            return &vm->exit_infos[i];
+        }
+    }
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Balloon Functions                                                          */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Note:
+ *
+ * Memory the guest gives back is only released if it came from the guest's
+ * original RAM (and not a shared template). Memory that was allocated after
+ * the fact (i.e. because the guest asked for it back, or because it was
+ * populated on demand) is kept until the VM is destroyed.
+ */
+
+static uint64_t
+release_balloon_ram(struct vm_t *vm, uint64_t gpa, uint64_t size)
+{
+    if (gpa < vm->addr_gpa || gpa + size > vm->addr_gpa + vm->addr_size) {
+        return 0;
+    }
+
+    return platform_release_guest_ram(vm->addr, gpa - vm->addr_gpa, size);
+}
+
+static int64_t
+populate_balloon_ram(struct vm_t *vm, uint64_t gpa, uint64_t size)
+{
+    char *addr;
+
+    addr = alloc_extra_ram(vm, size, gpa);
+    if (addr == 0) {
+        return FAILURE;
+    }
+
+    return donate_buffer(vm, addr, gpa, size);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Restore Functions                                                          */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Note:
+ *
+ * A restored VM gets the same memory map as a VM that is created from a
+ * bzImage, so the guest finds its RAM where it left it. The boot params
+ * page is only used to build the memory map (it is not given to the
+ * guest, as the guest has already booted). The BIOS RAM is allocated up
+ * front, while the rest of the guest's RAM is populated on demand, either
+ * when it is restored (see common_write_memory) or when the guest first
+ * touches it. If the guest has high RAM, the demand range also covers the
+ * reserved region below 4GB, which the VMM never populates as it is not
+ * RAM.
+ */
+
+static status_t
+setup_restored_ram(struct vm_t *vm, uint64_t size)
+{
+    status_t ret = SUCCESS;
+
+    vm->params = bfalloc_page(struct boot_params);
+    if (vm->params == 0) {
+        BFERROR("setup_restored_ram: failed to alloc boot params page\n");
+        return FAILURE;
+    }
+
+    ret = setup_microv_e820_map(vm);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    ret = setup_bootparams_e820_map(vm, size);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    ret = mv_vm_properties_op_set_e820(
+        &vm->handle, vm->domainid, 0, (mv_uint64_t)platform_virt_to_phys(vm->e820_map));
+    if (ret != SUCCESS) {
+        BFERROR("setup_restored_ram: mv_vm_properties_op_set_e820 failed\n");
+        return ret;
+    }
+
+    ret = setup_bios_ram(vm);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    vm->size = size;
+    vm->addr_gpa = 0x100000;
+
+    ret = hypercall_domain_op__set_demand_range(
+        vm->domainid, vm->addr_gpa, (guest_ram_end(size) - vm->addr_gpa) & ~(0xFFFULL));
+    if (ret != SUCCESS) {
+        BFERROR("__domain_op__set_demand_range failed\n");
+        return ret;
+    }
+
+    return SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Fork Functions                                                             */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Note:
+ *
+ * A VM that is forked from a paused VM maps the paused VM's memory, so the
+ * paused VM's memory cannot be freed when it is destroyed if it still has
+ * children. Instead, the VM is marked as destroyed, and it is freed when
+ * its last child is freed (which might in turn free its own parent). A
+ * forked VM only owns the memory it was given after it was created (i.e.
+ * its extra RAM), so everything else is 0 and is skipped.
+ */
+
+static void
+free_vm_memory(struct vm_t *vm)
+{
+    if (vm->bios_ram != 0) {
+        platform_free_rw(vm->bios_ram, BIOS_RAM_SIZE);
+    }
+
+    if (vm->params != 0) {
+        platform_free_rw(vm->params, BAREFLANK_PAGE_SIZE);
+    }
+
+    if (vm->cmdline != 0) {
+        platform_free_rw(vm->cmdline, BAREFLANK_PAGE_SIZE);
+    }
+
+    if (vm->mp_table != 0) {
+        platform_free_rw(vm->mp_table, BAREFLANK_PAGE_SIZE);
+    }
+
+    if (vm->gdt != 0) {
+        platform_free_rw(vm->gdt, BAREFLANK_PAGE_SIZE);
+    }
+
+    if (vm->addr != 0) {
+        platform_free_guest_ram(vm->addr, vm->addr_size);
+    }
+
+    if (vm->tpl != 0) {
+        release_template(vm->tpl);
+    }
+
+    free_extra_ram(vm);
+    release_exit_infos(vm);
+}
+
+static void
+free_vm(struct vm_t *vm)
+{
+    int free_parent;
+    struct vm_t *parent;
+
+    while (vm != 0) {
+        parent = vm->parent;
+
+        free_vm_memory(vm);
+        release_vm(vm);
+
+        if (parent == 0) {
+            return;
+        }
+
+        platform_acquire_mutex();
+
+        --parent->children;
+        free_parent = parent->children == 0 && parent->destroyed != 0;
+
+        platform_release_mutex();
+
+        vm = free_parent != 0 ? parent : 0;
+    }
+}
+
 /* -------------------------------------------------------------------------- */
 /* Implementation                                                             */
 /* -------------------------------------------------------------------------- */
@@ -716,6 +1549,139 @@ common_create_vm_from_bzimage(
     return SUCCESS;
 }
 
+int64_t
+common_fork(struct fork_vm_args *args)
+{
+    status_t ret;
+    struct vm_t *vm = acquire_vm();
+    struct vm_t *parent = get_vm(args->parent_domainid);
+
+    args->domainid = INVALID_DOMAINID;
+
+    if (mv_present(MV_SPEC_ID1_VAL) == 0) {
+        BFERROR("mv_present failed\n");
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    if (mv_handle_op_open_handle(MV_SPEC_ID1_VAL, &vm->handle) != 0) {
+        BFERROR("mv_handle_op_open failed\n");
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    vm->domainid = hypercall_domain_op__fork_domain(parent->domainid);
+    if (vm->domainid == INVALID_DOMAINID) {
+        BFERROR("__domain_op__fork_domain failed\n");
+        return COMMON_FORK_FAILED;
+    }
+
+    platform_acquire_mutex();
+
+    vm->parent = parent;
+    ++parent->children;
+
+    platform_release_mutex();
+
+    /**
+     * Note:
+     *
+     * The parent's memory is shared a batch at a time, so that no single
+     * hypercall keeps this core in the hypervisor for too long.
+     */
+
+    do {
+        ret = hypercall_domain_op__fork_memory(vm->domainid);
+    } while (ret == 1);
+
+    if (ret != SUCCESS) {
+        BFERROR("__domain_op__fork_memory failed\n");
+        return COMMON_FORK_FAILED;
+    }
+
+    ret = setup_uart(vm, args->uart);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    args->domainid = vm->domainid;
+    return SUCCESS;
+}
+
+int64_t
+common_restore(struct restore_vm_args *args)
+{
+    status_t ret;
+    struct vm_t *vm = acquire_vm();
+
+    args->domainid = INVALID_DOMAINID;
+
+    if (mv_present(MV_SPEC_ID1_VAL) == 0) {
+        BFERROR("mv_present failed\n");
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    if (mv_handle_op_open_handle(MV_SPEC_ID1_VAL, &vm->handle) != 0) {
+        BFERROR("mv_handle_op_open failed\n");
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    vm->domainid = hypercall_domain_op__create_domain();
+    if (vm->domainid == INVALID_DOMAINID) {
+        BFERROR("__domain_op__create_domain failed\n");
+        return COMMON_RESTORE_FAILED;
+    }
+
+    ret = setup_restored_ram(vm, args->size);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    args->domainid = vm->domainid;
+    return SUCCESS;
+}
+
+int64_t
+common_write_memory(struct write_memory_args *args)
+{
+    uint64_t ret;
+    uint64_t offset = 0;
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    if ((args->size % MEMORY_MAX_BUFFER) != 0) {
+        BFERROR("common_write_memory: invalid size\n");
+        return FAILURE;
+    }
+
+    /**
+     * Note:
+     *
+     * The hypervisor writes MEMORY_MAX_BUFFER bytes at a time, and stops
+     * early if it runs out of memory to populate the guest's RAM with, in
+     * which case more memory is added to the demand pool before moving on.
+     */
+
+    while (offset < args->size) {
+        ret = hypercall_domain_op__write_memory(
+            args->domainid, args->buffer + offset, args->gpa + offset);
+        if (ret == (uint64_t)FAILURE) {
+            BFERROR("__domain_op__write_memory failed\n");
+            return FAILURE;
+        }
+
+        offset += ret;
+
+        if (ret < MEMORY_MAX_BUFFER) {
+            if (common_populate(args->domainid) != SUCCESS) {
+                return FAILURE;
+            }
+        }
+    }
+
+    return SUCCESS;
+}
+
 int64_t
 common_destroy(uint64_t domainid)
 {
@@ -737,12 +1703,208 @@ common_destroy(uint64_t domainid)
         return COMMON_NO_HYPERVISOR;
     }
 
-    platform_free_rw(vm->bios_ram, BIOS_RAM_SIZE);
-    platform_free_rw(vm->params, BAREFLANK_PAGE_SIZE);
-    platform_free_rw(vm->cmdline, BAREFLANK_PAGE_SIZE);
-    platform_free_rw(vm->gdt, BAREFLANK_PAGE_SIZE);
-    platform_free_rw(vm->addr, vm->size);
+    platform_acquire_mutex();
+
+    if (vm->children != 0) {
+        vm->destroyed = 1;
+        platform_release_mutex();
 
-    release_vm(vm);
+        return SUCCESS;
+    }
+
+    platform_release_mutex();
+
+    free_vm(vm);
     return SUCCESS;
 }
+
+struct mv_vp_exit_info_t *
+common_vcpu_exit_info(uint64_t domainid, uint64_t vcpuid)
+{
+    struct vm_t *vm = get_vm(domainid);
+    struct vcpu_exit_info_t *exit_info;
+    struct mv_vp_exit_info_t *info = 0;
+
+    if (bfack() == 0) {
+        return 0;
+    }
+
+    platform_acquire_mutex();
+
+    exit_info = find_exit_info(vm, vcpuid);
+    if (exit_info != 0) {
+        info = exit_info->info;
+        goto done;
+    }
+
+    info = register_exit_info(vm, vcpuid);
+
+done:
+
+    platform_release_mutex();
+    return info;
+}
+
+int64_t
+common_wait_vcpu(struct wait_vcpu_args *args)
+{
+    struct vm_t *vm = get_vm(args->domainid);
+    struct vcpu_exit_info_t *exit_info;
+    void *event = 0;
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    /**
+     * Note:
+     *
+     * The event is registered along with the vCPU's exit info the first
+     * time the vCPU is run, and like the exit info, it is only freed when
+     * the VM is destroyed, which does not happen while the vCPU's thread
+     * is still running it. This is why the mutex is not held while we
+     * sleep.
+     */
+
+    platform_acquire_mutex();
+
+    exit_info = find_exit_info(vm, args->vcpuid);
+    if (exit_info != 0) {
+        event = exit_info->event;
+    }
+
+    platform_release_mutex();
+
+    if (event == 0) {
+        BFERROR("common_wait_vcpu: the vCPU has not been run yet\n");
+        return FAILURE;
+    }
+
+    args->woken = (uint64_t)platform_wait_event(event, args->nsec);
+    return SUCCESS;
+}
+
+int64_t
+common_wake_vcpu(uint64_t domainid, uint64_t vcpuid)
+{
+    struct vm_t *vm = get_vm(domainid);
+    struct vcpu_exit_info_t *exit_info;
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    platform_acquire_mutex();
+
+    exit_info = find_exit_info(vm, vcpuid);
+    if (exit_info != 0) {
+        platform_set_event(exit_info->event);
+    }
+
+    platform_release_mutex();
+    return SUCCESS;
+}
+
+int64_t
+common_balloon(struct balloon_args *args)
+{
+    uint64_t i;
+    status_t ret;
+    struct mv_mdl_t *mdl;
+    struct vm_t *vm = get_vm(args->domainid);
+
+    args->reclaimed = 0;
+    args->populated = 0;
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    ret = hypercall_domain_op__set_balloon_target(vm->domainid, args->target);
+    if (ret != SUCCESS) {
+        BFERROR("__domain_op__set_balloon_target failed\n");
+        return ret;
+    }
+
+    mdl = bfalloc_page(struct mv_mdl_t);
+    if (mdl == 0) {
+        BFERROR("common_balloon: failed to alloc mdl\n");
+        return FAILURE;
+    }
+
+    /**
+     * Note:
+     *
+     * The hypervisor hands out at most one MDL worth of ranges at a time,
+     * so we keep asking until there is nothing left. Once a range has been
+     * handed to us, we own the memory that backed it.
+     */
+
+    do {
+        ret = hypercall_domain_op__balloon_reclaim(vm->domainid, mdl);
+        if (ret != SUCCESS) {
+            BFERROR("__domain_op__balloon_reclaim failed\n");
+            goto done;
+        }
+
+        for (i = 0; i < mdl->num_entries; i++) {
+            args->reclaimed += release_balloon_ram(
+                vm, mdl->entries[i].gpa, mdl->entries[i].size);
+        }
+    }
+    while (mdl->num_entries != 0);
+
+    do {
+        ret = hypercall_domain_op__balloon_wanted(vm->domainid, mdl);
+        if (ret != SUCCESS) {
+            BFERROR("__domain_op__balloon_wanted failed\n");
+            goto done;
+        }
+
+        for (i = 0; i < mdl->num_entries; i++) {
+            ret = populate_balloon_ram(
+                vm, mdl->entries[i].gpa, mdl->entries[i].size);
+            if (ret != SUCCESS) {
+                goto done;
+            }
+
+            args->populated += mdl->entries[i].size;
+        }
+    }
+    while (mdl->num_entries != 0);
+
+done:
+
+    platform_free_rw(mdl, BAREFLANK_PAGE_SIZE);
+    return ret;
+}
+
+/**
+ * Note:
+ *
+ * Memory that is populated on demand is handed to the hypervisor in chunks
+ * of DEMAND_POOL_CHUNK_SIZE. The chunk is zeroed when it is allocated, so
+ * the hypervisor can map it into the guest as soon as the guest touches
+ * it. Larger chunks mean fewer round trips, while smaller chunks mean less
+ * memory is committed that the guest has not touched yet.
+ */
+
+#define DEMAND_POOL_CHUNK_SIZE 0x800000
+
+int64_t
+common_populate(uint64_t domainid)
+{
+    char *addr;
+    struct vm_t *vm = get_vm(domainid);
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    addr = alloc_extra_ram(vm, DEMAND_POOL_CHUNK_SIZE, 0);
+    if (addr == 0) {
+        return FAILURE;
+    }
+
+    return add_demand_pool(vm, addr, DEMAND_POOL_CHUNK_SIZE);
+}
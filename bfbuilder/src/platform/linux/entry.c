@@ -21,10 +21,17 @@
  */
 
 #include <linux/fs.h>
+#include <linux/cpumask.h>
 #include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/version.h>
 #include <linux/uaccess.h>
 #include <linux/miscdevice.h>
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/signal.h>
+#endif
+
 #include <common.h>
 #include <bfbuilderinterface.h>
 
@@ -172,6 +179,278 @@ ioctl_destroy(domainid_t *args)
     return BF_IOCTL_SUCCESS;
 }
 
+/**
+ * Note:
+ *
+ * A vCPU's VMCS stays active on the core that last ran it, so the thread
+ * that runs the vCPU is pinned to its core until the vCPU is released. On
+ * 5.11+ this is what migrate_disable() does. On older kernels (and !RT),
+ * migrate_disable() is preempt_disable(), which does not allow us to sleep
+ * (e.g. when memory is allocated for common_populate()), so the thread's
+ * affinity is narrowed to its current core instead, and put back once the
+ * vCPU is released. If the thread is moved anyway (e.g. userspace changed
+ * its affinity), the VMM refuses to run the vCPU on the new core.
+ */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+static const struct cpumask *
+current_cpus_allowed(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+    return current->cpus_ptr;
+#else
+    return &current->cpus_allowed;
+#endif
+}
+#endif
+
+static int64_t
+pin_vcpu_thread(cpumask_var_t *cpus_allowed)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+    migrate_disable();
+    return SUCCESS;
+#else
+    if (!alloc_cpumask_var(cpus_allowed, GFP_KERNEL)) {
+        return FAILURE;
+    }
+
+    cpumask_copy(*cpus_allowed, current_cpus_allowed());
+
+    if (set_cpus_allowed_ptr(current, cpumask_of(raw_smp_processor_id())) != 0) {
+        free_cpumask_var(*cpus_allowed);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+#endif
+}
+
+static void
+unpin_vcpu_thread(cpumask_var_t *cpus_allowed)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+    migrate_enable();
+#else
+    if (set_cpus_allowed_ptr(current, *cpus_allowed) != 0) {
+        BFALERT("IOCTL_RUN_VCPU: failed to restore the thread's affinity\n");
+    }
+
+    free_cpumask_var(*cpus_allowed);
+#endif
+}
+
+static long
+ioctl_run_vcpu(struct run_vcpu_args *args)
+{
+    int64_t ret;
+    struct run_vcpu_args kern_args;
+    struct mv_vp_exit_info_t *info;
+    cpumask_var_t cpus_allowed;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct run_vcpu_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_RUN_VCPU: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    info = common_vcpu_exit_info(kern_args.domainid, kern_args.vcpuid);
+    if (info == 0) {
+        BFALERT("IOCTL_RUN_VCPU: failed to get the vCPU's exit info\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    /**
+     * Note:
+     *
+     * A continue means the VMM handed a host interrupt back to us. The
+     * interrupt is serviced as soon as the vmcall returns, so there is no
+     * reason to go back to userspace. The same is true when the vCPU needs
+     * more memory to populate its RAM on demand, or when it sent a vIRQ to
+     * a sibling vCPU whose thread is asleep in IOCTL_WAIT_VCPU. We only
+     * leave the loop when userspace has work to do, or when it has to
+     * service a signal (e.g. a kill).
+     *
+     * The vCPU's VMCS stays active on the core that last ran it, so the
+     * thread is not allowed to move to another core while it is in this
+     * loop, and the vCPU is released before the thread is allowed to move
+     * again (see pin_vcpu_thread()). We can still be preempted (and sleep)
+     * while in this loop.
+     */
+
+    if (pin_vcpu_thread(&cpus_allowed) != SUCCESS) {
+        BFALERT("IOCTL_RUN_VCPU: failed to pin the thread to its core\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    while (1) {
+        kern_args.ret = hypercall_run_op(kern_args.vcpuid, 0, 0);
+
+        if (run_op_ret_op(kern_args.ret) == hypercall_enum_run_op__populate) {
+            if (common_populate(kern_args.domainid) != SUCCESS) {
+                break;
+            }
+        }
+        else if (run_op_ret_op(kern_args.ret) == hypercall_enum_run_op__wakeup) {
+            common_wake_vcpu(kern_args.domainid, run_op_ret_arg(kern_args.ret));
+        }
+        else if (run_op_ret_op(kern_args.ret) != hypercall_enum_run_op__continue) {
+            break;
+        }
+
+        if (signal_pending(current)) {
+            break;
+        }
+
+        cond_resched();
+    }
+
+    if (hypercall_vcpu_op__release_vcpu(kern_args.vcpuid) != SUCCESS) {
+        BFALERT("IOCTL_RUN_VCPU: failed to release the vCPU\n");
+    }
+
+    unpin_vcpu_thread(&cpus_allowed);
+
+    kern_args.exit = *info;
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct run_vcpu_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_RUN_VCPU: failed to copy args to userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_balloon(struct balloon_args *args)
+{
+    int64_t ret;
+    struct balloon_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct balloon_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_BALLOON: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_balloon(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_balloon failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct balloon_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_BALLOON: failed to copy args to userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_fork(struct fork_vm_args *args)
+{
+    int64_t ret;
+    struct fork_vm_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct fork_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_FORK: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_fork(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_fork failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct fork_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_FORK: failed to copy args to userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_restore(struct restore_vm_args *args)
+{
+    int64_t ret;
+    struct restore_vm_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct restore_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_RESTORE: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_restore(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_restore failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct restore_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_RESTORE: failed to copy args to userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_write_memory(struct write_memory_args *args)
+{
+    int64_t ret;
+    struct write_memory_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct write_memory_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_WRITE_MEMORY: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_write_memory(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_write_memory failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_wait_vcpu(struct wait_vcpu_args *args)
+{
+    int64_t ret;
+    struct wait_vcpu_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct wait_vcpu_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_WAIT_VCPU: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_wait_vcpu(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_wait_vcpu failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct wait_vcpu_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_WAIT_VCPU: failed to copy args to userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
 static long
 dev_unlocked_ioctl(
     struct file *file, unsigned int cmd, unsigned long arg)
@@ -183,6 +462,24 @@ dev_unlocked_ioctl(
         case IOCTL_DESTROY:
             return ioctl_destroy((domainid_t *)arg);
 
+        case IOCTL_RUN_VCPU:
+            return ioctl_run_vcpu((struct run_vcpu_args *)arg);
+
+        case IOCTL_BALLOON:
+            return ioctl_balloon((struct balloon_args *)arg);
+
+        case IOCTL_FORK:
+            return ioctl_fork((struct fork_vm_args *)arg);
+
+        case IOCTL_RESTORE:
+            return ioctl_restore((struct restore_vm_args *)arg);
+
+        case IOCTL_WRITE_MEMORY:
+            return ioctl_write_memory((struct write_memory_args *)arg);
+
+        case IOCTL_WAIT_VCPU:
+            return ioctl_wait_vcpu((struct wait_vcpu_args *)arg);
+
         default:
             return -EINVAL;
     }
@@ -23,8 +23,14 @@
 #include <bfdebug.h>
 #include <bfplatform.h>
 
+#include <common.h>
+
 #include <asm/io.h>
+#include <linux/gfp.h>
+#include <linux/list.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
 #include <linux/vmalloc.h>
 
 DEFINE_MUTEX(g_mutex);
@@ -114,6 +120,10 @@ platform_memcpy(
     return SUCCESS;
 }
 
+int64_t
+platform_memcmp(const void *a, const void *b, uint64_t num)
+{ return memcmp(a, b, num) == 0 ? 0 : 1; }
+
 void
 platform_acquire_mutex(void)
 { mutex_lock(&g_mutex); }
@@ -122,3 +132,327 @@ void
 platform_release_mutex(void)
 { mutex_unlock(&g_mutex); }
 
+/* -------------------------------------------------------------------------- */
+/* Guest RAM                                                                  */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Note:
+ *
+ * Guest RAM is backed by 2M pages whenever the buddy allocator can provide
+ * them (falling back to 4k pages when it cannot), and the pages are then
+ * mapped into a virtually contiguous buffer using vmap(). The 2M pages are
+ * placed so that they land on a 2M aligned guest physical address, which
+ * allows the hypervisor to map them using 2M EPT entries. Note that 1G
+ * pages are larger than the buddy allocator's max order, so these are only
+ * used by the hypervisor when 2M pages happen to be physically contiguous.
+ */
+
+#define GUEST_RAM_LARGE_PAGE_ORDER 9
+#define GUEST_RAM_LARGE_PAGE_SIZE (PAGE_SIZE << GUEST_RAM_LARGE_PAGE_ORDER)
+
+/**
+ * Note:
+ *
+ * The pages that back each guest RAM allocation are kept, so that pages
+ * that are released (see platform_release_guest_ram()) can be freed without
+ * touching the vmap(). Released pages are removed from the array, and
+ * platform_free_guest_ram() only frees what is left.
+ */
+
+struct guest_ram_t {
+    struct list_head list;
+
+    void *addr;
+    struct page **pages;
+    uint64_t num_pages;
+};
+
+static LIST_HEAD(g_guest_ram);
+static DEFINE_MUTEX(g_guest_ram_mutex);
+
+static struct guest_ram_t *
+find_guest_ram(void *addr)
+{
+    struct guest_ram_t *ram;
+
+    list_for_each_entry(ram, &g_guest_ram, list) {
+        if (ram->addr == addr) {
+            return ram;
+        }
+    }
+
+    return nullptr;
+}
+
+static void
+free_guest_ram_pages(struct page **pages, uint64_t num_pages)
+{
+    uint64_t i = 0;
+    unsigned int order;
+
+    while (i < num_pages) {
+        if (pages[i] == nullptr) {
+            i++;
+            continue;
+        }
+
+        if (PageHead(pages[i])) {
+            order = compound_order(pages[i]);
+            __free_pages(pages[i], order);
+
+            i += 1ULL << order;
+            continue;
+        }
+
+        __free_page(pages[i]);
+        i++;
+    }
+}
+
+void *
+platform_alloc_guest_ram(uint64_t len, uint64_t gpa)
+{
+    uint64_t i = 0;
+    uint64_t j;
+    uint64_t offset;
+    uint64_t num_pages = (len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    uint64_t head = (GUEST_RAM_LARGE_PAGE_SIZE - gpa) & (GUEST_RAM_LARGE_PAGE_SIZE - 1);
+
+    void *addr;
+    struct page *page;
+    struct page **pages;
+    struct guest_ram_t *ram;
+
+    if (len == 0) {
+        BFALERT("platform_alloc_guest_ram: invalid length\n");
+        return nullptr;
+    }
+
+    ram = kzalloc(sizeof(struct guest_ram_t), GFP_KERNEL);
+    if (ram == nullptr) {
+        BFALERT("platform_alloc_guest_ram: failed to alloc guest ram info\n");
+        return nullptr;
+    }
+
+    pages = kvmalloc_array(num_pages, sizeof(struct page *), GFP_KERNEL);
+    if (pages == nullptr) {
+        BFALERT("platform_alloc_guest_ram: failed to alloc page array\n");
+        kfree(ram);
+        return nullptr;
+    }
+
+    while (i < num_pages) {
+        page = nullptr;
+        offset = i << PAGE_SHIFT;
+
+        if (offset >= head &&
+            ((offset - head) & (GUEST_RAM_LARGE_PAGE_SIZE - 1)) == 0 &&
+            (num_pages << PAGE_SHIFT) - offset >= GUEST_RAM_LARGE_PAGE_SIZE) {
+            page = alloc_pages(
+                GFP_KERNEL | __GFP_ZERO | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY,
+                GUEST_RAM_LARGE_PAGE_ORDER);
+        }
+
+        if (page != nullptr) {
+            for (j = 0; j < (1ULL << GUEST_RAM_LARGE_PAGE_ORDER); j++) {
+                pages[i++] = nth_page(page, j);
+            }
+
+            continue;
+        }
+
+        page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (page == nullptr) {
+            BFALERT("platform_alloc_guest_ram: failed to alloc guest ram: %lld\n", len);
+            goto failure;
+        }
+
+        pages[i++] = page;
+    }
+
+    addr = vmap(pages, num_pages, VM_MAP, PAGE_KERNEL);
+    if (addr == nullptr) {
+        BFALERT("platform_alloc_guest_ram: failed to vmap guest ram\n");
+        goto failure;
+    }
+
+    ram->addr = addr;
+    ram->pages = pages;
+    ram->num_pages = num_pages;
+
+    mutex_lock(&g_guest_ram_mutex);
+    list_add(&ram->list, &g_guest_ram);
+    mutex_unlock(&g_guest_ram_mutex);
+
+    return addr;
+
+failure:
+
+    free_guest_ram_pages(pages, i);
+    kvfree(pages);
+    kfree(ram);
+
+    return nullptr;
+}
+
+void
+platform_free_guest_ram(void *addr, uint64_t len)
+{
+    struct guest_ram_t *ram;
+
+    if (addr == nullptr) {
+        return;
+    }
+
+    mutex_lock(&g_guest_ram_mutex);
+
+    ram = find_guest_ram(addr);
+    if (ram != nullptr) {
+        list_del(&ram->list);
+    }
+
+    mutex_unlock(&g_guest_ram_mutex);
+
+    if (ram == nullptr) {
+        BFALERT("platform_free_guest_ram: unknown guest ram: %p\n", addr);
+        return;
+    }
+
+    vunmap(addr);
+
+    free_guest_ram_pages(ram->pages, ram->num_pages);
+    kvfree(ram->pages);
+    kfree(ram);
+}
+
+/**
+ * Note:
+ *
+ * Ballooned memory is given back to the kernel one allocation at a time
+ * (i.e. a 4k page, or an entire 2M page). A 2M page that is only partially
+ * covered by the range cannot be split, so it is kept until the guest's RAM
+ * is freed. The kernel does not export a way to unmap part of a vmap(), so
+ * the mapping of a released page is left in place until the guest's RAM is
+ * freed. The builder never touches guest RAM through this mapping once the
+ * guest is running, so the stale mapping is never used.
+ */
+
+uint64_t
+platform_release_guest_ram(void *addr, uint64_t offset, uint64_t len)
+{
+    uint64_t i = offset >> PAGE_SHIFT;
+    uint64_t end = (offset + len) >> PAGE_SHIFT;
+    uint64_t j;
+    uint64_t first;
+    uint64_t last;
+    uint64_t freed = 0;
+    unsigned int order;
+
+    struct page *page;
+    struct page *head;
+    struct guest_ram_t *ram;
+
+    if (addr == nullptr || len == 0) {
+        return 0;
+    }
+
+    mutex_lock(&g_guest_ram_mutex);
+
+    ram = find_guest_ram(addr);
+    if (ram == nullptr || end > ram->num_pages) {
+        mutex_unlock(&g_guest_ram_mutex);
+
+        BFALERT("platform_release_guest_ram: invalid guest ram: %p\n", addr);
+        return 0;
+    }
+
+    while (i < end) {
+        page = ram->pages[i];
+
+        if (page == nullptr) {
+            i++;
+            continue;
+        }
+
+        head = compound_head(page);
+        order = compound_order(head);
+        first = i - (page_to_pfn(page) - page_to_pfn(head));
+        last = first + (1ULL << order);
+
+        if (first < offset >> PAGE_SHIFT || last > end) {
+            i = last;
+            continue;
+        }
+
+        for (j = first; j < last; j++) {
+            ram->pages[j] = nullptr;
+        }
+
+        __free_pages(head, order);
+        freed += PAGE_SIZE << order;
+
+        i = last;
+    }
+
+    mutex_unlock(&g_guest_ram_mutex);
+    return freed;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Events                                                                     */
+/* -------------------------------------------------------------------------- */
+
+struct platform_event_t {
+    wait_queue_head_t wq;
+    atomic_t set;
+};
+
+void *
+platform_alloc_event(void)
+{
+    struct platform_event_t *event =
+        kmalloc(sizeof(struct platform_event_t), GFP_KERNEL);
+
+    if (event == nullptr) {
+        BFALERT("platform_alloc_event: failed to kmalloc event\n");
+        return nullptr;
+    }
+
+    init_waitqueue_head(&event->wq);
+    atomic_set(&event->set, 0);
+
+    return event;
+}
+
+void
+platform_free_event(void *event)
+{ kfree(event); }
+
+void
+platform_set_event(void *event)
+{
+    struct platform_event_t *e = (struct platform_event_t *)event;
+
+    atomic_set(&e->set, 1);
+    wake_up_interruptible(&e->wq);
+}
+
+int64_t
+platform_wait_event(void *event, uint64_t nsec)
+{
+    struct platform_event_t *e = (struct platform_event_t *)event;
+
+    /**
+     * Note:
+     *
+     * The hrtimer based wait honors the thread's timer slack (which bfexec
+     * lowers), so a vCPU that is not woken up still wakes up close to its
+     * next event.
+     */
+
+    wait_event_interruptible_hrtimeout(
+        e->wq, atomic_read(&e->set) != 0, ns_to_ktime(nsec));
+
+    return atomic_xchg(&e->set, 0);
+}
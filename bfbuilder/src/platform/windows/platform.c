@@ -114,6 +114,10 @@ platform_memcpy(
     return SUCCESS;
 }
 
+int64_t
+platform_memcmp(const void *a, const void *b, uint64_t num)
+{ return RtlCompareMemory(a, b, num) == num ? 0 : 1; }
+
 void
 platform_acquire_mutex(void)
 { ExAcquireFastMutex(&g_mutex); }
@@ -121,3 +125,92 @@ platform_acquire_mutex(void)
 void
 platform_release_mutex(void)
 { ExReleaseFastMutex(&g_mutex); }
+
+/* -------------------------------------------------------------------------- */
+/* Guest RAM                                                                  */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Note:
+ *
+ * Large nonpaged pool allocations are backed by large pages when the
+ * kernel is able to, so for now guest RAM is allocated the same way as any
+ * other buffer, and the hypervisor maps whatever is physically contiguous
+ * using the largest EPT entries that it can.
+ */
+
+void *
+platform_alloc_guest_ram(uint64_t len, uint64_t gpa)
+{
+    (void) gpa;
+    return platform_alloc_rw(len);
+}
+
+void
+platform_free_guest_ram(void *addr, uint64_t len)
+{ platform_free_rw(addr, len); }
+
+uint64_t
+platform_release_guest_ram(void *addr, uint64_t offset, uint64_t len)
+{
+    /**
+     * Note:
+     *
+     * Guest RAM is a single non-paged pool allocation on Windows, and part
+     * of a pool allocation cannot be given back on its own. For this reason
+     * the balloon is not supported on Windows (there is no IOCTL_BALLOON),
+     * and nothing is ever released here.
+     */
+
+    (void) addr;
+    (void) offset;
+    (void) len;
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Events                                                                     */
+/* -------------------------------------------------------------------------- */
+
+void *
+platform_alloc_event(void)
+{
+    PKEVENT event = ExAllocatePoolWithTag(NonPagedPool, sizeof(KEVENT), BD_TAG);
+
+    if (event == nullptr) {
+        BFALERT("platform_alloc_event: failed to ExAllocatePoolWithTag event\n");
+        return nullptr;
+    }
+
+    KeInitializeEvent(event, SynchronizationEvent, FALSE);
+    return event;
+}
+
+void
+platform_free_event(void *event)
+{
+    if (event == nullptr) {
+        return;
+    }
+
+    ExFreePoolWithTag(event, BD_TAG);
+}
+
+void
+platform_set_event(void *event)
+{ KeSetEvent((PKEVENT)event, IO_NO_INCREMENT, FALSE); }
+
+int64_t
+platform_wait_event(void *event, uint64_t nsec)
+{
+    NTSTATUS status;
+    LARGE_INTEGER timeout;
+
+    timeout.QuadPart = -(LONGLONG)(nsec / 100);
+
+    status = KeWaitForSingleObject(
+        event, Executive, UserMode, TRUE, &timeout);
+
+    return status == STATUS_SUCCESS ? 1 : 0;
+}
@@ -189,6 +189,123 @@ ioctl_destroy(domainid_t *args)
     return BF_IOCTL_SUCCESS;
 }
 
+static long
+ioctl_run_vcpu(struct run_vcpu_args *args)
+{
+    PROCESSOR_NUMBER proc;
+    GROUP_AFFINITY affinity;
+    GROUP_AFFINITY previous;
+    struct mv_vp_exit_info_t *info;
+
+    info = common_vcpu_exit_info(args->domainid, args->vcpuid);
+    if (info == 0) {
+        BFALERT("IOCTL_RUN_VCPU: failed to get the vCPU's exit info\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    /**
+     * Note:
+     *
+     * See the Linux version of this IOCTL. The only difference is that
+     * there are no signals to check for, so instead we stop if the calling
+     * thread is being torn down, and the thread is kept on its current
+     * core by setting its affinity instead of disabling migration.
+     */
+
+    KeGetCurrentProcessorNumberEx(&proc);
+
+    RtlZeroMemory(&affinity, sizeof(GROUP_AFFINITY));
+    affinity.Group = proc.Group;
+    affinity.Mask = (KAFFINITY)1 << proc.Number;
+
+    KeSetSystemGroupAffinityThread(&affinity, &previous);
+
+    while (1) {
+        args->ret = hypercall_run_op(args->vcpuid, 0, 0);
+
+        if (run_op_ret_op(args->ret) == hypercall_enum_run_op__populate) {
+            if (common_populate(args->domainid) != SUCCESS) {
+                break;
+            }
+        }
+        else if (run_op_ret_op(args->ret) == hypercall_enum_run_op__wakeup) {
+            common_wake_vcpu(args->domainid, run_op_ret_arg(args->ret));
+        }
+        else if (run_op_ret_op(args->ret) != hypercall_enum_run_op__continue) {
+            break;
+        }
+
+        if (PsIsThreadTerminating(PsGetCurrentThread())) {
+            break;
+        }
+    }
+
+    if (hypercall_vcpu_op__release_vcpu(args->vcpuid) != SUCCESS) {
+        BFALERT("IOCTL_RUN_VCPU: failed to release the vCPU\n");
+    }
+
+    KeRevertToUserGroupAffinityThread(&previous);
+
+    args->exit = *info;
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_fork(struct fork_vm_args *args)
+{
+    int64_t ret;
+
+    ret = common_fork(args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_fork failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_restore(struct restore_vm_args *args)
+{
+    int64_t ret;
+
+    ret = common_restore(args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_restore failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_write_memory(struct write_memory_args *args)
+{
+    int64_t ret;
+
+    ret = common_write_memory(args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_write_memory failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_wait_vcpu(struct wait_vcpu_args *args)
+{
+    int64_t ret;
+
+    ret = common_wait_vcpu(args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_wait_vcpu failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
 NTSTATUS
 bfbuilderQueueInitialize(
     _In_ WDFDEVICE Device
@@ -262,6 +379,30 @@ bfbuilderEvtIoDeviceControl(
             ret = ioctl_destroy((domainid_t *)in);
             break;
 
+        case IOCTL_RUN_VCPU:
+            ret = ioctl_run_vcpu((struct run_vcpu_args *)in);
+            RtlCopyMemory(out, in, out_size);
+            break;
+
+        case IOCTL_FORK:
+            ret = ioctl_fork((struct fork_vm_args *)in);
+            RtlCopyMemory(out, in, out_size);
+            break;
+
+        case IOCTL_RESTORE:
+            ret = ioctl_restore((struct restore_vm_args *)in);
+            RtlCopyMemory(out, in, out_size);
+            break;
+
+        case IOCTL_WRITE_MEMORY:
+            ret = ioctl_write_memory((struct write_memory_args *)in);
+            break;
+
+        case IOCTL_WAIT_VCPU:
+            ret = ioctl_wait_vcpu((struct wait_vcpu_args *)in);
+            RtlCopyMemory(out, in, out_size);
+            break;
+
         default:
             goto IOCTL_FAILURE;
     }
@@ -44,10 +44,21 @@ parse_args(int argc, char *argv[])
     ("h,help", "Print this help menu")
     ("v,verbose", "Enable verbose output")
     ("version", "Print the version")
-    ("affinity", "The host CPU to execute the VM on", value<uint64_t>(), "[core #]")
+    ("affinity", "Pin the VM to a host CPU (optional)", value<uint64_t>(), "[core #]")
     ("bzimage", "Create a VM from a bzImage file")
+    ("fork", "Create a VM by pausing and forking a running VM", value<uint64_t>(), "[domain id]")
+    ("save", "Pause a running VM and save it to a file", value<std::string>(), "[path]")
+    ("restore", "Create a VM from a saved VM", value<std::string>(), "[path]")
+    ("domain", "The VM to save", value<uint64_t>(), "[domain id]")
     ("path", "The VM's path", value<std::string>(), "[path]")
     ("size", "The VM's total RAM", value<uint64_t>(), "[bytes]")
+    ("cpus", "The VM's number of vCPUs", value<uint64_t>(), "[#]")
+    ("share", "Share the kernel and initrd with other VMs booted from the same files (optional)")
+    ("lazy", "Allocate the VM's RAM the first time the VM touches it (optional)")
+    ("spin_nsec", "Spin instead of sleep for yields shorter than this (optional)", value<uint64_t>(), "[nsec]")
+    ("timer_slack", "The vCPU threads' timer slack (optional)", value<uint64_t>(), "[nsec]")
+    ("exit_stats", "Report each vCPU's VM exit statistics when the VM stops (optional)")
+    ("balloon", "Ask the VM to give this much RAM back to the host (optional)", value<uint64_t>(), "[bytes]")
     ("initrd", "The VM's initrd path", value<std::string>(), "[path]")
     ("cmdline", "Additional Linux command line arguments", value<std::string>(), "[text]")
     ("uart", "Give the VM an emulated UART", value<uint64_t>(), "[port #]")
@@ -69,8 +80,23 @@ parse_args(int argc, char *argv[])
         verbose = true;
     }
 
-    if (!args.count("bzimage")) {
-        throw std::runtime_error("must specify 'bzimage'");
+    auto num_modes =
+        args.count("bzimage") + args.count("fork") + args.count("save") + args.count("restore");
+
+    if (num_modes != 1) {
+        throw std::runtime_error("must specify 'bzimage', 'fork', 'save' or 'restore'");
+    }
+
+    if (args.count("fork") && (args.count("cpus") || args.count("pt_uart"))) {
+        throw std::runtime_error("'cpus' and 'pt_uart' are inherited with 'fork'");
+    }
+
+    if (args.count("restore") && (args.count("cpus") || args.count("uart") || args.count("pt_uart"))) {
+        throw std::runtime_error("'cpus', 'uart' and 'pt_uart' are inherited with 'restore'");
+    }
+
+    if (args.count("save") && !args.count("domain")) {
+        throw std::runtime_error("must specify 'domain' with 'save'");
     }
 
     if (args.count("uart") && args.count("pt_uart")) {
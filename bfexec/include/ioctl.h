@@ -102,6 +102,94 @@ public:
     ///
     void call_ioctl_destroy(domainid_t domainid) noexcept;
 
+    /// Run vCPU
+    ///
+    /// Runs a vCPU through the builder driver. The driver keeps re-entering
+    /// the vCPU for as long as it is told to continue, and only returns once
+    /// userspace has something to do (yield, hlt, fault, set_wallclock), or
+    /// the calling thread has a pending signal.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param domainid the domain the vCPU belongs to
+    /// @param vcpuid the vCPU to run
+    /// @param exit_info (out) the vCPU's exit info for the last run
+    /// @return the return value of the last hypercall_run_op
+    ///
+    uint64_t call_ioctl_run_vcpu(
+        domainid_t domainid, vcpuid_t vcpuid, mv_vp_exit_info_t &exit_info);
+
+    /// Balloon
+    ///
+    /// Services a VM's balloon through the builder driver. The guest is
+    /// given a new balloon target, memory the guest has given back is
+    /// released, and memory the guest has asked for is populated. The
+    /// balloon is not supported on Windows, where this always throws.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to service the balloon. On return, this
+    ///     also contains how much memory was released and populated.
+    ///
+    void call_ioctl_balloon(balloon_args &args);
+
+    /// Fork
+    ///
+    /// Creates a VM from a paused VM through the builder driver. The new VM
+    /// shares the paused VM's memory copy-on-write and continues from where
+    /// the paused VM stopped.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to fork the VM. On return, this also
+    ///     contains the domain ID of the new VM.
+    ///
+    void call_ioctl_fork(fork_vm_args &args);
+
+    /// Restore
+    ///
+    /// Creates an empty VM through the builder driver that a saved VM can
+    /// be restored into.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to create the VM. On return, this also
+    ///     contains the domain ID of the new VM.
+    ///
+    void call_ioctl_restore(restore_vm_args &args);
+
+    /// Write Memory
+    ///
+    /// Writes to a VM's RAM through the builder driver, populating the
+    /// VM's RAM as needed.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to write to the VM's RAM
+    ///
+    void call_ioctl_write_memory(write_memory_args &args);
+
+    /// Wait vCPU
+    ///
+    /// Puts the calling thread to sleep through the builder driver after a
+    /// vCPU yields. The thread sleeps until the timeout expires, or until a
+    /// sibling vCPU sends the vCPU a vIRQ, whichever comes first.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param domainid the domain the vCPU belongs to
+    /// @param vcpuid the vCPU that yielded
+    /// @param nsec the maximum number of nanoseconds to sleep for
+    /// @return true if the thread was woken up before the timeout expired
+    ///
+    bool call_ioctl_wait_vcpu(domainid_t domainid, vcpuid_t vcpuid, uint64_t nsec);
+
     /// VMCall
     ///
     /// Performs a VMCall through the Bareflank Driver. If
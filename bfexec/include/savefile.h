@@ -0,0 +1,159 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef SAVEFILE_H
+#define SAVEFILE_H
+
+#include <bitset>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+
+#include <bfhypercall.h>
+
+// Note:
+//
+// A saved VM is stored as follows:
+// - a header
+// - the guest RAM regions that were saved (num_regions entries)
+// - the VMM's snapshot of the VM (snapshot_size bytes). This is opaque to
+//   bfexec and is handed back to the VMM as is when the VM is restored.
+// - the contents of each region, in order, as a list of chunks. Each chunk
+//   covers MEMORY_MAX_BUFFER bytes of guest RAM (the last chunk of a region
+//   is padded with zeros).
+//
+// Each chunk starts with two bitmaps (one bit per page). A page that is all
+// zeros is not stored at all, a page that holds the same 64bit value over
+// and over is stored as that value, and every other page is stored as is.
+// Most of a guest's RAM falls into the first two groups, and pages that
+// are all zeros are also never written back when the VM is restored, so
+// they stay unpopulated until the guest touches them.
+//
+
+namespace bfn::savefile
+{
+
+constexpr const uint64_t magic = 0x56415359584F42ULL;
+constexpr const uint64_t version = 1;
+
+constexpr const uint64_t page_size = 0x1000;
+constexpr const uint64_t pages_per_chunk = MEMORY_MAX_BUFFER / page_size;
+
+static_assert(pages_per_chunk == 64);
+
+struct header_t {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t ram_size;
+    uint64_t num_vcpus;
+    uint64_t num_regions;
+    uint64_t snapshot_size;
+};
+
+struct region_t {
+    uint64_t gpa;
+    uint64_t size;
+};
+
+struct chunk_t {
+    uint64_t zero;
+    uint64_t fill;
+};
+
+inline uint64_t
+encoded_size(const chunk_t &chunk)
+{
+    if ((chunk.zero & chunk.fill) != 0) {
+        throw std::runtime_error("savefile: corrupt chunk");
+    }
+
+    auto num_fill = std::bitset<64>(chunk.fill).count();
+    auto num_raw = pages_per_chunk - std::bitset<64>(chunk.zero | chunk.fill).count();
+
+    return sizeof(chunk_t) + (num_fill * sizeof(uint64_t)) + (num_raw * page_size);
+}
+
+inline void
+encode_chunk(const char *data, std::vector<char> &out)
+{
+    chunk_t chunk{};
+    std::vector<char> payload;
+
+    for (uint64_t i = 0; i < pages_per_chunk; i++) {
+        const auto *page = data + (i * page_size);
+
+        uint64_t val;
+        std::memcpy(&val, page, sizeof(val));
+
+        auto filled = true;
+        for (uint64_t j = sizeof(val); j < page_size && filled; j += sizeof(val)) {
+            filled = std::memcmp(page + j, &val, sizeof(val)) == 0;
+        }
+
+        if (filled && val == 0) {
+            chunk.zero |= 1ULL << i;
+        }
+        else if (filled) {
+            chunk.fill |= 1ULL << i;
+            payload.insert(payload.end(), page, page + sizeof(val));
+        }
+        else {
+            payload.insert(payload.end(), page, page + page_size);
+        }
+    }
+
+    out.resize(sizeof(chunk_t));
+    std::memcpy(out.data(), &chunk, sizeof(chunk_t));
+
+    out.insert(out.end(), payload.begin(), payload.end());
+}
+
+inline void
+decode_chunk(const char *src, char *data)
+{
+    chunk_t chunk;
+    std::memcpy(&chunk, src, sizeof(chunk_t));
+
+    src += sizeof(chunk_t);
+
+    for (uint64_t i = 0; i < pages_per_chunk; i++) {
+        auto *page = data + (i * page_size);
+
+        if ((chunk.zero & (1ULL << i)) != 0) {
+            std::memset(page, 0, page_size);
+        }
+        else if ((chunk.fill & (1ULL << i)) != 0) {
+            for (uint64_t j = 0; j < page_size; j += sizeof(uint64_t)) {
+                std::memcpy(page + j, src, sizeof(uint64_t));
+            }
+
+            src += sizeof(uint64_t);
+        }
+        else {
+            std::memcpy(page, src, page_size);
+            src += page_size;
+        }
+    }
+}
+
+}
+
+#endif
@@ -34,6 +34,35 @@
         std::cout << "   cmdline" bfcolor_yellow " | " << bfcolor_green << cmdl.data() << bfcolor_end "\n";                                 \
     }
 
+#define fork_vm_verbose()                                                                                                                   \
+    if (verbose) {                                                                                                                          \
+        std::cout << '\n';                                                                                                                  \
+        std::cout << bfcolor_cyan    "Forked VM from paused VM:\n" bfcolor_end;                                                              \
+        std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;      \
+        std::cout << "    parent" bfcolor_yellow " | " << bfcolor_green << ioctl_args.parent_domainid << bfcolor_end "\n";                  \
+        std::cout << " domain id" bfcolor_yellow " | " << bfcolor_green << ioctl_args.domainid << bfcolor_end "\n";                         \
+    }
+
+#define save_vm_verbose()                                                                                                                   \
+    if (verbose) {                                                                                                                          \
+        std::cout << '\n';                                                                                                                  \
+        std::cout << bfcolor_cyan    "Saved paused VM:\n" bfcolor_end;                                                                      \
+        std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;      \
+        std::cout << " domain id" bfcolor_yellow " | " << bfcolor_green << domainid << bfcolor_end "\n";                                    \
+        std::cout << "      path" bfcolor_yellow " | " << bfcolor_green << path << bfcolor_end "\n";                                        \
+        std::cout << "  ram size" bfcolor_yellow " | " << bfcolor_green << (header.ram_size / 0x100000) << "MB" << bfcolor_end "\n";        \
+    }
+
+#define restore_vm_verbose()                                                                                                                \
+    if (verbose) {                                                                                                                          \
+        std::cout << '\n';                                                                                                                  \
+        std::cout << bfcolor_cyan    "Restored VM from saved VM:\n" bfcolor_end;                                                            \
+        std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;      \
+        std::cout << "      path" bfcolor_yellow " | " << bfcolor_green << path << bfcolor_end "\n";                                        \
+        std::cout << " domain id" bfcolor_yellow " | " << bfcolor_green << ioctl_args.domainid << bfcolor_end "\n";                         \
+        std::cout << "  ram size" bfcolor_yellow " | " << bfcolor_green << (header.ram_size / 0x100000) << "MB" << bfcolor_end "\n";        \
+    }
+
 #define output_vm_uart_verbose()                                                                                                            \
     if (verbose) {                                                                                                                          \
         std::cout << '\n';                                                                                                                  \
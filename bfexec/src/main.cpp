@@ -23,32 +23,48 @@
 #include <bfdebug.h>
 #include <bfstring.h>
 #include <bfaffinity.h>
+#include <bfconstants.h>
 #include <bfbuilderinterface.h>
 #include <bftsc.h>
 
 #include <list>
+#include <mutex>
+#include <atomic>
 #include <memory>
+#include <vector>
 #include <chrono>
 #include <thread>
+#include <cstring>
+#include <exception>
 #include <fstream>
+#include <sstream>
 #include <iostream>
+#include <algorithm>
 
 #include <args.h>
 #include <cmdl.h>
 #include <file.h>
 #include <ioctl.h>
 #include <verbose.h>
+#include <savefile.h>
 
 #if defined(WIN32) || defined(__CYGWIN__)
 #include <windows.h>
 #else
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/prctl.h>
 #endif
 
 using namespace std::chrono;
 
-vcpuid_t g_vcpuid;
 domainid_t g_domainid;
+std::vector<vcpuid_t> g_vcpuids;
 
 auto ctl = std::make_unique<ioctl>();
 
@@ -100,6 +116,30 @@ rdtsc()
 #endif
 }
 
+inline void
+cpu_relax()
+{
+#ifdef WIN32
+    _mm_pause();
+#else
+    __asm__ __volatile__("pause" ::: "memory");
+#endif
+}
+
+uint64_t g_tsc_freq_khz;
+
+inline uint64_t
+mul_div(uint64_t x, uint64_t n, uint64_t d)
+{ return ((x / d) * n) + (((x % d) * n) / d); }
+
+inline uint64_t
+tsc_to_nsec(uint64_t tsc)
+{ return mul_div(tsc, 1000000, g_tsc_freq_khz); }
+
+inline uint64_t
+nsec_to_tsc(uint64_t nsec)
+{ return mul_div(nsec, g_tsc_freq_khz, 1000000); }
+
 void
 init_tsc()
 {
@@ -110,9 +150,10 @@ init_tsc()
     // Note:
     //
     // Boxy doesn't support pre-skylake CPUs because of unreliable tsc freq.
-    // We don't actually need the tsc freq info here but we can use it to
-    // check whether the CPU is supported.
-    if (!calibrate_tsc_freq_khz()) {
+    // The tsc freq is also needed to turn yields into TSC deadlines, so
+    // this doubles as a check for whether the CPU is supported.
+    g_tsc_freq_khz = calibrate_tsc_freq_khz();
+    if (g_tsc_freq_khz == 0) {
         throw std::runtime_error("missing tsc info. system not supported");
     }
 }
@@ -122,7 +163,7 @@ init_tsc()
 // -----------------------------------------------------------------------------
 
 bool
-set_wallclock()
+set_wallclock(vcpuid_t vcpuid)
 {
     struct timespec ts;
     uint64_t initial_tsc = 0;
@@ -170,13 +211,129 @@ set_wallclock()
     status_t ret = 0;
 
     ret |= hypercall_vclock_op__set_host_wallclock_rtc(
-               g_vcpuid, ts.tv_sec, ts.tv_nsec);
+               vcpuid, ts.tv_sec, ts.tv_nsec);
     ret |= hypercall_vclock_op__set_host_wallclock_tsc(
-               g_vcpuid, initial_tsc + static_cast<uint64_t>(diff1 / 2));
+               vcpuid, initial_tsc + static_cast<uint64_t>(diff1 / 2));
 
     return ret == SUCCESS;
 }
 
+// -----------------------------------------------------------------------------
+// Yield
+// -----------------------------------------------------------------------------
+
+uint64_t g_yield_spin_nsec = 20000;
+uint64_t g_timer_slack_nsec = 1;
+
+struct yield_stats_t {
+    uint64_t num_yields{};
+    uint64_t num_spins{};
+    uint64_t num_wakeups{};
+    uint64_t num_overshoots{};
+    uint64_t total_overshoot_nsec{};
+    uint64_t max_overshoot_nsec{};
+};
+
+void
+init_yield()
+{
+    // Note:
+    //
+    // The timer slack is a per-thread setting, so this has to be called
+    // from each vCPU thread. The default slack (50us) is larger than most
+    // of the deadlines a guest asks for, which is why guest timers would
+    // otherwise fire late.
+    //
+
+#ifdef __linux__
+    if (prctl(PR_SET_TIMERSLACK, g_timer_slack_nsec, 0, 0, 0) != 0) {
+        std::cerr << "PR_SET_TIMERSLACK failed\n";
+    }
+#endif
+}
+
+bool
+wait_until_tsc(vcpuid_t vcpuid, uint64_t deadline_tsc)
+{
+    auto tsc = rdtsc();
+    if (tsc >= deadline_tsc) {
+        return false;
+    }
+
+    // Note:
+    //
+    // The driver puts us to sleep until the deadline, or until a sibling
+    // vCPU sends this vCPU a vIRQ, so an idle vCPU does not use any CPU
+    // while it waits, and still wakes up as soon as it has something to
+    // do. A signal also ends the wait early, which only happens when we
+    // are being killed.
+    //
+
+    return ctl->call_ioctl_wait_vcpu(
+        g_domainid, vcpuid, tsc_to_nsec(deadline_tsc - tsc));
+}
+
+void
+handle_yield(
+    vcpuid_t vcpuid, uint64_t exit_tsc, uint64_t nsec, yield_stats_t &stats)
+{
+    // Note:
+    //
+    // The deadline is calculated from the TSC at the time the vCPU exited
+    // (as reported by the VMM) and not from the time this thread got
+    // around to handling the yield, so that the time it takes to return to
+    // userspace does not add to the sleep. Anything under the spin
+    // threshold is spun instead of slept as the host's wakeup latency alone
+    // is often larger than that. Longer sleeps wake up early by the same
+    // amount and spin the rest of the way, unless the vCPU was woken up
+    // (i.e. it has a vIRQ to handle), in which case it is run right away.
+    //
+
+    auto deadline_tsc = exit_tsc + nsec_to_tsc(nsec);
+    stats.num_yields++;
+
+    if (nsec > g_yield_spin_nsec) {
+        if (wait_until_tsc(vcpuid, deadline_tsc - nsec_to_tsc(g_yield_spin_nsec))) {
+            stats.num_wakeups++;
+            return;
+        }
+    }
+    else {
+        stats.num_spins++;
+    }
+
+    auto tsc = rdtsc();
+    while (tsc < deadline_tsc) {
+        cpu_relax();
+        tsc = rdtsc();
+    }
+
+    if (auto overshoot = tsc_to_nsec(tsc - deadline_tsc); overshoot > 0) {
+        stats.num_overshoots++;
+        stats.total_overshoot_nsec += overshoot;
+        stats.max_overshoot_nsec = std::max(stats.max_overshoot_nsec, overshoot);
+    }
+}
+
+void
+dump_yield_stats(vcpuid_t vcpuid, const yield_stats_t &stats)
+{
+    if (!verbose || stats.num_yields == 0) {
+        return;
+    }
+
+    std::stringstream ss;
+
+    ss << "[0x" << std::hex << vcpuid << std::dec << "] ";
+    ss << "yields: " << stats.num_yields;
+    ss << ", spun: " << stats.num_spins;
+    ss << ", woken: " << stats.num_wakeups;
+    ss << ", overshoot avg: " << stats.total_overshoot_nsec / stats.num_yields << "ns";
+    ss << ", overshoot max: " << stats.max_overshoot_nsec << "ns\n";
+
+    std::cout << ss.str();
+}
+
 // -----------------------------------------------------------------------------
 // vCPU Thread
 // -----------------------------------------------------------------------------
@@ -184,47 +341,62 @@ set_wallclock()
 void
 vcpu_thread(vcpuid_t vcpuid)
 {
+    yield_stats_t yield_stats{};
+    mv_vp_exit_info_t exit_info{};
+
+    init_yield();
+
+    auto ___ = gsl::finally([&] {
+        dump_yield_stats(vcpuid, yield_stats);
+    });
+
     while (true) {
-        auto ret = hypercall_run_op(vcpuid, 0, 0);
+        auto ret = ctl->call_ioctl_run_vcpu(g_domainid, vcpuid, exit_info);
+
+        if (ret == SUSPEND) {
+            std::this_thread::sleep_for(milliseconds(250));
+            continue;
+        }
 
-        switch (run_op_ret_op(ret)) {
-            case hypercall_enum_run_op__continue:
+        switch (exit_info.reason) {
+            case mv_vp_exit_t_external_interrupt:
+            case mv_vp_exit_t_retry:
+            case mv_vp_exit_t_wakeup:
                 continue;
 
-            case hypercall_enum_run_op__yield:
-                if (auto nsec = run_op_ret_arg(ret); nsec > 0) {
-                    std::this_thread::sleep_for(nanoseconds(nsec));
+            case mv_vp_exit_t_populate:
+                std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
+                std::cerr << "failed to populate gpa: 0x" << std::hex << exit_info.arg << std::dec << '\n';
+                return;
+
+            case mv_vp_exit_t_yield:
+                if (auto nsec = exit_info.arg; nsec > 0) {
+                    handle_yield(vcpuid, exit_info.host_tsc, nsec, yield_stats);
                 }
                 else {
                     std::this_thread::yield();
                 }
                 continue;
 
-            case hypercall_enum_run_op__set_wallclock:
-                if (!set_wallclock()) {
+            case mv_vp_exit_t_sync_tsc:
+                if (!set_wallclock(vcpuid)) {
                     std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
                     std::cerr << "set_wallclock failed\n";
                     return;
                 }
                 continue;
 
-            case hypercall_enum_run_op__hlt:
+            case mv_vp_exit_t_hlt:
                 return;
 
-            case hypercall_enum_run_op__fault:
+            case mv_vp_exit_t_fault:
                 std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
-                std::cerr << "vcpu fault: " << run_op_ret_arg(ret) << '\n';
+                std::cerr << "vcpu fault: " << exit_info.arg << '\n';
                 return;
 
             default:
-
-                if (ret == SUSPEND) {
-                    std::this_thread::sleep_for(milliseconds(250));
-                    continue;
-                }
-
                 std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
-                std::cerr << "unknown vcpu ret: " << run_op_ret_op(ret) << '\n';
+                std::cerr << "unknown vcpu exit: " << exit_info.reason << '\n';
                 return;
         }
     }
@@ -386,6 +558,53 @@ uart_thread()
     update_output(buf);
 }
 
+// -----------------------------------------------------------------------------
+// Balloon Thread
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The balloon is serviced periodically. Each time, the guest is told how
+// many pages it should keep in its balloon, the memory it has given back
+// since the last time is released to the host, and any memory it has asked
+// to get back is populated. The guest's balloon driver polls its target, so
+// changing the target does not require an interrupt.
+//
+
+bool g_process_balloon = true;
+uint64_t g_balloon_target = 0;
+
+void
+balloon_thread()
+{
+    uint64_t reclaimed = 0;
+    uint64_t populated = 0;
+
+    auto ___ = gsl::finally([&] {
+        if (verbose) {
+            std::cout << "balloon: reclaimed " << (reclaimed >> 20) << "MB";
+            std::cout << ", populated " << (populated >> 20) << "MB\n";
+        }
+    });
+
+    while (g_process_balloon) {
+        balloon_args args = {g_domainid, g_balloon_target, 0, 0};
+
+        try {
+            ctl->call_ioctl_balloon(args);
+        }
+        catch (std::exception &e) {
+            std::cerr << "[ERROR] " << e.what() << '\n';
+            return;
+        }
+
+        reclaimed += args.reclaimed;
+        populated += args.populated;
+
+        std::this_thread::sleep_for(milliseconds(250));
+    }
+}
+
 // -----------------------------------------------------------------------------
 // Signal Handling
 // -----------------------------------------------------------------------------
@@ -393,21 +612,23 @@ uart_thread()
 #include <signal.h>
 
 void
-kill_signal_handler(void)
+kill_vcpus(void)
 {
-    status_t ret;
+    for (const auto vcpuid : g_vcpuids) {
+        if (hypercall_vcpu_op__kill_vcpu(vcpuid) != SUCCESS) {
+            BFALERT("__vcpu_op__kill_vcpu failed\n");
+        }
+    }
+}
 
+void
+kill_signal_handler(void)
+{
     std::cout << '\n';
     std::cout << '\n';
     std::cout << "killing VM: " << g_domainid << '\n';
 
-    ret = hypercall_vcpu_op__kill_vcpu(g_vcpuid);
-    if (ret != SUCCESS) {
-        BFALERT("__vcpu_op__kill_vcpu failed\n");
-        return;
-    }
-
-    return;
+    kill_vcpus();
 }
 
 void
@@ -428,36 +649,222 @@ setup_kill_signal_handler(void)
 #endif
 }
 
+// -----------------------------------------------------------------------------
+// Exit Statistics
+// -----------------------------------------------------------------------------
+
+bool g_exit_stats = false;
+
+static const char *
+exit_reason_name(uint64_t reason)
+{
+    static const char *names[] = {
+        "exception_or_nmi", "external_interrupt", "triple_fault", "init",
+        "sipi", "io_smi", "other_smi", "interrupt_window", "nmi_window",
+        "task_switch", "cpuid", "getsec", "hlt", "invd", "invlpg", "rdpmc",
+        "rdtsc", "rsm", "vmcall", "vmclear", "vmlaunch", "vmptrld",
+        "vmptrst", "vmread", "vmresume", "vmwrite", "vmxoff", "vmxon",
+        "control_register", "mov_dr", "io_instruction", "rdmsr", "wrmsr",
+        "bad_guest_state", "bad_msr_load", "reserved", "mwait", "mtf",
+        "reserved", "monitor", "pause", "machine_check", "reserved",
+        "tpr_below_threshold", "apic_access", "virtualized_eoi",
+        "gdtr_idtr", "ldtr_tr", "ept_violation", "ept_misconfiguration",
+        "invept", "rdtscp", "preemption_timer", "invvpid", "wbinvd",
+        "xsetbv", "apic_write", "rdrand", "invpcid", "vmfunc", "encls",
+        "rdseed", "pml_full", "xsaves", "xrstors", "reserved", "spp",
+        "umwait", "tpause"
+    };
+
+    if (reason < sizeof(names) / sizeof(names[0])) {
+        return names[reason];
+    }
+
+    return "unknown";
+}
+
+static void
+dump_exit_stats(vcpuid_t vcpuid, const mv_vmexit_log_t &log)
+{
+    std::cout << "\nvcpu " << std::hex << vcpuid << std::dec << ": "
+              << log.num_exits << " exits\n";
+
+    std::vector<uint64_t> reasons;
+    for (uint64_t r = 0; r < MV_VMEXIT_LOG_NUM_EXIT_REASONS; r++) {
+        if (log.num_exits_by_reason[r] != 0) {
+            reasons.push_back(r);
+        }
+    }
+
+    std::sort(reasons.begin(), reasons.end(), [&](auto a, auto b) {
+        return log.num_exits_by_reason[a] > log.num_exits_by_reason[b];
+    });
+
+    for (const auto r : reasons) {
+        auto count = log.num_exits_by_reason[r];
+        auto avg = tsc_to_nsec(log.ticks_by_reason[r] / count);
+
+        std::cout << "  " << exit_reason_name(r) << ": " << count
+                  << " exits, " << avg << " ns avg\n";
+
+        std::cout << "   ";
+        for (uint64_t b = 0; b < MV_VMEXIT_LOG_NUM_BUCKETS; b++) {
+            if (auto n = log.hist_by_reason[r][b]; n != 0) {
+                std::cout << " <" << tsc_to_nsec(2ULL << b) << "ns:" << n;
+            }
+        }
+        std::cout << '\n';
+    }
+
+    for (uint64_t i = 0; i < MV_VMEXIT_LOG_NUM_BFOPCODES; i++) {
+        if (auto n = log.num_vmcalls_by_bfopcode[i]; n != 0) {
+            std::cout << "  vmcall bfopcode 0x" << std::hex << i << std::dec
+                      << ": " << n << '\n';
+        }
+    }
+
+    for (uint64_t i = 0; i < MV_VMEXIT_LOG_NUM_MV_OPCODES; i++) {
+        if (auto n = log.num_vmcalls_by_mv_opcode[i]; n != 0) {
+            std::cout << "  vmcall mv opcode 0x" << std::hex << i << std::dec
+                      << ": " << n << '\n';
+        }
+    }
+
+    for (uint64_t i = 0; i < MV_VMEXIT_LOG_NUM_KEYS && log.msrs[i].count != 0; i++) {
+        std::cout << "  msr 0x" << std::hex << log.msrs[i].key << std::dec
+                  << ": " << log.msrs[i].count << '\n';
+    }
+
+    for (uint64_t i = 0; i < MV_VMEXIT_LOG_NUM_KEYS && log.ports[i].count != 0; i++) {
+        std::cout << "  port 0x" << std::hex << log.ports[i].key << std::dec
+                  << ": " << log.ports[i].count << '\n';
+    }
+
+    if (log.num_other_vmcalls != 0 || log.num_other_msrs != 0 || log.num_other_ports != 0) {
+        std::cout << "  other: " << log.num_other_vmcalls << " vmcalls, "
+                  << log.num_other_msrs << " msrs, "
+                  << log.num_other_ports << " ports\n";
+    }
+}
+
+static void
+dump_exit_stats()
+{
+    if (!g_exit_stats) {
+        return;
+    }
+
+    auto buf = alloc_locked_buffer(sizeof(mv_vmexit_log_t));
+    if (buf == nullptr) {
+        return;
+    }
+
+    auto ___ = gsl::finally([&]() {
+        free_locked_buffer(buf, sizeof(mv_vmexit_log_t));
+    });
+
+    auto log = static_cast<mv_vmexit_log_t *>(buf);
+
+    for (const auto vcpuid : g_vcpuids) {
+        if (hypercall_vcpu_op__vmexit_log(vcpuid, log) != SUCCESS) {
+            std::cerr << "__vcpu_op__vmexit_log failed\n";
+            continue;
+        }
+
+        dump_exit_stats(vcpuid, *log);
+    }
+}
+
 // -----------------------------------------------------------------------------
 // Attach to VM
 // -----------------------------------------------------------------------------
 
+static void
+destroy_vcpus()
+{
+    for (const auto vcpuid : g_vcpuids) {
+        if (hypercall_vcpu_op__destroy_vcpu(vcpuid) != SUCCESS) {
+            std::cerr << "__vcpu_op__destroy_vcpu failed\n";
+        }
+    }
+
+    g_vcpuids.clear();
+}
+
 static int
-attach_to_vm(const args_type &args)
+attach_to_vm(const args_type &args, uint64_t cpus)
 {
-    bfignored(args);
+    if (cpus == 0) {
+        throw cxxopts::OptionException("--cpus must be at least 1");
+    }
+
+    if (args.count("spin_nsec")) {
+        g_yield_spin_nsec = args["spin_nsec"].as<uint64_t>();
+    }
+
+    if (args.count("timer_slack")) {
+        g_timer_slack_nsec = args["timer_slack"].as<uint64_t>();
+    }
+
+    if (args.count("exit_stats")) {
+        g_exit_stats = true;
+    }
+
+    if (args.count("balloon")) {
+        g_balloon_target = args["balloon"].as<uint64_t>() / BAREFLANK_PAGE_SIZE;
+    }
+
+    // Note:
+    //
+    // All of the vCPUs are created before any of them are run. The VMM hands
+    // out APIC IDs in the order the vCPUs are created, so the first vCPU is
+    // the BSP, and the BSP is able to see all of the APs the moment it
+    // starts. The APs will not execute until the BSP sends them a SIPI.
+    //
+
+    auto ___ = gsl::finally(destroy_vcpus);
+
+    for (uint64_t i = 0; i < cpus; i++) {
+        auto vcpuid = hypercall_vcpu_op__create_vcpu(g_domainid);
+        if (vcpuid == INVALID_VCPUID) {
+            throw std::runtime_error("__vcpu_op__create_vcpu failed");
+        }
 
-    g_vcpuid = hypercall_vcpu_op__create_vcpu(g_domainid);
-    if (g_vcpuid == INVALID_VCPUID) {
-        throw std::runtime_error("__vcpu_op__create_vcpu failed");
+        g_vcpuids.push_back(vcpuid);
     }
 
-    std::thread t(vcpu_thread, g_vcpuid);
+    std::list<std::thread> threads;
     std::thread u;
+    std::thread b;
+
+    for (const auto vcpuid : g_vcpuids) {
+        threads.emplace_back([vcpuid] {
+            vcpu_thread(vcpuid);
+            kill_vcpus();
+        });
+    }
 
     output_vm_uart_verbose();
 
-    t.join();
+    if (args.count("balloon")) {
+        b = std::thread(balloon_thread);
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    if (b.joinable()) {
+        g_process_balloon = false;
+        b.join();
+    }
+
+    dump_exit_stats();
 
     if (verbose) {
         g_process_uart = false;
         u.join();
     }
 
-    if (hypercall_vcpu_op__destroy_vcpu(g_vcpuid) != SUCCESS) {
-        std::cerr << "__vcpu_op__destroy_vcpu failed\n";
-    }
-
     return EXIT_SUCCESS;
 }
 
@@ -466,7 +873,7 @@ attach_to_vm(const args_type &args)
 // -----------------------------------------------------------------------------
 
 static void
-create_vm_from_bzimage(const args_type &args)
+create_vm_from_bzimage(const args_type &args, uint64_t cpus)
 {
     create_vm_from_bzimage_args ioctl_args {};
 
@@ -520,6 +927,9 @@ create_vm_from_bzimage(const args_type &args)
     ioctl_args.uart = uart;
     ioctl_args.pt_uart = pt_uart;
     ioctl_args.size = size;
+    ioctl_args.share = args.count("share") != 0 ? 1 : 0;
+    ioctl_args.lazy = args.count("lazy") != 0 ? 1 : 0;
+    ioctl_args.num_vcpus = cpus;
 
     ctl->call_ioctl_create_vm_from_bzimage(ioctl_args);
     create_vm_from_bzimage_verbose();
@@ -527,6 +937,487 @@ create_vm_from_bzimage(const args_type &args)
     g_domainid = ioctl_args.domainid;
 }
 
+// -----------------------------------------------------------------------------
+// Fork VM
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// A vCPU that is running when its domain is paused only stops the next time
+// it exits (e.g. on the next external interrupt), so pausing is retried
+// until every vCPU has stopped. Once paused, the VM stays paused for good,
+// and the parent's own bfexec keeps it (and its memory) around until it is
+// killed.
+//
+constexpr const auto pause_retries = 1000;
+constexpr const auto pause_retry_delay_ms = 1;
+
+static void
+pause_vm(domainid_t domainid)
+{
+    for (auto i = 0; hypercall_domain_op__pause_domain(domainid) != SUCCESS; i++) {
+        if (i == pause_retries) {
+            throw std::runtime_error("__domain_op__pause_domain failed");
+        }
+
+        std::this_thread::sleep_for(milliseconds(pause_retry_delay_ms));
+    }
+}
+
+static uint64_t
+fork_vm(const args_type &args)
+{
+    fork_vm_args ioctl_args {};
+    ioctl_args.parent_domainid = args["fork"].as<uint64_t>();
+
+    if (args.count("uart")) {
+        ioctl_args.uart = args["uart"].as<uint64_t>();
+    }
+
+    pause_vm(ioctl_args.parent_domainid);
+
+    ctl->call_ioctl_fork(ioctl_args);
+    fork_vm_verbose();
+
+    g_domainid = ioctl_args.domainid;
+    return hypercall_domain_op__num_vcpus(ioctl_args.parent_domainid);
+}
+
+// -----------------------------------------------------------------------------
+// Save VM
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Guest RAM is read, encoded and decoded MEMORY_MAX_BUFFER bytes at a time
+// by one worker per host CPU (see savefile.h for the format). Each worker
+// owns a locked buffer, as the VMM can only map memory that is resident.
+// When a VM is saved, the chunks are encoded in batches so that they can be
+// written to the file in order without keeping the whole guest in memory.
+//
+constexpr const uint64_t chunks_per_worker = 16;
+
+static uint64_t
+num_workers()
+{
+    auto num = std::thread::hardware_concurrency();
+    return num != 0 ? num : 1;
+}
+
+template<typename F>
+static void
+run_workers(uint64_t num_items, F func)
+{
+    std::atomic<uint64_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::list<std::thread> threads;
+
+    for (uint64_t i = 0; i < num_workers(); i++) {
+        threads.emplace_back([&] {
+            try {
+                auto buf = reinterpret_cast<char *>(alloc_locked_buffer(MEMORY_MAX_BUFFER));
+                if (buf == nullptr) {
+                    throw std::runtime_error("alloc_locked_buffer failed");
+                }
+
+                auto ___ = gsl::finally([&]() {
+                    free_locked_buffer(buf, MEMORY_MAX_BUFFER);
+                });
+
+                for (auto item = next++; item < num_items; item = next++) {
+                    func(item, buf);
+                }
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+
+                if (!error) {
+                    error = std::current_exception();
+                }
+
+                next = num_items;
+            }
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+static std::vector<uint64_t>
+export_snapshot(domainid_t domainid)
+{
+    auto size = hypercall_domain_op__export_snapshot(domainid, nullptr, 0);
+    if (size == static_cast<uint64_t>(FAILURE) || size == 0) {
+        throw std::runtime_error("__domain_op__export_snapshot failed");
+    }
+
+    auto buf = reinterpret_cast<char *>(alloc_locked_buffer(size));
+    if (buf == nullptr) {
+        throw std::runtime_error("alloc_locked_buffer failed");
+    }
+
+    auto ___ = gsl::finally([&]() {
+        free_locked_buffer(buf, size);
+    });
+
+    if (hypercall_domain_op__export_snapshot(domainid, buf, size) != size) {
+        throw std::runtime_error("__domain_op__export_snapshot failed");
+    }
+
+    std::vector<uint64_t> snapshot(size / sizeof(uint64_t));
+    std::memcpy(snapshot.data(), buf, size);
+
+    return snapshot;
+}
+
+static std::vector<bfn::savefile::region_t>
+saved_regions(domainid_t domainid, uint64_t &ram_size)
+{
+    auto mdl = reinterpret_cast<mv_mdl_t *>(alloc_locked_buffer(sizeof(mv_mdl_t)));
+    if (mdl == nullptr) {
+        throw std::runtime_error("alloc_locked_buffer failed");
+    }
+
+    auto ___ = gsl::finally([&]() {
+        free_locked_buffer(mdl, sizeof(mv_mdl_t));
+    });
+
+    if (hypercall_domain_op__e820_map(domainid, mdl) != SUCCESS) {
+        throw std::runtime_error("__domain_op__e820_map failed");
+    }
+
+    // Note:
+    //
+    // Only guest RAM is saved. Reserved memory (e.g. the boot params) is
+    // only used while the guest boots, and is not needed once it has. The
+    // RAM below 1M is set up by the builder when the VM is restored, so
+    // only the RAM above it counts towards the VM's RAM size.
+    //
+
+    ram_size = 0;
+    std::vector<bfn::savefile::region_t> regions;
+
+    for (uint64_t i = 0; i < mdl->num_entries && i < MV_MDL_MAP_MAX_NUM_ENTRIES; i++) {
+        const auto &entry = mdl->entries[i];
+
+        if (entry.flags != MV_GPA_FLAG_CONVENTIONAL_MEM) {
+            continue;
+        }
+
+        if (entry.gpa >= 0x100000) {
+            ram_size += entry.size;
+        }
+
+        regions.push_back({entry.gpa, entry.size});
+    }
+
+    return regions;
+}
+
+static int
+save_vm(const args_type &args)
+{
+    using namespace bfn::savefile;
+
+    auto domainid = args["domain"].as<uint64_t>();
+    auto path = args["save"].as<std::string>();
+
+    pause_vm(domainid);
+
+    header_t header{};
+    header.magic = magic;
+    header.version = version;
+    header.num_vcpus = hypercall_domain_op__num_vcpus(domainid);
+
+    auto regions = saved_regions(domainid, header.ram_size);
+    auto snapshot = export_snapshot(domainid);
+
+    header.num_regions = regions.size();
+    header.snapshot_size = snapshot.size() * sizeof(uint64_t);
+
+    std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error("failed to open: " + path);
+    }
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(regions.data()),
+               gsl::narrow_cast<std::streamsize>(regions.size() * sizeof(region_t)));
+    file.write(reinterpret_cast<const char *>(snapshot.data()),
+               gsl::narrow_cast<std::streamsize>(header.snapshot_size));
+
+    // Note:
+    //
+    // The last chunk of a region can run past the end of the region. The
+    // part that is not in the region is saved as zeros, so that it is
+    // never written back when the VM is restored.
+    //
+
+    std::vector<region_t> chunks;
+    for (const auto &region : regions) {
+        for (uint64_t offset = 0; offset < region.size; offset += MEMORY_MAX_BUFFER) {
+            chunks.push_back({
+                region.gpa + offset, std::min<uint64_t>(region.size - offset, MEMORY_MAX_BUFFER)
+            });
+        }
+    }
+
+    auto batch_size = num_workers() * chunks_per_worker;
+    std::vector<std::vector<char>> encoded(batch_size);
+
+    for (uint64_t batch = 0; batch < chunks.size(); batch += batch_size) {
+        auto num = std::min<uint64_t>(batch_size, chunks.size() - batch);
+
+        run_workers(num, [&](uint64_t i, char *buf) {
+            const auto &chunk = chunks.at(batch + i);
+
+            if (hypercall_domain_op__read_memory(domainid, buf, chunk.gpa) != SUCCESS) {
+                throw std::runtime_error("__domain_op__read_memory failed");
+            }
+
+            std::memset(buf + chunk.size, 0, MEMORY_MAX_BUFFER - chunk.size);
+            encode_chunk(buf, encoded.at(i));
+        });
+
+        for (uint64_t i = 0; i < num; i++) {
+            file.write(encoded.at(i).data(),
+                       gsl::narrow_cast<std::streamsize>(encoded.at(i).size()));
+        }
+    }
+
+    if (!file.flush()) {
+        throw std::runtime_error("failed to write: " + path);
+    }
+
+    save_vm_verbose();
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Restore VM
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The saved VM is mapped instead of read, so only the parts of the file
+// that are actually needed are read in (pages that are all zeros are
+// never touched, as they are left to the demand pool). The mapped file
+// is not resident, so everything in it is copied into a locked buffer
+// before it is handed to the VMM.
+//
+
+#if defined(WIN32) || defined(__CYGWIN__)
+
+static const char *
+map_file(const std::string &path, uint64_t &size)
+{
+    auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("failed to open: " + path);
+    }
+
+    auto ___ = gsl::finally([&]() {
+        CloseHandle(file);
+    });
+
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) == 0 || file_size.QuadPart == 0) {
+        throw std::runtime_error("failed to get the size of: " + path);
+    }
+
+    auto mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        throw std::runtime_error("failed to map: " + path);
+    }
+
+    auto ____ = gsl::finally([&]() {
+        CloseHandle(mapping);
+    });
+
+    auto data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        throw std::runtime_error("failed to map: " + path);
+    }
+
+    size = static_cast<uint64_t>(file_size.QuadPart);
+    return static_cast<const char *>(data);
+}
+
+static void
+unmap_file(const char *data, uint64_t size)
+{
+    bfignored(size);
+
+    if (UnmapViewOfFile(data) == 0) {
+        std::cerr << __func__ << ": Unable to unmap file (error: "
+                  << std::hex << GetLastError() << ")\n";
+    }
+}
+
+#else
+
+static const char *
+map_file(const std::string &path, uint64_t &size)
+{
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("failed to open: " + path);
+    }
+
+    auto ___ = gsl::finally([&]() {
+        close(fd);
+    });
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        throw std::runtime_error("failed to get the size of: " + path);
+    }
+
+    auto data = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == data) {
+        throw std::runtime_error("failed to map: " + path);
+    }
+
+    size = static_cast<uint64_t>(st.st_size);
+    return static_cast<const char *>(data);
+}
+
+static void
+unmap_file(const char *data, uint64_t size)
+{
+    if (munmap(const_cast<char *>(data), size) != 0) {
+        std::cerr << __func__ << ": Unable to unmap file (errno: "
+                  << errno << ")\n";
+    }
+}
+
+#endif
+
+static void
+import_snapshot(domainid_t domainid, const char *snapshot, uint64_t size)
+{
+    auto buf = reinterpret_cast<char *>(alloc_locked_buffer(size));
+    if (buf == nullptr) {
+        throw std::runtime_error("alloc_locked_buffer failed");
+    }
+
+    auto ___ = gsl::finally([&]() {
+        free_locked_buffer(buf, size);
+    });
+
+    std::memcpy(buf, snapshot, size);
+
+    if (hypercall_domain_op__import_snapshot(domainid, buf, size) != SUCCESS) {
+        throw std::runtime_error("__domain_op__import_snapshot failed");
+    }
+}
+
+static uint64_t
+restore_vm(const args_type &args)
+{
+    using namespace bfn::savefile;
+
+    uint64_t size;
+    auto path = args["restore"].as<std::string>();
+    auto data = map_file(path, size);
+
+    auto ___ = gsl::finally([&]() {
+        unmap_file(data, size);
+    });
+
+    auto in_file = [&](uint64_t offset, uint64_t bytes) {
+        if (offset > size || bytes > size - offset) {
+            throw std::runtime_error("corrupt saved VM: " + path);
+        }
+    };
+
+    header_t header;
+    in_file(0, sizeof(header));
+    std::memcpy(&header, data, sizeof(header));
+
+    if (header.magic != magic || header.version != version) {
+        throw std::runtime_error("unsupported saved VM: " + path);
+    }
+
+    if (header.num_regions > MV_MDL_MAP_MAX_NUM_ENTRIES ||
+        header.snapshot_size == 0 || header.snapshot_size > size) {
+        throw std::runtime_error("corrupt saved VM: " + path);
+    }
+
+    uint64_t offset = sizeof(header);
+
+    std::vector<region_t> regions(header.num_regions);
+    in_file(offset, regions.size() * sizeof(region_t));
+    std::memcpy(regions.data(), data + offset, regions.size() * sizeof(region_t));
+    offset += regions.size() * sizeof(region_t);
+
+    in_file(offset, header.snapshot_size);
+    auto snapshot = data + offset;
+    offset += header.snapshot_size;
+
+    // Note:
+    //
+    // The encoded chunks vary in size, so they are indexed before any of
+    // them are decoded. Chunks that are all zeros are dropped here, as
+    // they do not need to be written.
+    //
+
+    std::vector<std::pair<uint64_t, const char *>> chunks;
+    for (const auto &region : regions) {
+        for (uint64_t i = 0; i < region.size; i += MEMORY_MAX_BUFFER) {
+            chunk_t chunk;
+            in_file(offset, sizeof(chunk));
+            std::memcpy(&chunk, data + offset, sizeof(chunk));
+
+            auto chunk_size = encoded_size(chunk);
+            in_file(offset, chunk_size);
+
+            if (chunk.zero != ~0ULL) {
+                chunks.emplace_back(region.gpa + i, data + offset);
+            }
+
+            offset += chunk_size;
+        }
+    }
+
+    restore_vm_args ioctl_args {};
+    ioctl_args.size = header.ram_size;
+
+    ctl->call_ioctl_restore(ioctl_args);
+    g_domainid = ioctl_args.domainid;
+
+    try {
+        import_snapshot(g_domainid, snapshot, header.snapshot_size);
+
+        run_workers(chunks.size(), [&](uint64_t i, char *buf) {
+            decode_chunk(chunks.at(i).second, buf);
+
+            write_memory_args write_args {};
+            write_args.domainid = g_domainid;
+            write_args.gpa = chunks.at(i).first;
+            write_args.buffer = buf;
+            write_args.size = MEMORY_MAX_BUFFER;
+
+            ctl->call_ioctl_write_memory(write_args);
+        });
+    }
+    catch (...) {
+        ctl->call_ioctl_destroy(g_domainid);
+        throw;
+    }
+
+    restore_vm_verbose();
+    return header.num_vcpus;
+}
+
 // -----------------------------------------------------------------------------
 // Main Functions
 // -----------------------------------------------------------------------------
@@ -537,25 +1428,31 @@ protected_main(const args_type &args)
     if (args.count("affinity")) {
         set_affinity(args["affinity"].as<uint64_t>());
     }
-    else {
 
-        // TODO:
-        //
-        // We need to remove the need for affinity. Right now if you don't
-        // state affinity, we default to 0 because we don't support VMCS
-        // migration, which needs to be fixed.
-        //
+    if (args.count("save")) {
+        return save_vm(args);
+    }
 
-        set_affinity(0);
+    uint64_t cpus = 1;
+    if (args.count("cpus")) {
+        cpus = args["cpus"].as<uint64_t>();
     }
 
-    create_vm_from_bzimage(args);
+    if (args.count("fork")) {
+        cpus = fork_vm(args);
+    }
+    else if (args.count("restore")) {
+        cpus = restore_vm(args);
+    }
+    else {
+        create_vm_from_bzimage(args, cpus);
+    }
 
     auto __ = gsl::finally([&] {
         ctl->call_ioctl_destroy(g_domainid);
     });
 
-    return attach_to_vm(args);
+    return attach_to_vm(args, cpus);
 }
 
 int
@@ -98,6 +98,65 @@ ioctl_private::call_ioctl_destroy(domainid_t domainid) noexcept
     }
 }
 
+uint64_t
+ioctl_private::call_ioctl_run_vcpu(
+    domainid_t domainid, vcpuid_t vcpuid, mv_vp_exit_info_t &exit_info)
+{
+    run_vcpu_args args = {domainid, vcpuid, 0, {}};
+
+    if (bfm_write_read_ioctl(fd2, IOCTL_RUN_VCPU, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_RUN_VCPU");
+    }
+
+    exit_info = args.exit;
+    return args.ret;
+}
+
+void
+ioctl_private::call_ioctl_balloon(balloon_args &args)
+{
+    if (bfm_write_read_ioctl(fd2, IOCTL_BALLOON, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_BALLOON");
+    }
+}
+
+void
+ioctl_private::call_ioctl_fork(fork_vm_args &args)
+{
+    if (bfm_write_read_ioctl(fd2, IOCTL_FORK, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_FORK");
+    }
+}
+
+void
+ioctl_private::call_ioctl_restore(restore_vm_args &args)
+{
+    if (bfm_write_read_ioctl(fd2, IOCTL_RESTORE, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_RESTORE");
+    }
+}
+
+void
+ioctl_private::call_ioctl_write_memory(write_memory_args &args)
+{
+    if (bfm_write_ioctl(fd2, IOCTL_WRITE_MEMORY, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_WRITE_MEMORY");
+    }
+}
+
+bool
+ioctl_private::call_ioctl_wait_vcpu(
+    domainid_t domainid, vcpuid_t vcpuid, uint64_t nsec)
+{
+    wait_vcpu_args args = {domainid, vcpuid, nsec, 0};
+
+    if (bfm_write_read_ioctl(fd2, IOCTL_WAIT_VCPU, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_WAIT_VCPU");
+    }
+
+    return args.woken != 0;
+}
+
 uint64_t
 ioctl_private::call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4)
 {
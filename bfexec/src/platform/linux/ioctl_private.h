@@ -33,6 +33,13 @@ public:
 
     void call_ioctl_create_vm_from_bzimage(create_vm_from_bzimage_args &args);
     void call_ioctl_destroy(domainid_t domainid) noexcept;
+    uint64_t call_ioctl_run_vcpu(
+        domainid_t domainid, vcpuid_t vcpuid, mv_vp_exit_info_t &exit_info);
+    void call_ioctl_balloon(balloon_args &args);
+    void call_ioctl_fork(fork_vm_args &args);
+    void call_ioctl_restore(restore_vm_args &args);
+    void call_ioctl_write_memory(write_memory_args &args);
+    bool call_ioctl_wait_vcpu(domainid_t domainid, vcpuid_t vcpuid, uint64_t nsec);
     uint64_t call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4);
 
 private:
@@ -40,6 +40,49 @@ ioctl::call_ioctl_destroy(domainid_t domainid) noexcept
     d->call_ioctl_destroy(domainid);
 }
 
+uint64_t
+ioctl::call_ioctl_run_vcpu(
+    domainid_t domainid, vcpuid_t vcpuid, mv_vp_exit_info_t &exit_info)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    return d->call_ioctl_run_vcpu(domainid, vcpuid, exit_info);
+}
+
+void
+ioctl::call_ioctl_balloon(balloon_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_balloon(args);
+}
+
+void
+ioctl::call_ioctl_fork(fork_vm_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_fork(args);
+}
+
+void
+ioctl::call_ioctl_restore(restore_vm_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_restore(args);
+}
+
+void
+ioctl::call_ioctl_write_memory(write_memory_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_write_memory(args);
+}
+
+bool
+ioctl::call_ioctl_wait_vcpu(domainid_t domainid, vcpuid_t vcpuid, uint64_t nsec)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    return d->call_ioctl_wait_vcpu(domainid, vcpuid, nsec);
+}
+
 uint64_t
 ioctl::call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4)
 {
@@ -48,6 +48,12 @@ extern "C" {
 
 #define IOCTL_CREATE_VM_FROM_BZIMAGE_CMD 0x901
 #define IOCTL_DESTROY_CMD 0x902
+#define IOCTL_RUN_VCPU_CMD 0x903
+#define IOCTL_BALLOON_CMD 0x904
+#define IOCTL_FORK_CMD 0x905
+#define IOCTL_RESTORE_CMD 0x906
+#define IOCTL_WRITE_MEMORY_CMD 0x907
+#define IOCTL_WAIT_VCPU_CMD 0x908
 
 /**
  * @struct create_vm_from_bzimage_args
@@ -76,6 +82,18 @@ extern "C" {
  *     pass-through the provided uart.
  * @var create_vm_from_bzimage_args::size
  *     the amount of RAM to give to the domain
+ * @var create_vm_from_bzimage_args::share
+ *     defaults to 0 (optional). If non zero, the kernel and initrd are
+ *     shared (copy-on-write) with every other VM that was created from the
+ *     same kernel and initrd with share set, instead of being copied into
+ *     this VM's RAM.
+ * @var create_vm_from_bzimage_args::lazy
+ *     defaults to 0 (optional). If non zero, only the RAM needed to hold
+ *     the kernel and initrd is allocated up front. The rest of the domain's
+ *     RAM is allocated the first time the guest touches it.
+ * @var create_vm_from_bzimage_args::num_vcpus
+ *     defaults to 0 (optional), which is the same as 1. The number of vCPUs
+ *     the guest is told about (using an MP table) when it boots.
  * @var create_vm_from_bzimage_args::domainid
  *     (out) the domain ID of the VM that was created
  */
@@ -93,7 +111,158 @@ struct create_vm_from_bzimage_args {
     uint64_t pt_uart;
 
     uint64_t size;
+    uint64_t share;
+    uint64_t lazy;
+    uint64_t num_vcpus;
+
+    uint64_t domainid;
+};
+
+/**
+ * @struct run_vcpu_args
+ *
+ * This structure is used to run a vCPU from the builder. The builder will
+ * keep re-entering the vCPU for as long as the VMM reports
+ * hypercall_enum_run_op__continue (or hypercall_enum_run_op__populate, in
+ * which case more memory is given to the VM first, or
+ * hypercall_enum_run_op__wakeup, in which case the thread of a sibling vCPU
+ * that is waiting in IOCTL_WAIT_VCPU is woken up first), and will only return
+ * to userspace when the vCPU yields, halts, faults, needs the wallclock or
+ * the calling thread has a pending signal.
+ *
+ * @var run_vcpu_args::domainid
+ *     the domain the vCPU belongs to
+ * @var run_vcpu_args::vcpuid
+ *     the vCPU to run
+ * @var run_vcpu_args::ret
+ *     (out) the last value returned by hypercall_run_op
+ * @var run_vcpu_args::exit
+ *     (out) the vCPU's exit info as reported by the VMM for the last run
+ */
+struct run_vcpu_args {
+    uint64_t domainid;
+    uint64_t vcpuid;
+    uint64_t ret;
+
+    struct mv_vp_exit_info_t exit;
+};
+
+/**
+ * @struct balloon_args
+ *
+ * This structure is used to service a VM's balloon. The builder tells the
+ * hypervisor how much memory the guest should give back, releases the
+ * memory the guest has given back since the last call, and provides new
+ * memory for anything the guest has asked to get back.
+ *
+ * @var balloon_args::domainid
+ *     the domain to service
+ * @var balloon_args::target
+ *     the number of 4k pages the guest should keep in its balloon
+ * @var balloon_args::reclaimed
+ *     (out) the number of bytes given back to the host by this call
+ * @var balloon_args::populated
+ *     (out) the number of bytes given back to the guest by this call
+ */
+struct balloon_args {
+    uint64_t domainid;
+    uint64_t target;
+
+    uint64_t reclaimed;
+    uint64_t populated;
+};
+
+/**
+ * @struct fork_vm_args
+ *
+ * This structure is used to create a VM from a paused VM (see
+ * hypercall_domain_op__pause_domain). The new VM shares the paused VM's
+ * memory copy-on-write and each of its vCPUs continues from where the
+ * paused VM's vCPU with the same APIC ID stopped. The paused VM's memory
+ * is kept until the paused VM and every VM forked from it are destroyed.
+ *
+ * @var fork_vm_args::parent_domainid
+ *     the paused domain to fork from
+ * @var fork_vm_args::uart
+ *     defaults to 0 (optional). If non zero, the hypervisor will be told to
+ *     emulate the provided uart.
+ * @var fork_vm_args::domainid
+ *     (out) the domain ID of the VM that was created
+ */
+struct fork_vm_args {
+    uint64_t parent_domainid;
+    uint64_t uart;
+    uint64_t domainid;
+};
+
+/**
+ * @struct restore_vm_args
+ *
+ * This structure is used to create an empty VM that a saved VM is restored
+ * into. The VM is given the same memory map as a VM that was created from
+ * a bzImage with the same amount of RAM, but none of its RAM (other than
+ * the BIOS RAM) is populated until it is written to (see write_memory_args)
+ * or touched by the guest. The vCPU state is restored using
+ * hypercall_domain_op__import_snapshot before any vCPUs are created.
+ *
+ * @var restore_vm_args::size
+ *     the amount of RAM the saved VM was given
+ * @var restore_vm_args::domainid
+ *     (out) the domain ID of the VM that was created
+ */
+struct restore_vm_args {
+    uint64_t size;
+    uint64_t domainid;
+};
+
+/**
+ * @struct write_memory_args
+ *
+ * This structure is used to write to a VM's RAM. Pages that are all zeros
+ * and have not been populated yet are skipped, and any other page that has
+ * not been populated yet is populated first.
+ *
+ * @var write_memory_args::domainid
+ *     the domain to write to
+ * @var write_memory_args::gpa
+ *     the guest physical address to write to (must be page aligned)
+ * @var write_memory_args::buffer
+ *     the data to write. This buffer must remain resident (i.e. locked)
+ *     while it is being written.
+ * @var write_memory_args::size
+ *     the number of bytes to write (must be a multiple of
+ *     MEMORY_MAX_BUFFER)
+ */
+struct write_memory_args {
+    uint64_t domainid;
+    uint64_t gpa;
+    const char *buffer;
+    uint64_t size;
+};
+
+/**
+ * @struct wait_vcpu_args
+ *
+ * This structure is used to put the thread that runs a vCPU to sleep after
+ * the vCPU yields. The thread sleeps until the timeout expires, or until a
+ * sibling vCPU sends this vCPU a vIRQ (see hypercall_enum_run_op__wakeup),
+ * whichever comes first. A wakeup that arrives before the thread goes to
+ * sleep is not lost, in which case the thread does not sleep at all.
+ *
+ * @var wait_vcpu_args::domainid
+ *     the domain the vCPU belongs to
+ * @var wait_vcpu_args::vcpuid
+ *     the vCPU that yielded
+ * @var wait_vcpu_args::nsec
+ *     the maximum number of nanoseconds to sleep for
+ * @var wait_vcpu_args::woken
+ *     (out) non zero if the thread was woken up before the timeout expired
+ */
+struct wait_vcpu_args {
     uint64_t domainid;
+    uint64_t vcpuid;
+    uint64_t nsec;
+    uint64_t woken;
 };
 
 /* -------------------------------------------------------------------------- */
@@ -104,6 +273,12 @@ struct create_vm_from_bzimage_args {
 
 #define IOCTL_CREATE_VM_FROM_BZIMAGE _IOWR(BUILDER_MAJOR, IOCTL_CREATE_VM_FROM_BZIMAGE_CMD, struct create_vm_from_bzimage_args *)
 #define IOCTL_DESTROY _IOW(BUILDER_MAJOR, IOCTL_DESTROY_CMD, domainid_t *)
+#define IOCTL_RUN_VCPU _IOWR(BUILDER_MAJOR, IOCTL_RUN_VCPU_CMD, struct run_vcpu_args *)
+#define IOCTL_BALLOON _IOWR(BUILDER_MAJOR, IOCTL_BALLOON_CMD, struct balloon_args *)
+#define IOCTL_FORK _IOWR(BUILDER_MAJOR, IOCTL_FORK_CMD, struct fork_vm_args *)
+#define IOCTL_RESTORE _IOWR(BUILDER_MAJOR, IOCTL_RESTORE_CMD, struct restore_vm_args *)
+#define IOCTL_WRITE_MEMORY _IOW(BUILDER_MAJOR, IOCTL_WRITE_MEMORY_CMD, struct write_memory_args *)
+#define IOCTL_WAIT_VCPU _IOWR(BUILDER_MAJOR, IOCTL_WAIT_VCPU_CMD, struct wait_vcpu_args *)
 
 #endif
 
@@ -120,6 +295,12 @@ DEFINE_GUID(GUID_DEVINTERFACE_builder,
 
 #define IOCTL_CREATE_VM_FROM_BZIMAGE CTL_CODE(BUILDER_DEVICETYPE, IOCTL_CREATE_VM_FROM_BZIMAGE_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
 #define IOCTL_DESTROY CTL_CODE(BUILDER_DEVICETYPE, IOCTL_DESTROY_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_RUN_VCPU CTL_CODE(BUILDER_DEVICETYPE, IOCTL_RUN_VCPU_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_BALLOON CTL_CODE(BUILDER_DEVICETYPE, IOCTL_BALLOON_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_FORK CTL_CODE(BUILDER_DEVICETYPE, IOCTL_FORK_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_RESTORE CTL_CODE(BUILDER_DEVICETYPE, IOCTL_RESTORE_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_WRITE_MEMORY CTL_CODE(BUILDER_DEVICETYPE, IOCTL_WRITE_MEMORY_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_WAIT_VCPU CTL_CODE(BUILDER_DEVICETYPE, IOCTL_WAIT_VCPU_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
 
 #endif
 
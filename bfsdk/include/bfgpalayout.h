@@ -51,8 +51,12 @@ enum e820_type {
  *               | Initial GDT          |  |
  *       0xEB000 +----------------------+  |
  *               | Free                 |  |
+ *       0xF0000 +----------------------+  |
+ *               | MP Table             |  |
+ *       0xF1000 +----------------------+  |
+ *               | Free                 |  |
  *      0x100000 +----------------------+ ---
- *               | Linux                |  | RAM
+ *               | Linux                |  | RAM (low RAM)
  *           XXX +----------------------+  |
  *               | Usable RAM           |  |
  *    0xXXXXXXXX +----------------------+ ---
@@ -60,6 +64,14 @@ enum e820_type {
  *    0xFEC00000 +----------------------+ ---
  *               | Free                 |  | Reserved
  *    0xFFFFFFFF +----------------------+ ---
+ *               |                      |  |
+ *   0x100000000 +----------------------+ ---
+ *               | Usable RAM           |  | RAM (high RAM)
+ *   0xXXXXXXXXX +----------------------+ ---
+ *
+ * Low RAM ends at LOW_RAM_END at the latest. Any RAM that does not fit
+ * below LOW_RAM_END is placed in high RAM, which starts at 4GB, so that
+ * the guest's RAM never overlaps the reserved region below 4GB.
  *
  * All RAM addresses must have backing memory, and must be mapped as RWE as this
  * is memory that the kernel could attempt to use. Reserved memory can be
@@ -70,15 +82,64 @@ enum e820_type {
 int64_t
 add_e820_entry(void *ptr, uint64_t saddr, uint64_t eaddr, uint32_t type);
 
+#define LOW_RAM_ADDR            0x100000
+#define LOW_RAM_END             0xFDC00000
+#define HIGH_RAM_ADDR           0x100000000
+#define RAM_MAX_SIZE            0x10000000000
+
+/**
+ * Low RAM Size
+ *
+ * @param size the amount of RAM given to the VM (not including BIOS RAM)
+ * @return the amount of the VM's RAM that is placed in low RAM
+ */
+static inline uint64_t
+low_ram_size(uint64_t size)
+{
+    if (size > LOW_RAM_END - LOW_RAM_ADDR) {
+        return LOW_RAM_END - LOW_RAM_ADDR;
+    }
+
+    return size;
+}
+
+/**
+ * High RAM Size
+ *
+ * @param size the amount of RAM given to the VM (not including BIOS RAM)
+ * @return the amount of the VM's RAM that is placed in high RAM (rounded
+ *     down to a page boundary)
+ */
+static inline uint64_t
+high_ram_size(uint64_t size)
+{
+    return (size - low_ram_size(size)) & ~(0xFFFULL);
+}
+
+/**
+ * Guest RAM End
+ *
+ * @param size the amount of RAM given to the VM (not including BIOS RAM)
+ * @return the guest physical address that follows the last byte of the
+ *     VM's RAM
+ */
+static inline uint64_t
+guest_ram_end(uint64_t size)
+{
+    if (high_ram_size(size) != 0) {
+        return HIGH_RAM_ADDR + high_ram_size(size);
+    }
+
+    return LOW_RAM_ADDR + size;
+}
+
 /**
  * Setup E820 Map
  *
  * This function uses the add_e820_entry function to tell the guest what the
  * E820 map is
  *
- * @expects size < 0xFDC00000. Right now we do not support more than 4gb of
- *     RAM, so this is the typical limitation for a < 4GB VM as you must remove
- *     BIOS and hardware addresses spaces from your 4GB limit
+ * @expects size <= RAM_MAX_SIZE
  *
  * @param vm a pointer to a VM object that is needed by add_e820_entry
  * @param size the amound of RAM given to the VM. Note that this amount does
@@ -91,16 +152,20 @@ setup_bootparams_e820_map(void *vm, uint64_t size)
 {
     status_t ret = 0;
 
-    if (size >= 0xFDC00000) {
+    if (size > RAM_MAX_SIZE) {
         BFALERT("setup_e820_map: unsupported amount of RAM\n");
         return FAILURE;
     }
 
     ret |= add_e820_entry(vm, 0x0000000000000000, 0x00000000000E8000, E820_TYPE_RAM);
     ret |= add_e820_entry(vm, 0x00000000000E8000, 0x0000000000100000, E820_TYPE_RESERVED);
-    ret |= add_e820_entry(vm, 0x0000000000100000, 0x000100000 + size, E820_TYPE_RAM);
+    ret |= add_e820_entry(vm, LOW_RAM_ADDR, LOW_RAM_ADDR + low_ram_size(size), E820_TYPE_RAM);
     ret |= add_e820_entry(vm, 0x00000000FEC00000, 0x00000000FFFFFFFF, E820_TYPE_RESERVED);
 
+    if (high_ram_size(size) != 0) {
+        ret |= add_e820_entry(vm, HIGH_RAM_ADDR, HIGH_RAM_ADDR + high_ram_size(size), E820_TYPE_RAM);
+    }
+
     if (ret != SUCCESS) {
         BFALERT("setup_e820_map: add_e820_entry failed to add E820 entries\n");
         return FAILURE;
@@ -115,5 +180,6 @@ setup_bootparams_e820_map(void *vm, uint64_t size)
 #define BOOT_PARAMS_PAGE_GPA    0xE8000
 #define COMMAND_LINE_PAGE_GPA   0xE9000
 #define INITIAL_GDT_GPA         0xEA000
+#define MP_TABLE_GPA            0xF0000
 
 #endif
@@ -125,6 +125,18 @@ _mv_vm_state_op_set_initial_reg_val(
     uint64_t const reg,
     uint64_t const val);
 
+uint64_t
+_mv_vm_state_op_list_of_initial_reg_vals(
+    uint64_t const handle,
+    uint64_t const vmid,
+    uint64_t const reg_vals_gpa);
+
+uint64_t
+_mv_vm_state_op_set_list_of_initial_reg_vals(
+    uint64_t const handle,
+    uint64_t const vmid,
+    uint64_t const reg_vals_gpa);
+
 uint64_t
 _mv_vm_state_op_initial_msr_val(
     uint64_t const handle,
@@ -301,6 +313,12 @@ _mv_vp_management_op_resume_vp(
     uint64_t const handle,
     uint64_t const vpid);
 
+uint64_t
+_mv_vp_exit_op_set_exit_info(
+    uint64_t const handle,
+    uint64_t const vpid,
+    uint64_t const exit_info_gpa);
+
 // -----------------------------------------------------------------------------
 // Scalar Types
 // -----------------------------------------------------------------------------
@@ -410,6 +428,39 @@ enum mv_reg_t {
     mv_reg_t_max = 71,
 };
 
+// Note:
+//
+// The following is used to get/set a list of registers using a single
+// hypercall. Each register is stored in vals using its mv_reg_t as the
+// index, and only the registers whose bit is set in mask are valid. This
+// structure must fit in a single page.
+//
+
+#define MV_REG_VALS_MASK_SIZE ((mv_uint64_t)2)
+
+struct mv_reg_vals_t {
+    mv_uint64_t mask[MV_REG_VALS_MASK_SIZE];
+    mv_uint64_t vals[mv_reg_t_max];
+};
+
+static inline void
+mv_reg_vals_set(
+    struct mv_reg_vals_t *const reg_vals,    /* OUT */
+    mv_uint64_t const reg,                   /* IN */
+    mv_uint64_t const val)                   /* IN */
+{
+    reg_vals->vals[reg] = val;
+    reg_vals->mask[reg >> 6] |= ((mv_uint64_t)1) << (reg & 0x3F);
+}
+
+static inline mv_uint64_t
+mv_reg_vals_is_set(
+    struct mv_reg_vals_t const *const reg_vals,    /* IN */
+    mv_uint64_t const reg)                         /* IN */
+{
+    return (reg_vals->mask[reg >> 6] >> (reg & 0x3F)) & 1;
+}
+
 // -----------------------------------------------------------------------------
 // GPA Flags
 // -----------------------------------------------------------------------------
@@ -751,6 +802,47 @@ mv_debug_op_dump_vmexit_log(
     return _mv_debug_op_dump_vmexit_log(vpid);
 }
 
+// Note:
+//
+// The following is the vmexit log that each VP keeps. Exit reasons are the
+// basic VMX exit reasons, and the handling time of each exit (measured in
+// TSC ticks from the exit until the VP is resumed or hands control back to
+// its parent) is stored in log2 buckets (i.e. bucket n holds the exits that
+// took [2^n, 2^(n+1)) ticks, and the last bucket holds everything larger).
+// MSRs and IO ports are tracked using a small table. Once a table is full,
+// accesses to MSRs and IO ports that are not in the table are counted as
+// "other".
+//
+
+#define MV_VMEXIT_LOG_NUM_EXIT_REASONS ((mv_uint64_t)0x50)
+#define MV_VMEXIT_LOG_NUM_BUCKETS ((mv_uint64_t)0x20)
+#define MV_VMEXIT_LOG_NUM_BFOPCODES ((mv_uint64_t)0x20)
+#define MV_VMEXIT_LOG_NUM_MV_OPCODES ((mv_uint64_t)0x10)
+#define MV_VMEXIT_LOG_NUM_KEYS ((mv_uint64_t)0x40)
+
+struct mv_vmexit_log_key_t {
+    mv_uint64_t key;
+    mv_uint64_t count;
+};
+
+struct mv_vmexit_log_t {
+    mv_uint64_t num_exits;
+
+    mv_uint64_t num_exits_by_reason[MV_VMEXIT_LOG_NUM_EXIT_REASONS];
+    mv_uint64_t ticks_by_reason[MV_VMEXIT_LOG_NUM_EXIT_REASONS];
+    mv_uint64_t hist_by_reason[MV_VMEXIT_LOG_NUM_EXIT_REASONS][MV_VMEXIT_LOG_NUM_BUCKETS];
+
+    mv_uint64_t num_vmcalls_by_bfopcode[MV_VMEXIT_LOG_NUM_BFOPCODES];
+    mv_uint64_t num_vmcalls_by_mv_opcode[MV_VMEXIT_LOG_NUM_MV_OPCODES];
+    mv_uint64_t num_other_vmcalls;
+
+    struct mv_vmexit_log_key_t msrs[MV_VMEXIT_LOG_NUM_KEYS];
+    mv_uint64_t num_other_msrs;
+
+    struct mv_vmexit_log_key_t ports[MV_VMEXIT_LOG_NUM_KEYS];
+    mv_uint64_t num_other_ports;
+};
+
 // -----------------------------------------------------------------------------
 // mv_handle_op_open_handle
 // -----------------------------------------------------------------------------
@@ -982,10 +1074,44 @@ mv_vm_state_op_set_initial_reg_val(
 // mv_vm_state_op_list_of_initial_reg_vals
 // -----------------------------------------------------------------------------
 
+#define MV_VM_STATE_OP_LIST_OF_INITIAL_REG_VALS_IDX_VAL                        \
+    ((mv_uint64_t)0x0000000000000002)
+
+static inline mv_status_t
+mv_vm_state_op_list_of_initial_reg_vals(
+    struct mv_handle_t const *const handle,    /* IN */
+    mv_uint64_t const vmid,                    /* IN */
+    mv_uint64_t const reg_vals_gpa)            /* IN */
+{
+    if (MV_NULL == handle) {
+        return MV_STATUS_INVALID_PARAMS0;
+    }
+
+    return _mv_vm_state_op_list_of_initial_reg_vals(
+               handle->hndl, vmid, reg_vals_gpa);
+}
+
 // -----------------------------------------------------------------------------
 // mv_vm_state_op_set_list_of_initial_reg_vals
 // -----------------------------------------------------------------------------
 
+#define MV_VM_STATE_OP_SET_LIST_OF_INITIAL_REG_VALS_IDX_VAL                    \
+    ((mv_uint64_t)0x0000000000000003)
+
+static inline mv_status_t
+mv_vm_state_op_set_list_of_initial_reg_vals(
+    struct mv_handle_t const *const handle,    /* IN */
+    mv_uint64_t const vmid,                    /* IN */
+    mv_uint64_t const reg_vals_gpa)            /* IN */
+{
+    if (MV_NULL == handle) {
+        return MV_STATUS_INVALID_PARAMS0;
+    }
+
+    return _mv_vm_state_op_set_list_of_initial_reg_vals(
+               handle->hndl, vmid, reg_vals_gpa);
+}
+
 // -----------------------------------------------------------------------------
 // mv_vm_state_op_initial_msr_val
 // -----------------------------------------------------------------------------
@@ -1076,6 +1202,15 @@ mv_vm_state_op_gva_to_gpa(
 
 #define MV_VM_STATE_OP_MAP_RANGE_IDX_VAL ((mv_uint64_t)0x00000000000000009)
 
+// Note:
+//
+// The lower 32 bits of flags_size hold the number of 4k pages in the range,
+// and the upper 32 bits hold the MV_GPA_FLAG_XXX flags for the mapping
+// (i.e. the access flags and optionally the largest page size to use).
+//
+
+#define MV_MAP_RANGE_SIZE_MASK ((mv_uint64_t)0x00000000FFFFFFFF)
+
 static inline mv_status_t
 mv_vm_state_op_map_range(
     struct mv_handle_t const *const handle,    /* IN */
@@ -1099,6 +1234,14 @@ mv_vm_state_op_map_range(
 
 #define MV_VM_STATE_OP_UNMAP_RANGE_IDX_VAL ((mv_uint64_t)0x0000000000000000A)
 
+// Note:
+//
+// The memory that backed the range must not be reused until this returns
+// MV_STATUS_SUCCESS. If one of the domain's vCPUs might still be using the
+// old translations, MV_STATUS_RETRY_CONTINUATION is returned instead, and
+// the call has to be repeated (with the same arguments) until it succeeds.
+//
+
 static inline mv_status_t
 mv_vm_state_op_unmap_range(
     struct mv_handle_t const *const handle,    /* IN */
@@ -1599,7 +1742,26 @@ enum mv_vp_exit_t {
     mv_vp_exit_t_hlt = 3,
     mv_vp_exit_t_fault = 4,
     mv_vp_exit_t_sync_tsc = 5,
-    mv_vp_exit_t_max = 6
+    mv_vp_exit_t_populate = 6,
+    mv_vp_exit_t_wakeup = 7,
+    mv_vp_exit_t_max = 8
+};
+
+// Note:
+//
+// Once registered using mv_vp_exit_op_set_exit_info, the VMM fills in this
+// page every time a VP hands control back to its parent. Unlike the value
+// returned by a run, the arg is not truncated, and the counters and exit
+// details do not require any additional hypercalls to read.
+//
+struct mv_vp_exit_info_t {
+    mv_uint64_t reason;
+    mv_uint64_t arg;
+    mv_uint64_t exit_reason;
+    mv_uint64_t guest_tsc;
+    mv_uint64_t host_tsc;
+    mv_uint64_t num_exits;
+    mv_uint64_t num_exits_by_reason[mv_vp_exit_t_max];
 };
 
 static inline mv_status_t
@@ -1678,6 +1840,25 @@ mv_vp_management_op_resume_vp(
     return _mv_vp_management_op_resume_vp(handle->hndl, vpid);
 }
 
+// -----------------------------------------------------------------------------
+// mv_vp_exit_op_set_exit_info
+// -----------------------------------------------------------------------------
+
+#define MV_VP_EXIT_OP_SET_EXIT_INFO_IDX_VAL ((mv_uint64_t)0x0000000000000000)
+
+static inline mv_status_t
+mv_vp_exit_op_set_exit_info(
+    struct mv_handle_t const *const handle,    /* IN */
+    mv_uint64_t const vpid,                    /* IN */
+    mv_uint64_t const exit_info_gpa)           /* IN */
+{
+    if (MV_NULL == handle) {
+        return MV_STATUS_INVALID_PARAMS0;
+    }
+
+    return _mv_vp_exit_op_set_exit_info(handle->hndl, vpid, exit_info_gpa);
+}
+
 // =============================================================================
 // !!! WARNING DEPRECATED !!!
 // =============================================================================
@@ -1718,6 +1899,7 @@ extern "C" {
 #define hypercall_enum_uart_op 0x04
 #define hypercall_enum_virq_op 0x10
 #define hypercall_enum_vclock_op 0x11
+#define hypercall_enum_balloon_op 0x12
 
 #define bfopcode(a) ((a & 0x00FF000000000000) >> 48)
 
@@ -1730,6 +1912,8 @@ extern "C" {
 #define hypercall_enum_run_op__continue 3
 #define hypercall_enum_run_op__yield 4
 #define hypercall_enum_run_op__set_wallclock 5
+#define hypercall_enum_run_op__populate 6
+#define hypercall_enum_run_op__wakeup 7
 
 #define run_op_ret_op(a) ((0x000000000000000FULL & a) >> 0)
 #define run_op_ret_arg(a) ((0xFFFFFFFFFFFFFFF0ULL & a) >> 4)
@@ -1780,6 +1964,10 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
 
 #define hypercall_enum_domain_op__create_domain 0xBF02000000000100
 #define hypercall_enum_domain_op__destroy_domain 0xBF02000000000101
+#define hypercall_enum_domain_op__pause_domain 0xBF02000000000102
+#define hypercall_enum_domain_op__fork_domain 0xBF02000000000103
+#define hypercall_enum_domain_op__num_vcpus 0xBF02000000000104
+#define hypercall_enum_domain_op__fork_memory 0xBF02000000000105
 
 #define hypercall_enum_domain_op__set_uart 0xBF02000000000200
 #define hypercall_enum_domain_op__set_pt_uart 0xBF02000000000201
@@ -1792,6 +1980,23 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
 #define hypercall_enum_domain_op__donate_page_rw 0xBF02000000000311
 #define hypercall_enum_domain_op__donate_page_rwe 0xBF02000000000313
 
+#define hypercall_enum_domain_op__set_balloon_target 0xBF02000000000400
+#define hypercall_enum_domain_op__balloon_reclaim 0xBF02000000000401
+#define hypercall_enum_domain_op__balloon_wanted 0xBF02000000000402
+
+#define hypercall_enum_domain_op__set_demand_range 0xBF02000000000500
+#define hypercall_enum_domain_op__demand_pool_add 0xBF02000000000501
+
+#define hypercall_enum_domain_op__e820_map 0xBF02000000000600
+#define hypercall_enum_domain_op__read_memory 0xBF02000000000601
+#define hypercall_enum_domain_op__write_memory 0xBF02000000000602
+#define hypercall_enum_domain_op__export_snapshot 0xBF02000000000603
+#define hypercall_enum_domain_op__import_snapshot 0xBF02000000000604
+
+#define hypercall_enum_domain_op__enable_dirty_log 0xBF02000000000700
+#define hypercall_enum_domain_op__disable_dirty_log 0xBF02000000000701
+#define hypercall_enum_domain_op__dirty_log 0xBF02000000000702
+
 #define hypercall_enum_domain_op__rax 0xBF02000000010000
 #define hypercall_enum_domain_op__set_rax 0xBF02000000010001
 #define hypercall_enum_domain_op__rbx 0xBF02000000010010
@@ -1931,6 +2136,8 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
 #define hypercall_enum_domain_op__set_ldtr_access_rights 0xBF02000000020731
 
 #define UART_MAX_BUFFER 0x4000
+#define MEMORY_MAX_BUFFER 0x40000
+#define DIRTY_LOG_MAX_BUFFER 0x1000
 
 static inline domainid_t
 hypercall_domain_op__create_domain(void)
@@ -1956,6 +2163,61 @@ hypercall_domain_op__destroy_domain(domainid_t foreign_domainid)
     return ret == 0 ? SUCCESS : FAILURE;
 }
 
+static inline status_t
+hypercall_domain_op__pause_domain(domainid_t foreign_domainid)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__pause_domain,
+                       foreign_domainid,
+                       0,
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline domainid_t
+hypercall_domain_op__fork_domain(domainid_t foreign_domainid)
+{
+    return _vmcall(
+               hypercall_enum_domain_op__fork_domain,
+               foreign_domainid,
+               0,
+               0
+           );
+}
+
+// Note:
+//
+// A forked domain does not share any of its parent's memory until
+// hypercall_domain_op__fork_memory() has been called until it returns
+// SUCCESS. Each call only shares a batch of the parent's memory, and 1 is
+// returned while there is more left to share. FAILURE is returned if the
+// domain was not forked, or its parent no longer exists.
+//
+
+static inline status_t
+hypercall_domain_op__fork_memory(domainid_t foreign_domainid)
+{
+    return _vmcall(
+               hypercall_enum_domain_op__fork_memory,
+               foreign_domainid,
+               0,
+               0
+           );
+}
+
+static inline uint64_t
+hypercall_domain_op__num_vcpus(domainid_t foreign_domainid)
+{
+    return _vmcall(
+               hypercall_enum_domain_op__num_vcpus,
+               foreign_domainid,
+               0,
+               0
+           );
+}
+
 static inline status_t
 hypercall_domain_op__set_uart(domainid_t foreign_domainid, uint64_t uart)
 {
@@ -2077,6 +2339,181 @@ hypercall_domain_op__donate_page_rwe(
     return ret == 0 ? SUCCESS : FAILURE;
 }
 
+static inline status_t
+hypercall_domain_op__set_balloon_target(domainid_t domainid, uint64_t pages)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__set_balloon_target,
+                       domainid,
+                       pages,
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__balloon_reclaim(
+    domainid_t domainid, struct mv_mdl_t *mdl)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__balloon_reclaim,
+                       domainid,
+                       bfrcast(uint64_t, mdl),
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__balloon_wanted(
+    domainid_t domainid, struct mv_mdl_t *mdl)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__balloon_wanted,
+                       domainid,
+                       bfrcast(uint64_t, mdl),
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__set_demand_range(
+    domainid_t domainid, uint64_t gpa, uint64_t size)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__set_demand_range,
+                       domainid,
+                       gpa,
+                       size
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__demand_pool_add(
+    domainid_t domainid, uint64_t mdl_gpa)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__demand_pool_add,
+                       domainid,
+                       mdl_gpa,
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__e820_map(
+    domainid_t domainid, struct mv_mdl_t *mdl)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__e820_map,
+                       domainid,
+                       bfrcast(uint64_t, mdl),
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__read_memory(
+    domainid_t domainid, char *buffer, uint64_t gpa)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__read_memory,
+                       domainid,
+                       bfrcast(uint64_t, buffer),
+                       gpa
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline uint64_t
+hypercall_domain_op__write_memory(
+    domainid_t domainid, const char *buffer, uint64_t gpa)
+{
+    return _vmcall(
+               hypercall_enum_domain_op__write_memory,
+               domainid,
+               bfrcast(uint64_t, buffer),
+               gpa
+           );
+}
+
+static inline uint64_t
+hypercall_domain_op__export_snapshot(
+    domainid_t domainid, char *buffer, uint64_t size)
+{
+    return _vmcall(
+               hypercall_enum_domain_op__export_snapshot,
+               domainid,
+               bfrcast(uint64_t, buffer),
+               size
+           );
+}
+
+static inline status_t
+hypercall_domain_op__import_snapshot(
+    domainid_t domainid, const char *buffer, uint64_t size)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__import_snapshot,
+                       domainid,
+                       bfrcast(uint64_t, buffer),
+                       size
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__enable_dirty_log(domainid_t domainid)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__enable_dirty_log,
+                       domainid,
+                       0,
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__disable_dirty_log(domainid_t domainid)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__disable_dirty_log,
+                       domainid,
+                       0,
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__dirty_log(
+    domainid_t domainid, uint64_t *bitmap, uint64_t gpa)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_domain_op__dirty_log,
+                       domainid,
+                       bfrcast(uint64_t, bitmap),
+                       gpa
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
 #define hypercall_domain_op__reg(reg)                                           \
     static inline uint64_t                                                      \
     hypercall_domain_op__ ## reg(domainid_t domainid)                           \
@@ -2248,6 +2685,8 @@ hypercall_domain_op__set_reg(ldtr_access_rights)
 #define hypercall_enum_vcpu_op__create_vcpu 0xBF03000000000100
 #define hypercall_enum_vcpu_op__kill_vcpu 0xBF03000000000101
 #define hypercall_enum_vcpu_op__destroy_vcpu 0xBF03000000000102
+#define hypercall_enum_vcpu_op__vmexit_log 0xBF03000000000103
+#define hypercall_enum_vcpu_op__release_vcpu 0xBF03000000000104
 
 static inline vcpuid_t
 hypercall_vcpu_op__create_vcpu(domainid_t domainid)
@@ -2282,6 +2721,43 @@ hypercall_vcpu_op__destroy_vcpu(vcpuid_t vcpuid)
            );
 }
 
+static inline status_t
+hypercall_vcpu_op__vmexit_log(vcpuid_t vcpuid, struct mv_vmexit_log_t *log)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_vcpu_op__vmexit_log,
+                       vcpuid,
+                       bfrcast(uint64_t, log),
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+// Note:
+//
+// The VMCS of a vCPU stays active on the core that last ran it, so that a
+// vCPU that keeps running on the same core is not cleared and launched
+// again every time it is run. Before the thread that runs a vCPU moves to
+// another core, it must release the vCPU from the core that last ran it
+// (i.e. the thread must not migrate between its last run_op and this
+// call). Running a vCPU from another core without releasing it first
+// results in a run_op fault.
+//
+
+static inline status_t
+hypercall_vcpu_op__release_vcpu(vcpuid_t vcpuid)
+{
+    status_t ret = _vmcall(
+                       hypercall_enum_vcpu_op__release_vcpu,
+                       vcpuid,
+                       0,
+                       0
+                   );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
 /* -------------------------------------------------------------------------- */
 /* Virtual IRQs                                                               */
 /* -------------------------------------------------------------------------- */
@@ -2290,6 +2766,51 @@ hypercall_vcpu_op__destroy_vcpu(vcpuid_t vcpuid)
 
 #define hypercall_enum_virq_op__set_hypervisor_callback_vector 0xBF10000000000100
 #define hypercall_enum_virq_op__get_next_virq 0xBF10000000000101
+#define hypercall_enum_virq_op__set_virq_page 0xBF10000000000102
+
+// Note:
+//
+// Once a vCPU registers a vIRQ page using hypercall_virq_op__set_virq_page,
+// its vIRQs are no longer queued for hypercall_virq_op__get_next_virq.
+// Instead, the VMM atomically sets the vIRQ's bit in pending, and only
+// injects the hypervisor callback vector if the bit was not already pending
+// and is not set in mask. The guest's callback handler can then drain every
+// pending vIRQ without any additional VM exits by atomically exchanging
+// each word of pending with 0. A vIRQ that arrives while it is masked stays
+// pending, so a guest that clears a bit in mask should check pending itself.
+// Unlike the queue, a vIRQ that is raised again before the guest drains it
+// is only delivered once. The page must be a 4k aligned page of the guest's
+// RAM, and cannot be given back using the balloon while it is registered.
+// Registering a gpa of 0 goes back to using the queue.
+//
+// A vIRQ that is an interrupt vector (e.g. an IPI) uses the bit of that
+// vector. The boxy_virq__xxx vIRQs use the bits below 0x20, which no
+// interrupt vector uses (see virq_page_index() and virq_page_virq()).
+//
+
+#define VIRQ_PAGE_NUM_WORDS 4
+#define VIRQ_PAGE_BOXY_VIRQ_BASE 0xBF00000000000200
+
+struct virq_page_t {
+    uint64_t pending[VIRQ_PAGE_NUM_WORDS];
+    uint64_t mask[VIRQ_PAGE_NUM_WORDS];
+};
+
+static inline uint64_t
+virq_page_index(uint64_t virq)
+{
+    return virq & 0xFF;
+}
+
+static inline uint64_t
+virq_page_virq(uint64_t index)
+{
+    if (index < 0x20) {
+        return VIRQ_PAGE_BOXY_VIRQ_BASE | index;
+    }
+
+    return index;
+}
 
 static inline uint64_t
 hypercall_virq_op__set_hypervisor_callback_vector(uint64_t vector)
@@ -2305,6 +2826,13 @@ hypercall_virq_op__get_next_virq(void)
                hypercall_enum_virq_op__get_next_virq, 0, 0, 0);
 }
 
+static inline status_t
+hypercall_virq_op__set_virq_page(uint64_t gpa)
+{
+    return _vmcall(
+               hypercall_enum_virq_op__set_virq_page, gpa, 0, 0);
+}
+
 /* -------------------------------------------------------------------------- */
 /* Virtual Clock                                                              */
 /* -------------------------------------------------------------------------- */
@@ -2317,6 +2845,86 @@ hypercall_virq_op__get_next_virq(void)
 #define hypercall_enum_vclock_op__set_guest_wallclock_rtc 0xBF11000000000106
 #define hypercall_enum_vclock_op__set_guest_wallclock_tsc 0xBF11000000000107
 #define hypercall_enum_vclock_op__get_guest_wallclock 0xBF11000000000108
+#define hypercall_enum_vclock_op__set_timer_page 0xBF11000000000109
+#define hypercall_enum_vclock_op__set_pvclock_page 0xBF1100000000010A
+#define hypercall_enum_vclock_op__set_steal_page 0xBF1100000000010B
+
+// Note:
+//
+// Once a vCPU registers a timer page using hypercall_vclock_op__set_timer_page,
+// it can arm its clock event without a VM exit by writing the guest TSC of
+// the event to deadline. The VMM picks up (and clears) deadline every time
+// the vCPU exits or is resumed, and like hypercall_vclock_op__set_next_event,
+// a new deadline replaces the one that is armed. The VMM reports the guest
+// TSC of the event it has armed in armed (0 if none), and since a deadline
+// is only picked up on the next exit, a guest should only rely on writing
+// deadline if it is not earlier than armed. An earlier deadline (or any
+// deadline while nothing is armed) still needs a VM exit, which is what
+// hypercall_vclock_op__set_next_event is for. A later deadline is picked up
+// when the armed one expires, at the latest, in which case no clock event
+// is delivered for the armed one.
+//
+
+struct vclock_timer_page_t {
+    uint64_t deadline;
+    uint64_t armed;
+};
+
+// Note:
+//
+// A pvclock page lets a guest (including its userspace) read the wallclock
+// without a VM exit. It is registered once per domain using
+// hypercall_vclock_op__set_pvclock_page, normally from the BSP (FAILURE is
+// returned if another vCPU of the domain already registered a page), and
+// the VMM keeps it up to date using the guest wallclock of the vCPU that
+// registered it. All of a domain's vCPUs share the same TSC offset, so
+// the page is valid on every vCPU. The wallclock at a given guest TSC is:
+//
+// wc_sec/wc_nsec + vclock_pvclock_scale(tsc - wc_tsc, tsc_mul, tsc_shift)
+//
+// The page is protected by a seqlock: version is odd while the VMM updates
+// the page, so a reader copies the page and retries if version was odd or
+// changed while it was being copied. A version of 0 means the page has not
+// been published yet (i.e. the guest has not set its wallclock). The scaled
+// math is not exactly the same as hypercall_vclock_op__get_guest_wallclock
+// (the error is well below 1 ppm), so a guest should not mix the two.
+//
+
+struct vclock_pvclock_page_t {
+    uint64_t version;
+    uint64_t tsc_freq_khz;
+    uint64_t tsc_mul;
+    int64_t tsc_shift;
+    uint64_t wc_tsc;
+    int64_t wc_sec;
+    int64_t wc_nsec;
+};
+
+// Note:
+//
+// A vCPU can register a steal page using hypercall_vclock_op__set_steal_page
+// to learn how much time it has lost to the host. steal is the total time
+// (in nanoseconds) that the vCPU was runnable, but was not running (e.g.
+// the host preempted it, or it slept past its next event). The VMM updates
+// it before the vCPU is resumed, and it never goes backwards.
+//
+
+struct vclock_steal_page_t {
+    uint64_t steal;
+};
+
+static inline uint64_t
+vclock_pvclock_scale(uint64_t delta, uint64_t mul, int64_t shift)
+{
+    if (shift < 0) {
+        delta >>= -shift;
+    }
+    else {
+        delta <<= shift;
+    }
+
+    return ((delta >> 32) * mul) + (((delta & 0xFFFFFFFF) * mul) >> 32);
+}
 
 static inline uint64_t
 hypercall_vclock_op__get_tsc_freq_khz(void)
@@ -2394,6 +3002,72 @@ hypercall_vclock_op__get_guest_wallclock(
                &op, sec, nsec, tsc);
 }
 
+static inline status_t
+hypercall_vclock_op__set_timer_page(uint64_t gpa)
+{
+    return _vmcall(
+               hypercall_enum_vclock_op__set_timer_page, gpa, 0, 0);
+}
+
+static inline status_t
+hypercall_vclock_op__set_pvclock_page(uint64_t gpa)
+{
+    return _vmcall(
+               hypercall_enum_vclock_op__set_pvclock_page, gpa, 0, 0);
+}
+
+static inline status_t
+hypercall_vclock_op__set_steal_page(uint64_t gpa)
+{
+    return _vmcall(
+               hypercall_enum_vclock_op__set_steal_page, gpa, 0, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Balloon                                                                    */
+/* -------------------------------------------------------------------------- */
+
+#define hypercall_enum_balloon_op__get_target 0xBF12000000000100
+#define hypercall_enum_balloon_op__inflate 0xBF12000000000101
+#define hypercall_enum_balloon_op__deflate 0xBF12000000000102
+#define hypercall_enum_balloon_op__report_free 0xBF12000000000103
+
+static inline uint64_t
+hypercall_balloon_op__get_target(void)
+{
+    return _vmcall(
+               hypercall_enum_balloon_op__get_target, 0, 0, 0);
+}
+
+// Note:
+//
+// The MDL passed to the balloon hypercalls can chain at most 64 MDL pages
+// (see mv_mdl_t.next). Longer chains are rejected with
+// MV_STATUS_INVALID_PARAMS0, and the caller should split the request into
+// more than one hypercall instead.
+//
+
+static inline status_t
+hypercall_balloon_op__inflate(uint64_t mdl_gpa)
+{
+    return _vmcall(
+               hypercall_enum_balloon_op__inflate, mdl_gpa, 0, 0);
+}
+
+static inline status_t
+hypercall_balloon_op__deflate(uint64_t mdl_gpa)
+{
+    return _vmcall(
+               hypercall_enum_balloon_op__deflate, mdl_gpa, 0, 0);
+}
+
+static inline status_t
+hypercall_balloon_op__report_free(uint64_t mdl_gpa)
+{
+    return _vmcall(
+               hypercall_enum_balloon_op__report_free, mdl_gpa, 0, 0);
+}
+
 #ifdef __cplusplus
 }
 #endif
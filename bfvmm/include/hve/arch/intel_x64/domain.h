@@ -24,8 +24,13 @@
 
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "uart.h"
+#include "snapshot.h"
 #include "../../../domain/domain.h"
 #include "../../../domain/domain_manager.h"
 
@@ -205,6 +210,575 @@ public:
     ///
     void release(uintptr_t gpa);
 
+    /// Unmap GPA Range
+    ///
+    /// Unmaps every page in [gpa, gpa + size). Unlike unmap(), large pages
+    /// are unmapped as a whole (and split if only partially covered), and
+    /// the EPT is flushed (see flush_ept()) only once, after the entire
+    /// range has been unmapped. The memory that backed the range must not
+    /// be reused, and the range must not be released, until all of this
+    /// domain's vCPUs have seen the flush (see synced_ept_generation()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address to unmap
+    /// @param size the number of bytes to unmap
+    ///
+    void unmap_range(uintptr_t gpa, uint64_t size);
+
+    /// Release GPA Range
+    ///
+    /// Returns any unused page tables in [gpa, gpa + size) back to the heap.
+    ///
+    /// @note that unmap_range must be run for any existing mappings,
+    ///     otherwise this function has no effect.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first address to release
+    /// @param size the number of bytes to release
+    ///
+    void release_range(uintptr_t gpa, uint64_t size);
+
+public:
+
+    /// Balloon Target
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of 4k pages dom0 would like this domain to keep
+    ///     in its balloon
+    ///
+    uint64_t balloon_target() const noexcept;
+
+    /// Set Balloon Target
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param pages the number of 4k pages dom0 would like this domain to
+    ///     keep in its balloon
+    ///
+    void set_balloon_target(uint64_t pages) noexcept;
+
+    /// Balloon Inflate
+    ///
+    /// Unmaps [gpa, gpa + size) from this domain on behalf of the guest. The
+    /// memory that backed the range is remembered, so that it can either be
+    /// handed back to the guest (see balloon_deflate()), or given back to
+    /// dom0 (see balloon_reclaim()).
+    ///
+    /// @expects [gpa, gpa + size) does not hold a shared page (see
+    ///     add_shared_page())
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address to give back
+    /// @param size the number of bytes to give back
+    ///
+    void balloon_inflate(uintptr_t gpa, uint64_t size);
+
+    /// Balloon Deflate
+    ///
+    /// Maps any part of [gpa, gpa + size) that was previously given back by
+    /// the guest. If dom0 has already reclaimed the memory that backed part
+    /// of the range, that part is added to the list of memory the guest
+    /// wants back (see balloon_wanted()) and has to be retried once dom0
+    /// has repopulated it.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address to take back
+    /// @param size the number of bytes to take back
+    /// @return true if the entire range is mapped, false otherwise
+    ///
+    bool balloon_deflate(uintptr_t gpa, uint64_t size);
+
+    /// Balloon Reclaim
+    ///
+    /// Fills in the provided MDL with ranges the guest has given back (in
+    /// this domain's guest physical address space) that dom0 has not yet
+    /// reclaimed. Once reported, dom0 owns (and is free to release) the
+    /// memory that backed these ranges, so a range is only reported once
+    /// none of this domain's vCPUs can reach it anymore (see
+    /// synced_ept_generation()). Until then, it is held back.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mdl the MDL to fill in
+    ///
+    void balloon_reclaim(mv_mdl_t &mdl);
+
+    /// Balloon Wanted
+    ///
+    /// Fills in the provided MDL with ranges the guest would like back after
+    /// dom0 reclaimed them. dom0 is expected to map new memory into these
+    /// ranges.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mdl the MDL to fill in
+    ///
+    void balloon_wanted(mv_mdl_t &mdl);
+
+public:
+
+    /// Set Demand Range
+    ///
+    /// Marks [gpa, gpa + size) as guest RAM that is reserved for this domain
+    /// but left unmapped until the guest first touches it. Each page in the
+    /// range is backed on first touch using memory from the demand pool (see
+    /// demand_pool_add() and demand_populate()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the number of bytes in the range
+    ///
+    void set_demand_range(uintptr_t gpa, uint64_t size);
+
+    /// Demand Pool Add
+    ///
+    /// Adds [hpa, hpa + size) to the pool of (already zeroed) memory used to
+    /// back this domain's demand range. 2M aligned pieces are kept whole so
+    /// that they can be mapped using a single large page.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param hpa the first host physical address to add
+    /// @param size the number of bytes to add
+    ///
+    void demand_pool_add(uintptr_t hpa, uint64_t size);
+
+    /// Is Demand GPA
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to check
+    /// @return true if gpa is part of this domain's demand range (or was
+    ///     given back by the guest using its balloon), false otherwise
+    ///
+    bool is_demand_gpa(uintptr_t gpa);
+
+    /// Demand Populate
+    ///
+    /// Backs the page that contains gpa. Memory the guest gave back using its
+    /// balloon (and that dom0 has not reclaimed) is mapped back in place.
+    /// Otherwise, if the surrounding 2M region has not been touched yet and
+    /// the pool has a 2M page, the whole region is mapped at once. If not, a
+    /// single 4k page is mapped.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address that was touched
+    /// @return true if the page is mapped, false if the pool is empty and
+    ///     dom0 needs to add more memory before the guest can continue
+    ///
+    bool demand_populate(uintptr_t gpa);
+
+    /// Is Accessible
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to check
+    /// @param access the access to check for, using the same bits as the
+    ///     EPT (bit 0 is read, bit 1 is write and bit 2 is execute)
+    /// @return true if gpa is mapped and the mapping allows the access,
+    ///     false otherwise
+    ///
+    bool is_accessible(uintptr_t gpa, uint64_t access);
+
+public:
+
+    /// Map 4k GPA to HPA (Copy-On-Write)
+    ///
+    /// Maps gpa to hpa as read/execute. The memory at hpa is shared (e.g.
+    /// with other domains booted from the same kernel and initrd), so the
+    /// first time the guest writes to the page, the page is copied into
+    /// memory from the demand pool (see cow_populate()) and the copy is
+    /// mapped read/write/execute in its place.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address
+    /// @param hpa the (shared) host physical address
+    ///
+    void map_4k_cow(uintptr_t gpa, uintptr_t hpa);
+
+    /// Is Copy-On-Write GPA
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to check
+    /// @return true if the page that contains gpa is still mapped onto
+    ///     shared memory, false otherwise
+    ///
+    bool is_cow_gpa(uintptr_t gpa);
+
+    /// Copy-On-Write Populate
+    ///
+    /// Gives the guest its own copy of the shared page that contains gpa.
+    /// The provided function is called with the host physical address of
+    /// the new page and the shared page, and is expected to copy the
+    /// contents of the shared page into the new page before the new page is
+    /// mapped.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address that was written to
+    /// @param copy the function that copies the shared page
+    /// @return true if the page no longer needs to be copied, false if the
+    ///     demand pool is empty and dom0 needs to add more memory first
+    ///
+    template<typename F>
+    bool cow_populate(uintptr_t gpa, F copy)
+    {
+        std::lock_guard lock(m_balloon_mutex);
+
+        auto page = gpa & ~(0xFFFULL);
+        auto iter = m_cow_pages.find(page);
+
+        if (iter == m_cow_pages.end()) {
+            return true;
+        }
+
+        uintptr_t hpa;
+        if (!this->demand_pool_take_4k(hpa)) {
+            return false;
+        }
+
+        copy(hpa, iter->second);
+        this->cow_remap(page, hpa);
+
+        m_cow_pages.erase(iter);
+        return true;
+    }
+
+public:
+
+    /// Enable Dirty Log
+    ///
+    /// Starts tracking which pages of this domain's guest RAM are written
+    /// to. Every page the guest has already touched is remapped as
+    /// read/execute using 4k pages, so that the first write to each page
+    /// can be recorded (see dirty_log_write()). Memory that is populated
+    /// (or ballooned) while the dirty log is enabled is recorded as dirty
+    /// as well.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_dirty_log();
+
+    /// Disable Dirty Log
+    ///
+    /// Stops tracking writes and makes all of the guest's RAM writable
+    /// again. Pages that were split into 4k pages stay split.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_dirty_log();
+
+    /// Dirty Log Write
+    ///
+    /// Called when the guest writes to a page that was write protected by
+    /// the dirty log. The page is recorded as dirty and made writable, so
+    /// further writes to the page do not fault until the dirty log is read.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address that was written to
+    /// @return true if the page was write protected by the dirty log (and
+    ///     is now writable), false otherwise
+    ///
+    bool dirty_log_write(uintptr_t gpa);
+
+    /// Dirty Log
+    ///
+    /// Fills in the provided bitmap (one bit per 4k page, starting at gpa)
+    /// with the pages that were written to since the last time they were
+    /// reported, and write protects them again.
+    ///
+    /// @expects gpa is 4k aligned
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address of the first page to report
+    /// @param bitmap the bitmap to fill in
+    ///
+    void dirty_log(uintptr_t gpa, gsl::span<uint64_t> bitmap);
+
+    /// EPT Generation
+    ///
+    /// Incremented each time this domain's EPT loses permissions that other
+    /// CPUs might still have cached (see vcpu::sync_ept()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the current EPT generation
+    ///
+    uint64_t ept_generation() const noexcept;
+
+    /// Synced EPT Generation
+    ///
+    /// Each vCPU flushes its EPT TLB before it is run if the EPT generation
+    /// changed since it last ran (see vcpu::sync_ept()). A vCPU that is
+    /// running right now might still be using translations that the EPT
+    /// no longer has until it exits to its parent (e.g. on the next
+    /// external interrupt) and is run again.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the oldest EPT generation one of this domain's vCPUs
+    ///     might still be using. Memory that was unmapped in (or before)
+    ///     this generation is no longer reachable from any of the vCPUs.
+    ///
+    uint64_t synced_ept_generation();
+
+public:
+
+    /// TSC Offset
+    ///
+    /// All of this domain's vCPUs use the same TSC offset so that an SMP
+    /// guest sees the same TSC on each of its vCPUs. A vCPU writes the
+    /// domain's offset to its VMCS before it is run (see
+    /// vcpu::sync_tsc_offset()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the TSC offset of this domain's vCPUs
+    ///
+    uint64_t tsc_offset() const noexcept;
+
+    /// Set TSC Offset
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param offset the new TSC offset of this domain's vCPUs
+    ///
+    void set_tsc_offset(uint64_t offset) noexcept;
+
+    /// Raise TSC Offset
+    ///
+    /// Raises the TSC offset (if needed) so that the guest's TSC on the
+    /// current core is not behind the provided guest TSC (e.g. the last
+    /// TSC a vCPU that moved to this core saw). The offset is never
+    /// lowered, so the guest's TSC never goes backwards on any of its
+    /// vCPUs.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param guest_tsc the guest TSC the guest should not be behind of
+    ///
+    void raise_tsc_offset(uint64_t guest_tsc) noexcept;
+
+public:
+
+    /// Add Shared Page
+    ///
+    /// Records a page of this domain's guest RAM that the VMM writes to on
+    /// behalf of the guest (e.g. a vIRQ page). The VMM writes to these
+    /// pages without going through the EPT, so they cannot be given back
+    /// using the balloon, and the dirty log always reports them as dirty.
+    /// A page can be added more than once, in which case it has to be
+    /// removed the same number of times.
+    ///
+    /// @expects gpa is guest RAM that is mapped and is not shared
+    ///     copy-on-write (see vcpu::populate_page())
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address of the page
+    ///
+    void add_shared_page(uintptr_t gpa);
+
+    /// Remove Shared Page
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address of a page that was added
+    ///     using add_shared_page()
+    ///
+    void remove_shared_page(uintptr_t gpa);
+
+    /// Claim pvclock Page
+    ///
+    /// The pvclock page is shared by all of the domain's vCPUs, but it is
+    /// written by the vclock handler of the vCPU that registered it. Only
+    /// one vCPU is allowed to own the page, so that two vCPUs never publish
+    /// into the same page at the same time.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param id the ID of the vCPU that is registering the page
+    /// @return returns true if the vCPU now owns the pvclock page (or
+    ///     already did), false if another vCPU owns it
+    ///
+    bool claim_pvclock_page(vcpuid::type id) noexcept;
+
+    /// Release pvclock Page
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param id the ID of the vCPU that claimed the page using
+    ///     claim_pvclock_page(). If the vCPU does not own the page, nothing
+    ///     happens.
+    ///
+    void release_pvclock_page(vcpuid::type id) noexcept;
+
+public:
+
+    /// Pause
+    ///
+    /// Stops this domain's vCPUs from being run again. A vCPU that is
+    /// running when the domain is paused finishes its current run (see
+    /// vcpu::mark_running()). Once paused, a domain cannot be resumed, as
+    /// its memory might be shared with domains forked from it.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void pause() noexcept;
+
+    /// Is Paused
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the domain has been paused, false otherwise
+    ///
+    bool is_paused() const noexcept;
+
+    /// Set Snapshot
+    ///
+    /// Stores the state of this (paused) domain's vCPUs so that domains can
+    /// be forked from it (see fork()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the state of each of this domain's vCPUs
+    ///
+    void set_snapshot(std::vector<vcpu_snapshot_t> &&snapshot);
+
+    /// Has Snapshot
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if set_snapshot() has been called, false
+    ///     otherwise
+    ///
+    bool has_snapshot() const noexcept;
+
+    /// Fork
+    ///
+    /// Turns this (new) domain into a copy of the provided paused domain.
+    /// Each vCPU that is added to this domain is created from the parent's
+    /// snapshot of the vCPU with the same APIC ID instead of from the
+    /// domain registers. The parent's guest memory is not shared here.
+    /// Instead, fork_memory() has to be called until it returns false
+    /// before this domain is run.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param parent the paused domain to fork from
+    ///
+    void fork(gsl::not_null<domain *> parent);
+
+    /// Fork Memory
+    ///
+    /// Maps the next batch of the parent's guest memory copy-on-write
+    /// (see map_4k_cow()). Memory the parent has not touched yet is left
+    /// to the demand pool. The parent's EPT is walked one leaf at a time,
+    /// but each leaf is shared as 4k pages, so that the first write to a
+    /// shared page only has to copy 4k.
+    ///
+    /// @expects fork() has been called, and the parent still exists and
+    ///     is still paused
+    /// @ensures
+    ///
+    /// @return returns true if there is more memory left to share (in
+    ///     which case fork_memory() has to be called again), false once
+    ///     all of the parent's memory has been shared
+    ///
+    bool fork_memory();
+
+    /// Fork Snapshot
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apic_id the APIC ID of the vCPU that is being created
+    /// @return returns the snapshot the vCPU should be created from, or
+    ///     nullptr if this domain was not forked or restored (or the
+    ///     snapshot does not have a vCPU with this APIC ID)
+    ///
+    const vcpu_snapshot_t *fork_snapshot(uint64_t apic_id) const noexcept;
+
+public:
+
+    /// Export Snapshot
+    ///
+    /// Serializes this (paused) domain's snapshot, along with the state of
+    /// its emulated UART, so that it can be stored outside of the VMM and
+    /// restored later using import_snapshot().
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the serialized snapshot
+    ///
+    std::vector<uint64_t> export_snapshot();
+
+    /// Import Snapshot
+    ///
+    /// Loads a snapshot that was serialized using export_snapshot(). Like
+    /// a domain that is forked, each vCPU that is added to this domain is
+    /// created from the snapshot of the vCPU with the same APIC ID (see
+    /// fork_snapshot()), so the snapshot must be imported before any vCPUs
+    /// are created. Guest memory is restored separately.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param words the serialized snapshot
+    ///
+    void import_snapshot(gsl::span<const uint64_t> words);
+
+    /// GPA to HPA
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to convert
+    /// @param hpa (out) the host physical address gpa is mapped to
+    /// @return returns true if gpa is mapped, false otherwise
+    ///
+    bool gpa_to_hpa(uintptr_t gpa, uintptr_t &hpa);
+
 public:
 
     /// Set UART
@@ -257,6 +831,66 @@ public:
     ///
     uint64_t dump_uart(const gsl::span<char> &buffer);
 
+public:
+
+    /// Add vCPU
+    ///
+    /// Adds a vCPU to the domain and returns the x2APIC ID assigned to it.
+    /// APIC IDs are handed out in the order vCPUs are added, so the first
+    /// vCPU added to a domain is the BSP (APIC ID 0).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to add
+    /// @return the APIC ID assigned to the vCPU
+    ///
+    uint64_t add_vcpu(gsl::not_null<vcpu *> vcpu);
+
+    /// Remove vCPU
+    ///
+    /// Removes a vCPU from the domain. The APIC ID of the vCPU is not
+    /// reused.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to remove
+    ///
+    void remove_vcpu(gsl::not_null<vcpu *> vcpu) noexcept;
+
+    /// Number of vCPUs
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of APIC IDs that have been handed out
+    ///
+    uint64_t num_vcpus() const;
+
+    /// For Each vCPU
+    ///
+    /// Calls the provided function for each vCPU that belongs to this
+    /// domain. The vCPU list is locked while the function executes, so the
+    /// function must not add or remove vCPUs.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param func the function to call
+    ///
+    template<typename F>
+    void foreach_vcpu(F func)
+    {
+        std::lock_guard lock(m_vcpus_mutex);
+
+        for (auto vcpu : m_vcpus) {
+            if (vcpu != nullptr) {
+                func(vcpu);
+            }
+        }
+    }
+
 public:
 
     /// Domain Registers
@@ -426,6 +1060,28 @@ private:
     void setup_dom0();
     void setup_domU();
 
+    void split_domU(uintptr_t gpa, uintptr_t page_size);
+    uint64_t ept_hole_size(uintptr_t gpa);
+
+    void unmap_leaves(uintptr_t gpa, uint64_t size);
+    void release_tables(uintptr_t gpa, uint64_t size);
+
+    void map_rwe_range(uintptr_t gpa, uintptr_t hpa, uint64_t size);
+    bool is_mapped_range(uintptr_t gpa, uint64_t size);
+
+    bool demand_pool_take_4k(uintptr_t &hpa);
+    void cow_remap(uintptr_t gpa, uintptr_t hpa);
+    void write_4k_leaf(uintptr_t gpa, uintptr_t hpa, ept::mmap::attr_type attr);
+
+    bool is_ram_gpa(uintptr_t gpa) const noexcept;
+    void remap_4k(uintptr_t gpa, bfvmm::intel_x64::ept::mmap::attr_type attr);
+    void remap_ram(bfvmm::intel_x64::ept::mmap::attr_type attr);
+    void mark_dirty(uintptr_t gpa, uint64_t size);
+    void flush_ept();
+
+    void set_fork_snapshot(std::vector<vcpu_snapshot_t> snapshots);
+    uart *emulated_uart() noexcept;
+
 private:
 
     bfvmm::intel_x64::ept::mmap m_ept_map{};
@@ -440,6 +1096,45 @@ private:
     uart m_uart_2E8{0x2E8};
     std::unique_ptr<uart> m_pt_uart{};
 
+    std::vector<vcpu *> m_vcpus{};
+    mutable std::mutex m_vcpus_mutex{};
+
+    struct balloon_run_t {
+        uintptr_t gpa;
+        uintptr_t hpa;
+        uint64_t size;
+        uint64_t ept_generation{};
+    };
+
+    uint64_t m_balloon_target{};
+    std::vector<balloon_run_t> m_balloon_held{};
+    std::vector<balloon_run_t> m_balloon_reclaimed{};
+    std::vector<balloon_run_t> m_balloon_wanted{};
+    std::mutex m_balloon_mutex{};
+
+    uintptr_t m_demand_start{};
+    uintptr_t m_demand_end{};
+    std::vector<uintptr_t> m_demand_pool_2m{};
+    std::vector<uintptr_t> m_demand_pool_4k{};
+    std::unordered_set<uintptr_t> m_demand_populated_2m{};
+    std::unordered_map<uintptr_t, uintptr_t> m_cow_pages{};
+
+    bool m_dirty_log{};
+    std::vector<uint64_t> m_dirty_bitmap{};
+    std::vector<uint64_t> m_dirty_pending{};
+    std::atomic<uint64_t> m_ept_generation{};
+    std::atomic<uint64_t> m_tsc_offset{};
+    std::unordered_map<uintptr_t, uint64_t> m_shared_pages{};
+    std::atomic<vcpuid::type> m_pvclock_owner{INVALID_VCPUID};
+
+    std::atomic<bool> m_paused{};
+    std::vector<vcpu_snapshot_t> m_snapshot{};
+    std::vector<vcpu_snapshot_t> m_fork_snapshot{};
+
+    domainid_type m_fork_parent{INVALID_DOMAINID};
+    uint64_t m_fork_entry{};
+    uintptr_t m_fork_gpa{};
+
     uint64_t m_rax{};
     uint64_t m_rbx{};
     uint64_t m_rcx{};
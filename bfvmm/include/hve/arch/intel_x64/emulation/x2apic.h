@@ -26,6 +26,8 @@
 #include <bfvmm/hve/arch/intel_x64/vmexit/rdmsr.h>
 #include <bfvmm/hve/arch/intel_x64/vmexit/wrmsr.h>
 
+#include "../snapshot.h"
+
 // -----------------------------------------------------------------------------
 // Definitions
 // -----------------------------------------------------------------------------
@@ -56,6 +58,30 @@ public:
     ///
     ~x2apic_handler() = default;
 
+public:
+
+    /// Save State
+    ///
+    /// Records the emulated x2APIC registers in the provided snapshot
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to save to
+    ///
+    void save_state(vcpu_snapshot_t &snapshot) const;
+
+    /// Restore State
+    ///
+    /// Sets the emulated x2APIC registers from the provided snapshot
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    ///
+    void restore_state(const vcpu_snapshot_t &snapshot);
+
 public:
 
     /// @cond
@@ -77,6 +103,10 @@ public:
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x00000808(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x0000080D(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x0000080D(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
     bool handle_rdmsr_0x0000080F(
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x0000080F(
@@ -152,6 +182,11 @@ public:
     bool handle_wrmsr_0x00000827(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
 
+    bool handle_rdmsr_0x00000830(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000830(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+
     bool handle_rdmsr_0x00000835(
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x00000835(
@@ -167,6 +202,12 @@ public:
 
     /// @endcond
 
+private:
+
+    uint64_t ldr(uint64_t apic_id) const noexcept;
+    bool is_ipi_target(vcpu *target, uint64_t icr) const noexcept;
+    void send_ipi(vcpu *target, uint64_t icr);
+
 private:
 
     vcpu *m_vcpu;
@@ -194,6 +235,8 @@ private:
     uint64_t m_0x00000826{0};
     uint64_t m_0x00000827{0};
 
+    uint64_t m_0x00000830{0};
+
     uint64_t m_0x00000835{1U << 16U};
     uint64_t m_0x00000836{1U << 16U};
     uint64_t m_0x00000837{1U << 16U};
@@ -0,0 +1,176 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef SNAPSHOT_INTEL_X64_BOXY_H
+#define SNAPSHOT_INTEL_X64_BOXY_H
+
+#include <ctime>
+#include <vector>
+#include <unordered_map>
+
+#include <bftypes.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+/// vCPU Snapshot (Fixed)
+///
+/// The part of a vCPU's snapshot that has a fixed size. It is kept apart
+/// from the rest of the snapshot so that it can be copied as is when a
+/// snapshot is exported (see domain::export_snapshot()).
+///
+struct vcpu_snapshot_fixed_t {
+    uint64_t apic_id;
+    bool wait_for_sipi;
+    bool sipi_pending;
+    uint64_t sipi_vector;
+
+    uint64_t rax;
+    uint64_t rbx;
+    uint64_t rcx;
+    uint64_t rdx;
+    uint64_t rbp;
+    uint64_t rsi;
+    uint64_t rdi;
+    uint64_t r08;
+    uint64_t r09;
+    uint64_t r10;
+    uint64_t r11;
+    uint64_t r12;
+    uint64_t r13;
+    uint64_t r14;
+    uint64_t r15;
+    uint64_t rip;
+    uint64_t rsp;
+    uint64_t rflags;
+    uint64_t gdt_base;
+    uint64_t gdt_limit;
+    uint64_t idt_base;
+    uint64_t idt_limit;
+    uint64_t cr0;
+    uint64_t cr0_read_shadow;
+    uint64_t cr2;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t cr4_read_shadow;
+    uint64_t cr8;
+    uint64_t dr0;
+    uint64_t dr1;
+    uint64_t dr2;
+    uint64_t dr3;
+    uint64_t dr6;
+    uint64_t dr7;
+    uint64_t xcr0;
+    uint64_t ia32_xss;
+    uint64_t ia32_efer;
+    uint64_t ia32_pat;
+    uint64_t ia32_sysenter_cs;
+    uint64_t ia32_sysenter_esp;
+    uint64_t ia32_sysenter_eip;
+
+    uint64_t es_selector;
+    uint64_t es_base;
+    uint64_t es_limit;
+    uint64_t es_access_rights;
+    uint64_t cs_selector;
+    uint64_t cs_base;
+    uint64_t cs_limit;
+    uint64_t cs_access_rights;
+    uint64_t ss_selector;
+    uint64_t ss_base;
+    uint64_t ss_limit;
+    uint64_t ss_access_rights;
+    uint64_t ds_selector;
+    uint64_t ds_base;
+    uint64_t ds_limit;
+    uint64_t ds_access_rights;
+    uint64_t fs_selector;
+    uint64_t fs_base;
+    uint64_t fs_limit;
+    uint64_t fs_access_rights;
+    uint64_t gs_selector;
+    uint64_t gs_base;
+    uint64_t gs_limit;
+    uint64_t gs_access_rights;
+    uint64_t tr_selector;
+    uint64_t tr_base;
+    uint64_t tr_limit;
+    uint64_t tr_access_rights;
+    uint64_t ldtr_selector;
+    uint64_t ldtr_base;
+    uint64_t ldtr_limit;
+    uint64_t ldtr_access_rights;
+
+    uint64_t interruptibility_state;
+    uint64_t activity_state;
+    bool ia_32e_mode_guest;
+    bool unrestricted_guest;
+
+    uint64_t tsc_offset;
+    uint64_t host_tsc;
+    uint64_t steal_tsc;
+
+    uint64_t next_event_tsc;
+    uint64_t guest_wc_tsc;
+    struct timespec guest_wc_rtc;
+    uint64_t timer_page_gpa;
+    uint64_t pvclock_page_gpa;
+    uint64_t steal_page_gpa;
+
+    uint64_t hypervisor_callback_vector;
+    uint64_t virq_page_gpa;
+};
+
+/// vCPU Snapshot
+///
+/// The state of a paused guest vCPU (see vcpu::save_state()). A domain that
+/// is forked from a paused domain creates its vCPUs from these snapshots
+/// (matched using the APIC ID) instead of from the domain registers, so
+/// each vCPU of the new domain continues from where the paused vCPU
+/// stopped. The register names match the domain registers. host_tsc is
+/// the host's TSC when the snapshot was taken, and any other field that
+/// holds a host TSC (i.e. next_event_tsc, as well as the TSC offset) is
+/// relative to it (see domain::fork()).
+///
+struct vcpu_snapshot_t : public vcpu_snapshot_fixed_t {
+    std::unordered_map<uint32_t, uint64_t> msrs;
+    std::unordered_map<uint32_t, uint64_t> x2apic;
+    std::vector<uint64_t> virqs;
+};
+
+/// UART Snapshot
+///
+/// The state of a domain's emulated UART (see uart::save_state()).
+///
+struct uart_snapshot_t {
+    uint64_t port;
+    uint64_t baud_rate_l;
+    uint64_t baud_rate_h;
+    uint64_t line_control_register;
+};
+
+}
+
+#endif
@@ -29,6 +29,8 @@
 #include <array>
 #include <mutex>
 
+#include "snapshot.h"
+
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 #include <bfvmm/hve/arch/intel_x64/vmexit/cpuid.h>
 #include <bfvmm/hve/arch/intel_x64/vmexit/io_instruction.h>
@@ -119,6 +121,29 @@ public:
     ///
     uint64_t dump(const gsl::span<char> &buffer);
 
+    /// Save State
+    ///
+    /// Stores the UART's registers in the provided snapshot. Data that has
+    /// not been dumped yet is not part of the snapshot.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to store the UART's state in
+    ///
+    void save_state(uart_snapshot_t &snapshot) const;
+
+    /// Restore State
+    ///
+    /// Restores the UART's registers from the provided snapshot.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore the UART's state from
+    ///
+    void restore_state(const uart_snapshot_t &snapshot);
+
 private:
 
     bool io_zero_handler(
@@ -23,10 +23,12 @@
 #define VCPU_INTEL_X64_BOXY_H
 
 #include <time.h>
+#include <atomic>
 #include <bfvmm/vcpu/vcpu_manager.h>
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 
 #include "domain.h"
+#include "snapshot.h"
 
 #include "vmexit/exception.h"
 #include "vmexit/external_interrupt.h"
@@ -55,9 +57,12 @@
 #include "emulation/mtrr.h"
 #include "emulation/x2apic.h"
 
+#include "virt/balloon.h"
 #include "virt/vclock.h"
 #include "virt/virq.h"
 
+#include "vmexit_log.h"
+
 //------------------------------------------------------------------------------
 // Definition
 //------------------------------------------------------------------------------
@@ -124,6 +129,15 @@ public:
     ///
     VIRTUAL domain::domainid_type domid() const noexcept;
 
+    /// Domain
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the vCPU's domain
+    ///
+    VIRTUAL domain *dom() const noexcept;
+
     //--------------------------------------------------------------------------
     // VMCall
     //--------------------------------------------------------------------------
@@ -133,9 +147,12 @@ public:
     /// @expects
     /// @ensures
     ///
+    /// @param opcode the opcode the delegate services (either a legacy
+    ///     bfopcode() value, or a MicroV MV_XXX_OP_VAL)
     /// @param d the delegate to call when a vmcall exit occurs
     ///
-    VIRTUAL void add_vmcall_handler(const handler_delegate_t &d);
+    VIRTUAL void add_vmcall_handler(
+        uint64_t opcode, const handler_delegate_t &d);
 
     //--------------------------------------------------------------------------
     // Hlt
@@ -204,6 +221,93 @@ public:
     ///
     VIRTUAL vcpu *parent_vcpu() const noexcept;
 
+    /// Load Parent vCPU
+    ///
+    /// Hands control of the physical core back to this vCPU's parent. The
+    /// VMCS of this vCPU stays active on this core (it is only cleared when
+    /// the vCPU is released, see release()), so running this vCPU again on
+    /// the same core only needs a VMPTRLD and a VMRESUME. Once this
+    /// function returns, the caller is expected to finish with one of the
+    /// parent's return_xxx() functions.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns this vCPU's parent vCPU (now loaded)
+    ///
+    VIRTUAL vcpu *load_parent_vcpu();
+
+    /// Release
+    ///
+    /// Clears this vCPU's VMCS so that it can be loaded on another core.
+    /// Must be called on the core that last ran this vCPU (i.e. by its
+    /// parent vCPU). Once released, the VMCS is not loaded on any core, so
+    /// the caller must load another VMCS before it returns to a guest.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void release();
+
+    /// Is Released
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if this vCPU's VMCS is not active on any core
+    ///
+    VIRTUAL bool is_released() const noexcept;
+
+    /// Migrate
+    ///
+    /// Called with this vCPU loaded when it is about to be run by a parent
+    /// vCPU that is different from the last parent that ran it (i.e. the
+    /// host moved the thread that runs this vCPU to another core, after
+    /// releasing it). Updates the parent and ensures the guest's TSC does
+    /// not go backwards.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param parent the new parent vCPU
+    ///
+    VIRTUAL void migrate(gsl::not_null<vcpu *> parent);
+
+    /// Set Runnable TSC
+    ///
+    /// Steal time is the time a vCPU spends outside of guest mode while it
+    /// is runnable. A vCPU becomes runnable again the moment it hands
+    /// control back to its parent (see load_parent_vcpu()), unless it is
+    /// going to sleep (e.g. it yielded until its next event), in which case
+    /// this is called after load_parent_vcpu() with the TSC at which it
+    /// wakes up.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tsc the host TSC at which this vCPU becomes runnable
+    ///
+    VIRTUAL void set_runnable_tsc(uint64_t tsc) noexcept;
+
+    /// Account Steal Time
+    ///
+    /// Called by the parent right before this vCPU is run. Adds the time
+    /// that has passed since this vCPU became runnable to its steal time.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void account_steal_time() noexcept;
+
+    /// Steal Time (TSC)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the total steal time of this vCPU in TSC ticks
+    ///
+    VIRTUAL uint64_t steal_tsc() const noexcept;
+
     /// Prepare For World Switch
     ///
     /// Prepares the vCPU for a world switch. This ensures that portions of
@@ -256,6 +360,82 @@ public:
     ///
     VIRTUAL void return_set_wallclock();
 
+    /// Return (Populate)
+    ///
+    /// Return to the parent vCPU (i.e. resume the parent), and tell the parent
+    /// to add memory to the child's demand pool (see
+    /// domain::demand_pool_add()) and then resume back to the guest
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address the guest touched
+    ///
+    VIRTUAL void return_populate(uint64_t gpa);
+
+    /// Return (Wakeup)
+    ///
+    /// Return to the parent vCPU (i.e. resume the parent), and tell the parent
+    /// to wake up the thread that is running the provided sibling vCPU (which
+    /// is asleep because the sibling yielded, see park()) and then resume
+    /// back to the guest
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpuid the id of the vCPU to wake up
+    ///
+    VIRTUAL void return_wakeup(uint64_t vcpuid);
+
+    /// Set Exit Info
+    ///
+    /// Registers the page that this vCPU reports its exits to. Each time
+    /// this vCPU hands control back to its parent, the reason for the exit
+    /// (along with a set of counters) is written to this page so that the
+    /// parent does not need to issue additional hypercalls to get them.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param exit_info the (mapped) page to report exits to
+    ///
+    VIRTUAL void set_exit_info(
+        bfvmm::x64::unique_map<mv_vp_exit_info_t> &&exit_info);
+
+    /// Record Exit
+    ///
+    /// Writes the provided exit, along with the current host and guest
+    /// TSC, to this vCPU's exit info page (if one has been registered).
+    /// This is called by the parent's return_xxx() functions, so there is
+    /// normally no need to call this directly.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param reason the mv_vp_exit_t to report
+    /// @param arg the argument associated with the exit
+    ///
+    VIRTUAL void record_exit(uint64_t reason, uint64_t arg = 0) noexcept;
+
+    /// VM Exit Log
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the per-exit-reason counters and latency histograms
+    ///     that this vCPU has collected since it was created
+    ///
+    VIRTUAL const mv_vmexit_log_t &vmexit_log_data() const noexcept;
+
+    /// Dump VM Exit Log
+    ///
+    /// Outputs this vCPU's vmexit log to the VMM's debug log
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void dump_vmexit_log() const;
+
     //--------------------------------------------------------------------------
     // Control
     //--------------------------------------------------------------------------
@@ -287,6 +467,244 @@ public:
     ///
     VIRTUAL bool is_killed() const noexcept;
 
+    /// Mark Running
+    ///
+    /// Called by the run_op handler before this vCPU is loaded. Fails if
+    /// the vCPU's domain has been paused, in which case the vCPU must not
+    /// be run.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the vCPU can be run, false otherwise
+    ///
+    VIRTUAL bool mark_running() noexcept;
+
+    /// Mark Stopped
+    ///
+    /// Called once this vCPU has handed control back to its parent (see
+    /// load_parent_vcpu()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void mark_stopped() noexcept;
+
+    /// Is Running
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the vCPU is executing (or is about to),
+    ///     false otherwise
+    ///
+    VIRTUAL bool is_running() const noexcept;
+
+    /// Park
+    ///
+    /// Called when this vCPU yields to its parent because it has nothing to
+    /// do (or because it is waiting for a SIPI). While parked, a vIRQ or an
+    /// INIT/SIPI sent to this vCPU by a sibling also tells the parent to
+    /// wake up the thread that runs this vCPU (see kick()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void park() noexcept;
+
+    /// Unpark
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if this vCPU was parked, false otherwise. Only
+    ///     one caller will see true for each call to park().
+    ///
+    VIRTUAL bool unpark() noexcept;
+
+    /// Sync EPT
+    ///
+    /// Called by the run_op handler before this vCPU is run. If this
+    /// vCPU's domain has taken permissions away from its EPT since this
+    /// vCPU last ran (see domain::ept_generation()), the EPT TLB of the
+    /// current CPU is flushed so that no stale translation is used.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void sync_ept();
+
+    /// EPT Generation
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's EPT generation this vCPU last synced
+    ///     with (see sync_ept())
+    ///
+    VIRTUAL uint64_t ept_generation() const noexcept;
+
+    /// Sync TSC Offset
+    ///
+    /// Called by the run_op handler before this vCPU is run. The TSC offset
+    /// is owned by this vCPU's domain so that all of its vCPUs see the same
+    /// TSC (see domain::tsc_offset()). If a sibling vCPU raised the offset
+    /// since this vCPU last ran, the new offset is written to the VMCS.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void sync_tsc_offset();
+
+    //--------------------------------------------------------------------------
+    // Shared Pages
+    //--------------------------------------------------------------------------
+
+    /// Populate Page
+    ///
+    /// Makes sure that the page of guest RAM that holds gpa is backed by
+    /// memory that only belongs to this vCPU's domain. A page that is still
+    /// shared copy-on-write is copied, and a page that is populated on
+    /// demand (and has not been touched yet) is populated.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to populate
+    /// @return returns true on success, false if the domain's demand pool
+    ///     is empty
+    ///
+    VIRTUAL bool populate_page(uintptr_t gpa);
+
+    /// Map Shared Page
+    ///
+    /// Maps a page of guest RAM that the guest shares with the VMM (e.g. a
+    /// vIRQ page) and records it with the domain (see
+    /// domain::add_shared_page()). The page is populated first (see
+    /// populate_page()), so that the VMM never writes to memory that
+    /// another domain can see. Once the page is no longer used, it should
+    /// be removed using domain::remove_shared_page().
+    ///
+    /// @expects gpa is 4k aligned
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address of the page
+    /// @return returns the mapped page, or an empty map if the page could
+    ///     not be populated because the domain's demand pool is empty
+    ///
+    template<typename T>
+    bfvmm::x64::unique_map<T> map_shared_page(uintptr_t gpa)
+    {
+        if ((gpa & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error("map_shared_page: unaligned gpa");
+        }
+
+        if (!this->populate_page(gpa)) {
+            return bfvmm::x64::unique_map<T>();
+        }
+
+        auto page{this->map_gpa_4k<T>(gpa)};
+        m_domain->add_shared_page(gpa);
+
+        return page;
+    }
+
+    //--------------------------------------------------------------------------
+    // Snapshot
+    //--------------------------------------------------------------------------
+
+    /// Save State
+    ///
+    /// Records the state of this vCPU (registers, VMCS guest state, MSRs,
+    /// x2APIC, vclock and vIRQs) in the provided snapshot. This must be
+    /// called with this vCPU loaded, and the vCPU must not run again
+    /// afterwards (i.e. its domain has been paused). The snapshot's host
+    /// TSC is left to the caller so that all of a domain's vCPUs can share
+    /// the same one.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to save to
+    ///
+    VIRTUAL void save_state(vcpu_snapshot_t &snapshot);
+
+    /// Restore State
+    ///
+    /// Sets the state of this vCPU from the provided snapshot. This must be
+    /// called with this vCPU loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    ///
+    VIRTUAL void restore_state(const vcpu_snapshot_t &snapshot);
+
+    //--------------------------------------------------------------------------
+    // SMP
+    //--------------------------------------------------------------------------
+
+    /// APIC ID
+    ///
+    /// Returns the x2APIC ID of this vCPU. The APIC ID is the order in which
+    /// the vCPU was added to its domain, which means the first vCPU created
+    /// for a domain is the BSP (i.e. APIC ID 0).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the x2APIC ID of this vCPU
+    ///
+    VIRTUAL uint64_t apic_id() const noexcept;
+
+    /// Receive INIT IPI
+    ///
+    /// Places the vCPU in the wait-for-SIPI state. A vCPU in this state is
+    /// not executed by the run_op handler until a SIPI is received. Note that
+    /// this can be called from any vCPU (i.e. this vCPU does not need to be
+    /// loaded).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void receive_init_ipi() noexcept;
+
+    /// Receive Startup IPI
+    ///
+    /// If the vCPU is waiting for a SIPI, records the startup vector and
+    /// marks the vCPU as runnable. The vCPU's state is not updated until
+    /// the next time it is run (see apply_startup_ipi()). Like INIT, this
+    /// can be called from any vCPU.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the SIPI vector (i.e. the start address >> 12)
+    ///
+    VIRTUAL void receive_startup_ipi(uint64_t vector) noexcept;
+
+    /// Is Waiting For SIPI
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the vCPU is waiting for a SIPI, false
+    ///     otherwise
+    ///
+    VIRTUAL bool is_waiting_for_sipi() const noexcept;
+
+    /// Apply Startup IPI
+    ///
+    /// If a SIPI has been received, but not yet applied, resets the vCPU's
+    /// state to the real mode state defined by the SDM for a SIPI. This
+    /// must be called with this vCPU loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void apply_startup_ipi();
+
     //--------------------------------------------------------------------------
     // Virtual IRQs
     //--------------------------------------------------------------------------
@@ -317,6 +735,45 @@ public:
     ///
     VIRTUAL void inject_virtual_interrupt(uint64_t vector);
 
+    /// Post vIRQ
+    ///
+    /// Posts a virtual IRQ to this vCPU from another vCPU (e.g. an IPI from
+    /// a sibling vCPU). Unlike queue_virtual_interrupt, this does not touch
+    /// the VMCS, so this vCPU does not need to be loaded. The vIRQ is queued
+    /// the next time this vCPU is resumed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector to post
+    ///
+    VIRTUAL void post_virtual_interrupt(uint64_t vector);
+
+    /// Is vIRQ Posted
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if a vIRQ has been posted to this vCPU that has
+    ///     not yet been queued, false otherwise
+    ///
+    VIRTUAL bool is_virtual_interrupt_posted() const noexcept;
+
+    /// Kick
+    ///
+    /// Called after a vIRQ (or an INIT/SIPI) has been sent to the provided
+    /// sibling vCPU. If the sibling is parked, the parent of this vCPU is
+    /// told to wake up the thread that runs the sibling the next time this
+    /// vCPU is resumed, so that the vIRQ is not delayed until the sibling's
+    /// yield expires.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param target the vCPU the vIRQ was sent to
+    ///
+    VIRTUAL void kick(gsl::not_null<vcpu *> target);
+
     //--------------------------------------------------------------------------
     // Virtual Clock
     //--------------------------------------------------------------------------
@@ -397,15 +854,35 @@ private:
     void setup_default_controls();
     void setup_default_handlers();
 
+    void detach_from_parent_vcpu() noexcept;
+
 private:
 
     domain *m_domain{};
 
     bool m_killed{};
+    bool m_released{};
+    std::atomic<bool> m_running{};
+    std::atomic<bool> m_parked{};
+    std::atomic<uint64_t> m_ept_generation{};
     vcpu *m_parent_vcpu{};
+    std::atomic<vcpu *> m_child_vcpu{};
+    uint64_t m_last_guest_tsc{};
+    uint64_t m_tsc_offset{};
+    uint64_t m_runnable_tsc{};
+    uint64_t m_steal_tsc{};
+
+    bfvmm::x64::unique_map<mv_vp_exit_info_t> m_exit_info;
+
+    uint64_t m_apic_id{};
+    uint64_t m_sipi_vector{};
+    std::atomic<bool> m_sipi_pending{};
+    std::atomic<bool> m_wait_for_sipi{};
 
 private:
 
+    vmexit_log m_vmexit_log;
+
     exception_handler m_exception_handler;
     external_interrupt_handler m_external_interrupt_handler;
     hlt_handler m_hlt_handler;
@@ -433,6 +910,7 @@ private:
     mtrr_handler m_mtrr_handler;
     x2apic_handler m_x2apic_handler;
 
+    balloon_handler m_balloon_handler;
     vclock_handler m_vclock_handler;
     virq_handler m_virq_handler;
 };
@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef VIRT_BALLOON_INTEL_X64_BOXY_H
+#define VIRT_BALLOON_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+/// Balloon
+///
+/// Provides the guest with a means to give memory back to dom0 (inflate),
+/// to take it back (deflate), and to report large blocks of free memory
+/// (free page reporting). Each request is described by an MDL in the
+/// guest's physical address space. The state of the balloon is stored in
+/// the domain, as it is shared by all of the domain's vCPUs.
+///
+class balloon_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    balloon_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~balloon_handler() = default;
+
+public:
+
+    /// @cond
+
+    void balloon_op__get_target(vcpu *vcpu);
+    void balloon_op__inflate(vcpu *vcpu);
+    void balloon_op__deflate(vcpu *vcpu);
+
+    bool dispatch(vcpu *vcpu);
+
+    /// @endcond
+
+private:
+
+    vcpu *m_vcpu;
+
+public:
+
+    /// @cond
+
+    balloon_handler(balloon_handler &&) = default;
+    balloon_handler &operator=(balloon_handler &&) = default;
+
+    balloon_handler(const balloon_handler &) = delete;
+    balloon_handler &operator=(const balloon_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -24,6 +24,8 @@
 
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 
+#include "../snapshot.h"
+
 // -----------------------------------------------------------------------------
 // Definitions
 // -----------------------------------------------------------------------------
@@ -139,6 +141,35 @@ public:
     ///
     VIRTUAL std::pair<struct timespec, uint64_t> get_guest_wallclock() const;
 
+    //--------------------------------------------------------------------------
+    // Snapshot
+    //--------------------------------------------------------------------------
+
+    /// Save State
+    ///
+    /// Records the guest's next timer event, timer, pvclock and steal pages
+    /// and wall clock in the provided snapshot
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to save to
+    ///
+    VIRTUAL void save_state(vcpu_snapshot_t &snapshot) const;
+
+    /// Restore State
+    ///
+    /// Sets the guest's next timer event, timer, pvclock and steal pages and
+    /// wall clock from the provided snapshot. The pages are mapped (and the
+    /// pvclock page is republished) the next time the vCPU is resumed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    ///
+    VIRTUAL void restore_state(const vcpu_snapshot_t &snapshot);
+
     //--------------------------------------------------------------------------
     // Time Helpers
     //--------------------------------------------------------------------------
@@ -199,6 +230,9 @@ public:
     void vclock_op__set_guest_wallclock_rtc(vcpu *vcpu);
     void vclock_op__set_guest_wallclock_tsc(vcpu *vcpu);
     void vclock_op__get_guest_wallclock(vcpu *vcpu);
+    void vclock_op__set_timer_page(vcpu *vcpu);
+    void vclock_op__set_pvclock_page(vcpu *vcpu);
+    void vclock_op__set_steal_page(vcpu *vcpu);
 
     bool dispatch_dom0(vcpu *vcpu);
     bool dispatch_domU(vcpu *vcpu);
@@ -215,6 +249,21 @@ private:
     void queue_vclock_event();
     void inject_vclock_event();
 
+    bool halt_poll(vcpu *vcpu, uint64_t next_event);
+
+    void map_timer_page();
+    void release_timer_page();
+    void read_timer_page();
+    void write_timer_page();
+
+    void map_pvclock_page();
+    void release_pvclock_page();
+    void publish_pvclock_page();
+
+    void map_steal_page();
+    void release_steal_page();
+    void write_steal_page();
+
 private:
 
     vcpu *m_vcpu;
@@ -222,12 +271,26 @@ private:
     uint64_t m_tsc_freq_khz{};
     uint64_t m_pet_decrement{};
     uint64_t m_next_event_tsc{};
+    uint64_t m_halt_poll_nsec{};
 
     uint64_t m_host_wc_tsc{};
     struct timespec m_host_wc_rtc {};
     uint64_t m_guest_wc_tsc{};
     struct timespec m_guest_wc_rtc {};
 
+    uintptr_t m_timer_page_gpa{};
+    bfvmm::x64::unique_map<vclock_timer_page_t> m_timer_page{};
+
+    uintptr_t m_pvclock_page_gpa{};
+    bfvmm::x64::unique_map<vclock_pvclock_page_t> m_pvclock_page{};
+    uint64_t m_pvclock_tsc_offset{};
+    bool m_pvclock_stale{};
+
+    uintptr_t m_steal_page_gpa{};
+    bfvmm::x64::unique_map<vclock_steal_page_t> m_steal_page{};
+    uint64_t m_steal_page_tsc{};
+    bool m_steal_page_stale{};
+
 public:
 
     /// @cond
@@ -22,9 +22,15 @@
 #ifndef VIRT_VIRQ_INTEL_X64_BOXY_H
 #define VIRT_VIRQ_INTEL_X64_BOXY_H
 
+#include <mutex>
+#include <atomic>
+#include <vector>
+
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 #include <bfvmm/hve/arch/intel_x64/interrupt_queue.h>
 
+#include "../snapshot.h"
+
 // -----------------------------------------------------------------------------
 // Definitions
 // -----------------------------------------------------------------------------
@@ -63,7 +69,9 @@ public:
     /// will actually queue the Hypervisor Callback Vector IRQ into the
     /// guest, and then the guest has to VMCall to this class to get the
     /// vIRQ vector. Also note that all vIRQs are essentially vMSIs so once
-    /// the vIRQ is dequeued, it is gone.
+    /// the vIRQ is dequeued, it is gone. If the guest has registered a vIRQ
+    /// page, the vIRQ is marked as pending in that page instead, and the
+    /// guest does not need to VMCall to get it.
     ///
     /// @expects
     /// @ensures
@@ -83,17 +91,91 @@ public:
     ///
     void inject_virtual_interrupt(uint64_t vector);
 
+    /// Post vIRQ
+    ///
+    /// Posts a virtual IRQ from another vCPU (e.g. an IPI). Since the vCPU
+    /// that owns this handler might be running on a different core, the
+    /// vIRQ is stored in a locked list and queued the next time the vCPU
+    /// is resumed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void post_virtual_interrupt(uint64_t vector);
+
+    /// Is vIRQ Posted
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if a vIRQ has been posted that has not yet been
+    ///     queued, false otherwise
+    ///
+    bool is_virtual_interrupt_posted() const noexcept;
+
+    /// Kick
+    ///
+    /// Records that the provided sibling vCPU was parked when a vIRQ was
+    /// posted to it (see vcpu::kick()). The next time the vCPU that owns
+    /// this handler is resumed, it returns to its parent instead so that
+    /// the parent can wake up the thread that runs the sibling.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpuid the id of the vCPU to wake up
+    ///
+    void kick(uint64_t vcpuid);
+
+    /// Save State
+    ///
+    /// Records the hypervisor callback vector, the vIRQ page and any vIRQs
+    /// that have not been delivered yet in the provided snapshot (vIRQs
+    /// that are pending in the vIRQ page are part of the guest's RAM). The vIRQs are removed
+    /// from this vCPU, so this should only be called on a vCPU that will not
+    /// run again (i.e. a paused vCPU).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to save to
+    ///
+    void save_state(vcpu_snapshot_t &snapshot);
+
+    /// Restore State
+    ///
+    /// Sets the hypervisor callback vector and the vIRQ page from the
+    /// provided snapshot, and posts any vIRQs that were not delivered when
+    /// the snapshot was taken. The vIRQ page is mapped the next time the
+    /// vCPU is resumed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    ///
+    void restore_state(const vcpu_snapshot_t &snapshot);
+
 public:
 
     /// @cond
 
+    void resume_delegate(vcpu_t *vcpu);
+
     void virq_op__set_hypervisor_callback_vector(vcpu *vcpu);
     void virq_op__get_next_virq(vcpu *vcpu);
+    void virq_op__set_virq_page(vcpu *vcpu);
 
     bool dispatch(vcpu *vcpu);
 
     /// @endcond
 
+private:
+
+    bool set_pending(uint64_t vector);
+    void map_virq_page();
+    void release_virq_page();
+
 private:
 
     vcpu *m_vcpu;
@@ -101,6 +183,15 @@ private:
     uint64_t m_hypervisor_callback_vector{};
     bfvmm::intel_x64::interrupt_queue m_interrupt_queue;
 
+    std::mutex m_posted_mutex;
+    std::atomic<bool> m_posted_pending{};
+    std::vector<uint64_t> m_posted;
+
+    std::vector<uint64_t> m_kicks;
+
+    uintptr_t m_virq_page_gpa{};
+    bfvmm::x64::unique_map<virq_page_t> m_virq_page{};
+
 public:
 
     /// @cond
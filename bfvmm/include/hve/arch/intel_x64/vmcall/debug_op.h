@@ -54,6 +54,8 @@ public:
 
 private:
 
+    void dump_vmexit_log(vcpu *vcpu);
+
     bool dispatch(vcpu *vcpu);
 
 private:
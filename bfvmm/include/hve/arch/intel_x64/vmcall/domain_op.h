@@ -56,6 +56,10 @@ private:
 
     void domain_op__create_domain(vcpu *vcpu);
     void domain_op__destroy_domain(vcpu *vcpu);
+    void domain_op__pause_domain(vcpu *vcpu);
+    void domain_op__fork_domain(vcpu *vcpu);
+    void domain_op__fork_memory(vcpu *vcpu);
+    void domain_op__num_vcpus(vcpu *vcpu);
 
     void domain_op__set_uart(vcpu *vcpu);
     void domain_op__set_pt_uart(vcpu *vcpu);
@@ -68,6 +72,23 @@ private:
     void domain_op__donate_page_rw(vcpu *vcpu);
     void domain_op__donate_page_rwe(vcpu *vcpu);
 
+    void domain_op__set_balloon_target(vcpu *vcpu);
+    void domain_op__balloon_reclaim(vcpu *vcpu);
+    void domain_op__balloon_wanted(vcpu *vcpu);
+
+    void domain_op__set_demand_range(vcpu *vcpu);
+    void domain_op__demand_pool_add(vcpu *vcpu);
+
+    void domain_op__e820_map(vcpu *vcpu);
+    void domain_op__read_memory(vcpu *vcpu);
+    void domain_op__write_memory(vcpu *vcpu);
+    void domain_op__export_snapshot(vcpu *vcpu);
+    void domain_op__import_snapshot(vcpu *vcpu);
+
+    void domain_op__enable_dirty_log(vcpu *vcpu);
+    void domain_op__disable_dirty_log(vcpu *vcpu);
+    void domain_op__dirty_log(vcpu *vcpu);
+
     void domain_op__rax(vcpu *vcpu);
     void domain_op__set_rax(vcpu *vcpu);
     void domain_op__rbx(vcpu *vcpu);
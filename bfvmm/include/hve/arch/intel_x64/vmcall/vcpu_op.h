@@ -57,6 +57,8 @@ private:
     void vcpu_op__create_vcpu(vcpu *vcpu);
     void vcpu_op__kill_vcpu(vcpu *vcpu);
     void vcpu_op__destroy_vcpu(vcpu *vcpu);
+    void vcpu_op__vmexit_log(vcpu *vcpu);
+    void vcpu_op__release_vcpu(vcpu *vcpu);
 
     bool dispatch(vcpu *vcpu);
 
@@ -54,6 +54,14 @@ public:
 
 private:
 
+    void initial_reg_val(vcpu *vcpu);
+    void set_initial_reg_val(vcpu *vcpu);
+    void list_of_initial_reg_vals(vcpu *vcpu);
+    void set_list_of_initial_reg_vals(vcpu *vcpu);
+    void map_range(vcpu *vcpu);
+    void unmap_range(vcpu *vcpu);
+    void map_mdl(vcpu *vcpu);
+
     bool dispatch(vcpu *vcpu);
 
 private:
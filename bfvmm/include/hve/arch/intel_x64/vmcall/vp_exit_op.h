@@ -54,6 +54,8 @@ public:
 
 private:
 
+    void set_exit_info(vcpu *vcpu);
+
     bool dispatch(vcpu *vcpu);
 
 private:
@@ -28,6 +28,8 @@
 
 #include <unordered_map>
 
+#include "../snapshot.h"
+
 // -----------------------------------------------------------------------------
 // Definitions
 // -----------------------------------------------------------------------------
@@ -58,6 +60,32 @@ public:
     ///
     ~msr_handler() = default;
 
+public:
+
+    /// Save State
+    ///
+    /// Records the guest's isolated and emulated MSRs in the provided
+    /// snapshot
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to save to
+    ///
+    void save_state(vcpu_snapshot_t &snapshot) const;
+
+    /// Restore State
+    ///
+    /// Sets the guest's isolated and emulated MSRs from the provided
+    /// snapshot
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    ///
+    void restore_state(const vcpu_snapshot_t &snapshot);
+
 public:
 
     /// @cond
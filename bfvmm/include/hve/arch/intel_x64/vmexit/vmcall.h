@@ -24,6 +24,9 @@
 
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 
+#include <array>
+#include <vector>
+
 // -----------------------------------------------------------------------------
 // Definitions
 // -----------------------------------------------------------------------------
@@ -59,12 +62,18 @@ public:
 
     /// Add Handler
     ///
+    /// Each opcode can only have one handler, which is looked up directly
+    /// using the opcode in RAX when a vmcall occurs.
+    ///
     /// @expects
     /// @ensures
     ///
+    /// @param opcode the opcode the handler services. This is either a
+    ///     legacy opcode (e.g. hypercall_enum_run_op) or a MicroV opcode
+    ///     (e.g. MV_DEBUG_OP_VAL)
     /// @param d the handler to call when an exit occurs
     ///
-    void add_handler(const handler_delegate_t &d);
+    void add_handler(uint64_t opcode, const handler_delegate_t &d);
 
 public:
 
@@ -77,7 +86,9 @@ public:
 private:
 
     vcpu *m_vcpu;
-    std::list<handler_delegate_t> m_handlers;
+
+    std::vector<handler_delegate_t> m_handlers;
+    std::array<uint8_t, 0x30> m_table{};
 
 public:
 
@@ -0,0 +1,124 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VMEXIT_LOG_INTEL_X64_BOXY_H
+#define VMEXIT_LOG_INTEL_X64_BOXY_H
+
+#include <bfhypercall.h>
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+class vmexit_log
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this log
+    ///
+    vmexit_log(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~vmexit_log() = default;
+
+    /// Log
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the vmexit log for this vCPU
+    ///
+    const mv_vmexit_log_t &log() const noexcept;
+
+    /// Stop Timer
+    ///
+    /// Records the handling time of the current exit. This is called
+    /// automatically when the vCPU is resumed, and has to be called when
+    /// the vCPU hands control back to its parent instead, as the time spent
+    /// in the parent is not part of the exit.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void stop_timer() noexcept;
+
+    /// Dump
+    ///
+    /// Outputs the vmexit log to the VMM's debug log
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump() const;
+
+    /// @cond
+
+    bool handle_exit(vcpu_t *vcpu);
+    void resume_delegate(vcpu_t *vcpu);
+
+    /// @endcond
+
+private:
+
+    void count_vmcall(uint64_t rax) noexcept;
+
+private:
+
+    vcpu *m_vcpu;
+
+    uint64_t m_exit_reason{};
+    uint64_t m_exit_tsc{};
+
+    alignas(64) mv_vmexit_log_t m_log{};
+
+public:
+
+    /// @cond
+
+    vmexit_log(vmexit_log &&) = default;
+    vmexit_log &operator=(vmexit_log &&) = default;
+
+    vmexit_log(const vmexit_log &) = delete;
+    vmexit_log &operator=(const vmexit_log &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
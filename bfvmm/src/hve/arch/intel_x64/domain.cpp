@@ -22,10 +22,34 @@
 #include <bfdebug.h>
 #include <bfgpalayout.h>
 
+#include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/domain.h>
 
+#include <cstring>
+#include <algorithm>
+
 using namespace bfvmm::intel_x64;
 
+// Note:
+//
+// The EPT page walk (like the host's 4 level paging) is limited to 48 bits
+// of guest physical address space, so this is the most dom0 can map.
+//
+constexpr uint64_t dom0_max_phys_bits = 48;
+
+constexpr uint64_t page_size_4k = 0x1000;
+constexpr uint64_t page_size_2m = 0x200000;
+constexpr uint64_t page_size_1g = 0x40000000;
+
+// Note:
+//
+// A fork shares the parent's memory a batch at a time (see fork_memory()),
+// so that a single vmcall does not keep the core in the VMM for as long as
+// it takes to walk all of the parent's RAM. This is the number of 4k pages
+// that are shared in each batch (i.e. 64 megs).
+//
+constexpr uint64_t fork_batch_pages = 0x4000;
+
 // TODO:
 // - The current domain code is not thread-safe. Some of this will be addressed
 //   once this code is ported to AUTOSAR as you cannot pass a reference to a
@@ -55,21 +79,64 @@ domain::domain(domainid_type domainid) :
 void
 domain::setup_dom0()
 {
-    // TODO:
+    // Note:
     //
-    // This should be changes to fix a couple of issues:
-    // - We should calculate the max physical address range using CPUID
-    //   and fill in EPT all the way to the end of addressable memory.
-    // - We should fill in EPT using 1 gig pages and then when we donate memory
-    //   the logic for doing this should be able to handle 1 gig pages.
-    // - 1 gig pages should be used because VMWare is not supported anways,
-    //   so we should assume that 1 gig page support is required. Once again,
-    //   legacy support is not a focus of this project
+    // dom0 is identity mapped using 1 gig pages all the way to the end of
+    // the physical address space reported by CPUID. 1 gig page support is
+    // assumed as legacy platforms (e.g. VMWare) are not a focus of this
+    // project. 1 gig pages keep the EPT small and the TLB pressure low.
+    // dom0's memory is never unmapped or remapped (memory is only ever
+    // mapped into a domU), so these pages are never split. A live 1 gig
+    // page could not be split without either a window where dom0's own
+    // memory is unmapped, or flushing the EPT TLB of every core.
     //
 
-    ept::identity_map(
-        m_ept_map, MAX_PHYS_ADDR
-    );
+    auto phys_bits =
+        std::min<uint64_t>(::x64::cpuid::addr_size::phys::get(), dom0_max_phys_bits);
+
+    auto end =
+        std::max<uint64_t>(1ULL << phys_bits, MAX_PHYS_ADDR);
+
+    for (uintptr_t gpa = 0; gpa < end; gpa += page_size_1g) {
+        m_ept_map.map_1g(gpa, gpa, ept::mmap::attr_type::read_write_execute);
+    }
+}
+
+void
+domain::split_domU(uintptr_t gpa, uintptr_t page_size)
+{
+    // Note:
+    //
+    // A domU is not identity mapped, so the large page is split using the
+    // host physical address it was already mapped to. Guest RAM is always
+    // mapped read/write/execute by the builder, so the smaller pages are
+    // mapped the same way.
+    //
+
+    auto leaf_size = 1ULL << m_ept_map.entry(gpa).second;
+
+    while (leaf_size > page_size) {
+        auto leaf_gpa = gpa & ~(leaf_size - 1);
+        auto leaf_hpa = m_ept_map.virt_to_phys(leaf_gpa).first;
+        auto next_size = leaf_size == page_size_1g ? page_size_2m : page_size_4k;
+
+        m_ept_map.unmap(leaf_gpa);
+
+        for (uint64_t i = 0; i < leaf_size; i += next_size) {
+            if (next_size == page_size_2m) {
+                m_ept_map.map_2m(
+                    leaf_gpa + i, leaf_hpa + i, ept::mmap::attr_type::read_write_execute
+                );
+            }
+            else {
+                m_ept_map.map_4k(
+                    leaf_gpa + i, leaf_hpa + i, ept::mmap::attr_type::read_write_execute
+                );
+            }
+        }
+
+        leaf_size = next_size;
+    }
 }
 
 void
@@ -121,64 +188,1501 @@ domain::release(uintptr_t gpa)
 { m_ept_map.release(gpa); }
 
 void
-domain::set_uart(uart::port_type uart) noexcept
-{ m_uart_port = uart; }
+domain::unmap_range(uintptr_t gpa, uint64_t size)
+{
+    if (this->id() == 0) {
+        throw std::runtime_error("unmap_range: dom0 not supported");
+    }
+
+    std::lock_guard lock(m_balloon_mutex);
+    this->unmap_leaves(gpa, size);
+}
 
 void
-domain::set_pt_uart(uart::port_type uart) noexcept
-{ m_pt_uart_port = uart; }
+domain::release_range(uintptr_t gpa, uint64_t size)
+{
+    std::lock_guard lock(m_balloon_mutex);
+    this->release_tables(gpa, size);
+}
+
+uint64_t
+domain::ept_hole_size(uintptr_t gpa)
+{
+    // Note:
+    //
+    // The EPT is walked by hand so that we know at which level the walk
+    // for gpa stops. If a PML4, PDPT or PD entry is not present, the whole
+    // range that entry covers (512 gigs, 1 gig or 2 megs) is a hole and can
+    // be skipped at once, instead of one 4k page at a time.
+    //
+
+    auto table_phys = m_ept_map.eptp();
+
+    for (uint64_t shift = 39; shift >= 12; shift -= 9) {
+        auto table = static_cast<uint64_t *>(g_mm->physint_to_virtptr(table_phys));
+        auto entry = table[(gpa >> shift) & 0x1FF];
+
+        if ((entry & 0x7) == 0) {
+            return 1ULL << shift;
+        }
+
+        if (shift == 12 || (entry & 0x80) != 0) {
+            break;
+        }
+
+        table_phys = entry & 0x000FFFFFFFFFF000;
+    }
+
+    return 0;
+}
 
 void
-domain::setup_vcpu_uarts(gsl::not_null<vcpu *> vcpu)
+domain::unmap_leaves(uintptr_t gpa, uint64_t size)
 {
     // Note:
     //
-    // We explicitly disable the 4 default com ports. This is because the
-    // Linux guest will attempt to probe these ports so they need to be
-    // handled by something.
+    // The range is walked one leaf at a time instead of one 4k page at a
+    // time, so a 1 gig or 2 meg page is torn down with a single update. A
+    // large page that is only partially covered by the range is split first
+    // (see split_domU()). Holes in the range are skipped one missing page
+    // table at a time (see ept_hole_size()). The EPT is flushed once at the
+    // end, and only if something was unmapped.
     //
 
-    m_uart_3F8.disable(vcpu);
-    m_uart_2F8.disable(vcpu);
-    m_uart_3E8.disable(vcpu);
-    m_uart_2E8.disable(vcpu);
+    auto end = gpa + size;
+    auto unmapped = false;
 
-    if (m_pt_uart_port == 0) {
-        switch (m_uart_port) {
-            case 0x3F8: m_uart_3F8.enable(vcpu); break;
-            case 0x2F8: m_uart_2F8.enable(vcpu); break;
-            case 0x3E8: m_uart_3E8.enable(vcpu); break;
-            case 0x2E8: m_uart_2E8.enable(vcpu); break;
+    while (gpa < end) {
+        if (auto hole_size = this->ept_hole_size(gpa); hole_size != 0) {
+            gpa = (gpa & ~(hole_size - 1)) + hole_size;
+            continue;
+        }
+
+        uint64_t page_size = 1ULL << m_ept_map.entry(gpa).second;
+
+        if ((gpa & (page_size - 1)) != 0 || gpa + page_size > end) {
+            auto split_size = page_size_4k;
+            if ((gpa & (page_size_2m - 1)) == 0 && gpa + page_size_2m <= end) {
+                split_size = page_size_2m;
+            }
+
+            this->split_domU(gpa, split_size);
+            continue;
+        }
+
+        m_ept_map.unmap(gpa);
+        gpa += page_size;
+
+        unmapped = true;
+    }
+
+    if (unmapped) {
+        this->flush_ept();
+    }
+}
+
+void
+domain::release_tables(uintptr_t gpa, uint64_t size)
+{
+    // Note:
+    //
+    // A page table covers 2 megs, so releasing once per 2 megs is enough to
+    // return every empty page table (and in turn, every empty page directory
+    // and PDPT) in the range back to the heap.
+    //
+
+    auto end = gpa + size;
+
+    for (gpa &= ~(page_size_2m - 1); gpa < end; gpa += page_size_2m) {
+        m_ept_map.release(gpa);
+    }
+}
+
+void
+domain::map_rwe_range(uintptr_t gpa, uintptr_t hpa, uint64_t size)
+{
+    while (size != 0) {
+        auto page_size = page_size_4k;
+
+        for (const auto candidate : {page_size_1g, page_size_2m}) {
+            if (candidate <= size && ((gpa | hpa) & (candidate - 1)) == 0) {
+                page_size = candidate;
+                break;
+            }
+        }
+
+        switch (page_size) {
+            case page_size_1g:
+                this->map_1g_rwe(gpa, hpa);
+                break;
+
+            case page_size_2m:
+                this->map_2m_rwe(gpa, hpa);
+                break;
 
             default:
+                this->map_4k_rwe(gpa, hpa);
                 break;
         };
+
+        gpa += page_size;
+        hpa += page_size;
+        size -= page_size;
     }
-    else {
-        m_pt_uart = std::make_unique<uart>(m_pt_uart_port);
-        m_pt_uart->pass_through(vcpu);
+}
+
+bool
+domain::is_mapped_range(uintptr_t gpa, uint64_t size)
+{
+    auto end = gpa + size;
+
+    while (gpa < end) {
+        try {
+            auto page_size = 1ULL << m_ept_map.entry(gpa).second;
+            gpa = (gpa & ~(page_size - 1)) + page_size;
+        }
+        catch (...) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Balloon
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Removes [gpa, end) from a list of runs, calling func with each piece that
+// was removed. Runs that are only partially covered are trimmed (or split
+// in two) so that only the covered piece is removed.
+//
+template<typename R, typename F>
+static void
+carve_runs(std::vector<R> &runs, uintptr_t gpa, uintptr_t end, F func)
+{
+    std::vector<R> remaining;
+
+    for (const auto &run : runs) {
+        auto run_end = run.gpa + run.size;
+
+        if (run_end <= gpa || run.gpa >= end) {
+            remaining.push_back(run);
+            continue;
+        }
+
+        auto lo = std::max<uintptr_t>(run.gpa, gpa);
+        auto hi = std::min<uintptr_t>(run_end, end);
+
+        auto piece = [&run](uintptr_t piece_gpa, uintptr_t piece_end) {
+            auto ret = run;
+
+            ret.gpa = piece_gpa;
+            ret.hpa = run.hpa + (piece_gpa - run.gpa);
+            ret.size = piece_end - piece_gpa;
+
+            return ret;
+        };
+
+        if (run.gpa < lo) {
+            remaining.push_back(piece(run.gpa, lo));
+        }
+
+        func(piece(lo, hi));
+
+        if (hi < run_end) {
+            remaining.push_back(piece(hi, run_end));
+        }
+    }
+
+    runs = std::move(remaining);
+}
+
+template<typename R>
+static void
+drain_runs(std::vector<R> &runs, mv_mdl_t &mdl, std::vector<R> *moved)
+{
+    mdl.num_entries = 0;
+    mdl.next = 0;
+
+    while (!runs.empty() && mdl.num_entries < MV_MDL_MAP_MAX_NUM_ENTRIES) {
+        const auto &run = runs.back();
+
+        mdl.entries[mdl.num_entries].gpa = run.gpa;
+        mdl.entries[mdl.num_entries].size = run.size;
+        mdl.entries[mdl.num_entries].flags = 0;
+        mdl.num_entries++;
+
+        if (moved != nullptr) {
+            moved->push_back(run);
+        }
+
+        runs.pop_back();
     }
 }
 
 uint64_t
-domain::dump_uart(const gsl::span<char> &buffer)
+domain::balloon_target() const noexcept
+{ return m_balloon_target; }
+
+void
+domain::set_balloon_target(uint64_t pages) noexcept
+{ m_balloon_target = pages; }
+
+void
+domain::balloon_inflate(uintptr_t gpa, uint64_t size)
 {
-    if (m_pt_uart) {
-        m_pt_uart->dump(buffer);
+    std::lock_guard lock(m_balloon_mutex);
+
+    auto end = gpa + size;
+    std::vector<balloon_run_t> runs;
+
+    for (const auto &[page, count] : m_shared_pages) {
+        if (page >= gpa && page < end) {
+            throw std::runtime_error("balloon_inflate: range holds a shared page");
+        }
     }
-    else {
-        switch (m_uart_port) {
-            case 0x3F8: return m_uart_3F8.dump(buffer);
-            case 0x2F8: return m_uart_2F8.dump(buffer);
-            case 0x3E8: return m_uart_3E8.dump(buffer);
-            case 0x2E8: return m_uart_2E8.dump(buffer);
 
-            default:
-                break;
-        };
+    // Note:
+    //
+    // The host physical addresses are collected before anything is
+    // unmapped, as they are needed to hand the memory back to either the
+    // guest or dom0 later. Holes in the range (e.g. memory that is already
+    // in the balloon) are skipped. A large page that is only partially
+    // covered by the range is split by unmap_leaves(), so only the covered
+    // part is recorded here.
+    //
+
+    for (auto next = gpa; next < end;) {
+        if (auto hole_size = this->ept_hole_size(next); hole_size != 0) {
+            next = (next & ~(hole_size - 1)) + hole_size;
+            continue;
+        }
+
+        auto ret = m_ept_map.virt_to_phys(next);
+
+        auto hpa = ret.first;
+        auto page_size = 1ULL << ret.second;
+
+        // Note:
+        //
+        // A shared (copy-on-write) page does not belong to the guest, so it
+        // cannot be handed back to the guest or to dom0. It is treated as
+        // if dom0 had already reclaimed it, so the guest gets a new page if
+        // it ever wants it back.
+        //
+
+        if (auto iter = m_cow_pages.find(next); iter != m_cow_pages.end()) {
+            m_balloon_reclaimed.push_back({next, hpa, page_size_4k});
+            m_cow_pages.erase(iter);
+
+            next += page_size_4k;
+            continue;
+        }
+
+        auto leaf_end = (next & ~(page_size - 1)) + page_size;
+        auto piece = std::min<uintptr_t>(leaf_end, end) - next;
+
+        if (!runs.empty() &&
+            runs.back().gpa + runs.back().size == next &&
+            runs.back().hpa + runs.back().size == hpa) {
+            runs.back().size += piece;
+        }
+        else {
+            runs.push_back({next, hpa, piece});
+        }
+
+        next += piece;
     }
 
-    return 0;
+    // Note:
+    //
+    // The memory is held until every vCPU of this domain has flushed the
+    // translations it might still have for the range (see
+    // balloon_reclaim()). The page tables are not released, as the guest
+    // is likely to take the range back at some point, and they could only
+    // be freed once no vCPU can walk them anymore either.
+    //
+
+    this->unmap_leaves(gpa, size);
+    this->mark_dirty(gpa, size);
+
+    for (auto &run : runs) {
+        run.ept_generation = m_ept_generation;
+    }
+
+    m_balloon_held.insert(m_balloon_held.end(), runs.begin(), runs.end());
+}
+
+bool
+domain::balloon_deflate(uintptr_t gpa, uint64_t size)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    auto end = gpa + size;
+
+    carve_runs(m_balloon_held, gpa, end, [&](const auto &run) {
+        this->map_rwe_range(run.gpa, run.hpa, run.size);
+        this->mark_dirty(run.gpa, run.size);
+    });
+
+    carve_runs(m_balloon_reclaimed, gpa, end, [&](const auto &run) {
+        m_balloon_wanted.push_back(run);
+    });
+
+    return this->is_mapped_range(gpa, size);
+}
+
+void
+domain::balloon_reclaim(mv_mdl_t &mdl)
+{
+    auto synced = this->synced_ept_generation();
+    std::lock_guard lock(m_balloon_mutex);
+
+    // Note:
+    //
+    // Memory that one of the vCPUs might still reach through a stale
+    // translation is kept out of the MDL (and reported on a later call),
+    // as dom0 is free to hand the memory to someone else once reported.
+    //
+
+    auto unsynced = std::stable_partition(
+        m_balloon_held.begin(), m_balloon_held.end(), [&](const auto &run) {
+            return run.ept_generation <= synced;
+        }
+    );
+
+    std::vector<balloon_run_t> pending(unsynced, m_balloon_held.end());
+    m_balloon_held.erase(unsynced, m_balloon_held.end());
+
+    drain_runs(m_balloon_held, mdl, &m_balloon_reclaimed);
+    m_balloon_held.insert(m_balloon_held.end(), pending.begin(), pending.end());
+}
+
+void
+domain::balloon_wanted(mv_mdl_t &mdl)
+{
+    std::lock_guard lock(m_balloon_mutex);
+    drain_runs<balloon_run_t>(m_balloon_wanted, mdl, nullptr);
+}
+
+// -----------------------------------------------------------------------------
+// Demand Paging
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The demand state shares the balloon's lock as a page that the guest gave
+// back using its balloon is mapped back in place when it is touched (i.e.
+// a reported free page that is used again without being deflated first).
+//
+
+void
+domain::set_demand_range(uintptr_t gpa, uint64_t size)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    if (((gpa | size) & (page_size_4k - 1)) != 0) {
+        throw std::runtime_error("set_demand_range: unaligned range");
+    }
+
+    m_demand_start = gpa;
+    m_demand_end = gpa + size;
+}
+
+void
+domain::demand_pool_add(uintptr_t hpa, uint64_t size)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    if (((hpa | size) & (page_size_4k - 1)) != 0) {
+        throw std::runtime_error("demand_pool_add: unaligned range");
+    }
+
+    for (auto end = hpa + size; hpa < end;) {
+        if ((hpa & (page_size_2m - 1)) == 0 && end - hpa >= page_size_2m) {
+            m_demand_pool_2m.push_back(hpa);
+            hpa += page_size_2m;
+        }
+        else {
+            m_demand_pool_4k.push_back(hpa);
+            hpa += page_size_4k;
+        }
+    }
+}
+
+bool
+domain::is_demand_gpa(uintptr_t gpa)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    // Note:
+    //
+    // When a guest has RAM above 4GB, its demand range might also cover
+    // the reserved region below 4GB, which must never be populated.
+    //
+
+    if (gpa >= m_demand_start && gpa < m_demand_end) {
+        return this->is_ram_gpa(gpa);
+    }
+
+    auto contains = [&](const auto &run) {
+        return gpa >= run.gpa && gpa < run.gpa + run.size;
+    };
+
+    return
+        std::any_of(m_balloon_held.begin(), m_balloon_held.end(), contains) ||
+        std::any_of(m_balloon_reclaimed.begin(), m_balloon_reclaimed.end(), contains);
+}
+
+bool
+domain::demand_populate(uintptr_t gpa)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    auto page_4k = gpa & ~(page_size_4k - 1);
+    auto page_2m = gpa & ~(page_size_2m - 1);
+
+    // Note:
+    //
+    // Another vCPU might have populated this page while we were waiting on
+    // the lock, in which case there is nothing left to do.
+    //
+
+    if (this->is_mapped_range(page_4k, page_size_4k)) {
+        return true;
+    }
+
+    auto remapped = false;
+
+    carve_runs(m_balloon_held, page_4k, page_4k + page_size_4k, [&](const auto &run) {
+        this->map_4k_rwe(run.gpa, run.hpa);
+        this->mark_dirty(run.gpa, run.size);
+        remapped = true;
+    });
+
+    if (remapped) {
+        return true;
+    }
+
+    carve_runs(m_balloon_reclaimed, page_4k, page_4k + page_size_4k, [](const auto &) { });
+
+    if (!m_demand_pool_2m.empty() &&
+        page_2m >= m_demand_start && page_2m + page_size_2m <= m_demand_end &&
+        this->is_ram_gpa(page_2m) && this->is_ram_gpa(page_2m + page_size_2m - 1) &&
+        m_demand_populated_2m.count(page_2m) == 0) {
+
+        this->map_2m_rwe(page_2m, m_demand_pool_2m.back());
+        this->mark_dirty(page_2m, page_size_2m);
+
+        m_demand_pool_2m.pop_back();
+        m_demand_populated_2m.insert(page_2m);
+
+        return true;
+    }
+
+    uintptr_t hpa;
+    if (!this->demand_pool_take_4k(hpa)) {
+        return false;
+    }
+
+    this->map_4k_rwe(page_4k, hpa);
+    this->mark_dirty(page_4k, page_size_4k);
+
+    m_demand_populated_2m.insert(page_2m);
+
+    return true;
+}
+
+bool
+domain::demand_pool_take_4k(uintptr_t &hpa)
+{
+    if (m_demand_pool_4k.empty()) {
+        if (m_demand_pool_2m.empty()) {
+            return false;
+        }
+
+        auto hpa_2m = m_demand_pool_2m.back();
+        m_demand_pool_2m.pop_back();
+
+        for (uint64_t i = 0; i < page_size_2m; i += page_size_4k) {
+            m_demand_pool_4k.push_back(hpa_2m + i);
+        }
+    }
+
+    hpa = m_demand_pool_4k.back();
+    m_demand_pool_4k.pop_back();
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Copy-On-Write
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Shared pages are always mapped using 4k pages so that a write only ever
+// copies the page that was written to. Like the demand state, the list of
+// shared pages is protected by the balloon's lock, as the balloon has to
+// make sure that shared memory is never handed back to the guest writable.
+//
+
+void
+domain::map_4k_cow(uintptr_t gpa, uintptr_t hpa)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    if (this->id() == 0) {
+        throw std::runtime_error("map_4k_cow: dom0 not supported");
+    }
+
+    m_ept_map.map_4k(gpa, hpa, ept::mmap::attr_type::read_execute);
+    m_cow_pages[gpa & ~(page_size_4k - 1)] = hpa;
+}
+
+bool
+domain::is_cow_gpa(uintptr_t gpa)
+{
+    std::lock_guard lock(m_balloon_mutex);
+    return m_cow_pages.count(gpa & ~(page_size_4k - 1)) != 0;
+}
+
+void
+domain::cow_remap(uintptr_t gpa, uintptr_t hpa)
+{
+    // Note:
+    //
+    // The shared page is still mapped (read/execute) on every other vCPU
+    // of this domain, so the leaf is swapped with a single write (see
+    // write_4k_leaf()) and the page is never seen as not present. The
+    // other vCPUs pick up the new leaf the next time they fault on the
+    // page, or when they flush their EPT TLB (see flush_ept()).
+    //
+
+    this->write_4k_leaf(gpa, hpa, ept::mmap::attr_type::read_write_execute);
+
+    this->mark_dirty(gpa, page_size_4k);
+    this->flush_ept();
+}
+
+void
+domain::write_4k_leaf(uintptr_t gpa, uintptr_t hpa, ept::mmap::attr_type attr)
+{
+    // Note:
+    //
+    // The leaf is updated in place with a single 64 bit write instead of
+    // being unmapped and mapped again, so that the page is never seen as
+    // not present by another vCPU in between. Only the address and the
+    // access bits are replaced. The memory type (and the other bits the
+    // mmap set) are kept as is.
+    //
+
+    constexpr const auto addr_mask = 0x000FFFFFFFFFF000ULL;
+    constexpr const auto rwx_mask = 0x7ULL;
+
+    uint64_t rwx = 0;
+
+    switch (attr) {
+        case ept::mmap::attr_type::read_only:
+            rwx = 0x1;
+            break;
+
+        case ept::mmap::attr_type::read_write:
+            rwx = 0x3;
+            break;
+
+        case ept::mmap::attr_type::read_execute:
+            rwx = 0x5;
+            break;
+
+        case ept::mmap::attr_type::read_write_execute:
+            rwx = 0x7;
+            break;
+
+        default:
+            throw std::runtime_error("write_4k_leaf: unsupported attr");
+    };
+
+    auto [entry, shift] = m_ept_map.entry(gpa);
+
+    if (shift != 12) {
+        throw std::runtime_error("write_4k_leaf: gpa is not mapped using a 4k page");
+    }
+
+    auto val = (entry.get() & ~(addr_mask | rwx_mask)) | (hpa & addr_mask) | rwx;
+    __atomic_store_n(&entry.get(), val, __ATOMIC_SEQ_CST);
+}
+
+bool
+domain::is_accessible(uintptr_t gpa, uint64_t access)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    if (this->ept_hole_size(gpa) != 0) {
+        return false;
+    }
+
+    auto entry = m_ept_map.entry(gpa).first.get();
+    return (entry & access) == access;
+}
+
+// -----------------------------------------------------------------------------
+// Dirty Logging
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Writes are tracked by write protecting guest RAM, one 4k page at a time,
+// and recording the first write to each page from the EPT violation
+// handler. Like the demand state, the dirty log is protected by the
+// balloon's lock, as populating, sharing and ballooning memory all change
+// the guest's RAM without the guest writing to it, and each of these marks
+// the affected pages as dirty.
+//
+// Taking away write access has to be flushed from every CPU that might
+// have cached the old translation. This CPU is flushed right away, and each
+// vCPU flushes the CPU it runs on the next time it is run (see
+// vcpu::sync_ept()). A vCPU that is running while the dirty log is read can
+// keep writing through a stale translation until its next VM exit, so the
+// pages reported while any vCPU is running are reported a second time the
+// next time the dirty log is read. Once the domain is paused, the dirty log
+// is exact.
+//
+
+static bool
+test_bit(const std::vector<uint64_t> &bitmap, uint64_t index) noexcept
+{
+    if (index / 64 >= bitmap.size()) {
+        return false;
+    }
+
+    return (bitmap[index / 64] & (1ULL << (index % 64))) != 0;
+}
+
+static void
+set_bit(std::vector<uint64_t> &bitmap, uint64_t index, bool val) noexcept
+{
+    if (index / 64 >= bitmap.size()) {
+        return;
+    }
+
+    if (val) {
+        bitmap[index / 64] |= 1ULL << (index % 64);
+    }
+    else {
+        bitmap[index / 64] &= ~(1ULL << (index % 64));
+    }
+}
+
+void
+domain::enable_dirty_log()
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    if (this->id() == 0) {
+        throw std::runtime_error("enable_dirty_log: dom0 not supported");
+    }
+
+    if (m_dirty_log) {
+        return;
+    }
+
+    uintptr_t end = 0;
+    for (uint64_t i = 0; i < m_e820_map.num_entries; i++) {
+        const auto &entry = m_e820_map.entries[i];
+
+        if (entry.flags == MV_GPA_FLAG_CONVENTIONAL_MEM) {
+            end = std::max<uintptr_t>(end, entry.gpa + entry.size);
+        }
+    }
+
+    auto num_words = ((end / page_size_4k) + 63) / 64;
+
+    m_dirty_bitmap.assign(num_words, 0);
+    m_dirty_pending.assign(num_words, 0);
+
+    this->remap_ram(ept::mmap::attr_type::read_execute);
+    m_dirty_log = true;
+
+    this->flush_ept();
+}
+
+void
+domain::disable_dirty_log()
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    if (!m_dirty_log) {
+        return;
+    }
+
+    this->remap_ram(ept::mmap::attr_type::read_write_execute);
+    m_dirty_log = false;
+
+    m_dirty_bitmap.clear();
+    m_dirty_bitmap.shrink_to_fit();
+    m_dirty_pending.clear();
+    m_dirty_pending.shrink_to_fit();
+}
+
+bool
+domain::dirty_log_write(uintptr_t gpa)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    auto page = gpa & ~(page_size_4k - 1);
+
+    // Note:
+    //
+    // The builder always maps guest RAM read/write/execute, so a write
+    // that faults on guest RAM that is mapped (and is not shared) was
+    // either write protected by the dirty log, or hit a translation that
+    // was cached before the dirty log was disabled. Either way, there is
+    // no need to flush the TLB, as an EPT violation flushes any cached
+    // translation for the address that faulted.
+    //
+
+    uintptr_t hpa;
+    if (!this->is_ram_gpa(page) || !this->gpa_to_hpa(page, hpa)) {
+        return false;
+    }
+
+    if (m_dirty_log) {
+        this->remap_4k(page, ept::mmap::attr_type::read_write_execute);
+        this->mark_dirty(page, page_size_4k);
+    }
+
+    return true;
+}
+
+void
+domain::dirty_log(uintptr_t gpa, gsl::span<uint64_t> bitmap)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    if (!m_dirty_log) {
+        throw std::runtime_error("dirty_log: dirty log is not enabled");
+    }
+
+    if ((gpa & (page_size_4k - 1)) != 0) {
+        throw std::runtime_error("dirty_log: unaligned gpa");
+    }
+
+    std::vector<uint64_t> reported;
+
+    for (std::ptrdiff_t i = 0; i < bitmap.size(); i++) {
+        bitmap[i] = 0;
+
+        for (uint64_t bit = 0; bit < 64; bit++) {
+            auto page = gpa + (((static_cast<uint64_t>(i) * 64) + bit) * page_size_4k);
+            auto index = page / page_size_4k;
+
+            auto dirty = test_bit(m_dirty_bitmap, index);
+            if (dirty || test_bit(m_dirty_pending, index) || m_shared_pages.count(page) != 0) {
+                bitmap[i] |= 1ULL << bit;
+            }
+
+            set_bit(m_dirty_pending, index, false);
+
+            if (dirty) {
+                set_bit(m_dirty_bitmap, index, false);
+                this->remap_4k(page, ept::mmap::attr_type::read_execute);
+
+                reported.push_back(index);
+            }
+        }
+    }
+
+    if (reported.empty()) {
+        return;
+    }
+
+    this->flush_ept();
+
+    auto running = false;
+    this->foreach_vcpu([&](auto vcpu) {
+        running = running || vcpu->is_running();
+    });
+
+    if (running) {
+        for (const auto index : reported) {
+            set_bit(m_dirty_pending, index, true);
+        }
+    }
+}
+
+uint64_t
+domain::ept_generation() const noexcept
+{ return m_ept_generation; }
+
+uint64_t
+domain::synced_ept_generation()
+{
+    // Note:
+    //
+    // A vCPU is marked as running before it reads the EPT generation (see
+    // run_op_handler::dispatch()), and the generation is incremented before
+    // we check if a vCPU is running, so a vCPU that is not running here
+    // will see the current generation before it runs again.
+    //
+
+    auto generation = m_ept_generation.load();
+
+    this->foreach_vcpu([&](auto vcpu) {
+        if (vcpu->is_running()) {
+            generation = std::min(generation, vcpu->ept_generation());
+        }
+    });
+
+    return generation;
+}
+
+// -----------------------------------------------------------------------------
+// TSC Offset
+// -----------------------------------------------------------------------------
+
+uint64_t
+domain::tsc_offset() const noexcept
+{ return m_tsc_offset; }
+
+void
+domain::set_tsc_offset(uint64_t offset) noexcept
+{ m_tsc_offset = offset; }
+
+void
+domain::raise_tsc_offset(uint64_t guest_tsc) noexcept
+{
+    auto offset = m_tsc_offset.load();
+
+    while (true) {
+        auto current_guest_tsc = ::x64::tsc::get() + offset;
+
+        if (current_guest_tsc >= guest_tsc) {
+            return;
+        }
+
+        auto new_offset = offset + (guest_tsc - current_guest_tsc);
+
+        if (m_tsc_offset.compare_exchange_weak(offset, new_offset)) {
+            return;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Shared Pages
+// -----------------------------------------------------------------------------
+
+void
+domain::add_shared_page(uintptr_t gpa)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    uintptr_t hpa;
+    auto page = gpa & ~(page_size_4k - 1);
+
+    if (!this->is_ram_gpa(page) || m_cow_pages.count(page) != 0 || !this->gpa_to_hpa(page, hpa)) {
+        throw std::runtime_error("add_shared_page: page is not private guest RAM");
+    }
+
+    m_shared_pages[page]++;
+}
+
+void
+domain::remove_shared_page(uintptr_t gpa)
+{
+    std::lock_guard lock(m_balloon_mutex);
+
+    auto iter = m_shared_pages.find(gpa & ~(page_size_4k - 1));
+    if (iter == m_shared_pages.end()) {
+        return;
+    }
+
+    if (--iter->second == 0) {
+        m_shared_pages.erase(iter);
+    }
+}
+
+bool
+domain::claim_pvclock_page(vcpuid::type id) noexcept
+{
+    vcpuid::type owner = INVALID_VCPUID;
+
+    if (m_pvclock_owner.compare_exchange_strong(owner, id)) {
+        return true;
+    }
+
+    return owner == id;
+}
+
+void
+domain::release_pvclock_page(vcpuid::type id) noexcept
+{ m_pvclock_owner.compare_exchange_strong(id, INVALID_VCPUID); }
+
+bool
+domain::is_ram_gpa(uintptr_t gpa) const noexcept
+{
+    for (uint64_t i = 0; i < m_e820_map.num_entries; i++) {
+        const auto &entry = m_e820_map.entries[i];
+
+        if (entry.flags == MV_GPA_FLAG_CONVENTIONAL_MEM &&
+            gpa >= entry.gpa && gpa < entry.gpa + entry.size) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+domain::remap_4k(uintptr_t gpa, ept::mmap::attr_type attr)
+{
+    uintptr_t hpa;
+
+    if (m_cow_pages.count(gpa) != 0 || !this->gpa_to_hpa(gpa, hpa)) {
+        return;
+    }
+
+    this->split_domU(gpa, page_size_4k);
+    this->write_4k_leaf(gpa, hpa, attr);
+}
+
+void
+domain::remap_ram(ept::mmap::attr_type attr)
+{
+    // Note:
+    //
+    // Like fork(), 2M regions of the demand range that the guest never
+    // touched are skipped as a whole, as they cannot have anything mapped
+    // in them (and will be marked dirty once they are populated).
+    //
+
+    for (uint64_t i = 0; i < m_e820_map.num_entries; i++) {
+        const auto &entry = m_e820_map.entries[i];
+
+        if (entry.flags != MV_GPA_FLAG_CONVENTIONAL_MEM) {
+            continue;
+        }
+
+        for (auto gpa = entry.gpa; gpa < entry.gpa + entry.size;) {
+            auto page_2m = gpa & ~(page_size_2m - 1);
+
+            if (gpa >= m_demand_start && gpa < m_demand_end &&
+                m_demand_populated_2m.count(page_2m) == 0) {
+                gpa = page_2m + page_size_2m;
+                continue;
+            }
+
+            this->remap_4k(gpa, attr);
+            gpa += page_size_4k;
+        }
+    }
+}
+
+void
+domain::mark_dirty(uintptr_t gpa, uint64_t size)
+{
+    if (!m_dirty_log) {
+        return;
+    }
+
+    for (auto end = gpa + size; gpa < end; gpa += page_size_4k) {
+        set_bit(m_dirty_bitmap, gpa / page_size_4k, true);
+    }
+}
+
+void
+domain::flush_ept()
+{
+    ::intel_x64::vmx::invept_global();
+    ++m_ept_generation;
+}
+
+// -----------------------------------------------------------------------------
+// Fork
+// -----------------------------------------------------------------------------
+
+void
+domain::pause() noexcept
+{ m_paused = true; }
+
+bool
+domain::is_paused() const noexcept
+{ return m_paused; }
+
+void
+domain::set_snapshot(std::vector<vcpu_snapshot_t> &&snapshot)
+{ m_snapshot = std::move(snapshot); }
+
+bool
+domain::has_snapshot() const noexcept
+{ return !m_snapshot.empty(); }
+
+void
+domain::fork(gsl::not_null<domain *> parent)
+{
+    if (!parent->is_paused() || !parent->has_snapshot()) {
+        throw std::runtime_error("fork: parent has not been paused");
+    }
+
+    if (this->id() == 0 || parent->id() == 0) {
+        throw std::runtime_error("fork: dom0 not supported");
+    }
+
+    std::lock_guard lock(m_balloon_mutex);
+    std::lock_guard parent_lock(parent->m_balloon_mutex);
+
+    m_e820_map = parent->m_e820_map;
+    m_uart_port = parent->m_uart_port;
+
+    m_demand_start = parent->m_demand_start;
+    m_demand_end = parent->m_demand_end;
+    m_demand_populated_2m = parent->m_demand_populated_2m;
+
+    // Note:
+    //
+    // Memory the parent gave back using its balloon is not mapped, and its
+    // backing might not even belong to the parent anymore, so it is
+    // treated as memory that dom0 has reclaimed. If the child touches it
+    // (or deflates it), it gets a new page.
+    //
+
+    m_balloon_reclaimed = parent->m_balloon_reclaimed;
+    m_balloon_reclaimed.insert(
+        m_balloon_reclaimed.end(),
+        parent->m_balloon_held.begin(),
+        parent->m_balloon_held.end());
+
+    // Note:
+    //
+    // The parent's memory is shared by fork_memory(), which the caller
+    // keeps calling until it is done. Only the parent's ID is kept, so
+    // that if the parent is destroyed in the meantime, fork_memory()
+    // fails instead of walking a domain that no longer exists.
+    //
+
+    m_fork_parent = parent->id();
+    m_fork_entry = 0;
+    m_fork_gpa = 0;
+
+    this->set_fork_snapshot(parent->m_snapshot);
+}
+
+bool
+domain::fork_memory()
+{
+    if (m_fork_parent == INVALID_DOMAINID) {
+        throw std::runtime_error("fork_memory: domain is not being forked");
+    }
+
+    auto parent = get_domain(m_fork_parent);
+
+    std::lock_guard lock(m_balloon_mutex);
+    std::lock_guard parent_lock(parent->m_balloon_mutex);
+
+    // Note:
+    //
+    // Only guest RAM is shared. Reserved memory (i.e. the boot params,
+    // command line and initial GDT) is only used while the guest boots,
+    // and as the parent has already booted, the child does not need it.
+    // 2M regions of the demand range that the parent never touched, and
+    // holes in the parent's EPT, are skipped as a whole, as they cannot
+    // have anything mapped in them.
+    //
+    // The parent's EPT is looked up once per leaf, but each 4k page of
+    // the leaf is mapped on its own. Shared memory is copied on the first
+    // write, and copying a whole 2M (or 1G) page because the guest wrote
+    // to a single 4k page of it would cost far more than the larger leaf
+    // saves (and would take up to 512 times more memory from the demand
+    // pool).
+    //
+
+    auto budget = fork_batch_pages;
+
+    for (; m_fork_entry < m_e820_map.num_entries; m_fork_entry++) {
+        const auto &entry = m_e820_map.entries[m_fork_entry];
+
+        if (entry.flags != MV_GPA_FLAG_CONVENTIONAL_MEM) {
+            continue;
+        }
+
+        auto end = entry.gpa + entry.size;
+        auto gpa = std::max<uintptr_t>(entry.gpa, m_fork_gpa);
+
+        while (gpa < end) {
+            if (budget == 0) {
+                m_fork_gpa = gpa;
+                return true;
+            }
+
+            auto page_2m = gpa & ~(page_size_2m - 1);
+
+            if (gpa >= m_demand_start && gpa < m_demand_end &&
+                m_demand_populated_2m.count(page_2m) == 0) {
+                gpa = page_2m + page_size_2m;
+                continue;
+            }
+
+            if (auto hole_size = parent->ept_hole_size(gpa); hole_size != 0) {
+                gpa = (gpa & ~(hole_size - 1)) + hole_size;
+                continue;
+            }
+
+            auto leaf_size = 1ULL << parent->m_ept_map.entry(gpa).second;
+            auto leaf_gpa = gpa & ~(leaf_size - 1);
+            auto leaf_hpa = parent->m_ept_map.virt_to_phys(leaf_gpa).first;
+            auto leaf_end = std::min<uintptr_t>(leaf_gpa + leaf_size, end);
+
+            for (; gpa < leaf_end && budget != 0; gpa += page_size_4k, budget--) {
+                auto hpa = leaf_hpa + (gpa - leaf_gpa);
+
+                m_ept_map.map_4k(gpa, hpa, ept::mmap::attr_type::read_execute);
+                m_cow_pages[gpa] = hpa;
+            }
+        }
+
+        m_fork_gpa = 0;
+    }
+
+    m_fork_parent = INVALID_DOMAINID;
+    return false;
+}
+
+const vcpu_snapshot_t *
+domain::fork_snapshot(uint64_t apic_id) const noexcept
+{
+    for (const auto &snapshot : m_fork_snapshot) {
+        if (snapshot.apic_id == apic_id) {
+            return &snapshot;
+        }
+    }
+
+    return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+// Save / Restore
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// An exported snapshot is a list of 64bit words. It starts with a version
+// and the size of the fixed part of a vCPU snapshot, so that a snapshot
+// that was exported by a different build of the VMM is rejected instead of
+// being misread. The words that follow are the state of the emulated UART,
+// the number of vCPUs and, for each vCPU, the fixed part of its snapshot
+// followed by each of its variable length lists (the length comes first).
+//
+constexpr const uint64_t snapshot_version = 5;
+
+template<typename T>
+static void
+export_words(std::vector<uint64_t> &words, const T &val)
+{
+    auto index = words.size();
+    words.resize(index + ((sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t)));
+
+    std::memcpy(&words.at(index), &val, sizeof(T));
+}
+
+template<typename T>
+static void
+import_words(gsl::span<const uint64_t> words, std::ptrdiff_t &index, T &val)
+{
+    auto num = gsl::narrow_cast<std::ptrdiff_t>(
+        (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+
+    if (index + num > words.size()) {
+        throw std::runtime_error("import_snapshot: snapshot is truncated");
+    }
+
+    std::memcpy(&val, &words.at(index), sizeof(T));
+    index += num;
+}
+
+static void
+export_map(std::vector<uint64_t> &words, const std::unordered_map<uint32_t, uint64_t> &map)
+{
+    words.push_back(map.size());
+
+    for (const auto &[key, val] : map) {
+        words.push_back(key);
+        words.push_back(val);
+    }
+}
+
+static void
+import_map(
+    gsl::span<const uint64_t> words, std::ptrdiff_t &index,
+    std::unordered_map<uint32_t, uint64_t> &map)
+{
+    uint64_t num = 0;
+    import_words(words, index, num);
+
+    for (uint64_t i = 0; i < num; i++) {
+        uint64_t key = 0;
+        uint64_t val = 0;
+
+        import_words(words, index, key);
+        import_words(words, index, val);
+
+        map[gsl::narrow<uint32_t>(key)] = val;
+    }
+}
+
+std::vector<uint64_t>
+domain::export_snapshot()
+{
+    if (!this->is_paused() || !this->has_snapshot()) {
+        throw std::runtime_error("export_snapshot: domain has not been paused");
+    }
+
+    std::vector<uint64_t> words;
+
+    words.push_back(snapshot_version);
+    words.push_back(sizeof(vcpu_snapshot_fixed_t));
+
+    uart_snapshot_t uart_snapshot{};
+    if (auto emulated_uart = this->emulated_uart()) {
+        emulated_uart->save_state(uart_snapshot);
+    }
+
+    export_words(words, uart_snapshot);
+    words.push_back(m_snapshot.size());
+
+    for (const auto &snapshot : m_snapshot) {
+        export_words(words, static_cast<const vcpu_snapshot_fixed_t &>(snapshot));
+        export_map(words, snapshot.msrs);
+        export_map(words, snapshot.x2apic);
+
+        words.push_back(snapshot.virqs.size());
+        words.insert(words.end(), snapshot.virqs.begin(), snapshot.virqs.end());
+    }
+
+    return words;
+}
+
+void
+domain::import_snapshot(gsl::span<const uint64_t> words)
+{
+    if (this->id() == 0) {
+        throw std::runtime_error("import_snapshot: dom0 not supported");
+    }
+
+    if (this->num_vcpus() != 0) {
+        throw std::runtime_error("import_snapshot: domain already has vCPUs");
+    }
+
+    std::ptrdiff_t index = 0;
+    uint64_t version = 0;
+    uint64_t fixed_size = 0;
+
+    import_words(words, index, version);
+    import_words(words, index, fixed_size);
+
+    if (version != snapshot_version || fixed_size != sizeof(vcpu_snapshot_fixed_t)) {
+        throw std::runtime_error("import_snapshot: unsupported snapshot");
+    }
+
+    uart_snapshot_t uart_snapshot{};
+    import_words(words, index, uart_snapshot);
+
+    uint64_t num = 0;
+    import_words(words, index, num);
+
+    std::vector<vcpu_snapshot_t> snapshots;
+
+    for (uint64_t i = 0; i < num; i++) {
+        auto &snapshot = snapshots.emplace_back();
+
+        import_words(words, index, static_cast<vcpu_snapshot_fixed_t &>(snapshot));
+        import_map(words, index, snapshot.msrs);
+        import_map(words, index, snapshot.x2apic);
+
+        uint64_t num_virqs = 0;
+        import_words(words, index, num_virqs);
+
+        for (uint64_t j = 0; j < num_virqs; j++) {
+            import_words(words, index, snapshot.virqs.emplace_back());
+        }
+    }
+
+    m_uart_port = gsl::narrow<uart::port_type>(uart_snapshot.port);
+    if (auto emulated_uart = this->emulated_uart()) {
+        emulated_uart->restore_state(uart_snapshot);
+    }
+
+    this->set_fork_snapshot(std::move(snapshots));
+}
+
+bool
+domain::gpa_to_hpa(uintptr_t gpa, uintptr_t &hpa)
+{
+    // Note:
+    //
+    // The EPT map hands back the address of the page that contains gpa,
+    // which might be a large page, so the offset into the large page is
+    // added back in here.
+    //
+
+    try {
+        auto page_size = 1ULL << m_ept_map.virt_to_phys(gpa).second;
+        auto page_gpa = gpa & ~(page_size - 1);
+
+        hpa = m_ept_map.virt_to_phys(page_gpa).first + (gpa - page_gpa);
+        return true;
+    }
+    catch (...) {
+        return false;
+    }
+}
+
+void
+domain::set_fork_snapshot(std::vector<vcpu_snapshot_t> snapshots)
+{
+    // Note:
+    //
+    // The snapshot's vCPUs stopped at the time the snapshot was taken. To
+    // make it look like no time has passed since (from the guest's point
+    // of view), the TSC offset is moved back so that the guest's TSC picks
+    // up where it stopped, and each vCPU's next timer event is moved by
+    // the same amount. All of the vCPUs share the domain's TSC offset (see
+    // tsc_offset()), so if the snapshot's vCPUs did not agree on the
+    // guest's TSC, the guest continues from the latest one so that none of
+    // its vCPUs see time go backwards. A snapshot that was saved before
+    // the host rebooted has a host_tsc that is ahead of the current TSC,
+    // which the unsigned math below still handles.
+    //
+
+    auto now = ::x64::tsc::get();
+    uint64_t guest_tsc{};
+
+    for (const auto &snapshot : snapshots) {
+        guest_tsc = std::max<uint64_t>(
+            guest_tsc, snapshot.host_tsc + snapshot.tsc_offset);
+    }
+
+    auto offset = guest_tsc - now;
+
+    for (auto &snapshot : snapshots) {
+        if (snapshot.next_event_tsc != 0) {
+            snapshot.next_event_tsc += snapshot.tsc_offset - offset;
+        }
+
+        snapshot.tsc_offset = offset;
+    }
+
+    m_tsc_offset = offset;
+    m_fork_snapshot = std::move(snapshots);
+}
+
+uart *
+domain::emulated_uart() noexcept
+{
+    switch (m_uart_port) {
+        case 0x3F8: return &m_uart_3F8;
+        case 0x2F8: return &m_uart_2F8;
+        case 0x3E8: return &m_uart_3E8;
+        case 0x2E8: return &m_uart_2E8;
+
+        default:
+            return nullptr;
+    };
+}
+
+void
+domain::set_uart(uart::port_type uart) noexcept
+{ m_uart_port = uart; }
+
+void
+domain::set_pt_uart(uart::port_type uart) noexcept
+{ m_pt_uart_port = uart; }
+
+void
+domain::setup_vcpu_uarts(gsl::not_null<vcpu *> vcpu)
+{
+    // Note:
+    //
+    // We explicitly disable the 4 default com ports. This is because the
+    // Linux guest will attempt to probe these ports so they need to be
+    // handled by something.
+    //
+
+    m_uart_3F8.disable(vcpu);
+    m_uart_2F8.disable(vcpu);
+    m_uart_3E8.disable(vcpu);
+    m_uart_2E8.disable(vcpu);
+
+    if (m_pt_uart_port == 0) {
+        switch (m_uart_port) {
+            case 0x3F8: m_uart_3F8.enable(vcpu); break;
+            case 0x2F8: m_uart_2F8.enable(vcpu); break;
+            case 0x3E8: m_uart_3E8.enable(vcpu); break;
+            case 0x2E8: m_uart_2E8.enable(vcpu); break;
+
+            default:
+                break;
+        };
+    }
+    else {
+        if (!m_pt_uart) {
+            m_pt_uart = std::make_unique<uart>(m_pt_uart_port);
+        }
+
+        m_pt_uart->pass_through(vcpu);
+    }
+}
+
+uint64_t
+domain::dump_uart(const gsl::span<char> &buffer)
+{
+    if (m_pt_uart) {
+        m_pt_uart->dump(buffer);
+    }
+    else {
+        switch (m_uart_port) {
+            case 0x3F8: return m_uart_3F8.dump(buffer);
+            case 0x2F8: return m_uart_2F8.dump(buffer);
+            case 0x3E8: return m_uart_3E8.dump(buffer);
+            case 0x2E8: return m_uart_2E8.dump(buffer);
+
+            default:
+                break;
+        };
+    }
+
+    return 0;
+}
+
+uint64_t
+domain::add_vcpu(gsl::not_null<vcpu *> vcpu)
+{
+    std::lock_guard lock(m_vcpus_mutex);
+
+    m_vcpus.push_back(vcpu);
+    return m_vcpus.size() - 1;
+}
+
+void
+domain::remove_vcpu(gsl::not_null<vcpu *> vcpu) noexcept
+{
+    std::lock_guard lock(m_vcpus_mutex);
+
+    for (auto &elem : m_vcpus) {
+        if (elem == vcpu) {
+            elem = nullptr;
+        }
+    }
+}
+
+uint64_t
+domain::num_vcpus() const
+{
+    std::lock_guard lock(m_vcpus_mutex);
+    return m_vcpus.size();
 }
 
 #define domain_reg(reg)                                                         \
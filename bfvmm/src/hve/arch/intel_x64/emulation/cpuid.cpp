@@ -92,8 +92,20 @@ cpuid_handler::handle_0x00000001(vcpu_t *vcpu)
         return vcpu->advance();
     }
 
+    // Note:
+    //
+    // The number of logical processors in EBX[23:16] is only valid when
+    // HTT (EDX[28]) is set, so HTT is always set instead of passing
+    // through whatever the host reports.
+    //
+
+    vcpu->set_rbx(
+        (vcpu->rbx() & 0x0000FFFF) |
+        ((m_vcpu->dom()->num_vcpus() & 0xFF) << 16) |
+        ((m_vcpu->apic_id() & 0xFF) << 24)
+    );
     vcpu->set_rcx((vcpu->rcx() & 0x61FC3203) | 0x80000000);
-    vcpu->set_rdx(vcpu->rdx() & 0x1FCBFBFB);
+    vcpu->set_rdx((vcpu->rdx() & 0x1FCBFBFB) | 0x10000000);
 
     return vcpu->advance();
 }
@@ -161,11 +173,42 @@ cpuid_handler::handle_0x0000000A(vcpu_t *vcpu)
 bool
 cpuid_handler::handle_0x0000000B(vcpu_t *vcpu)
 {
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    // Note:
+    //
+    // Each vCPU is reported as its own core with one thread per core. The
+    // x2APIC ID is reported in EDX for every sub-leaf as required by the
+    // SDM.
+    //
+
+    uint64_t shift = 0;
+    auto subleaf = vcpu->gr2() & 0xFF;
+    auto num_vcpus = m_vcpu->dom()->num_vcpus();
+
+    while ((1ULL << shift) < num_vcpus) {
+        shift++;
+    }
 
+    switch (subleaf) {
+        case 0:
+            vcpu->set_rax(0);
+            vcpu->set_rbx(1);
+            vcpu->set_rcx((1U << 8) | subleaf);
+            break;
+
+        case 1:
+            vcpu->set_rax(shift);
+            vcpu->set_rbx(num_vcpus & 0xFFFF);
+            vcpu->set_rcx((2U << 8) | subleaf);
+            break;
+
+        default:
+            vcpu->set_rax(0);
+            vcpu->set_rbx(0);
+            vcpu->set_rcx(subleaf);
+            break;
+    };
+
+    vcpu->set_rdx(m_vcpu->apic_id());
     return vcpu->advance();
 }
 
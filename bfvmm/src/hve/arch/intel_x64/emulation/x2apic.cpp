@@ -51,6 +51,7 @@ x2apic_handler::x2apic_handler(
     EMULATE_MSR(0x00000802, handle_rdmsr_0x00000802, handle_wrmsr_0x00000802);
     EMULATE_MSR(0x00000803, handle_rdmsr_0x00000803, handle_wrmsr_0x00000803);
     EMULATE_MSR(0x00000808, handle_rdmsr_0x00000808, handle_wrmsr_0x00000808);
+    EMULATE_MSR(0x0000080D, handle_rdmsr_0x0000080D, handle_wrmsr_0x0000080D);
     EMULATE_MSR(0x0000080F, handle_rdmsr_0x0000080F, handle_wrmsr_0x0000080F);
     EMULATE_MSR(0x00000828, handle_rdmsr_0x00000828, handle_wrmsr_0x00000828);
 
@@ -72,11 +73,73 @@ x2apic_handler::x2apic_handler(
     EMULATE_MSR(0x00000826, handle_rdmsr_0x00000826, handle_wrmsr_0x00000826);
     EMULATE_MSR(0x00000827, handle_rdmsr_0x00000827, handle_wrmsr_0x00000827);
 
+    EMULATE_MSR(0x00000830, handle_rdmsr_0x00000830, handle_wrmsr_0x00000830);
+
     EMULATE_MSR(0x00000835, handle_rdmsr_0x00000835, handle_wrmsr_0x00000835);
     EMULATE_MSR(0x00000836, handle_rdmsr_0x00000836, handle_wrmsr_0x00000836);
     EMULATE_MSR(0x00000837, handle_rdmsr_0x00000837, handle_wrmsr_0x00000837);
 }
 
+// -----------------------------------------------------------------------------
+// Snapshot Functions
+// -----------------------------------------------------------------------------
+
+void
+x2apic_handler::save_state(vcpu_snapshot_t &snapshot) const
+{
+    snapshot.x2apic[0x0000001B] = m_0x0000001B;
+    snapshot.x2apic[0x0000080F] = m_0x0000080F;
+    snapshot.x2apic[0x00000828] = m_0x00000828;
+    snapshot.x2apic[0x00000810] = m_0x00000810;
+    snapshot.x2apic[0x00000811] = m_0x00000811;
+    snapshot.x2apic[0x00000812] = m_0x00000812;
+    snapshot.x2apic[0x00000813] = m_0x00000813;
+    snapshot.x2apic[0x00000814] = m_0x00000814;
+    snapshot.x2apic[0x00000815] = m_0x00000815;
+    snapshot.x2apic[0x00000816] = m_0x00000816;
+    snapshot.x2apic[0x00000817] = m_0x00000817;
+    snapshot.x2apic[0x00000820] = m_0x00000820;
+    snapshot.x2apic[0x00000821] = m_0x00000821;
+    snapshot.x2apic[0x00000822] = m_0x00000822;
+    snapshot.x2apic[0x00000823] = m_0x00000823;
+    snapshot.x2apic[0x00000824] = m_0x00000824;
+    snapshot.x2apic[0x00000825] = m_0x00000825;
+    snapshot.x2apic[0x00000826] = m_0x00000826;
+    snapshot.x2apic[0x00000827] = m_0x00000827;
+    snapshot.x2apic[0x00000830] = m_0x00000830;
+    snapshot.x2apic[0x00000835] = m_0x00000835;
+    snapshot.x2apic[0x00000836] = m_0x00000836;
+    snapshot.x2apic[0x00000837] = m_0x00000837;
+}
+
+void
+x2apic_handler::restore_state(const vcpu_snapshot_t &snapshot)
+{
+    m_0x0000001B = snapshot.x2apic.at(0x0000001B);
+    m_0x0000080F = snapshot.x2apic.at(0x0000080F);
+    m_0x00000828 = snapshot.x2apic.at(0x00000828);
+    m_0x00000810 = snapshot.x2apic.at(0x00000810);
+    m_0x00000811 = snapshot.x2apic.at(0x00000811);
+    m_0x00000812 = snapshot.x2apic.at(0x00000812);
+    m_0x00000813 = snapshot.x2apic.at(0x00000813);
+    m_0x00000814 = snapshot.x2apic.at(0x00000814);
+    m_0x00000815 = snapshot.x2apic.at(0x00000815);
+    m_0x00000816 = snapshot.x2apic.at(0x00000816);
+    m_0x00000817 = snapshot.x2apic.at(0x00000817);
+    m_0x00000820 = snapshot.x2apic.at(0x00000820);
+    m_0x00000821 = snapshot.x2apic.at(0x00000821);
+    m_0x00000822 = snapshot.x2apic.at(0x00000822);
+    m_0x00000823 = snapshot.x2apic.at(0x00000823);
+    m_0x00000824 = snapshot.x2apic.at(0x00000824);
+    m_0x00000825 = snapshot.x2apic.at(0x00000825);
+    m_0x00000826 = snapshot.x2apic.at(0x00000826);
+    m_0x00000827 = snapshot.x2apic.at(0x00000827);
+    m_0x00000830 = snapshot.x2apic.at(0x00000830);
+    m_0x00000835 = snapshot.x2apic.at(0x00000835);
+    m_0x00000836 = snapshot.x2apic.at(0x00000836);
+    m_0x00000837 = snapshot.x2apic.at(0x00000837);
+}
+
 // -----------------------------------------------------------------------------
 // General MSRs
 // -----------------------------------------------------------------------------
@@ -113,7 +176,7 @@ x2apic_handler::handle_rdmsr_0x00000802(
 {
     bfignored(vcpu);
 
-    info.val = 0;
+    info.val = m_vcpu->apic_id();
     return true;
 }
 
@@ -165,6 +228,26 @@ x2apic_handler::handle_wrmsr_0x00000808(
     return true;
 }
 
+bool
+x2apic_handler::handle_rdmsr_0x0000080D(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = this->ldr(m_vcpu->apic_id());
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x0000080D(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(info);
+
+    vcpu->halt("writing to the LDR not supported");
+    return true;
+}
+
 bool
 x2apic_handler::handle_rdmsr_0x0000080F(
     vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
@@ -533,6 +616,82 @@ x2apic_handler::handle_wrmsr_0x00000827(
     return true;
 }
 
+// -----------------------------------------------------------------------------
+// ICR
+// -----------------------------------------------------------------------------
+
+bool
+x2apic_handler::handle_rdmsr_0x00000830(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = m_0x00000830;
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x00000830(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    // Note:
+    //
+    // IPIs are delivered synchronously (i.e. the delivery status bit is
+    // never set). A fixed IPI to ourselves is queued directly as we are
+    // loaded, while an IPI to a sibling vCPU is posted so that it is
+    // queued the next time the sibling is resumed. INIT and SIPI only
+    // change the run state of the target, which is applied by the run_op
+    // handler the next time the target is run.
+    //
+
+    switch ((info.val & 0x700) >> 8) {
+        case 0:
+        case 1:
+        case 5:
+        case 6:
+            break;
+
+        default:
+            vcpu->halt("unsupported IPI delivery mode");
+    };
+
+    m_0x00000830 = info.val & 0xFFFFFFFFFFFFEFFF;
+
+    // Note:
+    //
+    // A lowest priority IPI is delivered to only one of its targets. We do
+    // not emulate the TPR/PPR arbitration, so the target with the lowest
+    // APIC ID wins, which is what a guest that uses the same priority on
+    // all of its vCPUs would see anyway.
+    //
+
+    if ((info.val & 0x700) >> 8 == 1) {
+        boxy::intel_x64::vcpu *lowest = nullptr;
+
+        m_vcpu->dom()->foreach_vcpu([&](boxy::intel_x64::vcpu * target) {
+            if (this->is_ipi_target(target, info.val)) {
+                if (lowest == nullptr || target->apic_id() < lowest->apic_id()) {
+                    lowest = target;
+                }
+            }
+        });
+
+        if (lowest != nullptr) {
+            this->send_ipi(lowest, info.val);
+        }
+
+        return true;
+    }
+
+    m_vcpu->dom()->foreach_vcpu([&](boxy::intel_x64::vcpu * target) {
+        if (this->is_ipi_target(target, info.val)) {
+            this->send_ipi(target, info.val);
+        }
+    });
+
+    return true;
+}
+
 // -----------------------------------------------------------------------------
 // LVT
 // -----------------------------------------------------------------------------
@@ -601,4 +760,83 @@ x2apic_handler::handle_wrmsr_0x00000837(
     return true;
 }
 
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+uint64_t
+x2apic_handler::ldr(uint64_t apic_id) const noexcept
+{ return ((apic_id >> 4) << 16) | (1ULL << (apic_id & 0xF)); }
+
+bool
+x2apic_handler::is_ipi_target(vcpu *target, uint64_t icr) const noexcept
+{
+    auto dest = icr >> 32;
+
+    switch ((icr & 0xC0000) >> 18) {
+        case 1:
+            return target == m_vcpu;
+
+        case 2:
+            return true;
+
+        case 3:
+            return target != m_vcpu;
+
+        default:
+            break;
+    };
+
+    if (dest == 0xFFFFFFFF) {
+        return true;
+    }
+
+    if ((icr & 0x800) == 0) {
+        return target->apic_id() == dest;
+    }
+
+    auto ldr = this->ldr(target->apic_id());
+    return ((ldr >> 16) == (dest >> 16)) && ((ldr & dest & 0xFFFF) != 0);
+}
+
+void
+x2apic_handler::send_ipi(vcpu *target, uint64_t icr)
+{
+    auto vector = icr & 0xFF;
+
+    switch ((icr & 0x700) >> 8) {
+        case 0:
+        case 1:
+            if (target == m_vcpu) {
+                target->queue_virtual_interrupt(vector);
+            }
+            else {
+                target->post_virtual_interrupt(vector);
+                m_vcpu->kick(target);
+            }
+            break;
+
+        case 5:
+            if ((icr & 0x4000) != 0) {
+                target->receive_init_ipi();
+
+                if (target != m_vcpu) {
+                    m_vcpu->kick(target);
+                }
+            }
+            break;
+
+        case 6:
+            target->receive_startup_ipi(vector);
+
+            if (target != m_vcpu) {
+                m_vcpu->kick(target);
+            }
+            break;
+
+        default:
+            break;
+    };
+}
+
 }
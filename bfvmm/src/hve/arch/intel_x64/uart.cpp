@@ -123,6 +123,23 @@ uart::dump(const gsl::span<char> &buffer)
     return i;
 }
 
+void
+uart::save_state(uart_snapshot_t &snapshot) const
+{
+    snapshot.port = m_port;
+    snapshot.baud_rate_l = m_baud_rate_l;
+    snapshot.baud_rate_h = m_baud_rate_h;
+    snapshot.line_control_register = m_line_control_register;
+}
+
+void
+uart::restore_state(const uart_snapshot_t &snapshot)
+{
+    m_baud_rate_l = gsl::narrow<data_type>(snapshot.baud_rate_l);
+    m_baud_rate_h = gsl::narrow<data_type>(snapshot.baud_rate_h);
+    m_line_control_register = gsl::narrow<data_type>(snapshot.line_control_register);
+}
+
 bool
 uart::io_zero_handler(
     vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info)
@@ -20,6 +20,7 @@
 // SOFTWARE.
 
 #include <set>
+#include <cstring>
 #include <intrinsics.h>
 
 #include <bfgpalayout.h>
@@ -59,9 +60,51 @@ io_instruction_handler(vcpu_t *vcpu)
 static bool
 ept_violation_handler(vcpu_t *vcpu)
 {
-    vcpu->halt("ept_violation_handler executed. unsupported!!!");
+    // Note:
+    //
+    // The only EPT violations a domU is expected to take are writes to
+    // shared (copy-on-write) pages, writes to pages that are write
+    // protected by the dirty log, and accesses to guest RAM that is
+    // populated on demand. The first and the last take memory from the
+    // demand pool. If the pool is empty, control is handed back to the
+    // parent so that dom0 can add more memory, and once the guest is
+    // resumed, the same access faults again and is retried.
+    //
+    // Another vCPU of this domain might have already fixed the page up
+    // (e.g. it wrote to the same copy-on-write page first), or the page
+    // might have been briefly unmapped while a large page was split. If
+    // the EPT already allows the access, the violation is spurious, and
+    // the access is simply retried (the violation itself invalidates any
+    // stale translation this CPU had for the page).
+    //
+
+    auto gpa = vmcs_n::guest_physical_address::get();
+    auto dom = _v(vcpu)->dom();
+
+    if (dom->is_accessible(gpa, vmcs_n::exit_qualification::get() & 0x7)) {
+        return true;
+    }
+
+    if (dom->is_cow_gpa(gpa)) {
+        if (!_v(vcpu)->populate_page(gpa)) {
+            _v(vcpu)->load_parent_vcpu()->return_populate(gpa);
+        }
+
+        return true;
+    }
+
+    if (dom->dirty_log_write(gpa)) {
+        return true;
+    }
+
+    if (!dom->is_demand_gpa(gpa)) {
+        vcpu->halt("ept_violation_handler executed. unsupported!!!");
+    }
+
+    if (!dom->demand_populate(gpa)) {
+        _v(vcpu)->load_parent_vcpu()->return_populate(gpa);
+    }
 
-    // Unreachable
     return true;
 }
 
@@ -85,6 +128,8 @@ vcpu::vcpu(
     bfvmm::intel_x64::vcpu{id, domain->global_state()},
     m_domain{domain},
 
+    m_vmexit_log{this},
+
     m_exception_handler{this},
     m_external_interrupt_handler{this},
     m_hlt_handler{this},
@@ -112,6 +157,7 @@ vcpu::vcpu(
     m_mtrr_handler{this},
     m_x2apic_handler{this},
 
+    m_balloon_handler{this},
     m_vclock_handler{this},
     m_virq_handler{this}
 {
@@ -123,11 +169,24 @@ vcpu::vcpu(
     else {
         g_domU_vcpus.insert(this);
         this->write_domU_guest_state(domain);
+
+        m_apic_id = domain->add_vcpu(this);
+        m_wait_for_sipi = (m_apic_id != 0);
+
+        if (auto snapshot = domain->fork_snapshot(m_apic_id)) {
+            this->restore_state(*snapshot);
+        }
     }
 }
 
 vcpu::~vcpu()
 {
+    if (this->is_domU()) {
+        m_domain->remove_vcpu(this);
+    }
+
+    this->detach_from_parent_vcpu();
+
     if (this->is_bootstrap_vcpu()) {
         for (const auto &vcpu : g_domU_vcpus) {
             vcpu->clear();
@@ -152,13 +211,18 @@ domain::domainid_type
 vcpu::domid() const noexcept
 { return m_domain->id(); }
 
+domain *
+vcpu::dom() const noexcept
+{ return m_domain; }
+
 //------------------------------------------------------------------------------
 // VMCall
 //------------------------------------------------------------------------------
 
 void
-vcpu::add_vmcall_handler(const handler_delegate_t &d)
-{ m_vmcall_handler.add_handler(std::move(d)); }
+vcpu::add_vmcall_handler(
+    uint64_t opcode, const handler_delegate_t &d)
+{ m_vmcall_handler.add_handler(opcode, d); }
 
 //------------------------------------------------------------------------------
 // Hlt
@@ -192,6 +256,118 @@ vcpu *
 vcpu::parent_vcpu() const noexcept
 { return m_parent_vcpu; }
 
+vcpu *
+vcpu::load_parent_vcpu()
+{
+    using namespace vmcs_n;
+
+    // Note:
+    //
+    // A VMCS that is active on one core cannot be loaded on another core,
+    // but clearing the VMCS every time control is handed back to the
+    // parent would turn every VMRESUME into a VMLAUNCH. Instead, the VMCS
+    // stays active on this core until the thread that runs this vCPU
+    // releases it (see release()), which it does before it is allowed to
+    // move to another core. The parent is the core this vCPU last ran on.
+    //
+
+    m_vmexit_log.stop_timer();
+
+    auto host_tsc = ::x64::tsc::get();
+    m_last_guest_tsc = host_tsc + tsc_offset::get();
+    m_runnable_tsc = host_tsc;
+
+    if (auto exit_info = m_exit_info.get()) {
+        exit_info->exit_reason = exit_reason::basic_exit_reason::get();
+    }
+
+    m_released = false;
+    m_running = false;
+
+    m_parent_vcpu->m_child_vcpu = this;
+    m_parent_vcpu->load();
+
+    return m_parent_vcpu;
+}
+
+void
+vcpu::release()
+{
+    this->clear();
+    m_released = true;
+}
+
+bool
+vcpu::is_released() const noexcept
+{ return m_released; }
+
+void
+vcpu::migrate(gsl::not_null<vcpu *> parent)
+{
+    // Note:
+    //
+    // The host state of a vCPU (stack, GDT, TSS, CR3, etc...) is owned by
+    // the vCPU and not the physical core, so there is nothing to refresh
+    // there. The TSC however is per core, and although we require an
+    // invariant TSC, the host (or firmware) is free to adjust the TSC of
+    // each core (e.g. IA32_TSC_ADJUST). If the new core is behind the old
+    // one, the domain's TSC offset is raised so that the guest never sees
+    // time go backwards. The offset is raised for all of the domain's
+    // vCPUs (see sync_tsc_offset()) so that an SMP guest keeps seeing the
+    // same TSC on each of its vCPUs.
+    //
+
+    this->detach_from_parent_vcpu();
+    m_parent_vcpu = parent;
+
+    // Note:
+    //
+    // The new core might also still have translations cached from another
+    // vCPU of this domain that ran there before the domain's EPT lost
+    // permissions (see sync_ept()), so its EPT TLB is flushed as well.
+    //
+
+    ::intel_x64::vmx::invept_global();
+    m_domain->raise_tsc_offset(m_last_guest_tsc);
+}
+
+void
+vcpu::detach_from_parent_vcpu() noexcept
+{
+    // Note:
+    //
+    // The parent remembers the last child it ran (so that its return_xxx()
+    // functions can record the child's exit). Another child might be
+    // running on the parent's core right now, so the parent's child is
+    // only cleared if it is still this vCPU.
+    //
+
+    if (m_parent_vcpu != nullptr) {
+        vcpu *child = this;
+        m_parent_vcpu->m_child_vcpu.compare_exchange_strong(child, nullptr);
+    }
+}
+
+void
+vcpu::set_runnable_tsc(uint64_t tsc) noexcept
+{ m_runnable_tsc = tsc; }
+
+void
+vcpu::account_steal_time() noexcept
+{
+    auto tsc = ::x64::tsc::get();
+
+    if (m_runnable_tsc != 0 && tsc > m_runnable_tsc) {
+        m_steal_tsc += tsc - m_runnable_tsc;
+    }
+
+    m_runnable_tsc = 0;
+}
+
+uint64_t
+vcpu::steal_tsc() const noexcept
+{ return m_steal_tsc; }
+
 void
 vcpu::prepare_for_world_switch()
 {}
@@ -199,6 +375,10 @@ vcpu::prepare_for_world_switch()
 void
 vcpu::return_fault(uint64_t error)
 {
+    if (auto child_vcpu = m_child_vcpu.load()) {
+        child_vcpu->record_exit(mv_vp_exit_t_fault, error);
+    }
+
     this->set_rax((error << 4) | hypercall_enum_run_op__fault);
     this->prepare_for_world_switch();
     this->run();
@@ -207,6 +387,10 @@ vcpu::return_fault(uint64_t error)
 void
 vcpu::return_continue()
 {
+    if (auto child_vcpu = m_child_vcpu.load()) {
+        child_vcpu->record_exit(mv_vp_exit_t_external_interrupt);
+    }
+
     this->set_rax(hypercall_enum_run_op__continue);
     this->prepare_for_world_switch();
     this->run();
@@ -215,6 +399,10 @@ vcpu::return_continue()
 void
 vcpu::return_yield(uint64_t nsec)
 {
+    if (auto child_vcpu = m_child_vcpu.load()) {
+        child_vcpu->record_exit(mv_vp_exit_t_yield, nsec);
+    }
+
     this->set_rax((nsec << 4) | hypercall_enum_run_op__yield);
     this->prepare_for_world_switch();
     this->run();
@@ -223,11 +411,80 @@ vcpu::return_yield(uint64_t nsec)
 void
 vcpu::return_set_wallclock()
 {
+    if (auto child_vcpu = m_child_vcpu.load()) {
+        child_vcpu->record_exit(mv_vp_exit_t_sync_tsc);
+    }
+
     this->set_rax(hypercall_enum_run_op__set_wallclock);
     this->prepare_for_world_switch();
     this->run();
 }
 
+void
+vcpu::return_populate(uint64_t gpa)
+{
+    if (auto child_vcpu = m_child_vcpu.load()) {
+        child_vcpu->record_exit(mv_vp_exit_t_populate, gpa);
+    }
+
+    this->set_rax((gpa << 4) | hypercall_enum_run_op__populate);
+    this->prepare_for_world_switch();
+    this->run();
+}
+
+void
+vcpu::return_wakeup(uint64_t vcpuid)
+{
+    if (auto child_vcpu = m_child_vcpu.load()) {
+        child_vcpu->record_exit(mv_vp_exit_t_wakeup, vcpuid);
+    }
+
+    this->set_rax((vcpuid << 4) | hypercall_enum_run_op__wakeup);
+    this->prepare_for_world_switch();
+    this->run();
+}
+
+void
+vcpu::set_exit_info(bfvmm::x64::unique_map<mv_vp_exit_info_t> &&exit_info)
+{ m_exit_info = std::move(exit_info); }
+
+void
+vcpu::record_exit(uint64_t reason, uint64_t arg) noexcept
+{
+    auto exit_info = m_exit_info.get();
+
+    if (exit_info == nullptr || reason >= mv_vp_exit_t_max) {
+        return;
+    }
+
+    // Note:
+    //
+    // Not every exit comes from the guest. A vCPU that is waiting for a
+    // SIPI, or whose domain is paused, is handed back to the host without
+    // being run, so the TSC is read here and not when the guest exits.
+    // Otherwise, the host would compute its yield deadline from a TSC
+    // that is stale (or 0 for an AP that never ran).
+    //
+
+    auto host_tsc = ::x64::tsc::get();
+
+    exit_info->reason = reason;
+    exit_info->arg = arg;
+    exit_info->guest_tsc = host_tsc + m_domain->tsc_offset();
+    exit_info->host_tsc = host_tsc;
+
+    exit_info->num_exits++;
+    exit_info->num_exits_by_reason[reason]++;
+}
+
+const mv_vmexit_log_t &
+vcpu::vmexit_log_data() const noexcept
+{ return m_vmexit_log.log(); }
+
+void
+vcpu::dump_vmexit_log() const
+{ m_vmexit_log.dump(); }
+
 //------------------------------------------------------------------------------
 // Control
 //------------------------------------------------------------------------------
@@ -244,6 +501,440 @@ bool
 vcpu::is_killed() const noexcept
 { return m_killed; }
 
+bool
+vcpu::mark_running() noexcept
+{
+    // Note:
+    //
+    // The flag is set before the domain is checked, and the domain is
+    // paused before its vCPUs are checked (see domain_op__pause_domain()),
+    // so either this vCPU sees the pause, or the pause sees this vCPU.
+    //
+
+    m_running = true;
+    m_parked = false;
+
+    if (m_domain->is_paused()) {
+        m_running = false;
+        return false;
+    }
+
+    return true;
+}
+
+void
+vcpu::mark_stopped() noexcept
+{ m_running = false; }
+
+bool
+vcpu::is_running() const noexcept
+{ return m_running; }
+
+void
+vcpu::park() noexcept
+{ m_parked = true; }
+
+bool
+vcpu::unpark() noexcept
+{ return m_parked.exchange(false); }
+
+void
+vcpu::sync_ept()
+{
+    auto generation = m_domain->ept_generation();
+
+    if (m_ept_generation != generation) {
+        ::intel_x64::vmx::invept_global();
+        m_ept_generation = generation;
+    }
+}
+
+uint64_t
+vcpu::ept_generation() const noexcept
+{ return m_ept_generation; }
+
+void
+vcpu::sync_tsc_offset()
+{
+    auto offset = m_domain->tsc_offset();
+
+    if (m_tsc_offset != offset) {
+        vmcs_n::tsc_offset::set(offset);
+        m_tsc_offset = offset;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Shared Pages
+//------------------------------------------------------------------------------
+
+bool
+vcpu::populate_page(uintptr_t gpa)
+{
+    if (m_domain->is_cow_gpa(gpa)) {
+        return m_domain->cow_populate(gpa, [&](auto dst_hpa, auto src_hpa) {
+            auto dst = this->map_hpa_4k<uint8_t>(dst_hpa);
+            auto src = this->map_hpa_4k<uint8_t>(src_hpa);
+
+            std::memcpy(dst.get(), src.get(), BAREFLANK_PAGE_SIZE);
+        });
+    }
+
+    if (m_domain->is_demand_gpa(gpa)) {
+        return m_domain->demand_populate(gpa);
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Snapshot
+//------------------------------------------------------------------------------
+
+void
+vcpu::save_state(vcpu_snapshot_t &snapshot)
+{
+    using namespace vmcs_n;
+    using namespace vm_entry_controls;
+    using namespace secondary_processor_based_vm_execution_controls;
+
+    snapshot.apic_id = m_apic_id;
+    snapshot.wait_for_sipi = m_wait_for_sipi;
+    snapshot.sipi_pending = m_sipi_pending;
+    snapshot.sipi_vector = m_sipi_vector;
+
+    snapshot.rax = this->rax();
+    snapshot.rbx = this->rbx();
+    snapshot.rcx = this->rcx();
+    snapshot.rdx = this->rdx();
+    snapshot.rbp = this->rbp();
+    snapshot.rsi = this->rsi();
+    snapshot.rdi = this->rdi();
+    snapshot.r08 = this->r08();
+    snapshot.r09 = this->r09();
+    snapshot.r10 = this->r10();
+    snapshot.r11 = this->r11();
+    snapshot.r12 = this->r12();
+    snapshot.r13 = this->r13();
+    snapshot.r14 = this->r14();
+    snapshot.r15 = this->r15();
+    snapshot.rip = this->rip();
+    snapshot.rsp = this->rsp();
+    snapshot.gdt_base = this->gdt_base();
+    snapshot.gdt_limit = this->gdt_limit();
+    snapshot.idt_base = this->idt_base();
+    snapshot.idt_limit = this->idt_limit();
+    snapshot.cr2 = this->cr2();
+    snapshot.cr3 = this->cr3();
+    snapshot.cr8 = this->cr8();
+    snapshot.dr0 = this->dr0();
+    snapshot.dr1 = this->dr1();
+    snapshot.dr2 = this->dr2();
+    snapshot.dr3 = this->dr3();
+    snapshot.dr6 = this->dr6();
+    snapshot.dr7 = this->dr7();
+    snapshot.xcr0 = this->xcr0();
+    snapshot.ia32_xss = this->ia32_xss();
+    snapshot.ia32_efer = this->ia32_efer();
+    snapshot.ia32_pat = this->ia32_pat();
+    snapshot.rflags = guest_rflags::get();
+    snapshot.cr0 = guest_cr0::get();
+    snapshot.cr0_read_shadow = cr0_read_shadow::get();
+    snapshot.cr4 = guest_cr4::get();
+    snapshot.cr4_read_shadow = cr4_read_shadow::get();
+    snapshot.ia32_sysenter_cs = guest_ia32_sysenter_cs::get();
+    snapshot.ia32_sysenter_esp = guest_ia32_sysenter_esp::get();
+    snapshot.ia32_sysenter_eip = guest_ia32_sysenter_eip::get();
+
+    snapshot.es_selector = this->es_selector();
+    snapshot.es_base = this->es_base();
+    snapshot.es_limit = this->es_limit();
+    snapshot.es_access_rights = this->es_access_rights();
+    snapshot.cs_selector = this->cs_selector();
+    snapshot.cs_base = this->cs_base();
+    snapshot.cs_limit = this->cs_limit();
+    snapshot.cs_access_rights = this->cs_access_rights();
+    snapshot.ss_selector = this->ss_selector();
+    snapshot.ss_base = this->ss_base();
+    snapshot.ss_limit = this->ss_limit();
+    snapshot.ss_access_rights = this->ss_access_rights();
+    snapshot.ds_selector = this->ds_selector();
+    snapshot.ds_base = this->ds_base();
+    snapshot.ds_limit = this->ds_limit();
+    snapshot.ds_access_rights = this->ds_access_rights();
+    snapshot.fs_selector = this->fs_selector();
+    snapshot.fs_base = this->fs_base();
+    snapshot.fs_limit = this->fs_limit();
+    snapshot.fs_access_rights = this->fs_access_rights();
+    snapshot.gs_selector = this->gs_selector();
+    snapshot.gs_base = this->gs_base();
+    snapshot.gs_limit = this->gs_limit();
+    snapshot.gs_access_rights = this->gs_access_rights();
+    snapshot.tr_selector = this->tr_selector();
+    snapshot.tr_base = this->tr_base();
+    snapshot.tr_limit = this->tr_limit();
+    snapshot.tr_access_rights = this->tr_access_rights();
+    snapshot.ldtr_selector = this->ldtr_selector();
+    snapshot.ldtr_base = this->ldtr_base();
+    snapshot.ldtr_limit = this->ldtr_limit();
+    snapshot.ldtr_access_rights = this->ldtr_access_rights();
+
+    snapshot.interruptibility_state = guest_interruptibility_state::get();
+    snapshot.activity_state = guest_activity_state::get();
+    snapshot.ia_32e_mode_guest = ia_32e_mode_guest::is_enabled();
+    snapshot.unrestricted_guest = unrestricted_guest::is_enabled();
+
+    snapshot.tsc_offset = m_domain->tsc_offset();
+    snapshot.steal_tsc = m_steal_tsc;
+
+    m_msr_handler.save_state(snapshot);
+    m_x2apic_handler.save_state(snapshot);
+    m_vclock_handler.save_state(snapshot);
+    m_virq_handler.save_state(snapshot);
+}
+
+void
+vcpu::restore_state(const vcpu_snapshot_t &snapshot)
+{
+    using namespace vmcs_n;
+    using namespace vm_entry_controls;
+    using namespace secondary_processor_based_vm_execution_controls;
+
+    // Note:
+    //
+    // An AP that had not been started when the snapshot was taken keeps
+    // waiting for its SIPI (or applies the SIPI it had already received
+    // the first time it is run). Otherwise the vCPU continues from the
+    // snapshot's RIP instead of the domain's RIP. CR0 and CR4 are written
+    // to the VMCS directly so that the read shadows (and the bits the
+    // guest owns) are exactly what they were.
+    //
+
+    m_wait_for_sipi = snapshot.wait_for_sipi;
+    m_sipi_pending = snapshot.sipi_pending;
+    m_sipi_vector = snapshot.sipi_vector;
+
+    m_domain->set_tsc_offset(snapshot.tsc_offset);
+    this->sync_tsc_offset();
+
+    m_steal_tsc = snapshot.steal_tsc;
+
+    if (m_wait_for_sipi || m_sipi_pending) {
+        return;
+    }
+
+    this->set_rax(snapshot.rax);
+    this->set_rbx(snapshot.rbx);
+    this->set_rcx(snapshot.rcx);
+    this->set_rdx(snapshot.rdx);
+    this->set_rbp(snapshot.rbp);
+    this->set_rsi(snapshot.rsi);
+    this->set_rdi(snapshot.rdi);
+    this->set_r08(snapshot.r08);
+    this->set_r09(snapshot.r09);
+    this->set_r10(snapshot.r10);
+    this->set_r11(snapshot.r11);
+    this->set_r12(snapshot.r12);
+    this->set_r13(snapshot.r13);
+    this->set_r14(snapshot.r14);
+    this->set_r15(snapshot.r15);
+    this->set_rip(snapshot.rip);
+    this->set_rsp(snapshot.rsp);
+    this->set_gdt_base(snapshot.gdt_base);
+    this->set_gdt_limit(snapshot.gdt_limit);
+    this->set_idt_base(snapshot.idt_base);
+    this->set_idt_limit(snapshot.idt_limit);
+    this->set_cr2(snapshot.cr2);
+    this->set_cr3(snapshot.cr3);
+    this->set_cr8(snapshot.cr8);
+    this->set_dr0(snapshot.dr0);
+    this->set_dr1(snapshot.dr1);
+    this->set_dr2(snapshot.dr2);
+    this->set_dr3(snapshot.dr3);
+    this->set_dr6(snapshot.dr6);
+    this->set_dr7(snapshot.dr7);
+    this->set_xcr0(snapshot.xcr0);
+    this->set_ia32_xss(snapshot.ia32_xss);
+    this->set_ia32_efer(snapshot.ia32_efer);
+    this->set_ia32_pat(snapshot.ia32_pat);
+    guest_rflags::set(snapshot.rflags);
+    guest_cr0::set(snapshot.cr0);
+    cr0_read_shadow::set(snapshot.cr0_read_shadow);
+    guest_cr4::set(snapshot.cr4);
+    cr4_read_shadow::set(snapshot.cr4_read_shadow);
+    guest_ia32_sysenter_cs::set(snapshot.ia32_sysenter_cs);
+    guest_ia32_sysenter_esp::set(snapshot.ia32_sysenter_esp);
+    guest_ia32_sysenter_eip::set(snapshot.ia32_sysenter_eip);
+
+    this->set_es_selector(snapshot.es_selector);
+    this->set_es_base(snapshot.es_base);
+    this->set_es_limit(snapshot.es_limit);
+    this->set_es_access_rights(snapshot.es_access_rights);
+    this->set_cs_selector(snapshot.cs_selector);
+    this->set_cs_base(snapshot.cs_base);
+    this->set_cs_limit(snapshot.cs_limit);
+    this->set_cs_access_rights(snapshot.cs_access_rights);
+    this->set_ss_selector(snapshot.ss_selector);
+    this->set_ss_base(snapshot.ss_base);
+    this->set_ss_limit(snapshot.ss_limit);
+    this->set_ss_access_rights(snapshot.ss_access_rights);
+    this->set_ds_selector(snapshot.ds_selector);
+    this->set_ds_base(snapshot.ds_base);
+    this->set_ds_limit(snapshot.ds_limit);
+    this->set_ds_access_rights(snapshot.ds_access_rights);
+    this->set_fs_selector(snapshot.fs_selector);
+    this->set_fs_base(snapshot.fs_base);
+    this->set_fs_limit(snapshot.fs_limit);
+    this->set_fs_access_rights(snapshot.fs_access_rights);
+    this->set_gs_selector(snapshot.gs_selector);
+    this->set_gs_base(snapshot.gs_base);
+    this->set_gs_limit(snapshot.gs_limit);
+    this->set_gs_access_rights(snapshot.gs_access_rights);
+    this->set_tr_selector(snapshot.tr_selector);
+    this->set_tr_base(snapshot.tr_base);
+    this->set_tr_limit(snapshot.tr_limit);
+    this->set_tr_access_rights(snapshot.tr_access_rights);
+    this->set_ldtr_selector(snapshot.ldtr_selector);
+    this->set_ldtr_base(snapshot.ldtr_base);
+    this->set_ldtr_limit(snapshot.ldtr_limit);
+    this->set_ldtr_access_rights(snapshot.ldtr_access_rights);
+
+    guest_interruptibility_state::set(snapshot.interruptibility_state);
+    guest_activity_state::set(snapshot.activity_state);
+
+    if (snapshot.ia_32e_mode_guest) {
+        ia_32e_mode_guest::enable();
+    }
+    else {
+        ia_32e_mode_guest::disable();
+    }
+
+    if (snapshot.unrestricted_guest) {
+        unrestricted_guest::enable();
+    }
+    else {
+        unrestricted_guest::disable();
+    }
+
+    m_msr_handler.restore_state(snapshot);
+    m_x2apic_handler.restore_state(snapshot);
+    m_vclock_handler.restore_state(snapshot);
+    m_virq_handler.restore_state(snapshot);
+}
+
+//------------------------------------------------------------------------------
+// SMP
+//------------------------------------------------------------------------------
+
+uint64_t
+vcpu::apic_id() const noexcept
+{ return m_apic_id; }
+
+void
+vcpu::receive_init_ipi() noexcept
+{
+    m_sipi_pending = false;
+    m_wait_for_sipi = true;
+}
+
+void
+vcpu::receive_startup_ipi(uint64_t vector) noexcept
+{
+    if (!m_wait_for_sipi) {
+        return;
+    }
+
+    m_sipi_vector = vector & 0xFF;
+    m_sipi_pending = true;
+    m_wait_for_sipi = false;
+}
+
+bool
+vcpu::is_waiting_for_sipi() const noexcept
+{ return m_wait_for_sipi; }
+
+void
+vcpu::apply_startup_ipi()
+{
+    using namespace vmcs_n;
+
+    if (!m_sipi_pending.exchange(false)) {
+        return;
+    }
+
+    // Note:
+    //
+    // The state below is the state defined by the SDM for an AP after
+    // INIT/SIPI (see Table 9-1), with CS set to the SIPI vector. Real mode
+    // requires unrestricted guest support as paging and protected mode are
+    // both disabled.
+    //
+
+    using namespace secondary_processor_based_vm_execution_controls;
+    unrestricted_guest::enable();
+    vm_entry_controls::ia_32e_mode_guest::disable();
+
+    this->set_rip(0);
+    this->set_rsp(0);
+    this->set_rdx(0x600);
+
+    this->set_cs_selector(m_sipi_vector << 8);
+    this->set_cs_base(m_sipi_vector << 12);
+    this->set_cs_limit(0xFFFF);
+    this->set_cs_access_rights(0x9B);
+
+    this->set_es_selector(0);
+    this->set_es_base(0);
+    this->set_es_limit(0xFFFF);
+    this->set_es_access_rights(0x93);
+    this->set_ss_selector(0);
+    this->set_ss_base(0);
+    this->set_ss_limit(0xFFFF);
+    this->set_ss_access_rights(0x93);
+    this->set_ds_selector(0);
+    this->set_ds_base(0);
+    this->set_ds_limit(0xFFFF);
+    this->set_ds_access_rights(0x93);
+    this->set_fs_selector(0);
+    this->set_fs_base(0);
+    this->set_fs_limit(0xFFFF);
+    this->set_fs_access_rights(0x93);
+    this->set_gs_selector(0);
+    this->set_gs_base(0);
+    this->set_gs_limit(0xFFFF);
+    this->set_gs_access_rights(0x93);
+
+    this->set_tr_selector(0);
+    this->set_tr_base(0);
+    this->set_tr_limit(0xFFFF);
+    this->set_tr_access_rights(0x8B);
+    this->set_ldtr_selector(0);
+    this->set_ldtr_base(0);
+    this->set_ldtr_limit(0xFFFF);
+    this->set_ldtr_access_rights(0x82);
+
+    this->set_gdt_base(0);
+    this->set_gdt_limit(0xFFFF);
+    this->set_idt_base(0);
+    this->set_idt_limit(0xFFFF);
+
+    guest_cr0::set(
+        ::intel_x64::cr0::extension_type::mask |
+        (::intel_x64::msrs::ia32_vmx_cr0_fixed0::get() &
+         ~(::intel_x64::cr0::protection_enable::mask |
+           ::intel_x64::cr0::paging::mask))
+    );
+    cr0_read_shadow::set(::intel_x64::cr0::extension_type::mask);
+
+    this->set_cr3(0);
+    this->set_cr4(0);
+    this->set_ia32_efer(0);
+
+    guest_rflags::set(2);
+    guest_interruptibility_state::set(0);
+    guest_activity_state::set(guest_activity_state::active);
+}
+
 //------------------------------------------------------------------------------
 // Virtual IRQs
 //------------------------------------------------------------------------------
@@ -256,6 +947,22 @@ void
 vcpu::inject_virtual_interrupt(uint64_t vector)
 { m_virq_handler.inject_virtual_interrupt(vector); }
 
+void
+vcpu::post_virtual_interrupt(uint64_t vector)
+{ m_virq_handler.post_virtual_interrupt(vector); }
+
+bool
+vcpu::is_virtual_interrupt_posted() const noexcept
+{ return m_virq_handler.is_virtual_interrupt_posted(); }
+
+void
+vcpu::kick(gsl::not_null<vcpu *> target)
+{
+    if (target->unpark()) {
+        m_virq_handler.kick(target->id());
+    }
+}
+
 //------------------------------------------------------------------------------
 // Virtual Clock
 //------------------------------------------------------------------------------
@@ -292,8 +999,7 @@ vcpu::halt(const std::string &str)
         bferror_lnbr(0);
 
         try {
-            parent_vcpu->load();
-            parent_vcpu->return_fault();
+            this->load_parent_vcpu()->return_fault();
         }
         catch (...) {
             bferror_info(0, "attempt to kill child failed!!!");
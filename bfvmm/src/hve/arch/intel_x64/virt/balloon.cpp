@@ -0,0 +1,175 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/virt/balloon.h>
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+constexpr uint64_t page_size_4k = 0x1000;
+
+// Note:
+//
+// The MDL chain is owned by the guest, and nothing preempts the VMM while it
+// walks the chain, so a guest could keep a core in the VMM for as long as it
+// likes (or forever, using a chain that points back at itself). The chain is
+// therefore limited to this many MDL pages (i.e. a little over 10k entries),
+// and longer chains are rejected.
+//
+constexpr uint64_t max_mdl_pages = 64;
+
+template<typename F>
+static bool
+foreach_mdl_entry(boxy::intel_x64::vcpu *vcpu, uint64_t mdl_gpa, F func)
+{
+    for (uint64_t num_pages = 0; mdl_gpa != 0; num_pages++) {
+        if (num_pages == max_mdl_pages) {
+            return false;
+        }
+
+        auto mdl{vcpu->map_gpa_4k<mv_mdl_t>(mdl_gpa)};
+
+        if (mdl->num_entries > MV_MDL_MAP_MAX_NUM_ENTRIES) {
+            throw std::runtime_error("balloon: invalid mdl");
+        }
+
+        for (uint64_t i = 0; i < mdl->num_entries; i++) {
+            const auto &entry = mdl->entries[i];
+
+            if (((entry.gpa | entry.size) & (page_size_4k - 1)) != 0) {
+                throw std::runtime_error("balloon: unaligned mdl entry");
+            }
+
+            func(entry.gpa, entry.size);
+        }
+
+        mdl_gpa = mdl->next;
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+balloon_handler::balloon_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    if (vcpu->is_dom0()) {
+        return;
+    }
+
+    m_vcpu->add_vmcall_handler(
+        hypercall_enum_balloon_op, {&balloon_handler::dispatch, this}
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+void
+balloon_handler::balloon_op__get_target(vcpu *vcpu)
+{ vcpu->set_rax(vcpu->dom()->balloon_target()); }
+
+void
+balloon_handler::balloon_op__inflate(vcpu *vcpu)
+{
+    try {
+        auto valid = foreach_mdl_entry(vcpu, vcpu->rbx(), [&](auto gpa, auto size) {
+            vcpu->dom()->balloon_inflate(gpa, size);
+        });
+
+        vcpu->set_rax(valid ? SUCCESS : MV_STATUS_INVALID_PARAMS0);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+balloon_handler::balloon_op__deflate(vcpu *vcpu)
+{
+    try {
+        auto mapped = true;
+
+        auto valid = foreach_mdl_entry(vcpu, vcpu->rbx(), [&](auto gpa, auto size) {
+            mapped &= vcpu->dom()->balloon_deflate(gpa, size);
+        });
+
+        if (!valid) {
+            vcpu->set_rax(MV_STATUS_INVALID_PARAMS0);
+            return;
+        }
+
+        vcpu->set_rax(mapped ? SUCCESS : FAILURE);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+bool
+balloon_handler::dispatch(vcpu *vcpu)
+{
+    switch (vcpu->rax()) {
+        case hypercall_enum_balloon_op__get_target:
+            balloon_op__get_target(vcpu);
+            break;
+
+        case hypercall_enum_balloon_op__inflate:
+            balloon_op__inflate(vcpu);
+            break;
+
+        case hypercall_enum_balloon_op__deflate:
+            balloon_op__deflate(vcpu);
+            break;
+
+        // Note:
+        //
+        // Free page reporting is handled the same way as an inflate. The
+        // difference is only in how the guest accounts for the memory: a
+        // reported block is not part of the guest's balloon, and the guest
+        // should deflate it before the block is used again. If it does not,
+        // the block is mapped back the first time it is touched (see
+        // domain::demand_populate()).
+        //
+
+        case hypercall_enum_balloon_op__report_free:
+            balloon_op__inflate(vcpu);
+            break;
+
+        default:
+            vcpu->halt("unknown balloon op");
+    };
+
+    return true;
+}
+
+}
@@ -25,6 +25,36 @@
 
 #define NSEC_PER_SEC 1000000000L
 
+// -----------------------------------------------------------------------------
+// Notes about Halt Polling
+// -----------------------------------------------------------------------------
+
+// When a guest yields, handing control back to bfexec so that it can sleep
+// costs two world switches and a trip through the host's scheduler, which
+// is often more than the time the guest actually wants to sleep for. Like
+// KVM, before returning to the parent we poll (i.e. spin) for a short
+// window, waiting for either the guest's next event to expire or for a
+// sibling vCPU to post a vIRQ (e.g. an IPI). The window is per vCPU and
+// adapts to how the guest behaves:
+//
+// - If polling would have caught the wakeup had the window been a little
+//   larger (i.e. the next event is within halt_poll_nsec_max), the window
+//   grows.
+// - If the guest is going to sleep for longer than halt_poll_nsec_max, the
+//   polling was wasted, and the window shrinks.
+//
+// Note that we poll in VMX root, where host interrupts are held off until
+// we either resume the guest or return to the parent, so the maximum
+// window is kept a lot smaller than KVM's default. Polling also stops as
+// soon as the vCPU has a vIRQ queued (not just posted), or the host has an
+// interrupt pending in its local APIC (when the host uses the x2APIC, as
+// the xAPIC's registers are not mapped into the VMM). In the latter case,
+// the vCPU yields to its parent so that the host can service it.
+//
+
+constexpr const auto halt_poll_nsec_start = 2000ULL;
+constexpr const auto halt_poll_nsec_max = 20000ULL;
+
 // -----------------------------------------------------------------------------
 // Notes about Event Timer Injection
 // -----------------------------------------------------------------------------
@@ -235,6 +265,12 @@
 //   calculate how many nanoseconds have passed. Once we have that we can
 //   determine the current time.
 //
+// - The pvclock page is the exception to the above. It is read by the guest
+//   without a VM exit (possibly from userspace), where a divide is too slow,
+//   so it provides the same mul/shift pair that KVM's pvclock does, and the
+//   guest uses scaling math instead (see vclock_pvclock_scale()). The mul is
+//   a 32bit fraction, so the error stays well below 1 ppm.
+//
 
 // -----------------------------------------------------------------------------
 // Helpers
@@ -244,6 +280,32 @@ static uint64_t
 mul_div(uint64_t x, uint64_t n, uint64_t d)
 { return ((x / d) * n) + (((x % d) * n) / d); }
 
+static std::pair<uint64_t, int64_t>
+pvclock_mul_shift(uint64_t tsc_freq_khz)
+{
+    uint64_t nsec = NSEC_PER_SEC;
+    uint64_t tsc = tsc_freq_khz * 1000;
+    int64_t shift = 0;
+
+    while (tsc > nsec * 2 || (tsc & 0xFFFFFFFF00000000ULL) != 0) {
+        tsc >>= 1;
+        shift--;
+    }
+
+    while (tsc <= nsec || (nsec & 0xFFFFFFFF00000000ULL) != 0) {
+        if ((nsec & 0xFFFFFFFF00000000ULL) != 0 || (tsc & 0x80000000ULL) != 0) {
+            nsec >>= 1;
+        }
+        else {
+            tsc <<= 1;
+        }
+
+        shift++;
+    }
+
+    return {(nsec << 32) / tsc, shift};
+}
+
 static struct timespec
 inc_timespec(const struct timespec &ts, uint64_t nsec)
 {
@@ -269,6 +331,32 @@ sub_timespec(const struct timespec &ts1, const struct timespec &ts2)
     return {sec, nsec};
 }
 
+static bool
+is_x2apic_enabled()
+{ return (::x64::msrs::get(0x1B) & 0x400) != 0; }
+
+static bool
+is_host_interrupt_pending()
+{
+    for (uint32_t irr = 0x820; irr <= 0x827; irr++) {
+        if (::x64::msrs::get(irr) != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+is_guest_interrupt_queued()
+{
+    using namespace vmcs_n;
+
+    return
+        primary_processor_based_vm_execution_controls::interrupt_window_exiting::is_enabled() ||
+        vm_entry_interruption_information::valid_bit::is_enabled();
+}
+
 // -----------------------------------------------------------------------------
 // Implementation
 // -----------------------------------------------------------------------------
@@ -328,11 +416,17 @@ vclock_handler::get_host_wallclock() const
 
 void
 vclock_handler::set_guest_wallclock_rtc(void) noexcept
-{ m_guest_wc_rtc = m_host_wc_rtc; }
+{
+    m_guest_wc_rtc = m_host_wc_rtc;
+    m_pvclock_stale = true;
+}
 
 void
 vclock_handler::set_guest_wallclock_tsc(void) noexcept
-{ m_guest_wc_tsc = m_host_wc_tsc; }
+{
+    m_guest_wc_tsc = m_host_wc_tsc;
+    m_pvclock_stale = true;
+}
 
 std::pair<struct timespec, uint64_t>
 vclock_handler::get_guest_wallclock() const
@@ -343,6 +437,41 @@ vclock_handler::get_guest_wallclock() const
     return {inc_timespec(m_guest_wc_rtc, elapsed_nsec), tsc};
 }
 
+//------------------------------------------------------------------------------
+// Snapshot
+//------------------------------------------------------------------------------
+
+void
+vclock_handler::save_state(vcpu_snapshot_t &snapshot) const
+{
+    snapshot.next_event_tsc = m_next_event_tsc;
+    snapshot.guest_wc_tsc = m_guest_wc_tsc;
+    snapshot.guest_wc_rtc = m_guest_wc_rtc;
+    snapshot.timer_page_gpa = m_timer_page_gpa;
+    snapshot.pvclock_page_gpa = m_pvclock_page_gpa;
+    snapshot.steal_page_gpa = m_steal_page_gpa;
+}
+
+void
+vclock_handler::restore_state(const vcpu_snapshot_t &snapshot)
+{
+    m_next_event_tsc = snapshot.next_event_tsc;
+    m_guest_wc_tsc = snapshot.guest_wc_tsc;
+    m_guest_wc_rtc = snapshot.guest_wc_rtc;
+    m_timer_page_gpa = snapshot.timer_page_gpa;
+    if (snapshot.pvclock_page_gpa != 0) {
+        if (!m_vcpu->dom()->claim_pvclock_page(m_vcpu->id())) {
+            throw std::runtime_error(
+                "pvclock page already registered by another vcpu");
+        }
+    }
+
+    m_pvclock_page_gpa = snapshot.pvclock_page_gpa;
+    m_pvclock_stale = true;
+    m_steal_page_gpa = snapshot.steal_page_gpa;
+    m_steal_page_stale = true;
+}
+
 //------------------------------------------------------------------------------
 // Time Helpers
 //------------------------------------------------------------------------------
@@ -366,16 +495,43 @@ vclock_handler::nsec_to_tsc(uint64_t nsec) const noexcept
 bool
 vclock_handler::handle_yield(vcpu *vcpu)
 {
+    this->read_timer_page();
+
     auto next_event = m_next_event_tsc;
 
     vcpu->advance();
     this->inject_vclock_event();
 
     if (auto tsc = ::x64::tsc::get(); tsc < next_event) {
+        if (this->halt_poll(vcpu, next_event)) {
+            return true;
+        }
+
+        tsc = ::x64::tsc::get();
+        if (tsc >= next_event) {
+            return true;
+        }
+
+        // Note:
+        //
+        // The vCPU is parked before the posted vIRQs are checked, and a
+        // sibling posts its vIRQ before it checks if this vCPU is parked
+        // (see vcpu::kick()), so either this vCPU sees the vIRQ, or the
+        // sibling has the parent wake up this vCPU's thread.
+        //
+
+        vcpu->park();
+
+        if (vcpu->is_virtual_interrupt_posted()) {
+            vcpu->unpark();
+            return true;
+        }
+
         auto nsec = this->tsc_to_nsec(next_event - tsc);
+        auto parent = vcpu->load_parent_vcpu();
 
-        vcpu->parent_vcpu()->load();
-        vcpu->parent_vcpu()->return_yield(nsec);
+        vcpu->set_runnable_tsc(next_event);
+        parent->return_yield(nsec);
     }
 
     return true;
@@ -386,6 +542,19 @@ vclock_handler::handle_preemption_timer(vcpu *vcpu)
 {
     bfignored(vcpu);
 
+    // Note:
+    //
+    // If the guest has moved its clock event to a later deadline using its
+    // timer page, the event that expired is dropped, and the new deadline
+    // is armed when the vCPU is resumed (see resume_delegate()).
+    //
+
+    this->read_timer_page();
+
+    if (m_next_event_tsc != 0 && ::x64::tsc::get() < m_next_event_tsc) {
+        return true;
+    }
+
     this->queue_vclock_event();
     return true;
 }
@@ -419,8 +588,7 @@ vclock_handler::vclock_op__reset_host_wallclock(vcpu *vcpu)
     try {
         vcpu->set_rax(SUCCESS);
 
-        vcpu->parent_vcpu()->load();
-        vcpu->parent_vcpu()->return_set_wallclock();
+        vcpu->load_parent_vcpu()->return_set_wallclock();
     }
     catchall({
         vcpu->set_rax(FAILURE);
@@ -496,13 +664,109 @@ vclock_handler::vclock_op__get_guest_wallclock(vcpu *vcpu)
     })
 }
 
-bool
-vclock_handler::dispatch_dom0(vcpu *vcpu)
+void
+vclock_handler::vclock_op__set_timer_page(vcpu *vcpu)
+{
+    try {
+        auto gpa = vcpu->rbx();
+        bfvmm::x64::unique_map<vclock_timer_page_t> page;
+
+        if (gpa != 0) {
+            page = vcpu->map_shared_page<vclock_timer_page_t>(gpa);
+
+            if (page.get() == nullptr) {
+                throw std::runtime_error("timer page could not be populated");
+            }
+        }
+
+        this->release_timer_page();
+
+        m_timer_page = std::move(page);
+        m_timer_page_gpa = gpa;
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vclock_handler::vclock_op__set_pvclock_page(vcpu *vcpu)
+{
+    try {
+        auto gpa = vcpu->rbx();
+        bfvmm::x64::unique_map<vclock_pvclock_page_t> page;
+
+        // Note:
+        //
+        // The page is shared by all of the domain's vCPUs, but its writer
+        // state (the guest wallclock and the mapping) is ours, so only the
+        // vCPU that registered the page can publish into it. A second vCPU
+        // that tries to register the page is refused.
+        //
+
+        if (gpa != 0) {
+            if (!m_vcpu->dom()->claim_pvclock_page(m_vcpu->id())) {
+                throw std::runtime_error(
+                    "pvclock page already registered by another vcpu");
+            }
+
+            page = vcpu->map_shared_page<vclock_pvclock_page_t>(gpa);
+
+            if (page.get() == nullptr) {
+                throw std::runtime_error("pvclock page could not be populated");
+            }
+        }
+
+        this->release_pvclock_page();
+
+        if (gpa == 0) {
+            m_vcpu->dom()->release_pvclock_page(m_vcpu->id());
+        }
+
+        m_pvclock_page = std::move(page);
+        m_pvclock_page_gpa = gpa;
+        m_pvclock_stale = true;
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vclock_handler::vclock_op__set_steal_page(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_vclock_op) {
-        return false;
+    try {
+        auto gpa = vcpu->rbx();
+        bfvmm::x64::unique_map<vclock_steal_page_t> page;
+
+        if (gpa != 0) {
+            page = vcpu->map_shared_page<vclock_steal_page_t>(gpa);
+
+            if (page.get() == nullptr) {
+                throw std::runtime_error("steal page could not be populated");
+            }
+        }
+
+        this->release_steal_page();
+
+        m_steal_page = std::move(page);
+        m_steal_page_gpa = gpa;
+        m_steal_page_stale = true;
+
+        vcpu->set_rax(SUCCESS);
     }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
 
+bool
+vclock_handler::dispatch_dom0(vcpu *vcpu)
+{
     switch (vcpu->rax()) {
         case hypercall_enum_vclock_op__get_tsc_freq_khz:
             vclock_op__get_tsc_freq_khz(vcpu);
@@ -526,10 +790,6 @@ vclock_handler::dispatch_dom0(vcpu *vcpu)
 bool
 vclock_handler::dispatch_domU(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_vclock_op) {
-        return false;
-    }
-
     switch (vcpu->rax()) {
         case hypercall_enum_vclock_op__get_tsc_freq_khz:
             vclock_op__get_tsc_freq_khz(vcpu);
@@ -555,6 +815,18 @@ vclock_handler::dispatch_domU(vcpu *vcpu)
             vclock_op__get_guest_wallclock(vcpu);
             break;
 
+        case hypercall_enum_vclock_op__set_timer_page:
+            vclock_op__set_timer_page(vcpu);
+            break;
+
+        case hypercall_enum_vclock_op__set_pvclock_page:
+            vclock_op__set_pvclock_page(vcpu);
+            break;
+
+        case hypercall_enum_vclock_op__set_steal_page:
+            vclock_op__set_steal_page(vcpu);
+            break;
+
         default:
             vcpu->halt("unknown domU vclock op");
     };
@@ -565,19 +837,34 @@ vclock_handler::dispatch_domU(vcpu *vcpu)
 void
 vclock_handler::resume_delegate(vcpu_t *vcpu)
 {
-    if (m_next_event_tsc == 0 || m_guest_wc_tsc == 0) {
-        return;
+    if (m_timer_page_gpa != 0 && m_timer_page.get() == nullptr) {
+        this->map_timer_page();
     }
 
-    if (auto tsc = ::x64::tsc::get(); tsc < m_next_event_tsc) {
-        vcpu->set_preemption_timer(
-            ((m_next_event_tsc - tsc) >> m_pet_decrement) + 1
-        );
+    if (m_pvclock_page_gpa != 0 && m_pvclock_page.get() == nullptr) {
+        this->map_pvclock_page();
+    }
 
-        return;
+    if (m_steal_page_gpa != 0 && m_steal_page.get() == nullptr) {
+        this->map_steal_page();
     }
 
-    this->queue_vclock_event();
+    this->read_timer_page();
+    this->publish_pvclock_page();
+    this->write_steal_page();
+
+    if (m_next_event_tsc != 0 && m_guest_wc_tsc != 0) {
+        if (auto tsc = ::x64::tsc::get(); tsc < m_next_event_tsc) {
+            vcpu->set_preemption_timer(
+                ((m_next_event_tsc - tsc) >> m_pet_decrement) + 1
+            );
+        }
+        else {
+            this->queue_vclock_event();
+        }
+    }
+
+    this->write_timer_page();
 }
 
 // -----------------------------------------------------------------------------
@@ -588,7 +875,7 @@ void
 vclock_handler::setup_dom0()
 {
     m_vcpu->add_vmcall_handler(
-    {&vclock_handler::dispatch_dom0, this}
+        hypercall_enum_vclock_op, {&vclock_handler::dispatch_dom0, this}
     );
 }
 
@@ -603,7 +890,7 @@ vclock_handler::setup_domU()
     }
 
     m_vcpu->add_vmcall_handler(
-    {&vclock_handler::dispatch_domU, this}
+        hypercall_enum_vclock_op, {&vclock_handler::dispatch_domU, this}
     );
 
     m_vcpu->add_resume_delegate(
@@ -637,4 +924,257 @@ vclock_handler::inject_vclock_event()
     m_next_event_tsc = 0;
 }
 
+bool
+vclock_handler::halt_poll(vcpu *vcpu, uint64_t next_event)
+{
+    auto tsc = ::x64::tsc::get();
+    auto end = tsc + this->nsec_to_tsc(m_halt_poll_nsec);
+
+    if (tsc < end && is_guest_interrupt_queued()) {
+        return true;
+    }
+
+    auto x2apic = tsc < end && is_x2apic_enabled();
+
+    while (tsc < end) {
+        if (tsc >= next_event || vcpu->is_virtual_interrupt_posted()) {
+            return true;
+        }
+
+        if (vcpu->is_killed()) {
+            return false;
+        }
+
+        if (x2apic && is_host_interrupt_pending()) {
+            return false;
+        }
+
+        __builtin_ia32_pause();
+        tsc = ::x64::tsc::get();
+    }
+
+    auto remaining = tsc < next_event ? next_event - tsc : 0;
+
+    if (remaining <= this->nsec_to_tsc(halt_poll_nsec_max)) {
+        m_halt_poll_nsec = std::min(
+            m_halt_poll_nsec != 0 ? m_halt_poll_nsec * 2 : halt_poll_nsec_start,
+            halt_poll_nsec_max
+        );
+    }
+    else {
+        m_halt_poll_nsec /= 2;
+        if (m_halt_poll_nsec < halt_poll_nsec_start) {
+            m_halt_poll_nsec = 0;
+        }
+    }
+
+    return false;
+}
+
+void
+vclock_handler::map_timer_page()
+{
+    // Note:
+    //
+    // Like the vIRQ page, a timer page that comes from a snapshot is
+    // mapped the first time the vCPU is resumed (see
+    // virq_handler::map_virq_page()).
+    //
+
+    try {
+        m_timer_page = m_vcpu->map_shared_page<vclock_timer_page_t>(m_timer_page_gpa);
+    }
+    catchall({
+        m_timer_page_gpa = 0;
+        return;
+    })
+
+    if (m_timer_page.get() == nullptr) {
+        m_vcpu->load_parent_vcpu()->return_populate(m_timer_page_gpa);
+    }
+}
+
+void
+vclock_handler::release_timer_page()
+{
+    if (m_timer_page.get() != nullptr) {
+        m_vcpu->dom()->remove_shared_page(m_timer_page_gpa);
+    }
+
+    m_timer_page = bfvmm::x64::unique_map<vclock_timer_page_t>();
+    m_timer_page_gpa = 0;
+}
+
+void
+vclock_handler::read_timer_page()
+{
+    auto page = m_timer_page.get();
+
+    if (page == nullptr || page->deadline == 0) {
+        return;
+    }
+
+    m_next_event_tsc = page->deadline - vmcs_n::tsc_offset::get();
+    page->deadline = 0;
+}
+
+void
+vclock_handler::write_timer_page()
+{
+    auto page = m_timer_page.get();
+
+    if (page == nullptr) {
+        return;
+    }
+
+    if (m_next_event_tsc == 0) {
+        page->armed = 0;
+        return;
+    }
+
+    page->armed = m_next_event_tsc + vmcs_n::tsc_offset::get();
+}
+
+void
+vclock_handler::map_pvclock_page()
+{
+    try {
+        m_pvclock_page = m_vcpu->map_shared_page<vclock_pvclock_page_t>(m_pvclock_page_gpa);
+    }
+    catchall({
+        m_pvclock_page_gpa = 0;
+        return;
+    })
+
+    if (m_pvclock_page.get() == nullptr) {
+        m_vcpu->load_parent_vcpu()->return_populate(m_pvclock_page_gpa);
+    }
+}
+
+void
+vclock_handler::release_pvclock_page()
+{
+    if (m_pvclock_page.get() != nullptr) {
+        m_vcpu->dom()->remove_shared_page(m_pvclock_page_gpa);
+    }
+
+    m_pvclock_page = bfvmm::x64::unique_map<vclock_pvclock_page_t>();
+    m_pvclock_page_gpa = 0;
+}
+
+void
+vclock_handler::publish_pvclock_page()
+{
+    auto page = m_pvclock_page.get();
+
+    if (page == nullptr || m_guest_wc_tsc == 0) {
+        return;
+    }
+
+    // Note:
+    //
+    // The page holds the wallclock base as a guest TSC, and although the
+    // page is shared by all of the domain's vCPUs, there is only one TSC
+    // offset per domain (see domain::tsc_offset()), which every vCPU loads
+    // before it resumes (see vcpu::sync_tsc_offset()). The domain's offset
+    // is used here instead of our VMCS's, so the page is valid on every
+    // vCPU, and it is republished whenever the offset changes (e.g. the
+    // domain was restored from a snapshot, or one of its vCPUs migrated to
+    // a core that is behind).
+    // The guest also sets its wallclock using two vmcalls (the RTC and
+    // then the TSC), and until both come from the same host wallclock the
+    // page is left alone so that the other vCPUs never see an RTC paired
+    // with the wrong TSC.
+    //
+
+    auto offset = m_vcpu->dom()->tsc_offset();
+
+    if (!m_pvclock_stale && offset == m_pvclock_tsc_offset) {
+        return;
+    }
+
+    if (m_host_wc_tsc != 0) {
+        if (m_guest_wc_tsc != m_host_wc_tsc ||
+            m_guest_wc_rtc.tv_sec != m_host_wc_rtc.tv_sec ||
+            m_guest_wc_rtc.tv_nsec != m_host_wc_rtc.tv_nsec) {
+            return;
+        }
+    }
+
+    auto [mul, shift] = pvclock_mul_shift(m_tsc_freq_khz);
+
+    auto version = reinterpret_cast<uint64_t *>(page);
+    auto seq = __atomic_load_n(version, __ATOMIC_RELAXED) & ~1ULL;
+
+    __atomic_store_n(version, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    page->tsc_freq_khz = m_tsc_freq_khz;
+    page->tsc_mul = mul;
+    page->tsc_shift = shift;
+    page->wc_tsc = m_guest_wc_tsc + offset;
+    page->wc_sec = m_guest_wc_rtc.tv_sec;
+    page->wc_nsec = m_guest_wc_rtc.tv_nsec;
+
+    __atomic_store_n(version, seq + 2, __ATOMIC_RELEASE);
+
+    m_pvclock_tsc_offset = offset;
+    m_pvclock_stale = false;
+}
+
+void
+vclock_handler::map_steal_page()
+{
+    try {
+        m_steal_page = m_vcpu->map_shared_page<vclock_steal_page_t>(m_steal_page_gpa);
+    }
+    catchall({
+        m_steal_page_gpa = 0;
+        return;
+    })
+
+    if (m_steal_page.get() == nullptr) {
+        m_vcpu->load_parent_vcpu()->return_populate(m_steal_page_gpa);
+    }
+}
+
+void
+vclock_handler::release_steal_page()
+{
+    if (m_steal_page.get() != nullptr) {
+        m_vcpu->dom()->remove_shared_page(m_steal_page_gpa);
+    }
+
+    m_steal_page = bfvmm::x64::unique_map<vclock_steal_page_t>();
+    m_steal_page_gpa = 0;
+}
+
+void
+vclock_handler::write_steal_page()
+{
+    auto page = m_steal_page.get();
+
+    if (page == nullptr) {
+        return;
+    }
+
+    // Note:
+    //
+    // This runs before every VM entry, so the conversion (which needs two
+    // divides) is skipped unless the steal time has changed since the
+    // page was last written.
+    //
+
+    auto steal_tsc = m_vcpu->steal_tsc();
+
+    if (!m_steal_page_stale && steal_tsc == m_steal_page_tsc) {
+        return;
+    }
+
+    page->steal = this->tsc_to_nsec(steal_tsc);
+
+    m_steal_page_tsc = steal_tsc;
+    m_steal_page_stale = false;
+}
+
 }
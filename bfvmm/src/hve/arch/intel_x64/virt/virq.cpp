@@ -39,7 +39,11 @@ virq_handler::virq_handler(
     }
 
     m_vcpu->add_vmcall_handler(
-    {&virq_handler::dispatch, this}
+        hypercall_enum_virq_op, {&virq_handler::dispatch, this}
+    );
+
+    m_vcpu->add_resume_delegate(
+    {&virq_handler::resume_delegate, this}
     );
 }
 
@@ -50,6 +54,14 @@ virq_handler::virq_handler(
 void
 virq_handler::queue_virtual_interrupt(uint64_t vector)
 {
+    if (m_virq_page_gpa != 0) {
+        if (this->set_pending(vector)) {
+            m_vcpu->queue_external_interrupt(m_hypervisor_callback_vector);
+        }
+
+        return;
+    }
+
     m_interrupt_queue.push(vector);
     m_vcpu->queue_external_interrupt(m_hypervisor_callback_vector);
 }
@@ -57,14 +69,186 @@ virq_handler::queue_virtual_interrupt(uint64_t vector)
 void
 virq_handler::inject_virtual_interrupt(uint64_t vector)
 {
+    if (m_virq_page_gpa != 0) {
+        if (this->set_pending(vector)) {
+            m_vcpu->inject_external_interrupt(m_hypervisor_callback_vector);
+        }
+
+        return;
+    }
+
     m_interrupt_queue.push(vector);
     m_vcpu->inject_external_interrupt(m_hypervisor_callback_vector);
 }
 
+void
+virq_handler::post_virtual_interrupt(uint64_t vector)
+{
+    std::lock_guard lock(m_posted_mutex);
+
+    m_posted.push_back(vector);
+    m_posted_pending = true;
+}
+
+bool
+virq_handler::is_virtual_interrupt_posted() const noexcept
+{ return m_posted_pending; }
+
+void
+virq_handler::kick(uint64_t vcpuid)
+{ m_kicks.push_back(vcpuid); }
+
+void
+virq_handler::save_state(vcpu_snapshot_t &snapshot)
+{
+    std::lock_guard lock(m_posted_mutex);
+
+    snapshot.hypervisor_callback_vector = m_hypervisor_callback_vector;
+    snapshot.virq_page_gpa = m_virq_page_gpa;
+
+    while (!m_interrupt_queue.empty()) {
+        snapshot.virqs.push_back(m_interrupt_queue.pop());
+    }
+
+    snapshot.virqs.insert(snapshot.virqs.end(), m_posted.begin(), m_posted.end());
+}
+
+void
+virq_handler::restore_state(const vcpu_snapshot_t &snapshot)
+{
+    m_hypervisor_callback_vector = snapshot.hypervisor_callback_vector;
+    m_virq_page_gpa = snapshot.virq_page_gpa;
+
+    for (const auto vector : snapshot.virqs) {
+        this->post_virtual_interrupt(vector);
+    }
+}
+
+bool
+virq_handler::set_pending(uint64_t vector)
+{
+    auto page = m_virq_page.get();
+
+    // Note:
+    //
+    // A vIRQ that is queued before the vIRQ page is mapped (see
+    // map_virq_page()) is posted instead, and is marked as pending once the
+    // page has been mapped.
+    //
+
+    if (page == nullptr) {
+        this->post_virtual_interrupt(vector);
+        return false;
+    }
+
+    // Note:
+    //
+    // The structures in bfhypercall.h are packed, so the page is accessed
+    // as an array of words (pending followed by mask) instead of taking
+    // the address of a packed member.
+    //
+
+    auto words = reinterpret_cast<uint64_t *>(page);
+
+    auto index = virq_page_index(vector);
+    auto word = index / 64;
+    auto bit = 1ULL << (index % 64);
+
+    auto old = __atomic_fetch_or(&words[word], bit, __ATOMIC_SEQ_CST);
+    auto mask = __atomic_load_n(&words[VIRQ_PAGE_NUM_WORDS + word], __ATOMIC_SEQ_CST);
+
+    return ((old | mask) & bit) == 0;
+}
+
+void
+virq_handler::map_virq_page()
+{
+    // Note:
+    //
+    // A vCPU that is restored (or forked) from a snapshot maps its vIRQ page
+    // the first time it is resumed, as the page might still be shared
+    // copy-on-write, or might not be populated yet. If there is no memory
+    // left to populate it with, control is handed back to the parent so
+    // that dom0 can add more, and the page is mapped the next time this
+    // vCPU is resumed. Since the hypervisor callback vector is not part of
+    // the snapshot, it is queued again if the page still holds vIRQs that
+    // were pending when the snapshot was taken. A page that cannot be
+    // mapped at all leaves the vCPU using the vIRQ queue.
+    //
+
+    try {
+        m_virq_page = m_vcpu->map_shared_page<virq_page_t>(m_virq_page_gpa);
+    }
+    catchall({
+        m_virq_page_gpa = 0;
+        return;
+    })
+
+    if (m_virq_page.get() == nullptr) {
+        m_vcpu->load_parent_vcpu()->return_populate(m_virq_page_gpa);
+    }
+
+    for (uint64_t i = 0; i < VIRQ_PAGE_NUM_WORDS; i++) {
+        if ((m_virq_page->pending[i] & ~m_virq_page->mask[i]) != 0) {
+            m_vcpu->queue_external_interrupt(m_hypervisor_callback_vector);
+            break;
+        }
+    }
+}
+
+void
+virq_handler::release_virq_page()
+{
+    if (m_virq_page.get() != nullptr) {
+        m_vcpu->dom()->remove_shared_page(m_virq_page_gpa);
+    }
+
+    m_virq_page = bfvmm::x64::unique_map<virq_page_t>();
+    m_virq_page_gpa = 0;
+}
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
 
+void
+virq_handler::resume_delegate(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // Kicks are only recorded by this vCPU (while it handles an IPI), so
+    // the list does not need to be locked. Each kick costs a trip to the
+    // parent, and the remaining kicks are handled as the parent resumes
+    // this vCPU again.
+    //
+
+    if (!m_kicks.empty()) {
+        auto vcpuid = m_kicks.back();
+        m_kicks.pop_back();
+
+        m_vcpu->load_parent_vcpu()->return_wakeup(vcpuid);
+    }
+
+    if (m_virq_page_gpa != 0 && m_virq_page.get() == nullptr) {
+        this->map_virq_page();
+    }
+
+    if (!m_posted_pending) {
+        return;
+    }
+
+    std::lock_guard lock(m_posted_mutex);
+
+    for (const auto vector : m_posted) {
+        this->queue_virtual_interrupt(vector);
+    }
+
+    m_posted.clear();
+    m_posted_pending = false;
+}
+
 void
 virq_handler::virq_op__set_hypervisor_callback_vector(
     vcpu *vcpu)
@@ -93,13 +277,49 @@ virq_handler::virq_op__get_next_virq(vcpu *vcpu)
     })
 }
 
-bool
-virq_handler::dispatch(vcpu *vcpu)
+void
+virq_handler::virq_op__set_virq_page(
+    vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_virq_op) {
-        return false;
+    try {
+        auto gpa = vcpu->rbx();
+        bfvmm::x64::unique_map<virq_page_t> page;
+
+        if (gpa != 0) {
+            page = vcpu->map_shared_page<virq_page_t>(gpa);
+
+            if (page.get() == nullptr) {
+                throw std::runtime_error("virq page could not be populated");
+            }
+        }
+
+        this->release_virq_page();
+
+        m_virq_page = std::move(page);
+        m_virq_page_gpa = gpa;
+
+        // Note:
+        //
+        // vIRQs that were queued before the page was registered are moved
+        // into the page, so that the guest only has to look in one place.
+        //
+
+        if (m_virq_page_gpa != 0) {
+            while (!m_interrupt_queue.empty()) {
+                this->queue_virtual_interrupt(m_interrupt_queue.pop());
+            }
+        }
+
+        vcpu->set_rax(SUCCESS);
     }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
 
+bool
+virq_handler::dispatch(vcpu *vcpu)
+{
     switch (vcpu->rax()) {
         case hypercall_enum_virq_op__set_hypervisor_callback_vector:
             virq_op__set_hypervisor_callback_vector(vcpu);
@@ -109,6 +329,10 @@ virq_handler::dispatch(vcpu *vcpu)
             virq_op__get_next_virq(vcpu);
             break;
 
+        case hypercall_enum_virq_op__set_virq_page:
+            virq_op__set_virq_page(vcpu);
+            break;
+
         default:
             vcpu->halt("unknown virq op");
     };
@@ -35,19 +35,38 @@ debug_op_handler::debug_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&debug_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        MV_DEBUG_OP_VAL, {&debug_op_handler::dispatch, this});
 }
 
-bool
-debug_op_handler::dispatch(vcpu *vcpu)
+void
+debug_op_handler::dump_vmexit_log(vcpu *vcpu)
 {
-    if (mv_hypercall_opcode(vcpu->rax()) != MV_DEBUG_OP_VAL) {
-        return false;
+    try {
+        if (vcpu->r10() == MV_VPID_SELF) {
+            vcpu->dump_vmexit_log();
+        }
+        else {
+            get_vcpu(vcpu->r10())->dump_vmexit_log();
+        }
+
+        vcpu->set_rax(MV_STATUS_SUCCESS);
     }
+    catchall({
+        vcpu->set_rax(MV_STATUS_FAILURE_UNKNOWN);
+    })
+}
 
+bool
+debug_op_handler::dispatch(vcpu *vcpu)
+{
     // TODO: Validate the handle
 
     switch (mv_hypercall_index(vcpu->rax())) {
+        case MV_DEBUG_OP_DUMP_VMEXIT_LOG_IDX_VAL:
+            this->dump_vmexit_log(vcpu);
+            return true;
+
         default:
             break;
     };
@@ -23,6 +23,9 @@
 #include <hve/arch/intel_x64/domain.h>
 #include <hve/arch/intel_x64/vmcall/domain_op.h>
 
+#include <cstring>
+#include <algorithm>
+
 namespace boxy::intel_x64
 {
 
@@ -35,7 +38,8 @@ domain_op_handler::domain_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&domain_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        hypercall_enum_domain_op, {&domain_op_handler::dispatch, this});
 }
 
 void
@@ -67,6 +71,130 @@ domain_op_handler::domain_op__destroy_domain(vcpu *vcpu)
     })
 }
 
+void
+domain_op_handler::domain_op__pause_domain(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__pause_domain: self not supported");
+        }
+
+        auto dom = get_domain(vcpu->rbx());
+        dom->pause();
+
+        // Note:
+        //
+        // A vCPU that is running when the domain is paused is not stopped
+        // here. It will stop the next time it exits to its parent (e.g. the
+        // next external interrupt), so the caller is expected to try again
+        // until all of the vCPUs have stopped. A stopped vCPU might also
+        // still be active on the core that last ran it, until the next
+        // time its thread tries to run it (see run_op_handler::dispatch()).
+        //
+
+        auto running = false;
+        dom->foreach_vcpu([&](auto child) {
+            running = running || child->is_running() || !child->is_released();
+        });
+
+        if (running) {
+            vcpu->set_rax(FAILURE);
+            return;
+        }
+
+        // Note:
+        //
+        // Each vCPU's VMCS has to be loaded on this core to read its state.
+        // None of them are active on another core (see vcpu::release()),
+        // and once the state is read, the VMCS is released again and the
+        // VMCS of the vCPU that made this call is put back.
+        //
+
+        if (!dom->has_snapshot()) {
+            std::vector<vcpu_snapshot_t> snapshot;
+            auto host_tsc = ::x64::tsc::get();
+
+            auto ___ = gsl::finally([&] {
+                vcpu->load();
+            });
+
+            dom->foreach_vcpu([&](auto child) {
+                auto &state = snapshot.emplace_back();
+
+                child->load();
+                child->save_state(state);
+                child->release();
+
+                state.host_tsc = host_tsc;
+            });
+
+            dom->set_snapshot(std::move(snapshot));
+        }
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__fork_domain(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__fork_domain: self not supported");
+        }
+
+        auto parent = get_domain(vcpu->rbx());
+        auto domainid = domain::generate_domainid();
+
+        g_dm->create(domainid, nullptr);
+
+        try {
+            get_domain(domainid)->fork(parent);
+        }
+        catch (...) {
+            g_dm->destroy(domainid);
+            throw;
+        }
+
+        vcpu->set_rax(domainid);
+    }
+    catchall({
+        vcpu->set_rax(INVALID_DOMAINID);
+    })
+}
+
+void
+domain_op_handler::domain_op__fork_memory(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__fork_memory: self not supported");
+        }
+
+        vcpu->set_rax(get_domain(vcpu->rbx())->fork_memory() ? 1 : SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__num_vcpus(vcpu *vcpu)
+{
+    try {
+        vcpu->set_rax(get_domain(vcpu->rbx())->num_vcpus());
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
 void
 domain_op_handler::domain_op__set_uart(vcpu *vcpu)
 {
@@ -268,6 +396,389 @@ domain_op_handler::domain_op__donate_page_rwe(vcpu *vcpu)
     })
 }
 
+void
+domain_op_handler::domain_op__set_balloon_target(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__set_balloon_target: self not supported");
+        }
+
+        get_domain(vcpu->rbx())->set_balloon_target(vcpu->rcx());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__balloon_reclaim(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__balloon_reclaim: self not supported");
+        }
+
+        auto mdl =
+            vcpu->map_gva_4k<mv_mdl_t>(vcpu->rcx(), sizeof(mv_mdl_t));
+
+        get_domain(vcpu->rbx())->balloon_reclaim(*mdl);
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__balloon_wanted(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__balloon_wanted: self not supported");
+        }
+
+        auto mdl =
+            vcpu->map_gva_4k<mv_mdl_t>(vcpu->rcx(), sizeof(mv_mdl_t));
+
+        get_domain(vcpu->rbx())->balloon_wanted(*mdl);
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__set_demand_range(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__set_demand_range: self not supported");
+        }
+
+        get_domain(vcpu->rbx())->set_demand_range(vcpu->rcx(), vcpu->rdx());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__demand_pool_add(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__demand_pool_add: self not supported");
+        }
+
+        auto dom = get_domain(vcpu->rbx());
+
+        for (auto mdl_gpa = vcpu->rcx(); mdl_gpa != 0;) {
+            auto mdl{vcpu->map_gpa_4k<mv_mdl_t>(mdl_gpa)};
+
+            if (mdl->num_entries > MV_MDL_MAP_MAX_NUM_ENTRIES) {
+                throw std::runtime_error(
+                    "domain_op__demand_pool_add: invalid mdl");
+            }
+
+            for (uint64_t i = 0; i < mdl->num_entries; i++) {
+                const auto &entry = mdl->entries[i];
+                dom->demand_pool_add(vcpu->gpa_to_hpa(entry.gpa).first, entry.size);
+            }
+
+            mdl_gpa = mdl->next;
+        }
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__e820_map(vcpu *vcpu)
+{
+    try {
+        auto mdl =
+            vcpu->map_gva_4k<mv_mdl_t>(vcpu->rcx(), sizeof(mv_mdl_t));
+
+        *mdl = get_domain(vcpu->rbx())->e820_map();
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__read_memory(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__read_memory: self not supported");
+        }
+
+        auto dom = get_domain(vcpu->rbx());
+        auto gpa = vcpu->rdx();
+
+        if (!dom->is_paused() || (gpa & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error(
+                "domain_op__read_memory: invalid domain or gpa");
+        }
+
+        auto buffer =
+            vcpu->map_gva_4k<uint8_t>(vcpu->rcx(), MEMORY_MAX_BUFFER);
+
+        // Note:
+        //
+        // Pages that are not mapped (i.e. memory that has not been populated
+        // yet, or that was given back using the balloon) read as zero.
+        //
+
+        for (uint64_t i = 0; i < MEMORY_MAX_BUFFER; i += BAREFLANK_PAGE_SIZE) {
+            if (uintptr_t hpa; dom->gpa_to_hpa(gpa + i, hpa)) {
+                auto page = vcpu->map_hpa_4k<uint8_t>(hpa);
+                std::memcpy(buffer.get() + i, page.get(), BAREFLANK_PAGE_SIZE);
+            }
+            else {
+                std::memset(buffer.get() + i, 0, BAREFLANK_PAGE_SIZE);
+            }
+        }
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__write_memory(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__write_memory: self not supported");
+        }
+
+        auto dom = get_domain(vcpu->rbx());
+        auto gpa = vcpu->rdx();
+
+        if ((gpa & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error(
+                "domain_op__write_memory: invalid gpa");
+        }
+
+        auto buffer =
+            vcpu->map_gva_4k<uint8_t>(vcpu->rcx(), MEMORY_MAX_BUFFER);
+
+        // Note:
+        //
+        // A page that is all zeros is skipped if it has not been populated
+        // yet, as the demand pool will back it with a zeroed page the first
+        // time the guest touches it. Any other page that is not populated
+        // yet is populated here. If the demand pool runs dry, the number of
+        // bytes that were written so far is returned, and the caller is
+        // expected to add more memory to the pool and try again. A page
+        // that is still shared copy-on-write (e.g. with a fork's parent or
+        // a template) is given its own copy first (which is also taken
+        // from the demand pool), as the shared page must not be modified.
+        //
+
+        for (uint64_t i = 0; i < MEMORY_MAX_BUFFER; i += BAREFLANK_PAGE_SIZE) {
+            auto src = buffer.get() + i;
+
+            uintptr_t hpa;
+            if (!dom->gpa_to_hpa(gpa + i, hpa)) {
+                auto zero = std::all_of(src, src + BAREFLANK_PAGE_SIZE, [](auto byte) {
+                    return byte == 0;
+                });
+
+                if (zero) {
+                    continue;
+                }
+
+                if (!dom->is_demand_gpa(gpa + i)) {
+                    throw std::runtime_error(
+                        "domain_op__write_memory: gpa is not guest RAM");
+                }
+
+                if (!dom->demand_populate(gpa + i)) {
+                    vcpu->set_rax(i);
+                    return;
+                }
+
+                if (!dom->gpa_to_hpa(gpa + i, hpa)) {
+                    throw std::runtime_error(
+                        "domain_op__write_memory: demand_populate failed");
+                }
+            }
+
+            if (dom->is_cow_gpa(gpa + i)) {
+                auto copied = false;
+
+                auto populated = dom->cow_populate(gpa + i, [&](auto dst_hpa, auto) {
+                    auto page = vcpu->map_hpa_4k<uint8_t>(dst_hpa);
+                    std::memcpy(page.get(), src, BAREFLANK_PAGE_SIZE);
+
+                    copied = true;
+                });
+
+                if (!populated) {
+                    vcpu->set_rax(i);
+                    return;
+                }
+
+                if (copied) {
+                    continue;
+                }
+
+                if (!dom->gpa_to_hpa(gpa + i, hpa)) {
+                    throw std::runtime_error(
+                        "domain_op__write_memory: cow_populate failed");
+                }
+            }
+
+            auto page = vcpu->map_hpa_4k<uint8_t>(hpa);
+            std::memcpy(page.get(), src, BAREFLANK_PAGE_SIZE);
+        }
+
+        vcpu->set_rax(MEMORY_MAX_BUFFER);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__export_snapshot(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__export_snapshot: self not supported");
+        }
+
+        auto words = get_domain(vcpu->rbx())->export_snapshot();
+        auto size = words.size() * sizeof(uint64_t);
+
+        // Note:
+        //
+        // The size of the snapshot is always returned, but the snapshot is
+        // only copied if the provided buffer is large enough, so the caller
+        // can ask for the size first by providing an empty buffer.
+        //
+
+        if (vcpu->rdx() >= size) {
+            auto buffer = vcpu->map_gva_4k<uint8_t>(vcpu->rcx(), size);
+            std::memcpy(buffer.get(), words.data(), size);
+        }
+
+        vcpu->set_rax(size);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__import_snapshot(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__import_snapshot: self not supported");
+        }
+
+        auto size = vcpu->rdx();
+        if (size == 0 || (size % sizeof(uint64_t)) != 0) {
+            throw std::runtime_error(
+                "domain_op__import_snapshot: invalid size");
+        }
+
+        auto buffer = vcpu->map_gva_4k<uint64_t>(vcpu->rcx(), size);
+
+        get_domain(vcpu->rbx())->import_snapshot(
+            gsl::span<const uint64_t>(
+                buffer.get(), gsl::narrow<std::ptrdiff_t>(size / sizeof(uint64_t)))
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__enable_dirty_log(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__enable_dirty_log: self not supported");
+        }
+
+        get_domain(vcpu->rbx())->enable_dirty_log();
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__disable_dirty_log(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__disable_dirty_log: self not supported");
+        }
+
+        get_domain(vcpu->rbx())->disable_dirty_log();
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__dirty_log(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__dirty_log: self not supported");
+        }
+
+        auto bitmap =
+            vcpu->map_gva_4k<uint64_t>(vcpu->rcx(), DIRTY_LOG_MAX_BUFFER);
+
+        get_domain(vcpu->rbx())->dirty_log(
+            vcpu->rdx(),
+            gsl::span<uint64_t>(
+                bitmap.get(), DIRTY_LOG_MAX_BUFFER / sizeof(uint64_t))
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
 #define domain_op__reg(reg)                                                     \
     void                                                                        \
     domain_op_handler::domain_op__ ## reg(vcpu *vcpu)                    \
@@ -439,13 +950,13 @@ domain_op__set_reg(ldtr_access_rights);
 bool
 domain_op_handler::dispatch(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_domain_op) {
-        return false;
-    }
-
     switch (vcpu->rax()) {
             dispatch_case(create_domain)
             dispatch_case(destroy_domain)
+            dispatch_case(pause_domain)
+            dispatch_case(fork_domain)
+            dispatch_case(fork_memory)
+            dispatch_case(num_vcpus)
 
             dispatch_case(set_uart)
             dispatch_case(set_pt_uart)
@@ -458,6 +969,23 @@ domain_op_handler::dispatch(vcpu *vcpu)
             dispatch_case(donate_page_rw)
             dispatch_case(donate_page_rwe)
 
+            dispatch_case(set_balloon_target)
+            dispatch_case(balloon_reclaim)
+            dispatch_case(balloon_wanted)
+
+            dispatch_case(set_demand_range)
+            dispatch_case(demand_pool_add)
+
+            dispatch_case(e820_map)
+            dispatch_case(read_memory)
+            dispatch_case(write_memory)
+            dispatch_case(export_snapshot)
+            dispatch_case(import_snapshot)
+
+            dispatch_case(enable_dirty_log)
+            dispatch_case(disable_dirty_log)
+            dispatch_case(dirty_log)
+
             dispatch_case(rax);
             dispatch_case(set_rax);
             dispatch_case(rbx);
@@ -34,7 +34,8 @@ handle_op_handler::handle_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&handle_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        MV_HANDLE_OP_VAL, {&handle_op_handler::dispatch, this});
 }
 
 void
@@ -57,10 +58,6 @@ handle_op_handler::close_handle(vcpu *vcpu)
 bool
 handle_op_handler::dispatch(vcpu *vcpu)
 {
-    if (mv_hypercall_opcode(vcpu->rax()) != MV_HANDLE_OP_VAL) {
-        return false;
-    }
-
     // TODO: Validate the handle
 
     switch (mv_hypercall_index(vcpu->rax())) {
@@ -22,6 +22,23 @@
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/vmcall/run_op.h>
 
+// Note:
+//
+// An AP that is waiting for a SIPI is not run. Instead, it is parked and
+// the parent is told to yield. The sibling that sends the SIPI wakes the
+// thread that runs the AP up (see vcpu::kick()), so the following is only
+// an upper bound on how long the parent sleeps before trying again.
+//
+constexpr const auto wait_for_sipi_yield_nsec = 100000000ULL;
+
+// Note:
+//
+// A vCPU that belongs to a paused domain is not run either (see
+// domain::pause()). A paused domain is only ever forked from, so its vCPUs
+// are not resumed and the parent can yield for much longer.
+//
+constexpr const auto paused_yield_nsec = 100000000ULL;
+
 namespace boxy::intel_x64
 {
 
@@ -34,7 +51,8 @@ run_op_handler::run_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&run_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        hypercall_enum_run_op, {&run_op_handler::dispatch, this});
 }
 
 bool
@@ -51,13 +69,13 @@ run_op_handler::dispatch(vcpu *vcpu)
     //   executing a guest.
     // - Do no assume that the parent vCPU is always the same. It is possible
     //   for the host to change the parent vCPU the next time this is executed.
-    //   If this happens, a VMCS migration must take place.
-    // - This handler should be the first handler to be called. This way, we
-    //   do no end up looping through the vmcall handlers on every interrupt.
-
-    if (bfopcode(vcpu->rax()) != hypercall_enum_run_op) {
-        return false;
-    }
+    //   If this happens, a VMCS migration must take place. The child's VMCS
+    //   stays active on the core that last ran it, and the host is expected
+    //   to release it from that core before moving the thread that runs it
+    //   (see vcpu::release()), so all that is left to do here is migrate().
+    //   A child that was not released cannot be loaded here.
+    // - The vmcall handler looks this handler up directly using its opcode,
+    //   so no other vmcall handlers are executed on the way here.
 
     try {
         if (m_child_vcpuid != vcpu->rbx()) {
@@ -65,24 +83,112 @@ run_op_handler::dispatch(vcpu *vcpu)
             m_child_vcpuid = vcpu->rbx();
         }
 
-        m_child_vcpu->set_parent_vcpu(vcpu);
-
         if (m_child_vcpu->is_alive()) {
-            m_child_vcpu->load();
+            if (!m_child_vcpu->is_released()) {
+                if (m_child_vcpu->parent_vcpu() != vcpu) {
+                    throw std::runtime_error(
+                        "run_op: vcpu was not released by the last core to run it");
+                }
+            }
+
+            if (m_child_vcpu->is_waiting_for_sipi()) {
+
+                // Note:
+                //
+                // The AP is parked before it checks for the SIPI again, and
+                // a sibling delivers the SIPI before it checks if the AP is
+                // parked, so either the AP sees the SIPI here, or the
+                // sibling has the parent wake up the AP's thread.
+                //
+
+                m_child_vcpu->park();
+
+                if (m_child_vcpu->is_waiting_for_sipi()) {
+                    m_child_vcpu->set_runnable_tsc(0);
+                    m_child_vcpu->record_exit(
+                        mv_vp_exit_t_yield, wait_for_sipi_yield_nsec
+                    );
+
+                    vcpu->set_rax(
+                        (wait_for_sipi_yield_nsec << 4) | hypercall_enum_run_op__yield
+                    );
+
+                    return true;
+                }
+
+                m_child_vcpu->unpark();
+            }
+
+            if (!m_child_vcpu->mark_running()) {
+
+                // Note:
+                //
+                // A paused domain's vCPUs are not run again, and their
+                // state can only be read once none of them are active on
+                // any core (see domain_op__pause_domain()). A vCPU that is
+                // not allowed to run is not runnable, so the time the
+                // domain spends paused (or an AP spends waiting for its
+                // SIPI) is not reported to the guest as steal time.
+                //
+
+                if (!m_child_vcpu->is_released()) {
+                    m_child_vcpu->release();
+                }
+
+                m_child_vcpu->set_runnable_tsc(0);
+
+                m_child_vcpu->record_exit(
+                    mv_vp_exit_t_yield, paused_yield_nsec
+                );
+
+                vcpu->set_rax(
+                    (paused_yield_nsec << 4) | hypercall_enum_run_op__yield
+                );
+
+                return true;
+            }
+
+            // Note:
+            //
+            // If anything fails once the child is loaded, its VMCS is
+            // released so that it is not left active on this core, and the
+            // VMCS of the parent is put back before the fault is reported.
+            //
 
             try {
+                m_child_vcpu->load();
+
+                if (m_child_vcpu->parent_vcpu() != vcpu) {
+                    m_child_vcpu->migrate(vcpu);
+                }
+
+                m_child_vcpu->sync_ept();
+                m_child_vcpu->sync_tsc_offset();
+
+                m_child_vcpu->apply_startup_ipi();
+                m_child_vcpu->account_steal_time();
+
                 m_child_vcpu->prepare_for_world_switch();
                 m_child_vcpu->run();
             }
             catch (...) {
+                m_child_vcpu->release();
+
+                vcpu->load();
                 vcpu->prepare_for_world_switch();
                 throw;
             }
         }
 
+        m_child_vcpu->record_exit(mv_vp_exit_t_hlt);
         vcpu->set_rax(hypercall_enum_run_op__hlt);
     }
     catchall({
+        if (m_child_vcpuid == vcpu->rbx()) {
+            m_child_vcpu->mark_stopped();
+            m_child_vcpu->record_exit(mv_vp_exit_t_fault);
+        }
+
         vcpu->set_rax(hypercall_enum_run_op__fault);
     })
 
@@ -35,7 +35,8 @@ vcpu_op_handler::vcpu_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&vcpu_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        hypercall_enum_vcpu_op, {&vcpu_op_handler::dispatch, this});
 }
 
 void
@@ -44,6 +45,15 @@ vcpu_op_handler::vcpu_op__create_vcpu(vcpu *vcpu)
     try {
         vcpu->set_rax(bfvmm::vcpu::generate_vcpuid());
         g_vcm->create(vcpu->rax(), get_domain(vcpu->rbx()));
+
+        // Note:
+        //
+        // The new vCPU's VMCS was loaded on this core to set it up, but the
+        // thread that runs it might start on any core. The vmcall handler
+        // puts the VMCS of the vCPU that made this call back once we return.
+        //
+
+        get_vcpu(vcpu->rax())->release();
     }
     catchall({
         vcpu->set_rax(INVALID_VCPUID);
@@ -76,13 +86,46 @@ vcpu_op_handler::vcpu_op__destroy_vcpu(vcpu *vcpu)
     })
 }
 
-bool
-vcpu_op_handler::dispatch(vcpu *vcpu)
+void
+vcpu_op_handler::vcpu_op__vmexit_log(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_vcpu_op) {
-        return false;
+    try {
+        auto log = vcpu->map_gva_4k<char>(vcpu->rcx(), sizeof(mv_vmexit_log_t));
+        auto &data = get_vcpu(vcpu->rbx())->vmexit_log_data();
+
+        memcpy(log.get(), &data, sizeof(mv_vmexit_log_t));
+        vcpu->set_rax(SUCCESS);
     }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vcpu_op_handler::vcpu_op__release_vcpu(vcpu *vcpu)
+{
+    try {
+        auto child_vcpu = get_vcpu(vcpu->rbx());
 
+        if (!child_vcpu->is_released()) {
+            if (child_vcpu->parent_vcpu() != vcpu) {
+                throw std::runtime_error(
+                    "vcpu_op__release_vcpu: vcpu was last run on another core");
+            }
+
+            child_vcpu->release();
+        }
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+bool
+vcpu_op_handler::dispatch(vcpu *vcpu)
+{
     switch (vcpu->rax()) {
         case hypercall_enum_vcpu_op__create_vcpu:
             this->vcpu_op__create_vcpu(vcpu);
@@ -96,6 +139,14 @@ vcpu_op_handler::dispatch(vcpu *vcpu)
             this->vcpu_op__destroy_vcpu(vcpu);
             return true;
 
+        case hypercall_enum_vcpu_op__vmexit_log:
+            this->vcpu_op__vmexit_log(vcpu);
+            return true;
+
+        case hypercall_enum_vcpu_op__release_vcpu:
+            this->vcpu_op__release_vcpu(vcpu);
+            return true;
+
         default:
             break;
     };
@@ -35,16 +35,13 @@ vm_management_op_handler::vm_management_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&vm_management_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        MV_VM_MANAGEMENT_OP_VAL, {&vm_management_op_handler::dispatch, this});
 }
 
 bool
 vm_management_op_handler::dispatch(vcpu *vcpu)
 {
-    if (mv_hypercall_opcode(vcpu->rax()) != MV_VM_MANAGEMENT_OP_VAL) {
-        return false;
-    }
-
     // TODO: Validate the handle
 
     switch (mv_hypercall_index(vcpu->rax())) {
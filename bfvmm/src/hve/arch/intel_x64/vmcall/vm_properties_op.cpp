@@ -35,7 +35,8 @@ vm_properties_op_handler::vm_properties_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&vm_properties_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        MV_VM_PROPERTIES_OP_VAL, {&vm_properties_op_handler::dispatch, this});
 }
 
 void
@@ -103,10 +104,6 @@ vm_properties_op_handler::set_e820(vcpu *vcpu)
 bool
 vm_properties_op_handler::dispatch(vcpu *vcpu)
 {
-    if (mv_hypercall_opcode(vcpu->rax()) != MV_VM_PROPERTIES_OP_VAL) {
-        return false;
-    }
-
     // TODO: Validate the handle
 
     switch (mv_hypercall_index(vcpu->rax())) {
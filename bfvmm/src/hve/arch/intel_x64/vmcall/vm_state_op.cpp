@@ -26,6 +26,229 @@
 namespace boxy::intel_x64
 {
 
+// -----------------------------------------------------------------------------
+// Initial Register State
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The following maps each mv_reg_t to the domain's initial register state so
+// that a register (or a whole list of registers) can be get/set without
+// having to go through a switch statement for each register. Registers that
+// the domain does not store are left empty and are reported as unsupported.
+//
+
+struct reg_accessors_t {
+    uint64_t (domain::*get)() const noexcept;
+    void (domain::*set)(uint64_t) noexcept;
+};
+
+#define REG(a) reg_accessors_t{&domain::a, &domain::set_##a}
+#define NO_REG reg_accessors_t{nullptr, nullptr}
+
+static const std::array<reg_accessors_t, mv_reg_t_max> s_reg_accessors = {
+    REG(rax), REG(rbx), REG(rcx), REG(rdx), REG(rdi), REG(rsi),
+    REG(r08), REG(r09), REG(r10), REG(r11), REG(r12), REG(r13),
+    REG(r14), REG(r15), REG(rbp), REG(rsp), REG(rip),
+    REG(cr0), REG(cr2), REG(cr3), REG(cr4), REG(cr8),
+    REG(dr0), REG(dr1), REG(dr2), REG(dr3), NO_REG, NO_REG, REG(dr6), REG(dr7),
+    NO_REG,
+    REG(es_selector), REG(es_base), REG(es_limit), REG(es_access_rights),
+    REG(cs_selector), REG(cs_base), REG(cs_limit), REG(cs_access_rights),
+    REG(ss_selector), REG(ss_base), REG(ss_limit), REG(ss_access_rights),
+    REG(ds_selector), REG(ds_base), REG(ds_limit), REG(ds_access_rights),
+    REG(fs_selector), REG(fs_base), REG(fs_limit), REG(fs_access_rights),
+    REG(gs_selector), REG(gs_base), REG(gs_limit), REG(gs_access_rights),
+    REG(ldtr_selector), REG(ldtr_base), REG(ldtr_limit), REG(ldtr_access_rights),
+    REG(tr_selector), REG(tr_base), REG(tr_limit), REG(tr_access_rights),
+    NO_REG, REG(gdt_base), REG(gdt_limit), NO_REG,
+    NO_REG, REG(idt_base), REG(idt_limit), NO_REG
+};
+
+#undef REG
+#undef NO_REG
+
+static bool
+is_supported_reg(uint64_t reg) noexcept
+{ return reg < mv_reg_t_max && s_reg_accessors[reg].get != nullptr; }
+
+static bool
+resolve_vmid(vcpu *vcpu, uint64_t &vmid)
+{
+    switch (vmid) {
+        case MV_VMID_SELF:
+            vmid = vcpu->domid();
+            return true;
+
+        case MV_VMID_GLOBAL_STORE:
+        case MV_VMID_ANY:
+            vcpu->set_rax(MV_STATUS_INVALID_VMID_UNSUPPORTED_ANY);
+            return false;
+
+        default:
+            return true;
+    };
+}
+
+// -----------------------------------------------------------------------------
+// Memory Mapping
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The following is used by the map_range and map_mdl hypercalls to map a
+// run of memory owned by the caller into another domain. Each run is mapped
+// using the largest EPT page size that the alignment of both the
+// destination GPA and the backing HPA allow, as long as the backing memory is
+// physically contiguous for the entire page. A page size flag can be used
+// to limit the largest page size that is used. If the write protected flag
+// is set, the memory is shared with the destination copy-on-write (see
+// domain::map_4k_cow()), one 4k page at a time.
+//
+
+constexpr uint64_t page_size_4k = 0x1000;
+constexpr uint64_t page_size_2m = 0x200000;
+constexpr uint64_t page_size_1g = 0x40000000;
+
+constexpr uint64_t map_perm_flags =
+    MV_GPA_FLAG_READ_ACCESS |
+    MV_GPA_FLAG_WRITE_ACCESS |
+    MV_GPA_FLAG_EXECUTE_ACCESS;
+
+static bool
+is_supported_map_flags(uint64_t flags) noexcept
+{
+    switch (flags & map_perm_flags) {
+        case MV_GPA_FLAG_READ_ACCESS:
+        case MV_GPA_FLAG_READ_ACCESS | MV_GPA_FLAG_WRITE_ACCESS:
+        case map_perm_flags:
+            return true;
+
+        default:
+            return false;
+    };
+}
+
+static uint64_t
+max_page_size(uint64_t flags) noexcept
+{
+    if ((flags & (MV_GPA_FLAG_PAGE_SIZE_4k | MV_GPA_FLAG_WRITE_PROTECTED)) != 0) {
+        return page_size_4k;
+    }
+
+    if ((flags & MV_GPA_FLAG_PAGE_SIZE_2M) != 0) {
+        return page_size_2m;
+    }
+
+    return page_size_1g;
+}
+
+static bool
+is_contiguous(vcpu *vcpu, uint64_t gpa, uint64_t hpa, uint64_t size)
+{
+    for (uint64_t offset = page_size_4k; offset < size; offset += page_size_4k) {
+        if (vcpu->gpa_to_hpa(gpa + offset).first != hpa + offset) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+map_page(
+    domain *dom, uint64_t page_size, uint64_t gpa, uint64_t hpa, uint64_t flags)
+{
+    auto perm = flags & map_perm_flags;
+
+    if ((flags & MV_GPA_FLAG_WRITE_PROTECTED) != 0) {
+        return dom->map_4k_cow(gpa, hpa);
+    }
+
+    switch (page_size) {
+        case page_size_1g:
+            if (perm == MV_GPA_FLAG_READ_ACCESS) {
+                return dom->map_1g_r(gpa, hpa);
+            }
+            if (perm == map_perm_flags) {
+                return dom->map_1g_rwe(gpa, hpa);
+            }
+            return dom->map_1g_rw(gpa, hpa);
+
+        case page_size_2m:
+            if (perm == MV_GPA_FLAG_READ_ACCESS) {
+                return dom->map_2m_r(gpa, hpa);
+            }
+            if (perm == map_perm_flags) {
+                return dom->map_2m_rwe(gpa, hpa);
+            }
+            return dom->map_2m_rw(gpa, hpa);
+
+        default:
+            if (perm == MV_GPA_FLAG_READ_ACCESS) {
+                return dom->map_4k_r(gpa, hpa);
+            }
+            if (perm == map_perm_flags) {
+                return dom->map_4k_rwe(gpa, hpa);
+            }
+            return dom->map_4k_rw(gpa, hpa);
+    };
+}
+
+static void
+map_run(
+    vcpu *vcpu, domain *dom,
+    uint64_t src_gpa, uint64_t dst_gpa, uint64_t size, uint64_t flags)
+{
+    auto max = max_page_size(flags);
+
+    while (size != 0) {
+        auto hpa = vcpu->gpa_to_hpa(src_gpa).first;
+        auto page_size = page_size_4k;
+
+        for (const auto candidate : {page_size_1g, page_size_2m}) {
+            if (candidate > max || candidate > size) {
+                continue;
+            }
+
+            if (((dst_gpa | hpa) & (candidate - 1)) != 0) {
+                continue;
+            }
+
+            if (is_contiguous(vcpu, src_gpa, hpa, candidate)) {
+                page_size = candidate;
+                break;
+            }
+        }
+
+        map_page(dom, page_size, dst_gpa, hpa, flags);
+
+        src_gpa += page_size;
+        dst_gpa += page_size;
+        size -= page_size;
+    }
+}
+
+static bool
+resolve_map_vmids(vcpu *vcpu, uint64_t src_vmid, uint64_t &dst_vmid)
+{
+    if (src_vmid != MV_VMID_SELF && src_vmid != vcpu->domid()) {
+        vcpu->set_rax(MV_STATUS_INVALID_PARAMS1);
+        return false;
+    }
+
+    if (dst_vmid == MV_VMID_SELF || dst_vmid == vcpu->domid()) {
+        vcpu->set_rax(MV_STATUS_INVALID_VMID_UNSUPPORTED_SELF);
+        return false;
+    }
+
+    return resolve_vmid(vcpu, dst_vmid);
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
 vm_state_op_handler::vm_state_op_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
@@ -35,19 +258,327 @@ vm_state_op_handler::vm_state_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&vm_state_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        MV_VM_STATE_OP_VAL, {&vm_state_op_handler::dispatch, this});
 }
 
-bool
-vm_state_op_handler::dispatch(vcpu *vcpu)
+void
+vm_state_op_handler::initial_reg_val(vcpu *vcpu)
 {
-    if (mv_hypercall_opcode(vcpu->rax()) != MV_VM_STATE_OP_VAL) {
-        return false;
+    try {
+        auto vmid{vcpu->r11()};
+        auto reg{vcpu->r12()};
+
+        if (!resolve_vmid(vcpu, vmid)) {
+            return;
+        }
+
+        if (!is_supported_reg(reg)) {
+            vcpu->set_rax(MV_STATUS_INVALID_PARAMS2);
+            return;
+        }
+
+        auto dom = get_domain(vmid);
+        vcpu->set_r13((dom->*s_reg_accessors[reg].get)());
+
+        vcpu->set_rax(MV_STATUS_SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(MV_STATUS_FAILURE_UNKNOWN);
+    })
+}
+
+void
+vm_state_op_handler::set_initial_reg_val(vcpu *vcpu)
+{
+    try {
+        auto vmid{vcpu->r11()};
+        auto reg{vcpu->r12()};
+
+        if (!resolve_vmid(vcpu, vmid)) {
+            return;
+        }
+
+        if (!is_supported_reg(reg)) {
+            vcpu->set_rax(MV_STATUS_INVALID_PARAMS2);
+            return;
+        }
+
+        auto dom = get_domain(vmid);
+        (dom->*s_reg_accessors[reg].set)(vcpu->r13());
+
+        vcpu->set_rax(MV_STATUS_SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(MV_STATUS_FAILURE_UNKNOWN);
+    })
+}
+
+void
+vm_state_op_handler::list_of_initial_reg_vals(vcpu *vcpu)
+{
+    try {
+        auto vmid{vcpu->r11()};
+        auto reg_vals{vcpu->map_gpa_4k<mv_reg_vals_t>(vcpu->r12())};
+
+        if (!resolve_vmid(vcpu, vmid)) {
+            return;
+        }
+
+        auto dom = get_domain(vmid);
+        memset(reg_vals.get(), 0, sizeof(mv_reg_vals_t));
+
+        for (uint64_t reg = 0; reg < mv_reg_t_max; reg++) {
+            if (is_supported_reg(reg)) {
+                mv_reg_vals_set(
+                    reg_vals.get(), reg, (dom->*s_reg_accessors[reg].get)());
+            }
+        }
+
+        vcpu->set_rax(MV_STATUS_SUCCESS);
     }
+    catchall({
+        vcpu->set_rax(MV_STATUS_FAILURE_UNKNOWN);
+    })
+}
+
+void
+vm_state_op_handler::set_list_of_initial_reg_vals(vcpu *vcpu)
+{
+    try {
+        auto vmid{vcpu->r11()};
+        auto reg_vals{vcpu->map_gpa_4k<mv_reg_vals_t>(vcpu->r12())};
+
+        if (!resolve_vmid(vcpu, vmid)) {
+            return;
+        }
+
+        // Note:
+        //
+        // The list is validated before any of the registers are set so that
+        // an unsupported register does not leave the domain's initial
+        // register state partially updated.
+        //
+
+        for (uint64_t reg = 0; reg < mv_reg_t_max; reg++) {
+            if (mv_reg_vals_is_set(reg_vals.get(), reg) && !is_supported_reg(reg)) {
+                vcpu->set_rax(MV_STATUS_INVALID_PARAMS2);
+                return;
+            }
+        }
+
+        auto dom = get_domain(vmid);
+
+        for (uint64_t reg = 0; reg < mv_reg_t_max; reg++) {
+            if (mv_reg_vals_is_set(reg_vals.get(), reg)) {
+                (dom->*s_reg_accessors[reg].set)(reg_vals->vals[reg]);
+            }
+        }
+
+        vcpu->set_rax(MV_STATUS_SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(MV_STATUS_FAILURE_UNKNOWN);
+    })
+}
+
+void
+vm_state_op_handler::map_range(vcpu *vcpu)
+{
+    try {
+        auto src_vmid{vcpu->r11()};
+        auto src_gpa{vcpu->r12()};
+        auto dst_vmid{vcpu->r13()};
+        auto dst_gpa{vcpu->r14()};
+        auto flags{vcpu->r15() & ~MV_MAP_RANGE_SIZE_MASK};
+        auto size{(vcpu->r15() & MV_MAP_RANGE_SIZE_MASK) * page_size_4k};
+
+        if (!resolve_map_vmids(vcpu, src_vmid, dst_vmid)) {
+            return;
+        }
+
+        if (((src_gpa | dst_gpa) & (page_size_4k - 1)) != 0) {
+            vcpu->set_rax(MV_STATUS_INVALID_GPA_ALIGNMENT);
+            return;
+        }
+
+        if (size == 0) {
+            vcpu->set_rax(MV_STATUS_INVALID_SIZE_ZERO);
+            return;
+        }
+
+        if (!is_supported_map_flags(flags)) {
+            vcpu->set_rax(MV_STATUS_FAILURE_UNSUPPORTED_FLAGS);
+            return;
+        }
+
+        map_run(vcpu, get_domain(dst_vmid), src_gpa, dst_gpa, size, flags);
+        vcpu->set_rax(MV_STATUS_SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(MV_STATUS_FAILURE_UNKNOWN);
+    })
+}
+
+void
+vm_state_op_handler::unmap_range(vcpu *vcpu)
+{
+    try {
+        auto src_vmid{vcpu->r11()};
+        auto dst_vmid{vcpu->r13()};
+        auto dst_gpa{vcpu->r14()};
+        auto flags{vcpu->r15() & ~MV_MAP_RANGE_SIZE_MASK};
+        auto size{(vcpu->r15() & MV_MAP_RANGE_SIZE_MASK) * page_size_4k};
 
+        if (!resolve_map_vmids(vcpu, src_vmid, dst_vmid)) {
+            return;
+        }
+
+        if ((dst_gpa & (page_size_4k - 1)) != 0) {
+            vcpu->set_rax(MV_STATUS_INVALID_GPA_ALIGNMENT);
+            return;
+        }
+
+        if (size == 0) {
+            vcpu->set_rax(MV_STATUS_INVALID_SIZE_ZERO);
+            return;
+        }
+
+        if (flags != 0) {
+            vcpu->set_rax(MV_STATUS_FAILURE_UNSUPPORTED_FLAGS);
+            return;
+        }
+
+        auto dom = get_domain(dst_vmid);
+
+        dom->unmap_range(dst_gpa, size);
+        auto generation = dom->ept_generation();
+
+        // Note:
+        //
+        // A vCPU that is running right now might still be using the old
+        // translations, so neither the memory that backed the range nor the
+        // page tables can be handed back until all of the vCPUs have seen
+        // the flush. Until then, the caller is asked to try again. The
+        // range is already unmapped, so trying again does not flush again.
+        //
+
+        if (dom->synced_ept_generation() < generation) {
+            vcpu->set_rax(MV_STATUS_RETRY_CONTINUATION);
+            return;
+        }
+
+        dom->release_range(dst_gpa, size);
+        vcpu->set_rax(MV_STATUS_SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(MV_STATUS_FAILURE_UNKNOWN);
+    })
+}
+
+void
+vm_state_op_handler::map_mdl(vcpu *vcpu)
+{
+    try {
+        auto src_vmid{vcpu->r11()};
+        auto mdl_gpa{vcpu->r12()};
+        auto dst_vmid{vcpu->r13()};
+        auto dst_gpa{vcpu->r14()};
+        auto flags{vcpu->r15()};
+
+        if (!resolve_map_vmids(vcpu, src_vmid, dst_vmid)) {
+            return;
+        }
+
+        if ((dst_gpa & (page_size_4k - 1)) != 0) {
+            vcpu->set_rax(MV_STATUS_INVALID_GPA_ALIGNMENT);
+            return;
+        }
+
+        if (!is_supported_map_flags(flags)) {
+            vcpu->set_rax(MV_STATUS_FAILURE_UNSUPPORTED_FLAGS);
+            return;
+        }
+
+        auto dom = get_domain(dst_vmid);
+
+        // Note:
+        //
+        // Each entry in the MDL is mapped right after the previous entry in
+        // the destination domain, and large MDLs are provided as a chain of
+        // MDL pages using the "next" field. If an entry is invalid, the
+        // entries that came before it remain mapped.
+        //
+
+        while (mdl_gpa != 0) {
+            auto mdl{vcpu->map_gpa_4k<mv_mdl_t>(mdl_gpa)};
+
+            if (mdl->num_entries > MV_MDL_MAP_MAX_NUM_ENTRIES) {
+                vcpu->set_rax(MV_STATUS_INVALID_PARAMS2);
+                return;
+            }
+
+            for (uint64_t i = 0; i < mdl->num_entries; i++) {
+                const auto &entry = mdl->entries[i];
+
+                if ((entry.gpa & (page_size_4k - 1)) != 0) {
+                    vcpu->set_rax(MV_STATUS_INVALID_GPA_ALIGNMENT);
+                    return;
+                }
+
+                if (entry.size == 0 || (entry.size & (page_size_4k - 1)) != 0) {
+                    vcpu->set_rax(MV_STATUS_INVALID_SIZE_ALIGNMENT);
+                    return;
+                }
+
+                map_run(vcpu, dom, entry.gpa, dst_gpa, entry.size, flags);
+                dst_gpa += entry.size;
+            }
+
+            mdl_gpa = mdl->next;
+        }
+
+        vcpu->set_rax(MV_STATUS_SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(MV_STATUS_FAILURE_UNKNOWN);
+    })
+}
+
+bool
+vm_state_op_handler::dispatch(vcpu *vcpu)
+{
     // TODO: Validate the handle
 
     switch (mv_hypercall_index(vcpu->rax())) {
+        case MV_VM_STATE_OP_INITIAL_REG_VAL_IDX_VAL:
+            this->initial_reg_val(vcpu);
+            return true;
+
+        case MV_VM_STATE_OP_SET_INITIAL_REG_VAL_IDX_VAL:
+            this->set_initial_reg_val(vcpu);
+            return true;
+
+        case MV_VM_STATE_OP_LIST_OF_INITIAL_REG_VALS_IDX_VAL:
+            this->list_of_initial_reg_vals(vcpu);
+            return true;
+
+        case MV_VM_STATE_OP_SET_LIST_OF_INITIAL_REG_VALS_IDX_VAL:
+            this->set_list_of_initial_reg_vals(vcpu);
+            return true;
+
+        case MV_VM_STATE_OP_MAP_RANGE_IDX_VAL:
+            this->map_range(vcpu);
+            return true;
+
+        case MV_VM_STATE_OP_UNMAP_RANGE_IDX_VAL:
+            this->unmap_range(vcpu);
+            return true;
+
+        case MV_VM_STATE_OP_MAP_MDL_IDX_VAL:
+            this->map_mdl(vcpu);
+            return true;
+
         default:
             break;
     };
@@ -35,19 +35,36 @@ vp_exit_op_handler::vp_exit_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&vp_exit_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        MV_VP_EXIT_OP_VAL, {&vp_exit_op_handler::dispatch, this});
 }
 
-bool
-vp_exit_op_handler::dispatch(vcpu *vcpu)
+void
+vp_exit_op_handler::set_exit_info(vcpu *vcpu)
 {
-    if (mv_hypercall_opcode(vcpu->rax()) != MV_VP_EXIT_OP_VAL) {
-        return false;
+    try {
+        auto child_vcpu = get_vcpu(vcpu->r11());
+        child_vcpu->set_exit_info(
+            vcpu->map_gpa_4k<mv_vp_exit_info_t>(vcpu->r12())
+        );
+
+        vcpu->set_rax(MV_STATUS_SUCCESS);
     }
+    catchall({
+        vcpu->set_rax(MV_STATUS_FAILURE_UNKNOWN);
+    })
+}
 
+bool
+vp_exit_op_handler::dispatch(vcpu *vcpu)
+{
     // TODO: Validate the handle
 
     switch (mv_hypercall_index(vcpu->rax())) {
+        case MV_VP_EXIT_OP_SET_EXIT_INFO_IDX_VAL:
+            this->set_exit_info(vcpu);
+            return true;
+
         default:
             break;
     };
@@ -35,16 +35,13 @@ vp_management_op_handler::vp_management_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&vp_management_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        MV_VP_MANAGEMENT_OP_VAL, {&vp_management_op_handler::dispatch, this});
 }
 
 bool
 vp_management_op_handler::dispatch(vcpu *vcpu)
 {
-    if (mv_hypercall_opcode(vcpu->rax()) != MV_VP_MANAGEMENT_OP_VAL) {
-        return false;
-    }
-
     // TODO: Validate the handle
 
     switch (mv_hypercall_index(vcpu->rax())) {
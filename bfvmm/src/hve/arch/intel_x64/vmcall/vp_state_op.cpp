@@ -35,16 +35,13 @@ vp_state_op_handler::vp_state_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&vp_state_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        MV_VP_STATE_OP_VAL, {&vp_state_op_handler::dispatch, this});
 }
 
 bool
 vp_state_op_handler::dispatch(vcpu *vcpu)
 {
-    if (mv_hypercall_opcode(vcpu->rax()) != MV_VP_STATE_OP_VAL) {
-        return false;
-    }
-
     // TODO: Validate the handle
 
     switch (mv_hypercall_index(vcpu->rax())) {
@@ -52,9 +52,8 @@ exception_handler::handle(
     vcpu_t *vcpu, bfvmm::intel_x64::exception_handler::info_t &info)
 {
     bfignored(vcpu);
-    auto parent_vcpu = m_vcpu->parent_vcpu();
+    auto parent_vcpu = m_vcpu->load_parent_vcpu();
 
-    parent_vcpu->load();
     parent_vcpu->inject_exception(info.vector);
     parent_vcpu->return_continue();
 
@@ -47,9 +47,8 @@ external_interrupt_handler::handle(
     vcpu_t *vcpu, bfvmm::intel_x64::external_interrupt_handler::info_t &info)
 {
     bfignored(vcpu);
-    auto parent_vcpu = m_vcpu->parent_vcpu();
+    auto parent_vcpu = m_vcpu->load_parent_vcpu();
 
-    parent_vcpu->load();
     parent_vcpu->queue_external_interrupt(info.vector);
     parent_vcpu->return_continue();
 
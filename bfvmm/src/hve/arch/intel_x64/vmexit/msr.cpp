@@ -193,6 +193,33 @@ msr_handler::isolate_msr__on_write(
     return true;
 }
 
+// -----------------------------------------------------------------------------
+// Snapshot Functions
+// -----------------------------------------------------------------------------
+
+void
+msr_handler::save_state(vcpu_snapshot_t &snapshot) const
+{
+    // Note:
+    //
+    // The guest's values of the isolated MSRs are always in m_msrs while
+    // the vCPU is not running (the kernel_gs_base is saved on every exit),
+    // so there is no need to read the hardware here.
+    //
+
+    snapshot.msrs = m_msrs;
+}
+
+void
+msr_handler::restore_state(const vcpu_snapshot_t &snapshot)
+{
+    for (const auto &msr : snapshot.msrs) {
+        if (m_msrs.count(msr.first) != 0) {
+            m_msrs[msr.first] = msr.second;
+        }
+    }
+}
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -54,9 +54,8 @@ nmi_window_handler::handle(vcpu_t *vcpu)
     using namespace vmcs_n;
     primary_processor_based_vm_execution_controls::nmi_window_exiting::disable();
 
-    auto parent_vcpu = m_vcpu->parent_vcpu();
+    auto parent_vcpu = m_vcpu->load_parent_vcpu();
 
-    parent_vcpu->load();
     parent_vcpu->inject_nmi();
     parent_vcpu->return_continue();
 
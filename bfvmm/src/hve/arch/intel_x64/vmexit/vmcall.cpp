@@ -22,6 +22,34 @@
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/vmexit/vmcall.h>
 
+// -----------------------------------------------------------------------------
+// Opcode Table
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The vmcall handlers are stored in a dense table that is indexed by opcode.
+// The first 0x10 entries are for the MicroV opcodes (i.e. MV_XXX_OP_VAL),
+// and the remaining entries are for the legacy opcodes (i.e. bfopcode()).
+// Each entry stores the index of the handler (+1) so that an empty entry is
+// 0, and so that the table fits in a single cache line.
+//
+
+constexpr uint64_t num_mv_opcodes = 0x10;
+constexpr uint64_t num_bfopcodes = 0x20;
+
+static inline uint64_t
+opcode_to_slot(uint64_t rax) noexcept
+{
+    if (mv_hypercall_sig(rax) == MV_HYPERCALL_SIG_VAL) {
+        auto opcode = (mv_hypercall_opcode(rax) >> MV_OP_SHIFT) & 0xFFFF;
+        return opcode < num_mv_opcodes ? opcode : num_mv_opcodes + num_bfopcodes;
+    }
+
+    auto opcode = bfopcode(rax);
+    return opcode < num_bfopcodes ? num_mv_opcodes + opcode : num_mv_opcodes + num_bfopcodes;
+}
+
 namespace boxy::intel_x64
 {
 
@@ -44,8 +72,30 @@ vmcall_handler::vmcall_handler(
 
 void
 vmcall_handler::add_handler(
-    const handler_delegate_t &d)
-{ m_handlers.push_back(d); }
+    uint64_t opcode, const handler_delegate_t &d)
+{
+    // Note:
+    //
+    // Legacy opcodes are registered using their bfopcode() value and not a
+    // full RAX value, so they are converted here before the lookup.
+    //
+
+    if (mv_hypercall_sig(opcode) != MV_HYPERCALL_SIG_VAL) {
+        opcode <<= 48;
+    }
+
+    auto slot = opcode_to_slot(opcode);
+    if (slot >= m_table.size()) {
+        throw std::runtime_error("add_handler: unsupported vmcall opcode");
+    }
+
+    if (m_table.at(slot) != 0) {
+        throw std::runtime_error("add_handler: vmcall opcode already registered");
+    }
+
+    m_handlers.push_back(d);
+    m_table.at(slot) = gsl::narrow_cast<uint8_t>(m_handlers.size());
+}
 
 // -----------------------------------------------------------------------------
 // Handlers
@@ -84,9 +134,11 @@ vmcall_handler::handle(vcpu_t *vcpu)
     vcpu->advance();
 
     try {
-        for (const auto &d : m_handlers) {
-            if (d(m_vcpu)) {
-                return true;
+        if (auto slot = opcode_to_slot(vcpu->rax()); slot < m_table.size()) {
+            if (auto index = m_table[slot]; index != 0) {
+                if (m_handlers[index - 1U](m_vcpu)) {
+                    return true;
+                }
             }
         }
     }
@@ -0,0 +1,243 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <bfdebug.h>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/vmexit_log.h>
+
+#include <string>
+
+//--------------------------------------------------------------------------
+// Implementation
+//--------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+static uint64_t
+tick_bucket(uint64_t ticks) noexcept
+{
+    auto bucket = static_cast<uint64_t>(63 - __builtin_clzll(ticks | 1));
+    return bucket < MV_VMEXIT_LOG_NUM_BUCKETS ? bucket : MV_VMEXIT_LOG_NUM_BUCKETS - 1;
+}
+
+static void
+count_key(
+    mv_vmexit_log_key_t *keys, uint64_t &num_other, uint64_t key) noexcept
+{
+    for (uint64_t i = 0; i < MV_VMEXIT_LOG_NUM_KEYS; i++) {
+        if (keys[i].count == 0) {
+            keys[i].key = key;
+            keys[i].count = 1;
+            return;
+        }
+
+        if (keys[i].key == key) {
+            keys[i].count++;
+            return;
+        }
+    }
+
+    num_other++;
+}
+
+static void
+dump_keys(
+    const char *name, const mv_vmexit_log_key_t *keys, uint64_t num_other)
+{
+    bfdebug_transaction(0, [&](std::string * msg) {
+        for (uint64_t i = 0; i < MV_VMEXIT_LOG_NUM_KEYS && keys[i].count != 0; i++) {
+            bfdebug_subnhex(0, name, keys[i].key, msg);
+            bfdebug_subndec(0, "- count", keys[i].count, msg);
+        }
+
+        if (num_other != 0) {
+            bfdebug_subndec(0, "other", num_other, msg);
+        }
+    });
+}
+
+vmexit_log::vmexit_log(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    vcpu->add_exit_handler({&vmexit_log::handle_exit, this});
+    vcpu->add_resume_delegate({&vmexit_log::resume_delegate, this});
+}
+
+const mv_vmexit_log_t &
+vmexit_log::log() const noexcept
+{ return m_log; }
+
+void
+vmexit_log::stop_timer() noexcept
+{
+    if (m_exit_tsc == 0) {
+        return;
+    }
+
+    auto ticks = ::x64::tsc::get() - m_exit_tsc;
+    m_exit_tsc = 0;
+
+    m_log.ticks_by_reason[m_exit_reason] += ticks;
+    m_log.hist_by_reason[m_exit_reason][tick_bucket(ticks)]++;
+}
+
+void
+vmexit_log::dump() const
+{
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "vmexit log", msg);
+        bfdebug_brk1(0, msg);
+        bfdebug_subnhex(0, "vcpuid", m_vcpu->id(), msg);
+        bfdebug_subndec(0, "num exits", m_log.num_exits, msg);
+    });
+
+    for (uint64_t r = 0; r < MV_VMEXIT_LOG_NUM_EXIT_REASONS; r++) {
+        auto num_exits = m_log.num_exits_by_reason[r];
+        if (num_exits == 0) {
+            continue;
+        }
+
+        bfdebug_transaction(0, [&](std::string * msg) {
+            bfdebug_subnhex(0, "exit reason", r, msg);
+            bfdebug_subndec(0, "- count", num_exits, msg);
+            bfdebug_subndec(0, "- avg ticks", m_log.ticks_by_reason[r] / num_exits, msg);
+
+            for (uint64_t b = 0; b < MV_VMEXIT_LOG_NUM_BUCKETS; b++) {
+                if (auto count = m_log.hist_by_reason[r][b]; count != 0) {
+                    auto name = "- ticks >= 2^" + std::to_string(b);
+                    bfdebug_subndec(0, name.c_str(), count, msg);
+                }
+            }
+        });
+    }
+
+    bfdebug_transaction(0, [&](std::string * msg) {
+        for (uint64_t i = 0; i < MV_VMEXIT_LOG_NUM_BFOPCODES; i++) {
+            if (auto count = m_log.num_vmcalls_by_bfopcode[i]; count != 0) {
+                bfdebug_subnhex(0, "vmcall bfopcode", i, msg);
+                bfdebug_subndec(0, "- count", count, msg);
+            }
+        }
+
+        for (uint64_t i = 0; i < MV_VMEXIT_LOG_NUM_MV_OPCODES; i++) {
+            if (auto count = m_log.num_vmcalls_by_mv_opcode[i]; count != 0) {
+                bfdebug_subnhex(0, "vmcall mv opcode", i, msg);
+                bfdebug_subndec(0, "- count", count, msg);
+            }
+        }
+
+        if (m_log.num_other_vmcalls != 0) {
+            bfdebug_subndec(0, "vmcall other", m_log.num_other_vmcalls, msg);
+        }
+    });
+
+    dump_keys("msr", m_log.msrs, m_log.num_other_msrs);
+    dump_keys("port", m_log.ports, m_log.num_other_ports);
+}
+
+bool
+vmexit_log::handle_exit(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+    using namespace vmcs_n::exit_reason;
+
+    m_log.num_exits++;
+
+    m_exit_reason = basic_exit_reason::get();
+    if (m_exit_reason >= MV_VMEXIT_LOG_NUM_EXIT_REASONS) {
+        m_exit_tsc = 0;
+        return false;
+    }
+
+    m_exit_tsc = ::x64::tsc::get();
+    m_log.num_exits_by_reason[m_exit_reason]++;
+
+    switch (m_exit_reason) {
+        case basic_exit_reason::vmcall:
+            this->count_vmcall(m_vcpu->rax());
+            break;
+
+        case basic_exit_reason::rdmsr:
+        case basic_exit_reason::wrmsr:
+            count_key(
+                m_log.msrs, m_log.num_other_msrs, m_vcpu->rcx() & 0xFFFFFFFF);
+            break;
+
+        case basic_exit_reason::io_instruction:
+            count_key(
+                m_log.ports, m_log.num_other_ports,
+                vmcs_n::exit_qualification::io_instruction::port_number::get());
+            break;
+
+        default:
+            break;
+    };
+
+    return false;
+}
+
+void
+vmexit_log::resume_delegate(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+    this->stop_timer();
+}
+
+void
+vmexit_log::count_vmcall(uint64_t rax) noexcept
+{
+    // Note:
+    //
+    // The legacy run_op hypercall does not return until the child vCPU
+    // hands control back, so timing it would include the entire time the
+    // child was running. These exits are counted, but not timed.
+    //
+
+    if (mv_hypercall_sig(rax) == MV_HYPERCALL_SIG_VAL) {
+        auto opcode = (mv_hypercall_opcode(rax) >> MV_OP_SHIFT) & 0xFFFF;
+
+        if (opcode < MV_VMEXIT_LOG_NUM_MV_OPCODES) {
+            m_log.num_vmcalls_by_mv_opcode[opcode]++;
+            return;
+        }
+    }
+    else if ((rax & 0xFF00000000000000) == 0xBF00000000000000) {
+        auto opcode = bfopcode(rax);
+
+        if (opcode == hypercall_enum_run_op) {
+            m_exit_tsc = 0;
+        }
+
+        if (opcode < MV_VMEXIT_LOG_NUM_BFOPCODES) {
+            m_log.num_vmcalls_by_bfopcode[opcode]++;
+            return;
+        }
+    }
+
+    m_log.num_other_vmcalls++;
+}
+
+}